@@ -1,4 +1,7 @@
 #include "Inkplate.h"  //Include Inkplate library to the sketch
+#include <ArduinoClock.h>
+#include <DisplayReceiver.h>
+#include <ImageCache.h>
 //#include "image.h"
 Inkplate display(INKPLATE_3BIT);  // Create object on Inkplate library and set library to work in gray mode (3-bit)
                                   // Other option is BW mode, which is demonstrated in next example
@@ -9,164 +12,247 @@ Inkplate display(INKPLATE_3BIT);  // Create object on Inkplate library and set l
 const int WAKE_PIN = 14;
 
 volatile unsigned long wakeStart = 0;
+volatile bool wakePulsed = false; // the nRF receiver pulsed the wake pin while the esp was awake
 const int SLEEP_TIME = 1500; // how long it takes for the esp to go to sleep after receiving an interrupt
+const bool keepFrameBuffer = true; // light sleep keeps the last image for rectangle updates, deep sleep restarts the esp
+const bool deferDisplayInit = true; // display.begin() runs on core 0 while the first message comes in, the ready frame goes out right after the boot
+const unsigned long wakeBufferSize = 256 * 1024; // PSRAM for the message that comes before the display is ready, a whole uncompressed image
+volatile bool displayStarted = false;
+const bool overlapRefresh = true; // the panel refreshes on core 0 while the next image comes into a PSRAM back buffer on core 1
+const uint8_t cacheSlots = 8; // whole images kept on the SD card for displayCachedImageFlag (ImageCache.h), 240 KB each, 0 - no cache
 
-const int flagBytesCount = 5; 
-byte transmitBytesFlag = 0x01;   // [0] - 0x01, [1,2] - byte count,
-byte transmitImageFlag = 0x02;   // [0] - 0x02, [1,2] - image height, [3,4] - image width
-byte transmitStringFlag = 0x03;  // [0] - 0x03, [1,...,4] - string length
-byte transmit3BitImageFlag = 0x04;
-byte ackFlag = 0xFF;  // ack - {0xFF, 0xXX}, 0xXX - whatever the sent flag was
-const String wakeMessage = "awake";
+// what DisplayReceiver.h needs from the Inkplate, images go straight into the 3 bit framebuffer
+// With a back buffer, display() hands the refresh to refreshTask on core 0 and returns, so loop() keeps reading Serial2.
+// Until the next display() the images go into the back buffer, which starts as a copy of the framebuffer (for
+// rectangles), and display() swaps it with DMemory4Bit once the refresh before it is done.
+struct InkplateScreen {
+  Inkplate& inkplate;
+  uint8_t* back = NULL;          // ps_malloc()'d in setup(), NULL refreshes on loop()'s core
+  bool backCurrent = false;      // the back buffer holds the newer image
+  TaskHandle_t refreshTask = NULL;
+  volatile bool refreshRunning = false;
+  const uint8_t* volatile saveAfterRefresh = NULL; // refreshTask saves this image in the image cache once it's shown
+  const uint8_t* saveBeforeSleep = NULL; // without a back buffer loop() saves the shown image before it sleeps, drawing cancels it
 
-// TODO: currently, when the inkplate goes to sleep, it doesn't wake up fast enough to get the needed data
+  void clearDisplay(){
+    saveBeforeSleep = NULL;
+    uint8_t* target = frameBuffer();
+    if(target != NULL && target == back)
+      memset(back, 0xFF, frameBufferSize()); // what Inkplate::clearDisplay() writes in 3 bit mode
+    else
+      inkplate.clearDisplay();
+  }
+  void display(){
+    waitRefresh();
+    if(back == NULL || !direct()){
+      inkplate.display();
+      return;
+    }
+    if(backCurrent){
+      uint8_t* shown = inkplate.DMemory4Bit;
+      inkplate.DMemory4Bit = back;
+      back = shown;
+      backCurrent = false;
+    }
+    refreshRunning = true;
+    xTaskNotifyGive(refreshTask);
+    memcpy(back, inkplate.DMemory4Bit, frameBufferSize()); // both only read it
+  }
+  // the library only refreshes part of the panel in 1 bit mode, 3 bit mode redraws all of it
+  void partialUpdate(){
+    if(inkplate.getDisplayMode() == INKPLATE_1BIT){
+      waitRefresh();
+      inkplate.partialUpdate();
+    }
+    else
+      display();
+  }
+  void drawPixel(int16_t x, int16_t y, uint16_t color){ saveBeforeSleep = NULL; inkplate.drawPixel(x, y, color); } // only without a direct framebuffer, nothing refreshes then
+  int width(){ return E_INK_WIDTH; }
+  int height(){ return E_INK_HEIGHT; }
+
+  // two pixels per byte, even x in the high nibble (Inkplate::writePixel), only in 3 bit mode without rotation
+  // the back buffer once a refresh started, until display() swaps it in
+  uint8_t* frameBuffer(){
+    saveBeforeSleep = NULL; // whoever asks may draw into it
+    if(!direct())
+      return NULL;
+    if(back != NULL && (refreshRunning || backCurrent)){
+      backCurrent = true;
+      return back;
+    }
+    return inkplate.DMemory4Bit;
+  }
+  unsigned int frameBufferStride(){ return E_INK_WIDTH / 2; }
+  bool ready(){ return displayStarted; }
+
+  bool direct(){ return inkplate.getDisplayMode() == INKPLATE_3BIT && inkplate.getRotation() == 0; }
+  unsigned long frameBufferSize(){ return (unsigned long)E_INK_WIDTH * E_INK_HEIGHT / 2; }
+  void waitRefresh(){
+    while(refreshRunning)
+      delay(1);
+  }
+};
 
+// a file per slot of the image cache, loop() loads the images, refreshTask saves them (sdLock)
+struct SdImageStore {
+  bool read(uint8_t slot, unsigned long offset, uint8_t data[], unsigned long size){
+    SdFile file;
+    if(!open(file, slot, O_RDONLY))
+      return false;
+    bool done = file.seekSet(offset) && file.read(data, size) == (int)size;
+    file.close();
+    return done;
+  }
+  bool write(uint8_t slot, unsigned long offset, const uint8_t data[], unsigned long size){
+    SdFile file;
+    if(!open(file, slot, O_RDWR | O_CREAT))
+      return false;
+    bool done = file.seekSet(offset) && file.write(data, size) == size;
+    file.close();
+    return done;
+  }
+  bool open(SdFile& file, uint8_t slot, oflag_t flags){
+    char path[24];
+    snprintf(path, sizeof(path), "/imagecache%u.bin", slot);
+    return file.open(path, flags);
+  }
+};
+
+ArduinoClock boardClock;
+InkplateScreen screen{display};
+SdImageStore sdStore;
+ImageCache<SdImageStore> imageCache(sdStore, cacheSlots, (unsigned long)E_INK_WIDTH * E_INK_HEIGHT / 2);
+SemaphoreHandle_t sdLock;
+DisplayReceiver<HardwareSerial, InkplateScreen, ArduinoClock> receiver(Serial2, screen, boardClock); // the protocol lives in DisplayReceiver.h
+
+// a boot from deep sleep announces itself before display.begin(), which takes most of the boot,
+// the first message waits in PSRAM until the display is ready (see DisplayReceiver.h)
 void setup() {
-  Serial2.begin(1000000, SERIAL_8N1, 12, 13);  //rx, tx
+  Serial2.begin(1000000, SERIAL_8N1, 12, 13);  //rx, tx, the receiver's credits (UartFrame.h) keep it within the default 256 byte rx buffer
   Serial.begin(2000000);
-  display.begin();         // Init library (you should call this function ONLY ONCE)
-  display.clearDisplay();  // Clear any data that may have been in (software) frame buffer.
-                           //(NOTE! This does not clean image on screen, it only clears it in the frame buffer inside
-                           // ESP32).
-  
-  /*display.drawImage(picture1, 100, 100, 500,
-                    332);  // Arguments are: array variable name, start X, start Y,  size X, size Y
-  display.display();
-  delay(5000);*/
 
-  Serial.println("\n" + wakeMessage);
-  Serial2.print(wakeMessage); // to signal the nrf receiver
-  Serial2.flush();
-  Serial2.println(); // to signal that it is awake
+  receiver.log = logMessage;
+  receiver.onBytes = printAsHex;
+  receiver.onString = printString;
+  receiver.wakeBuffer = (uint8_t*)ps_malloc(wakeBufferSize);
+  receiver.wakeBufferSize = receiver.wakeBuffer != NULL ? wakeBufferSize : 0;
+  sdLock = xSemaphoreCreateMutex();
+  if(overlapRefresh){
+    screen.back = (uint8_t*)ps_malloc(screen.frameBufferSize());
+    xTaskCreatePinnedToCore(refreshTask, "refresh", 4096, NULL, 1, &screen.refreshTask, 0);
+  }
+
+  receiver.session = esp_random(); // new on every boot, the PC sends the whole image when it changes
+  Serial.println("\nawake");
+  if(deferDisplayInit){
+    receiver.signalAwake(); // ready frame to the nrf receiver
+    xTaskCreatePinnedToCore(startDisplayTask, "display", 4096, NULL, 1, NULL, 0); // loop() runs on core 1
+  }
+  else{
+    startDisplay();
+    receiver.signalAwake();
+  }
 
   esp_sleep_enable_ext0_wakeup(GPIO_NUM_14, 1); // GPIO_NUM_X needs to be the same as WAKE_PIN!!!
-  //pinMode(WAKE_PIN, INPUT_PULLDOWN);
-  //attachInterrupt(digitalPinToInterrupt(WAKE_PIN), wakeUp, HIGH);
+  pinMode(WAKE_PIN, INPUT_PULLDOWN);
+  attachInterrupt(digitalPinToInterrupt(WAKE_PIN), onWakePin, RISING); // the receiver waits for a ready frame even if the esp is awake
   wakeStart = millis();
 }
 
 void loop() {
-  if (Serial2.available()) {
-
-    byte flag[flagBytesCount];
-    Serial2.readBytes(flag, sizeof(flag));
-    Serial.println("Received packet:");
-    printAsHex(flag, sizeof(flag));
-    // Choose the next step depending on what type of message is transmitting
-    if (flag[0] == transmitBytesFlag) {
-      Serial.println("Receiving bytes flag");
-      // read second, third, fourth and fifth byte as integer and call transmitBytes
-      receiveBytes(((unsigned long)flag[1] << 24) | ((unsigned long)flag[2] << 16)
-                   | ((unsigned long)flag[3] << 8) | (unsigned long)flag[4]);
-      wakeStart = millis(); 
-
-    } else if (flag[0] == transmit3BitImageFlag) {
-      Serial.println("Receiving image3bit");
-      display.clearDisplay();
-      int height = (flag[1] << 8) | flag[2];
-      int width = (flag[3] << 8) | flag[4];
-      Serial.println("3bit- Height: " + String(height) + ", Width: " + String(width));
-      receiveImage3Bit((flag[1] << 8) | flag[2], (flag[3] << 8) | flag[4]);
-      //(flag[1] << 8) | flag[2] - read second and third byte as integer
-      //(flag[3] << 8) | flag[4] - read fourth and fifth byte as integer
-      wakeStart = millis(); 
-
-    } else if (flag[0] == transmitStringFlag) {
-
-      // read second, third, fourth and fifth byte as integer and call transmitString
-      receiveString(((unsigned long)flag[1] << 24) | ((unsigned long)flag[2] << 16)
-                    | ((unsigned long)flag[3] << 8) | (unsigned long)flag[4]);
-      wakeStart = millis(); 
-    }
+  if (wakePulsed) {
+    wakePulsed = false;
+    receiver.signalAwake();
+    wakeStart = millis();
   }
-  if(millis() - wakeStart > SLEEP_TIME)
+  if (receiver.poll())
+    wakeStart = millis();
+
+  unsigned long sleepTime = receiver.linkTimeout > SLEEP_TIME ? receiver.linkTimeout : SLEEP_TIME; // stays awake while the PC keeps a link open
+  if(millis() - wakeStart > sleepTime)
   {
-    Serial.println("going to sleep!");
-    esp_deep_sleep_start();
+    if(screen.saveBeforeSleep != NULL){
+      xSemaphoreTake(sdLock, portMAX_DELAY);
+      imageCache.save(screen.saveBeforeSleep);
+      xSemaphoreGive(sdLock);
+      screen.saveBeforeSleep = NULL;
+      return; // sleeps on the next loop(), unless a wake pulse came during the save
+    }
+    Serial.printf("going to sleep! first message %lu ms after the ready frame, %lu of %lu messages broken, image cache %lu hits, %lu misses\n",
+                  receiver.wakeToFirstByte, receiver.messagesBroken, receiver.messages, imageCache.hits, imageCache.misses);
+    receiver.linkTimeout = 0; // the link is over once it sleeps
+    screen.waitRefresh();
+    if(!keepFrameBuffer)
+      esp_deep_sleep_start();
+
+    esp_light_sleep_start(); // continues here once the wake pin goes high
+    Serial.println("woke up!");
+    wakePulsed = false; // the pulse that woke it up
+    receiver.signalAwake();
+    wakeStart = millis();
   }
 }
 
-void wakeUp(){
-  // calling the function
-  Serial.println("woke up!");
-  wakeStart = millis();
-  
+void startDisplay() {
+  display.begin();         // Init library (you should call this function ONLY ONCE)
+  display.clearDisplay();  // Clear any data that may have been in (software) frame buffer.
+                           //(NOTE! This does not clean image on screen, it only clears it in the frame buffer inside
+                           // ESP32).
+  if(cacheSlots > 0 && display.sdCardInit()){ // without a card every cached image is a miss, the PC sends them whole
+    imageCache.begin();
+    receiver.loadImage = loadCachedImage;
+    receiver.saveImage = saveCachedImage;
+  }
+  displayStarted = true;
 }
 
-void receiveBytes(unsigned long count) {
-  Serial.println("Receiving " + String(count) + " bytes");
-  while (count > 0) {
-    int bytesToReceive = 0;
-    // Take at most a 32 byte chunk
-    if (count > 32)
-      bytesToReceive = 32;
-    else
-      bytesToReceive = count;
-
-    byte data[bytesToReceive];
-    
-    unsigned long startTime = millis();
-    while (Serial2.available() < bytesToReceive){
-      if (millis() - startTime >= 1000) {
-        Serial.println(F("Transmission timed out"));
-        return; // or any other action you want to take when canceling the transmission
-      }
-    }
-
-    Serial2.readBytes(data, sizeof(data));
-    printAsHex(data, sizeof(data));
-    count -= bytesToReceive;
-  }
+void startDisplayTask(void*) {
+  startDisplay();
+  vTaskDelete(NULL);
 }
 
-void receiveImage3Bit(int height, int width) {
-  unsigned long count = (unsigned long)height * (unsigned long)width / 2;
-  unsigned long total = count;
-  // receive data for the image,
-  // store it in the 3bit buffer
-  while (count > 0) {
-    int bytesToReceive = 0;
-    // Take at most a 32 byte chunk
-    if (count > 32)
-      bytesToReceive = 32;
-    else
-      bytesToReceive = count;
-
-    byte data[bytesToReceive];
-    unsigned long startTime = millis();
-    while (Serial2.available() < bytesToReceive){
-      if (millis() - startTime >= 1000) {
-        Serial.println(F("Transmission timed out"));
-        return; // or any other action you want to take when canceling the transmission
-      }
+// refreshes the panel for InkplateScreen::display() on core 0
+void refreshTask(void*) {
+  while(true){
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    display.display();
+    const uint8_t* image = screen.saveAfterRefresh;
+    screen.saveAfterRefresh = NULL;
+    if(image != NULL && image == display.DMemory4Bit){ // the one just shown, not a buffer loop() writes into
+      xSemaphoreTake(sdLock, portMAX_DELAY);
+      imageCache.save(image);
+      xSemaphoreGive(sdLock);
     }
+    screen.refreshRunning = false;
+  }
+}
 
-    Serial2.readBytes(data, sizeof(data));
-    // for each pixel received, save it to the buffer
-
-    for (int i = 0; i < bytesToReceive; i++) {
-      int bufferIndex = total - count + i;
-      int x = (bufferIndex * 2) % width;
-      int y = (bufferIndex * 2) / width;
-      byte pixel1 = data[i] >> 4;
-      display.drawPixel(x, y, pixel1);  //x, y, pixel color
-
-      x = (bufferIndex * 2 + 1) % width;
-      y = (bufferIndex * 2 + 1) / width;
-      byte pixel2 = data[i] & 0x0F;
-      display.drawPixel(x, y, pixel2);
-    }
+// the image cache for DisplayReceiver.h, a load waits while refreshTask saves
+bool loadCachedImage(uint32_t key, uint8_t frameBuffer[]) {
+  xSemaphoreTake(sdLock, portMAX_DELAY);
+  bool loaded = imageCache.load(key, frameBuffer);
+  xSemaphoreGive(sdLock);
+  return loaded;
+}
 
-    //printAsHex(data, sizeof(data));
-    count -= bytesToReceive;
+// called right before display() shows *frameBuffer*, with a back buffer refreshTask saves it after the refresh, loop() goes on
+// without one the 240 KB would hold up loop() right after the refresh, it's saved before the sleep when the link is idle
+void saveCachedImage(const uint8_t frameBuffer[]) {
+  if(screen.back != NULL && screen.direct()){
+    screen.waitRefresh(); // display() waits for it anyway, and the image is for the next refresh
+    screen.saveAfterRefresh = frameBuffer;
+    return;
   }
+  screen.saveBeforeSleep = frameBuffer;
+}
 
-  display.display();
-  Serial.println("Image 3bit received!");
+void IRAM_ATTR onWakePin(){
+  wakePulsed = true;
 }
 
-void receiveString(unsigned long length) {
-  // TODO: implement
+void logMessage(const char* message) {
+  Serial.println(message);
 }
 
 void drawRandomRectangles() {
@@ -195,10 +281,15 @@ void displayCurrentAction(String text) {
   display.print(text);
 }
 
-void printAsHex(byte data[], int arrSize) {
+void printAsHex(const byte data[], int arrSize) {
   for (int i = 0; i < arrSize; i++) {
     Serial.print(data[i], HEX);
     Serial.print(" ");
   }
   Serial.println();
+}
+
+// the text of a string flag, as it comes
+void printString(const char text[], int size) {
+  Serial.write((const uint8_t*)text, size);
 }
\ No newline at end of file
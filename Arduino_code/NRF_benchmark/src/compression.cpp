@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <Compression.h>
+#include <SimPipeline.h>
+#include "../../Inkplate/image.h"
+
+// Compression of 3 bit images (Compression.h): the compression ratio of picture1 from image.h and a few
+// reference images, how fast the PC compresses and the Inkplate side decompresses them, and the time it
+// takes to get each image onto the simulated Inkplate raw (two pixels per byte), dense (8 pixels in 3 bytes,
+// PackedImage.h) and compressed.
+//
+// usage: program [loss %]...
+
+struct Image {
+  const char* name;
+  int width, height;
+  std::vector<uint8_t> pixels; // packed 3 bit, the left pixel in the high nibble
+};
+
+
+void setPixel(Image& image, int x, int y, uint8_t color){
+  uint8_t& packed = image.pixels[(y * image.width + x) / 2];
+  packed = x % 2 == 0 ? (packed & 0x0F) | (color << 4) : (packed & 0xF0) | color;
+}
+
+
+void fillRect(Image& image, int x0, int y0, int width, int height, uint8_t color){
+  for(int y = y0; y < y0 + height && y < image.height; y++)
+    for(int x = x0; x < x0 + width && x < image.width; x++)
+      setPixel(image, x, y, color);
+}
+
+
+// the 4 bit grayscale picture from Inkplate/image.h, brought down to 3 bits the way ConvertToBitmap3bit would
+Image lighthouse(){
+  Image image = {"picture1", 500, 332, std::vector<uint8_t>(sizeof(picture1))};
+  for(size_t i = 0; i < sizeof(picture1); i++)
+    image.pixels[i] = (picture1[i] >> 1) & 0x77;
+  return image;
+}
+
+
+// white screen with a title bar, lines of "text", a few gray boxes and a chart
+Image dashboard(){
+  Image image = {"dashboard", 800, 600, std::vector<uint8_t>(800 * 600 / 2, 0x77)};
+  std::mt19937 rng(7);
+  fillRect(image, 0, 0, 800, 48, 0);
+  for(int line = 0; line < 20; line++){
+    int characters = 20 + rng() % 40;
+    for(int c = 0; c < characters; c++){
+      for(int stroke = 0; stroke < 3; stroke++) // a few strokes per 8x12 character
+        fillRect(image, 16 + c * 9 + rng() % 6, 64 + line * 18 + rng() % 10, 1 + rng() % 3, 1 + rng() % 4, 0);
+    }
+  }
+  for(int box = 0; box < 3; box++)
+    fillRect(image, 560, 70 + box * 120, 220, 100, 5 - box * 2);
+  for(int x = 0; x < 760; x++)
+    fillRect(image, 20 + x, 560 - (int)(20 + 15 * (1 + sin(x / 40.0)) + x / 40), 2, 2, 1);
+  return image;
+}
+
+
+// horizontal gradient with 4x4 ordered dithering between the 8 levels
+Image gradient(){
+  const int bayer[4][4] = {{0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}};
+  Image image = {"gradient", 800, 600, std::vector<uint8_t>(800 * 600 / 2)};
+  for(int y = 0; y < image.height; y++){
+    for(int x = 0; x < image.width; x++){
+      int level = x * 7 * 16 / image.width; // in 1/16 of a level
+      int color = level / 16 + ((level % 16) > bayer[y % 4][x % 4] ? 1 : 0);
+      setPixel(image, x, y, color > 7 ? 7 : color);
+    }
+  }
+  return image;
+}
+
+
+// random pixels, nothing to compress
+Image noise(){
+  Image image = {"noise", 800, 600, std::vector<uint8_t>(800 * 600 / 2)};
+  std::mt19937 rng(1);
+  for(uint8_t& value : image.pixels)
+    value = rng() & 0x77;
+  return image;
+}
+
+
+bool sameImage(const SimDisplay& screen, const Image& image){
+  for(int y = 0; y < image.height; y++){
+    for(int x = 0; x < image.width; x++){
+      uint8_t packed = image.pixels[(y * image.width + x) / 2];
+      if(screen.pixel(x, y) != (x % 2 == 0 ? packed >> 4 : packed & 0x0F))
+        return false;
+    }
+  }
+  return true;
+}
+
+
+// seconds until the image is on the simulated Inkplate, 0 if it didn't arrive intact
+double sendTime(const Image& image, double loss, bool compress, bool dense){
+  PipelineConfig config;
+  config.air.loss = loss;
+  SimPipeline pipeline(config);
+  pipeline.pc.compressImages = compress;
+  pipeline.pc.denseImages = dense;
+  if(!pipeline.sendImage3Bit(image.pixels.data(), image.height, image.width, 300 * simSecond) || !sameImage(pipeline.screen, image))
+    return 0;
+  return pipeline.now() / (double)simSecond;
+}
+
+
+int main(int argc, char* argv[]){
+  std::vector<double> losses;
+  for(int i = 1; i < argc; i++)
+    losses.push_back(atof(argv[i]) / 100);
+  if(losses.empty())
+    losses = {0, 0.1};
+
+  static Compressor compressor;
+  bool allOk = true;
+  printf("%-10s %8s %8s %8s %6s %9s %9s %6s %9s %9s %9s %7s %s\n", "image", "raw B", "dense B", "packed B", "ratio", "enc MB/s",
+         "dec MB/s", "loss %", "raw s", "dense s", "packed s", "saved", "result");
+  for(const Image& image : {lighthouse(), dashboard(), gradient(), noise()}){
+    std::vector<uint8_t> compressed(compressedBound(image.pixels.size()));
+    auto start = std::chrono::steady_clock::now();
+    compressed.resize(compressor.compress(image.pixels.data(), image.pixels.size(), compressed.data()));
+    double encodeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // decompressed in displayChunkSize pieces, like DisplayReceiver.h takes them from Serial2
+    std::vector<uint8_t> decompressed;
+    decompressed.reserve(image.pixels.size());
+    StreamDecompressor decompressor;
+    start = std::chrono::steady_clock::now();
+    decompressor.begin();
+    for(size_t offset = 0; offset < compressed.size(); offset += displayChunkSize){
+      unsigned int size = compressed.size() - offset < displayChunkSize ? compressed.size() - offset : displayChunkSize;
+      decompressor.write(&compressed[offset], size,
+                         [&](const uint8_t data[], unsigned int count){ decompressed.insert(decompressed.end(), data, data + count); });
+    }
+    double decodeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    bool roundTrip = decompressed == image.pixels;
+    allOk &= roundTrip;
+
+    for(double loss : losses){
+      double raw = sendTime(image, loss, false, false);
+      double dense = sendTime(image, loss, false, true);
+      double packed = sendTime(image, loss, true, true); // falls back to dense if compressing doesn't help
+      bool ok = roundTrip && raw > 0 && dense > 0 && packed > 0;
+      allOk &= ok;
+      printf("%-10s %8zu %8lu %8zu %6.2f %9.1f %9.1f %6.1f %9.3f %9.3f %9.3f %6.1f%% %s\n", image.name, image.pixels.size(),
+             denseImageBytes((unsigned long)image.width * image.height), compressed.size(),
+             image.pixels.size() / (double)compressed.size(), image.pixels.size() / encodeSeconds / 1e6,
+             image.pixels.size() / decodeSeconds / 1e6, loss * 100, raw, dense, packed, raw > 0 ? (1 - packed / raw) * 100 : 0,
+             ok ? "ok" : "failed");
+    }
+  }
+  return allOk ? 0 : 1;
+}
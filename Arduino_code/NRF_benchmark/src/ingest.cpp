@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <PackedImage.h>
+
+// Micro-benchmark of the Inkplate's 3 bit image ingest on the PC: unpacking every byte into two
+// drawPixel() calls (the old receiveImage3Bit) against copying rows into the framebuffer with
+// PackedImageWriter. Both go into a mock of the Inkplate's 4 bit framebuffer and must give the same pixels.
+//
+// usage: program [repeats]
+
+const int screenWidth = 800;
+const int screenHeight = 600;
+const unsigned int chunkSize = 32;      // displayChunkSize in DisplayReceiver.h
+const double lineBytesPerSecond = 1e5;  // Serial2 at 1 Mbaud
+
+
+// DMemory4Bit with drawPixel() going through a virtual call, rotation and bounds checks like Adafruit_GFX/Inkplate
+class MockInkplate {
+public:
+  MockInkplate() : buffer(screenWidth / 2 * screenHeight, 0x77) {}
+  virtual ~MockInkplate() {}
+
+  std::vector<uint8_t> buffer;
+  uint8_t rotation = 0;
+
+  virtual void drawPixel(int16_t x, int16_t y, uint16_t color){
+    if(x < 0 || y < 0 || x >= screenWidth || y >= screenHeight)
+      return;
+    switch(rotation){
+      case 1: { int16_t t = x; x = screenWidth - y - 1; y = t; break; }
+      case 2: x = screenWidth - x - 1; y = screenHeight - y - 1; break;
+      case 3: { int16_t t = x; x = y; y = screenHeight - t - 1; break; }
+    }
+    color &= 7;
+    uint8_t& packed = buffer[(screenWidth / 2) * y + (x >> 1)];
+    packed = (x & 1) ? (packed & 0xF0) | color : (packed & 0x0F) | (color << 4);
+  }
+};
+
+
+// receiveImage3Bit before the framebuffer writer
+void drawPerPixel(MockInkplate& display, const uint8_t image[], int height, int width){
+  unsigned long total = (unsigned long)height * width / 2;
+  for(unsigned long offset = 0; offset < total; offset += chunkSize){
+    int bytesToReceive = total - offset > chunkSize ? chunkSize : total - offset;
+    for(int i = 0; i < bytesToReceive; i++){
+      unsigned long bufferIndex = offset + i;
+      int x = (bufferIndex * 2) % width;
+      int y = (bufferIndex * 2) / width;
+      display.drawPixel(x, y, image[bufferIndex] >> 4);
+      x = (bufferIndex * 2 + 1) % width;
+      y = (bufferIndex * 2 + 1) / width;
+      display.drawPixel(x, y, image[bufferIndex] & 0x0F);
+    }
+  }
+}
+
+
+void copyRows(MockInkplate& display, const uint8_t image[], int height, int width){
+  PackedImageWriter writer;
+  writer.begin(display.buffer.data(), screenWidth / 2, screenWidth, screenHeight, 0, 0, width, height);
+  unsigned long total = (unsigned long)height * width / 2;
+  for(unsigned long offset = 0; offset < total; offset += chunkSize)
+    writer.write(&image[offset], total - offset > chunkSize ? chunkSize : total - offset);
+}
+
+
+template <class Ingest>
+double measure(Ingest ingest, MockInkplate& display, const std::vector<uint8_t>& image, int height, int width, int repeats){
+  auto start = std::chrono::steady_clock::now();
+  for(int i = 0; i < repeats; i++)
+    ingest(display, image.data(), height, width);
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / repeats;
+}
+
+
+int main(int argc, char* argv[]){
+  int repeats = argc > 1 ? atoi(argv[1]) : 20;
+  bool allOk = true;
+
+  printf("%-9s %-10s %12s %10s %10s %s\n", "image", "ingest", "us/image", "MB/s", "x 1 Mbaud", "result");
+  const int sizes[][2] = {{screenWidth, screenHeight}, {500, 332}, {1000, 700}}; // full screen, smaller, clipped
+  for(const int* size : sizes){
+    int width = size[0], height = size[1];
+    std::mt19937 rng(width * height);
+    std::vector<uint8_t> image(width * height / 2);
+    for(uint8_t& value : image)
+      value = rng(); // the writer has to drop the 4th bit like drawPixel does
+
+    MockInkplate reference, rows;
+    double perPixel = measure(drawPerPixel, reference, image, height, width, repeats);
+    double rowCopy = measure(copyRows, rows, image, height, width, repeats);
+    bool same = reference.buffer == rows.buffer;
+    allOk &= same;
+
+    char name[16];
+    snprintf(name, sizeof(name), "%dx%d", width, height);
+    const char* names[] = {"drawPixel", "rows"};
+    double times[] = {perPixel, rowCopy};
+    for(int i = 0; i < 2; i++){
+      double bytesPerSecond = image.size() / times[i];
+      printf("%-9s %-10s %12.1f %10.1f %10.0f %s\n", name, names[i], times[i] * 1e6, bytesPerSecond / 1e6,
+             bytesPerSecond / lineBytesPerSecond, same ? "ok" : "different");
+    }
+  }
+
+  return allOk ? 0 : 1;
+}
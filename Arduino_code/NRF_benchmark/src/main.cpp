@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <SimPipeline.h>
+
+// Benchmark of the whole chain (PC -> transmitter -> receiver -> Inkplate) on simulated hardware.
+// Runs byte transfers from 5 B to 240 KB, a full 3 bit image and an update of part of it at different loss rates, with ack
+// payloads and ack frames, and reports throughput, payload latency, retransmits and how long
+// every stage was busy. One JSON object per run goes to the -o file, a table to stdout.
+//
+// usage: program [-o results.jsonl] [-s seed] [-b bit error rate] [-r reorder %] [-q quantum us] [-a payloads] [-S size]... [loss %]...
+//   -a how many payloads the PC may write ahead of the window (ingestPayloads in SlidingWindow.h)
+
+const int imageWidth = 800;
+const int imageHeight = 600;
+
+struct Run {
+  const char* kind;     // "bytes", "image3bit" or "update3bit" (rectangles for a clock sized change)
+  unsigned long size;
+  double loss;
+  bool ackPayloads;
+};
+
+
+struct Result {
+  bool ok = false;
+  unsigned long bytesSent = 0; // through the radio, the rectangles for an update
+  double pcSeconds = 0;    // until the PC got the last ack (the Stopwatch in Program.cs)
+  double totalSeconds = 0; // until the Inkplate had all of the data (and drew the image)
+  double latency50 = 0, latency90 = 0, latency99 = 0, latencyMax = 0; // ms from writing a payload to its ack on the PC
+  unsigned long payloads = 0;
+  unsigned long framesOnAir = 0, framesLost = 0, retransmits = 0, failures = 0, overflows = 0;
+  double usbBusy = 0, radioBusy = 0, uartBusy = 0, drawBusy = 0; // ms every stage was busy
+  double wallMs = 0;
+};
+
+
+double percentile(std::vector<simtime_t> sorted, double p){
+  if(sorted.empty())
+    return 0;
+  size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+  return sorted[index] / (double)simMillisecond;
+}
+
+
+// counters of a pipeline, a run only reports what changed during the measured transfer
+struct Counters {
+  simtime_t start;
+  unsigned long framesOnAir, framesLost, retransmits, failures, overflows;
+  unsigned long usbBytes, uartBytes;
+  simtime_t timeOnAir, drawTime;
+
+  explicit Counters(SimPipeline& pipeline)
+    : start(pipeline.now()),
+      framesOnAir(pipeline.air.framesOnAir), framesLost(pipeline.air.framesLost),
+      retransmits(pipeline.transmitterRadio.retransmits + pipeline.receiverRadio.retransmits),
+      failures(pipeline.transmitterRadio.failures + pipeline.receiverRadio.failures),
+      overflows(pipeline.pcToTransmitter.overflows + pipeline.receiverToDisplay.overflows),
+      usbBytes(pipeline.pcToTransmitter.bytesSent), uartBytes(pipeline.receiverToDisplay.bytesSent),
+      timeOnAir(pipeline.air.timeOnAir), drawTime(pipeline.screen.drawTime) {}
+};
+
+
+// the first image of an update run, the update changes a clock sized area of it
+void changeClockArea(std::vector<uint8_t>& image){
+  for(int y = 16; y < 64; y++){
+    for(int x = 560; x < 784; x += 2){
+      uint8_t& packed = image[(y * imageWidth + x) / 2];
+      packed = (packed + 0x23) & 0x77;
+    }
+  }
+}
+
+
+Result runOnce(const PipelineConfig& base, const Run& run, const std::vector<uint8_t>& data){
+  PipelineConfig config = base;
+  config.air.loss = run.loss;
+  config.useAckPayloads = run.ackPayloads;
+
+  Result result;
+  auto wallStart = std::chrono::steady_clock::now();
+  SimPipeline pipeline(config);
+  simtime_t limit = 300 * simSecond;
+  std::vector<uint8_t> image(data.begin(), data.begin() + imageWidth * imageHeight / 2);
+  bool isImage = strcmp(run.kind, "bytes") != 0;
+  if(strcmp(run.kind, "update3bit") == 0){
+    if(!pipeline.sendImage3Bit(image.data(), imageHeight, imageWidth, limit))
+      return result;
+    pipeline.idle(2 * simSecond); // the Inkplate goes back to sleep
+    changeClockArea(image);
+  }
+
+  Counters before(pipeline);
+  bool sent;
+  if(isImage){
+    if(strcmp(run.kind, "update3bit") == 0)
+      sent = pipeline.sendImage3BitUpdate(image.data(), imageHeight, imageWidth, limit);
+    else
+      sent = pipeline.sendImage3Bit(image.data(), imageHeight, imageWidth, limit);
+    result.ok = sent;
+    for(int y = 0; result.ok && y < imageHeight; y++){
+      for(int x = 0; result.ok && x < imageWidth; x++){
+        uint8_t packed = image[(y * imageWidth + x) / 2];
+        result.ok = pipeline.screen.pixel(x, y) == (x % 2 == 0 ? packed >> 4 : packed & 0x0F);
+      }
+    }
+  }
+  else{
+    sent = pipeline.sendByteArray(data.data(), run.size, limit);
+    result.ok = sent && std::equal(data.begin(), data.begin() + run.size, pipeline.displayedBytes.begin());
+  }
+  result.wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wallStart).count();
+
+  result.bytesSent = strcmp(run.kind, "update3bit") == 0 ? pipeline.pc.lastUpdateBytes : isImage ? pipeline.pc.lastImageBytes : run.size;
+  result.pcSeconds = (pipeline.pcFinished - before.start) / (double)simSecond;
+  result.totalSeconds = (pipeline.now() - before.start) / (double)simSecond;
+
+  std::vector<simtime_t> latencies;
+  for(size_t i = 0; i < pipeline.pc.ackTimes.size(); i++)
+    latencies.push_back(pipeline.pc.ackTimes[i] - pipeline.pc.sendTimes[i]);
+  std::sort(latencies.begin(), latencies.end());
+  result.payloads = latencies.size();
+  result.latency50 = percentile(latencies, 0.5);
+  result.latency90 = percentile(latencies, 0.9);
+  result.latency99 = percentile(latencies, 0.99);
+  result.latencyMax = percentile(latencies, 1);
+
+  Counters after(pipeline);
+  result.framesOnAir = after.framesOnAir - before.framesOnAir;
+  result.framesLost = after.framesLost - before.framesLost;
+  result.retransmits = after.retransmits - before.retransmits;
+  result.failures = after.failures - before.failures;
+  result.overflows = after.overflows - before.overflows;
+
+  result.usbBusy = (after.usbBytes - before.usbBytes) * config.pcToTransmitter.byteTime / (double)simMillisecond;
+  result.radioBusy = (after.timeOnAir - before.timeOnAir) / (double)simMillisecond;
+  result.uartBusy = (after.uartBytes - before.uartBytes) * config.receiverToDisplay.byteTime / (double)simMillisecond;
+  result.drawBusy = (after.drawTime - before.drawTime) / (double)simMillisecond;
+  return result;
+}
+
+
+void writeJson(FILE* file, const Run& run, const Result& result, unsigned int seed){
+  fprintf(file, "{\"kind\":\"%s\",\"bytes\":%lu,\"loss\":%.3f,\"acks\":\"%s\",\"seed\":%u,\"ok\":%s,"
+          "\"pc_s\":%.6f,\"total_s\":%.6f,\"bytes_per_s\":%.1f,"
+          "\"payloads\":%lu,\"latency_ms\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+          "\"frames_on_air\":%lu,\"frames_lost\":%lu,\"retransmits\":%lu,\"failures\":%lu,\"overflows\":%lu,"
+          "\"busy_ms\":{\"usb\":%.3f,\"radio\":%.3f,\"uart\":%.3f,\"draw\":%.3f},\"wall_ms\":%.1f}\n",
+          run.kind, result.bytesSent, run.loss, run.ackPayloads ? "ack-payload" : "ack-frame", seed, result.ok ? "true" : "false",
+          result.pcSeconds, result.totalSeconds, result.ok ? result.bytesSent / result.totalSeconds : 0,
+          result.payloads, result.latency50, result.latency90, result.latency99, result.latencyMax,
+          result.framesOnAir, result.framesLost, result.retransmits, result.failures, result.overflows,
+          result.usbBusy, result.radioBusy, result.uartBusy, result.drawBusy, result.wallMs);
+  fflush(file);
+}
+
+
+int main(int argc, char* argv[]){
+  PipelineConfig base;
+  const char* outputPath = NULL;
+  std::vector<unsigned long> sizes;
+  int option;
+  while((option = getopt(argc, argv, "o:s:b:r:q:a:S:")) != -1){
+    switch(option){
+      case 'o': outputPath = optarg; break;
+      case 's': base.air.seed = strtoul(optarg, NULL, 10); break;
+      case 'b': base.air.bitErrorRate = atof(optarg); break;
+      case 'r': base.air.reorder = atof(optarg) / 100; break;
+      case 'q': base.quantum = (simtime_t)(atof(optarg) * simMicrosecond); break;
+      case 'a': base.pcCredits = windowSize + strtoul(optarg, NULL, 10); break;
+      case 'S': sizes.push_back(strtoul(optarg, NULL, 10)); break;
+      default:
+        fprintf(stderr, "usage: %s [-o results.jsonl] [-s seed] [-b bit error rate] [-r reorder %%] [-q quantum us] [-a payloads] [-S size]... [loss %%]...\n", argv[0]);
+        return 2;
+    }
+  }
+  std::vector<double> losses;
+  for(int i = optind; i < argc; i++)
+    losses.push_back(atof(argv[i]) / 100);
+  if(losses.empty())
+    losses = {0, 0.01, 0.05, 0.1, 0.2};
+  if(sizes.empty())
+    sizes = {5, 30, 240, 2400, 24000, 240000};
+
+  FILE* output = NULL;
+  if(outputPath && (output = fopen(outputPath, "w")) == NULL){
+    perror(outputPath);
+    return 2;
+  }
+
+  std::vector<Run> runs;
+  for(double loss : losses){
+    for(bool ackPayloads : {true, false}){
+      for(unsigned long size : sizes)
+        runs.push_back({"bytes", size, loss, ackPayloads});
+      runs.push_back({"image3bit", (unsigned long)imageWidth * imageHeight / 2, loss, ackPayloads});
+      runs.push_back({"update3bit", (unsigned long)imageWidth * imageHeight / 2, loss, ackPayloads});
+    }
+  }
+
+  unsigned long largest = (unsigned long)imageWidth * imageHeight / 2;
+  for(unsigned long size : sizes)
+    largest = std::max(largest, size);
+  std::mt19937 rng(base.air.seed);
+  std::vector<uint8_t> data(largest);
+  for(uint8_t& value : data)
+    value = rng() & 0x77; // valid 3 bit pixels, so the same data works as an image
+
+  printf("%-10s %7s %-11s %6s %9s %9s %9s %8s %8s %8s %8s %8s %8s %8s %8s %s\n", "kind", "bytes", "acks", "loss %",
+         "total s", "bytes/s", "p50 ms", "p99 ms", "retries", "overflow", "usb ms", "radio ms", "uart ms", "draw ms",
+         "wall ms", "result");
+  bool allOk = true;
+  for(const Run& run : runs){
+    Result result = runOnce(base, run, data);
+    allOk &= result.ok;
+    printf("%-10s %7lu %-11s %6.1f %9.3f %9.0f %9.2f %8.2f %8lu %8lu %8.1f %8.1f %8.1f %8.1f %8.0f %s\n", run.kind, result.bytesSent,
+           run.ackPayloads ? "ack-payload" : "ack-frame", run.loss * 100, result.totalSeconds,
+           result.ok ? result.bytesSent / result.totalSeconds : 0, result.latency50, result.latency99, result.retransmits,
+           result.overflows, result.usbBusy, result.radioBusy, result.uartBusy, result.drawBusy, result.wallMs,
+           result.ok ? "ok" : "failed");
+    fflush(stdout);
+    if(output)
+      writeJson(output, run, result, base.air.seed);
+  }
+
+  if(output)
+    fclose(output);
+  return allOk ? 0 : 1;
+}
@@ -3,6 +3,8 @@
 #include <SPI.h>
 #include <RF24.h>
 #include "LowPower.h"
+#include <ArduinoClock.h>
+#include <Receiver.h>
 
 //#define debug
 
@@ -25,30 +27,41 @@
   #define DEBUG_PRINT(...) DEBUG_PRINT_HELPER1(COUNT_ARGS(__VA_ARGS__), __VA_ARGS__)
 
 const int RECEIVER_WAKE_PIN = 3; // to wake the ESP32 or other receiving controller
+const int RADIO_IRQ_PIN = 2; // nRF24 IRQ, INT1 on the ATmega32U4
+
+#ifndef RECEIVER_NODE
+  #define RECEIVER_NODE 0 // every receiver in range needs its own, set it in platformio.ini (see Nodes in Protocol.h)
+#endif
+
+// wakes up the receiving controller (or PC)
+struct WakePin {
+  void pulse(){
+    digitalWrite(RECEIVER_WAKE_PIN, HIGH);
+    delayMicroseconds(500);
+    digitalWrite(RECEIVER_WAKE_PIN, LOW);
+  }
+};
+
+// turns the radio's IRQ pin interrupt off and on, without touching the other interrupts (Serial1, millis())
+struct RadioInterrupt {
+  void disable(){ EIMSK &= ~bit(digitalPinToInterrupt(RADIO_IRQ_PIN)); }
+  void enable(){ EIMSK |= bit(digitalPinToInterrupt(RADIO_IRQ_PIN)); }
+};
 
 RF24 radio(7, 8); // CE, CSN
+ArduinoClock boardClock;
+WakePin wakePin;
+RadioInterrupt radioInterrupt;
+Receiver<RF24, HardwareSerial, ArduinoClock, WakePin, RadioInterrupt> receiver(radio, Serial1, boardClock, wakePin, radioInterrupt);
 
-const uint8_t address[] = "00050";
-const unsigned int flagBytesCount = 5;
-const unsigned int payloadSize = 30; // need 2 bytes free for payloadCount
-const byte transmitBytesFlag = 0x01; // [0] - 0x01, [1,...,4] - byte count
-const byte transmitBytesWakeFlag = 0x02; // [0] - 0x02, [1,...,4] - byte count -> before sending the data, wakes up the receiver
-const byte ackFlag = 0xFF; // acknoledgement
-const byte nakFlag = 0x00; // negative acknoledgement
-const String wakeMessage = "awake";
-const int sleep_time = 1; // total sleep time: sleep_time * 8 seconds
 const int sleep_timeout = 5000; // how long will the receiver wait for a message before going to sleep
-unsigned long last_sleep_time = 0; // when the receiver last woke up
 
-bool waitForWake(int timeout = 1000);
-void receiveInterrupt();
-void wakeReceiver();
-bool sendAck(unsigned long payloadCount);
-void receiveBytes(unsigned long count);
+void onRadioIrq();
+void sleepFor(unsigned long ms);
+void debugPrintln(const char* message);
 void printAsHex(byte data[], int arrSize);
-void setupRadio();
 
-int nrf_power_pin = 4; // controls the power connected to the nrf24l01 module
+int nrf_power_pin = 4; // controls the power connected to the nrf24l01 module, stays on: the radio's power down keeps its registers
 
 
 void setup() {
@@ -56,198 +69,66 @@ void setup() {
   digitalWrite(nrf_power_pin, LOW);
   pinMode(RECEIVER_WAKE_PIN, OUTPUT);
   digitalWrite(RECEIVER_WAKE_PIN, LOW);
+  pinMode(RADIO_IRQ_PIN, INPUT_PULLUP); // open drain on the nRF24 side, and keeps it high while the radio is off
+
+  attachInterrupt(digitalPinToInterrupt(RADIO_IRQ_PIN), onRadioIrq, FALLING);
+  SPI.usingInterrupt(digitalPinToInterrupt(RADIO_IRQ_PIN)); // no radio interrupt in the middle of loop()'s SPI transfers
 
   Serial1.begin(1000000);
   #ifdef debug
     Serial.begin(1000000);
+    receiver.log = debugPrintln;
   #endif
 
-  setupRadio();
-
-  last_sleep_time = millis();
-}
-
-
+  receiver.node = RECEIVER_NODE;
+  receiver.begin();
 
-void setupRadio(){
-  radio.begin();
-  radio.maskIRQ(false, false, true); // interrupt - (tx_ok, tx_fail, rx_ready)
-  radio.setPALevel(RF24_PA_LOW);
-  radio.enableDynamicPayloads();
-  radio.enableDynamicAck();
-  radio.setChannel(85);
-  radio.openWritingPipe(address);
-  radio.openReadingPipe(1, address);  // using pipe 1
-  radio.startListening(); // put radio in RX mode
+  receiver.idleSince = millis();
 }
 
 
 void loop() {
-  if (radio.available()) {
-    byte flag[flagBytesCount];
-    radio.read(&flag, sizeof(flag));
-    if(flag[0] == transmitBytesFlag){
-      // read second, third, fourth and fifth byte as integer and call receiveBytes
-      unsigned long count = ((unsigned long)flag[1] << 24) | ((unsigned long)flag[2] << 16)
-                | ((unsigned long)flag[3] << 8) | (unsigned long)flag[4];
-      
-      bool report = sendAck(count);
-      
-      receiveBytes(count);
-    }
-    else if(flag[0] == transmitBytesWakeFlag){
-      // read second, third, fourth and fifth byte as integer and call receiveBytes
-      unsigned long count = ((unsigned long)flag[1] << 24) | ((unsigned long)flag[2] << 16)
-                | ((unsigned long)flag[3] << 8) | (unsigned long)flag[4];
-      
-      wakeReceiver();
-
-      if(!waitForWake()){
-        DEBUG_PRINTLN("Wake signal not received");
-        return;
-      }
-      bool report = sendAck(count);
-      
-      receiveBytes(count);
-    }
+  receiver.poll(); // the protocol lives in Receiver.h
 
-    radio.flush_rx(); // clear the rx buffer
-    radio.flush_tx(); // clear the tx buffer
-  }
-
-  if(millis() - last_sleep_time >= sleep_timeout){
+  if(!receiver.linkOpen() && millis() - receiver.idleSince >= sleep_timeout){ // stays awake while the PC keeps a link open
     DEBUG_PRINTLN("Going to sleep");
-    digitalWrite(nrf_power_pin, HIGH);
-    delay(2); //wait for everything to finish
-    for(int i = 0; i < sleep_time; i++){ // go to sleep for sleep_time * 8 seconds
-      LowPower.powerDown(SLEEP_8S, ADC_OFF, BOD_OFF); // Sleep for 8 seconds
-    }
+    receiver.powerDown();
+    do{ // low power listening (see Protocol.h), the transmitter strobes its flag until a window catches it
+      sleepFor(listenPeriod);
+    } while(!receiver.listen(listenWindow));
     // woke up
-    digitalWrite(nrf_power_pin, LOW);
-    setupRadio();
-    last_sleep_time = millis();
+    receiver.idleSince = millis();
   }
 }
 
 
+void onRadioIrq(){
+  receiver.onRadioInterrupt();
+}
 
-// waits until receiving controller sends wake signal
-// returns true if wake signal is received, false otherwise
-bool waitForWake(int timeout = 1000){
-  char buffer[sizeof(wakeMessage)];
-  int index = 0;
-
-  unsigned long startTime = millis();
-  while(millis() - startTime < timeout){
-    if(Serial1.available()){
-      buffer[index] = Serial1.read();
-      index = (index + 1) % 5;
-
-      for (int i = 0; i < sizeof(wakeMessage); i++) {
-        char temp[sizeof(wakeMessage) + 1]; // +1 for null terminator
-        for (int j = 0; j < 5; j++) {
-          temp[j] = buffer[(i + j) % 5];
-        }
-        temp[5] = '\0';
 
-        if (strcmp(temp, wakeMessage.c_str()) == 0) {
-          return true;
-        }
-      }
+// watchdog sleeps of the longest steps that fit, the watchdog's timing is only good to about 10 %
+void sleepFor(unsigned long ms){
+  const period_t steps[] = {SLEEP_8S, SLEEP_4S, SLEEP_2S, SLEEP_1S, SLEEP_500MS, SLEEP_250MS, SLEEP_120MS, SLEEP_60MS, SLEEP_30MS, SLEEP_15MS};
+  const unsigned int stepMillis[] = {8000, 4000, 2000, 1000, 500, 250, 120, 60, 30, 15};
+  for(uint8_t i = 0; i < sizeof(stepMillis) / sizeof(stepMillis[0]); i++){
+    while(ms >= stepMillis[i]){
+      LowPower.powerDown(steps[i], ADC_OFF, BOD_OFF);
+      ms -= stepMillis[i];
     }
   }
-
-  return false;
 }
 
 
-// wake up the receiving controller (or PC)
-void wakeReceiver(){
-  digitalWrite(RECEIVER_WAKE_PIN, HIGH);
-  delayMicroseconds(500);
-  digitalWrite(RECEIVER_WAKE_PIN, LOW);
+void debugPrintln(const char* message){
+  DEBUG_PRINTLN(message);
 }
 
 
-// for sending the ack back to the transmitter
-bool sendAck(unsigned long payloadCount){
-  bool report = false;
-  byte ackMessage[flagBytesCount];
-
-  ackMessage[0] = ackFlag;
-  ackMessage[1] = payloadCount >> 24;
-  ackMessage[2] = payloadCount >> 16;
-  ackMessage[3] = payloadCount >> 8;
-  ackMessage[4] = payloadCount & 0xFF;
-
-  radio.stopListening();  // put in TX mode
-  radio.writeFast(&ackMessage, sizeof(ackMessage));  // load response to TX FIFO
-  report = radio.txStandBy(150);          // keep retrying for 150 ms
-  radio.startListening();  // put back in RX mode
-
-  return report;
-}
-
-
-
-void receiveBytes(unsigned long count){
-  unsigned long payloadCount = 0; // current payload index
-
-  // Keep receiving bytes until you get all of it
-  while(count > 0){
-    int bytesToReceive = 0;
-    // Take at most *payloadSize* byte chunk
-    if(count > payloadSize)
-      bytesToReceive = payloadSize;
-    else
-      bytesToReceive = count;
-    
-    byte data[bytesToReceive + 2]; // +2 for payloadCount
-
-    // only wait for a certain ammount of time before canceling transmission
-    unsigned long startTime = millis();
-    while (!radio.available()) {
-      if (millis() - startTime >= 1000) {
-        DEBUG_PRINTLN("Transmission timed out");
-        last_sleep_time = millis(); // if the transmission fails, let the transmitter try again
-        return; // cancel transmission
-      }
-    }
-    
-    radio.read(&data, sizeof(data));
-    
-    unsigned long receivedPayloadCount = ((unsigned long)data[bytesToReceive] << 8) | data[bytesToReceive + 1];
-    
-    // check if the packet was already received (if the previous ack failed and the transmitter resent the packet)
-    if(receivedPayloadCount < payloadCount){
-      DEBUG_PRINTLN("Received old packet");
-      sendAck(receivedPayloadCount);
-      continue;
-    }
-    else if(receivedPayloadCount > payloadCount){
-      DEBUG_PRINTLN("Received future packet");
-      last_sleep_time = millis(); // if the transmission fails, let the transmitter try again
-      return;
-    }
-
-
-    Serial1.write(data, bytesToReceive);
-    count -= bytesToReceive;
-
-    // send ack to transmitter
-    bool report = sendAck(receivedPayloadCount);
-    DEBUG_PRINTLN("Ack report: " + String(report));
-    
-    payloadCount++;
-  }
-}
-
-
-
 void printAsHex(byte data[], int arrSize){
   for (int i = 0; i < arrSize; i++) {
     DEBUG_PRINT(data[i], HEX);
     DEBUG_PRINT(" ");
   }
   DEBUG_PRINTLN();
-}
\ No newline at end of file
+}
@@ -0,0 +1,703 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <SimPipeline.h>
+
+// Runs the boards' protocol code (Transmitter.h, Receiver.h, DisplayReceiver.h) on simulated
+// hardware and sends an 800x600 3 bit image from the PC to the Inkplate, the way "sendimg3" does.
+// Every run is deterministic for a given seed, a full image takes well under a second of wall time.
+//
+// usage: program [-s seed] [-b bit error rate] [-r reorder %] [-l latency us] [-j jitter us] [-q quantum us] [-u baud] [-e bit error rate] [-w] [-k] [-n] [-f] [-a] [-c] [-g] [-t] [-p] [-d] [-i] [-v] [loss %]...
+//   -u sets the receiver -> Inkplate UART, a slow one shows how the receiver holds the radio back
+//   -w measures the wake handshake instead: from deep sleep, light sleep, awake and after a reset of the Inkplate
+//   -k measures a burst of messages with and without a link (see Protocol.h)
+//   -n measures the image going to 1 to 8 nodes, one after the other and as a broadcast, with and without a sleeping receiver
+//   -f measures a broadcast to 4 nodes with a parity frame every 2, 4 and 8 payloads and without (see Parity.h)
+//   -a measures three images in a row on a near, a far and a noisy link, with and without adaptive radio settings (see LinkAdapter.h)
+//   -e sets the bit error rate of the receiver -> Inkplate UART
+//   -c measures images over a noisy UART with and without the end to end check (see checkFlag in Protocol.h)
+//   -g measures bursts of corrupted bytes on the receiver -> Inkplate UART (see UartFrame.h)
+//   -t prints the transmitter's and the receiver's counters from the status query after an image (see LinkStats.h)
+//   -p measures wakes of a receiver in low power listening and its current while idle, for listen periods of 250 ms to 8 s
+//   -d measures images sent back to back, with the Inkplate's refresh blocking it and overlapping the next image
+//   -i measures a rotation of 3 images, with and without the Inkplate's image cache (see ImageCache.h)
+
+const int imageWidth = 800;
+const int imageHeight = 600;
+
+// LilyPadUSB (NRF_receiver), for the energy of low power listening
+const double sleepCurrent = 0.006; // mA, ATmega32U4 in power down with the watchdog on, the nRF24 in power down
+const double awakeCurrent = 17.5;  // mA, ATmega32U4 at 8 MHz and the nRF24 in RX
+const unsigned long receiverSleepTimeout = 5000; // ms, sleep_timeout in NRF_receiver/src/main.cpp
+
+
+// gradient with some noise, two pixels per byte, high nibble first (ConvertToBitmap3bit in the PC code)
+std::vector<uint8_t> testImage(unsigned int seed){
+  std::mt19937 rng(seed);
+  std::vector<uint8_t> image(imageWidth * imageHeight / 2);
+  for(int y = 0; y < imageHeight; y++){
+    for(int x = 0; x < imageWidth; x += 2){
+      uint8_t first = ((x + y) / 100 + (rng() % 3 == 0)) & 0x07;
+      uint8_t second = ((x + 1 + y) / 100 + (rng() % 3 == 0)) & 0x07;
+      image[(y * imageWidth + x) / 2] = (first << 4) | second;
+    }
+  }
+  return image;
+}
+
+
+bool sameImage(const SimDisplay& screen, const std::vector<uint8_t>& image){
+  for(int y = 0; y < imageHeight; y++){
+    for(int x = 0; x < imageWidth; x++){
+      uint8_t packed = image[(y * imageWidth + x) / 2];
+      uint8_t expected = x % 2 == 0 ? packed >> 4 : packed & 0x0F;
+      if(screen.pixel(x, y) != expected)
+        return false;
+    }
+  }
+  return true;
+}
+
+
+// every step changes part of the image and sends it as an update, the first one and the one
+// after the reset have to fall back to the whole image
+// "first byte ms" is the Inkplate's wait from the ready frame to the message, "staged" the bytes that came before
+// its display was ready, "broken" the messages that didn't come whole of all it got
+bool measureWakes(const PipelineConfig& base, const std::vector<double>& losses, const std::vector<uint8_t>& first){
+  printf("%-12s %7s %-6s %-12s %9s %12s %14s %9s %9s %9s %8s %s\n", "acks", "loss %", "defer", "inkplate", "wake ms", "wake ack ms",
+         "first byte ms", "staged", "s", "bytes", "broken", "result");
+  bool allOk = true;
+  simtime_t slowest = 0;
+  for(double loss : losses){
+    for(bool ackPayloads : {true, false}){
+      for(bool defer : {false, true}){
+        PipelineConfig config = base;
+        config.air.loss = loss;
+        config.useAckPayloads = ackPayloads;
+        config.displayDeferInit = defer;
+        SimPipeline pipeline(config);
+        std::vector<uint8_t> image = first;
+
+        const char* steps[] = {"deep sleep", "light sleep", "awake", "reset"};
+        for(int step = 0; step < 4; step++){
+          if(step == 1)
+            pipeline.idle(2 * simSecond); // the Inkplate goes back to sleep
+          if(step == 3)
+            pipeline.resetDisplay();
+          for(int y = step * 40; y < step * 40 + 40; y++) // a 40 pixel band in a new color
+            memset(&image[(y * imageWidth + 200) / 2], 0x11 * (step + 2), 100);
+
+          pipeline.displayReceiver.stagedBytes = 0;
+          simtime_t start = pipeline.now();
+          bool ok = pipeline.sendImage3BitUpdate(image.data(), imageHeight, imageWidth, 60 * simSecond)
+                 && sameImage(pipeline.screen, image);
+          allOk &= ok;
+          if(pipeline.pc.wakeAckTime > slowest)
+            slowest = pipeline.pc.wakeAckTime;
+          char broken[16];
+          snprintf(broken, sizeof(broken), "%lu/%lu", pipeline.displayReceiver.messagesBroken, pipeline.displayReceiver.messages);
+          printf("%-12s %7.1f %-6s %-12s %9lu %12.1f %14lu %9lu %9.3f %9lu %8s %s\n", ackPayloads ? "ack-payload" : "ack-frame",
+                 loss * 100, defer ? "yes" : "no", steps[step], pipeline.receiver.wakeLatency,
+                 pipeline.pc.wakeAckTime / (double)simMillisecond, pipeline.displayReceiver.wakeToFirstByte,
+                 pipeline.displayReceiver.stagedBytes, (pipeline.pcFinished - start) / (double)simSecond,
+                 pipeline.pc.lastUpdateBytes, broken, ok ? "ok" : "failed");
+        }
+      }
+    }
+  }
+  printf("slowest wake ack %.1f ms, the transmitter waits up to %lu ms (wakeAckTimeout)\n",
+         slowest / (double)simMillisecond, wakeAckTimeout);
+  return allOk;
+}
+
+
+// 20 sensor sized byte messages and an update of the image, one after the other like a script would send them
+bool measureLink(const PipelineConfig& base, const std::vector<double>& losses, const std::vector<uint8_t>& first){
+  const int messages = 20;
+  const unsigned long linkTimeout = 10000;
+  printf("%-12s %7s %-5s %12s %10s %9s %s\n", "acks", "loss %", "link", "message ms", "update s", "total s", "result");
+  bool allOk = true;
+  for(double loss : losses){
+    for(bool ackPayloads : {true, false}){
+      for(bool link : {false, true}){
+        PipelineConfig config = base;
+        config.air.loss = loss;
+        config.useAckPayloads = ackPayloads;
+        SimPipeline pipeline(config);
+        std::vector<uint8_t> image = first;
+        bool ok = pipeline.sendImage3Bit(image.data(), imageHeight, imageWidth) && sameImage(pipeline.screen, image);
+        pipeline.idle(2 * simSecond); // the Inkplate went back to sleep, like between two scripts
+
+        simtime_t start = pipeline.now();
+        if(link)
+          ok &= pipeline.runOnPc([&](){ return pipeline.pc.openLink(linkTimeout); });
+        for(int i = 0; ok && i < messages; i++){
+          std::vector<uint8_t> data(64);
+          for(size_t j = 0; j < data.size(); j++)
+            data[j] = (uint8_t)(i * 31 + j);
+          ok = pipeline.sendByteArray(data.data(), data.size()) && pipeline.displayedBytes == data;
+        }
+        simtime_t messagesDone = pipeline.now();
+
+        for(int y = 300; y < 340; y++) // a clock sized area
+          memset(&image[(y * imageWidth + 200) / 2], 0x33, 100);
+        ok = ok && pipeline.sendImage3BitUpdate(image.data(), imageHeight, imageWidth) && sameImage(pipeline.screen, image);
+        simtime_t updateDone = pipeline.now();
+        if(link)
+          ok = ok && pipeline.runOnPc([&](){ return pipeline.pc.closeLink(); });
+        allOk &= ok;
+
+        printf("%-12s %7.1f %-5s %12.1f %10.3f %9.3f %s\n", ackPayloads ? "ack-payload" : "ack-frame", loss * 100, link ? "yes" : "no",
+               (messagesDone - start) / (double)simMillisecond / messages, (updateDone - messagesDone) / (double)simSecond,
+               (pipeline.now() - start) / (double)simSecond, ok ? "ok" : "failed");
+      }
+    }
+  }
+  return allOk;
+}
+
+
+// every node gets the image, the scheduler (SendToNodes) takes turns, a broadcast sends it once to all of them
+// with a sleeping receiver, the others shouldn't have to wait for it ("awake s"), it gets the image once it wakes up ("all s")
+bool measureNodes(const PipelineConfig& base, const std::vector<double>& losses, const std::vector<uint8_t>& image){
+  printf("%7s %6s %-10s %-7s %9s %9s %11s %s\n", "loss %", "nodes", "send", "asleep", "awake s", "all s", "frames/air", "result");
+  bool allOk = true;
+  for(double loss : losses){
+    for(uint8_t nodes : {1, 2, 4, 8}){
+      for(bool broadcast : {false, true}){
+        for(bool asleep : {false, true}){
+          if(asleep && nodes == 1)
+            continue;
+          PipelineConfig config = base;
+          config.air.loss = loss;
+          config.nodes = nodes;
+          SimPipeline pipeline(config);
+          uint8_t all = (uint8_t)((1u << nodes) - 1);
+          uint8_t sleeping = asleep ? (uint8_t)(1u << (nodes - 1)) : 0;
+          if(asleep){
+            pipeline.sleepReceiver(nodes - 1);
+            pipeline.idle(10 * simMillisecond);
+          }
+
+          std::vector<unsigned long> refreshes = pipeline.refreshCounts();
+          simtime_t start = 0; // the sleeping receiver is already further ahead than the PC
+          uint8_t done = 0;
+          pipeline.runOnPc([&](){
+            start = pipeline.pcNode.now();
+            simtime_t deadline = start + 120 * simSecond; // one by one, the receivers that wait for their turn fall asleep
+            if(broadcast)
+              done = pipeline.pc.broadcastImage3Bit(all, image.data(), imageHeight, imageWidth, deadline);
+            else
+              done = pipeline.pc.sendToNodes(all, [&](){ return pipeline.pc.sendImage3Bit(image.data(), imageHeight, imageWidth); }, deadline);
+            return done == all;
+          }, 180 * simSecond);
+
+          simtime_t awake = 0, last = 0;
+          for(uint8_t n = 0; n < nodes; n++){
+            simtime_t time = pipeline.pc.nodeDone[n] - start;
+            if(!(sleeping & (1u << n)) && time > awake)
+              awake = time;
+            if(time > last)
+              last = time;
+          }
+          bool ok = done == all && pipeline.waitForRefreshes(refreshes, all);
+          for(uint8_t n = 0; ok && n < nodes; n++)
+            ok = sameImage(pipeline.stations[n]->screen, image);
+          allOk &= ok;
+          printf("%7.1f %6u %-10s %-7s %9.3f %9.3f %11lu %s\n", loss * 100, nodes, broadcast ? "broadcast" : "one by one",
+                 asleep ? "yes" : "no", awake / (double)simSecond, last / (double)simSecond, pipeline.air.framesOnAir, ok ? "ok" : "failed");
+        }
+      }
+    }
+  }
+  return allOk;
+}
+
+
+// goodput of a broadcast with and without parity frames, the image goes uncompressed so every run carries the same bytes
+// "rebuilt" - payloads the nodes got from parity instead of a resend, all nodes together
+bool measureParity(const PipelineConfig& base, const std::vector<double>& losses, const std::vector<uint8_t>& image){
+  const uint8_t nodes = 4;
+  printf("%7s %-8s %9s %9s %11s %8s %s\n", "loss %", "parity", "s", "kB/s", "frames/air", "rebuilt", "result");
+  bool allOk = true;
+  for(double loss : losses){
+    for(uint8_t block : {0, 8, 4, 2}){
+      PipelineConfig config = base;
+      config.air.loss = loss;
+      config.nodes = nodes;
+      SimPipeline pipeline(config);
+      pipeline.pc.compressImages = false;
+      pipeline.pc.parityBlock = block;
+      uint8_t all = (uint8_t)((1u << nodes) - 1);
+
+      std::vector<unsigned long> refreshes = pipeline.refreshCounts();
+      simtime_t start = 0;
+      uint8_t done = 0;
+      pipeline.runOnPc([&](){
+        start = pipeline.pcNode.now();
+        done = pipeline.pc.broadcastImage3Bit(all, image.data(), imageHeight, imageWidth, start + 60 * simSecond);
+        return done == all;
+      }, 120 * simSecond);
+      simtime_t time = 0;
+      for(uint8_t n = 0; n < nodes; n++){
+        if(pipeline.pc.nodeDone[n] - start > time)
+          time = pipeline.pc.nodeDone[n] - start;
+      }
+
+      bool ok = done == all && pipeline.waitForRefreshes(refreshes, all);
+      unsigned long rebuilt = 0;
+      for(uint8_t n = 0; n < nodes; n++){
+        ok = ok && sameImage(pipeline.stations[n]->screen, image);
+        rebuilt += pipeline.stations[n]->receiver.payloadsRebuilt();
+      }
+      allOk &= ok;
+      char parityText[16];
+      snprintf(parityText, sizeof(parityText), block == 0 ? "none" : "every %u", block);
+      printf("%7.1f %-8s %9.3f %9.2f %11lu %8lu %s\n", loss * 100, parityText, time / (double)simSecond,
+             image.size() / 1000.0 / (time / (double)simSecond), pipeline.air.framesOnAir, rebuilt, ok ? "ok" : "failed");
+    }
+  }
+  return allOk;
+}
+
+
+const char* dataRateName(uint8_t dataRate){
+  return dataRate == RF24_250KBPS ? "250k" : dataRate == RF24_1MBPS ? "1M" : "2M";
+}
+
+const char* paLevelName(uint8_t paLevel){
+  const char* names[] = {"min", "low", "high", "max"};
+  return names[paLevel & 0x03];
+}
+
+
+// the settings the transmitter learned carry over to the next image, "s" is the time of each image on the PC
+// far - the default settings (RF24_PA_LOW, 1 Mbps) barely reach, noisy - WiFi or another link on radioChannel
+bool measureRadio(const PipelineConfig& base, const std::vector<uint8_t>& image){
+  struct Scenario { const char* name; double pathLoss; double channelLoss; };
+  const Scenario scenarios[] = {{"near", 40, 0}, {"far", 70, 0}, {"noisy", 45, 0.3}};
+  const int images = 3;
+  printf("%-6s %-12s %-6s %3s %9s %-15s %11s %s\n", "link", "acks", "adapt", "#", "s", "settings", "frames/air", "result");
+  bool allOk = true;
+  for(const Scenario& scenario : scenarios){
+    for(bool ackPayloads : {true, false}){
+      for(bool adapt : {false, true}){
+        PipelineConfig config = base;
+        config.air.pathLoss = scenario.pathLoss;
+        if(scenario.channelLoss > 0)
+          config.air.channelLoss[radioChannel] = scenario.channelLoss;
+        config.useAckPayloads = ackPayloads;
+        config.adaptRadio = adapt;
+        SimPipeline pipeline(config);
+
+        for(int i = 0; i < images; i++){
+          simtime_t start = pipeline.now();
+          unsigned long frames = pipeline.air.framesOnAir;
+          bool ok = pipeline.sendImage3Bit(image.data(), imageHeight, imageWidth, 300 * simSecond)
+                 && sameImage(pipeline.screen, image);
+          simtime_t end = ok ? pipeline.pcFinished : pipeline.now(); // the time to the failure, on the clock of start
+          if(adapt) // the fixed settings are only there to compare, they can't make the far and the noisy link
+            allOk &= ok;
+          RadioSettings settings = pipeline.transmitter.radioSettings();
+          char settingsText[16];
+          snprintf(settingsText, sizeof(settingsText), "ch%u %s %s", settings.channel, dataRateName(settings.dataRate),
+                   paLevelName(settings.paLevel));
+          printf("%-6s %-12s %-6s %3d %9.3f %-15s %11lu %s\n", scenario.name, ackPayloads ? "ack-payload" : "ack-frame",
+                 adapt ? "yes" : "no", i + 1, (end - start) / (double)simSecond, settingsText,
+                 pipeline.air.framesOnAir - frames, ok ? "ok" : "failed");
+          pipeline.idle(2 * simSecond); // the Inkplate went back to sleep, like between two scripts
+        }
+      }
+    }
+  }
+  return allOk;
+}
+
+
+// every image goes out raw and compressed, "resent" is what the checks sent again, "flipped" the bytes the UART corrupted
+// without the check a corrupted image is shown as it came, only the checked ones have to arrive intact
+bool measureChecks(const PipelineConfig& base, const std::vector<uint8_t>& image){
+  const double bitErrorRates[] = {0, 1e-7, 1e-6, 1e-5};
+  const int images = 3;
+  printf("%-10s %-11s %-6s %9s %9s %8s %s\n", "uart ber", "image", "check", "s", "resent", "flipped", "result");
+  bool allOk = true;
+  for(double bitErrorRate : bitErrorRates){
+    for(bool compress : {false, true}){
+      for(bool check : {false, true}){
+        PipelineConfig config = base;
+        config.receiverToDisplay.bitErrorRate = bitErrorRate;
+        SimPipeline pipeline(config);
+        pipeline.pc.compressImages = compress;
+        pipeline.pc.checkImages = check;
+
+        simtime_t time = 0;
+        unsigned long resent = 0;
+        int intact = 0, failed = 0;
+        for(int i = 0; i < images; i++){
+          simtime_t start = pipeline.now();
+          bool sent = pipeline.sendImage3Bit(image.data(), imageHeight, imageWidth, 300 * simSecond);
+          time += pipeline.pcFinished - start;
+          resent += pipeline.pc.lastRepairBytes;
+          if(sent && sameImage(pipeline.screen, image))
+            intact++;
+          else if(!sent)
+            failed++;
+          pipeline.idle(2 * simSecond);
+        }
+        if(check)
+          allOk &= intact == images;
+        char result[32];
+        snprintf(result, sizeof(result), "%d/%d intact%s", intact, images, failed > 0 ? ", failed" : "");
+        printf("%-10g %-11s %-6s %9.3f %9lu %8lu %s\n", bitErrorRate, compress ? "compressed" : "raw", check ? "yes" : "no",
+               time / (double)simSecond / images, resent, pipeline.receiverToDisplay.corrupted, result);
+      }
+    }
+  }
+  return allOk;
+}
+
+
+// when the first frame in order came after the burst (DisplayReceiver's debug message)
+SimPipeline* uartPipeline = NULL;
+simtime_t uartResentAt = 0;
+
+void recordUartEvent(const char* message){
+  if(strcmp(message, "UART frames resent") == 0 && uartResentAt == 0)
+    uartResentAt = uartPipeline->displayNode.now();
+}
+
+
+// a burst of corrupted bytes on the receiver -> Inkplate UART in the middle of every image, "line B/B" is what the
+// framing puts on the line for every byte of the message, "dropped" the frames the Inkplate couldn't decode,
+// "recovery ms" the time from the end of the burst until the lost frames came again
+bool measureUart(const PipelineConfig& base, const std::vector<uint8_t>& image){
+  const unsigned long bursts[] = {0, 1, 8, 64, 512};
+  printf("%-8s %-11s %9s %9s %8s %8s %12s %s\n", "burst B", "image", "s", "line B/B", "dropped", "resends", "recovery ms", "result");
+  bool allOk = true;
+  for(unsigned long burst : bursts){
+    for(bool compress : {false, true}){
+      PipelineConfig config = base;
+      SimPipeline pipeline(config);
+      pipeline.pc.compressImages = compress;
+      pipeline.pc.checkImages = false; // the framing on its own
+      uartPipeline = &pipeline;
+      uartResentAt = 0;
+      pipeline.displayReceiver.log = recordUartEvent;
+      if(burst > 0)
+        pipeline.receiverToDisplay.corruptBurst(100000, burst); // well into the image, raw or compressed
+
+      simtime_t start = pipeline.now();
+      unsigned long lineBytes = pipeline.receiverToDisplay.bytesSent;
+      bool ok = pipeline.sendImage3Bit(image.data(), imageHeight, imageWidth, 300 * simSecond)
+             && sameImage(pipeline.screen, image);
+      allOk &= ok;
+      unsigned long messageBytes = pipeline.pc.lastImageBytes;
+      char recovery[16] = "-";
+      if(burst > 0 && uartResentAt > pipeline.receiverToDisplay.burstEnd)
+        snprintf(recovery, sizeof(recovery), "%.3f", (uartResentAt - pipeline.receiverToDisplay.burstEnd) / (double)simMillisecond);
+      printf("%-8lu %-11s %9.3f %9.3f %8lu %8lu %12s %s\n", burst, compress ? "compressed" : "raw",
+             (pipeline.pcFinished - start) / (double)simSecond,
+             (pipeline.receiverToDisplay.bytesSent - lineBytes) / (double)messageBytes,
+             pipeline.displayReceiver.uartFramesDropped(), pipeline.displayReceiver.uartResends, recovery, ok ? "intact" : "failed");
+    }
+  }
+  return allOk;
+}
+
+
+// an image at every loss rate, then the counters the PC reads with the status query (see LinkStats.h),
+// "rtt us" is from a write to its auto-ack, min/avg/max
+bool measureStatus(const PipelineConfig& base, const std::vector<double>& losses, const std::vector<uint8_t>& image){
+  printf("%-12s %7s %7s %6s %7s %8s %5s %9s %-15s | %7s %5s %6s %8s %8s %s\n", "acks", "loss %", "frames", "lost", "retrans",
+         "timeouts", "naks", "bytes/s", "rtt us", "rx frm", "old", "future", "ack fail", "rx bytes", "result");
+  bool allOk = true;
+  for(double loss : losses){
+    for(bool ackPayloads : {true, false}){
+      PipelineConfig config = base;
+      config.air.loss = loss;
+      config.useAckPayloads = ackPayloads;
+      SimPipeline pipeline(config);
+      bool ok = pipeline.sendImage3Bit(image.data(), imageHeight, imageWidth, 300 * simSecond) && sameImage(pipeline.screen, image);
+
+      std::vector<uint32_t> tx, rx;
+      bool answered = false;
+      for(int attempt = 0; ok && !answered && attempt < 3; attempt++) // the receiver's answer can get lost like any ack frame
+        answered = pipeline.runOnPc([&](){ return pipeline.pc.queryStatus(statusTransmitter, tx) && pipeline.pc.queryStatus(statusReceiver, rx); });
+      ok = ok && answered && tx.size() == transmitterStatCount && rx.size() == receiverStatCount;
+      allOk &= ok;
+      if(!ok){
+        printf("%-12s %7.1f status failed\n", ackPayloads ? "ack-payload" : "ack-frame", loss * 100);
+        continue;
+      }
+      char rtt[32];
+      uint32_t acked = tx[txFramesSent] - tx[txFramesLost];
+      snprintf(rtt, sizeof(rtt), "%u/%u/%u", tx[txRttMin], acked > 0 ? tx[txRttTotal] / acked : 0, tx[txRttMax]);
+      printf("%-12s %7.1f %7u %6u %7u %8u %5u %9.0f %-15s | %7u %5u %6u %8u %8u %s\n", ackPayloads ? "ack-payload" : "ack-frame",
+             loss * 100, tx[txFramesSent], tx[txFramesLost], tx[txRetransmits], tx[txAckTimeouts], tx[txNaks],
+             tx[txTransferMillis] > 0 ? tx[txBytes] * 1000.0 / tx[txTransferMillis] : 0, rtt,
+             rx[rxFrames], rx[rxOldPayloads], rx[rxFuturePayloads], rx[rxAckFailures], rx[rxBytes], "ok");
+    }
+  }
+  return allOk;
+}
+
+
+// a 64 byte message to a receiver in low power listening, at random points of its listen period
+// "wake ack ms" - from the wake flag to its ack, the Inkplate's wake included, avg/max
+// "idle uA" - the receiver's average current while nothing comes, the same as its uAh per hour
+bool measureListen(const PipelineConfig& base, const std::vector<double>& losses){
+  const int wakes = 8;
+  const unsigned long periods[] = {250, 500, 1000, 2000, 4000, 8000}; // LowPower's watchdog steps
+  printf("%-12s %7s %9s %-17s %10s %9s %8s %s\n", "acks", "loss %", "period", "wake ack ms", "bound ms", "listens",
+         "idle uA", "result");
+  bool allOk = true;
+  for(double loss : losses){
+    for(bool ackPayloads : {true, false}){
+      for(unsigned long period : periods){
+        PipelineConfig config = base;
+        config.air.loss = loss;
+        config.useAckPayloads = ackPayloads;
+        config.listenPeriod = period;
+        SimPipeline pipeline(config);
+        SimPipeline::Station& station = *pipeline.stations[0];
+        std::mt19937 rng(config.air.seed);
+
+        bool ok = true;
+        simtime_t slowest = 0, total = 0;
+        for(int i = 0; ok && i < wakes; i++){
+          // the PC waits on its own clock, idle() only stops once the receiver is done with its sleep
+          simtime_t wait = (receiverSleepTimeout + period) * simMillisecond + rng() % (period * simMillisecond);
+          pipeline.runOnPc([&](){ pipeline.pcNode.spend(wait); return true; }, wait + simSecond);
+          std::vector<uint8_t> data(64);
+          for(size_t j = 0; j < data.size(); j++)
+            data[j] = (uint8_t)(i * 31 + j);
+          ok = pipeline.sendByteArray(data.data(), data.size()) && pipeline.displayedBytes == data;
+          total += pipeline.pc.wakeAckTime;
+          if(pipeline.pc.wakeAckTime > slowest)
+            slowest = pipeline.pc.wakeAckTime;
+        }
+        allOk &= ok;
+
+        simtime_t listened = station.listenedTime, slept = station.sleptTime;
+        double idle = (listened * awakeCurrent + slept * sleepCurrent) / (double)(listened + slept) * 1000;
+        char wake[32];
+        snprintf(wake, sizeof(wake), "%.1f/%.1f", total / (double)wakes / simMillisecond, slowest / (double)simMillisecond);
+        printf("%-12s %7.1f %9lu %-17s %10lu %9lu %8.1f %s\n", ackPayloads ? "ack-payload" : "ack-frame", loss * 100,
+               period, wake, listenStrobeTime(period) + wakeAckTimeout, station.listens, idle, ok ? "ok" : "failed");
+      }
+    }
+  }
+  printf("after a message the receiver stays awake for the sleep timeout, %.4f mAh\n", receiverSleepTimeout * awakeCurrent / 3600000);
+  printf("before, deaf for 8 s and then awake for the sleep timeout: %.1f uA idle, a wake while it was deaf failed\n",
+         (receiverSleepTimeout * awakeCurrent + 8000 * sleepCurrent) / (receiverSleepTimeout + 8000) * 1000);
+  return allOk;
+}
+
+
+// the PC sends the next image as soon as the last one was acked, and sends an image again if it failed (up to 3 times)
+// "s/image" - from the first image until the last one was shown, "again" - the images the PC had to send again,
+// "dropped" - UART frames the Inkplate couldn't decode and bytes its Serial2 buffer had no room for, "resends" - the
+// UART frames it asked for again, "broken" - messages that didn't come whole
+bool measureRefresh(const PipelineConfig& base, const std::vector<double>& losses){
+  const int images = 6;
+  std::vector<std::vector<uint8_t> > sequence;
+  for(int i = 0; i < images; i++)
+    sequence.push_back(testImage(base.air.seed + i));
+  printf("%7s %-8s %9s %6s %8s %8s %7s %s\n", "loss %", "overlap", "s/image", "again", "dropped", "resends", "broken", "result");
+  bool allOk = true;
+  for(double loss : losses){
+    for(bool overlap : {false, true}){
+      PipelineConfig config = base;
+      config.air.loss = loss;
+      config.displayOverlapRefresh = overlap;
+      SimPipeline pipeline(config);
+
+      simtime_t start = pipeline.now();
+      int again = 0;
+      bool sent = pipeline.runOnPc([&](){
+        for(const std::vector<uint8_t>& image : sequence){
+          int attempt = 0;
+          while(!pipeline.pc.sendImage3Bit(image.data(), imageHeight, imageWidth)){
+            if(++attempt > 3)
+              return false;
+            again++;
+          }
+        }
+        return true;
+      }, 600 * simSecond);
+      while(sent && pipeline.screen.refreshes < (unsigned long)images && pipeline.now() - start < 600 * simSecond)
+        pipeline.idle(simMillisecond);
+      bool ok = sent && pipeline.screen.refreshes == (unsigned long)images && sameImage(pipeline.screen, sequence.back());
+      allOk &= ok;
+
+      DisplayReceiver<SimSerial, SimDisplay, SimClock>& display = pipeline.displayReceiver;
+      printf("%7.1f %-8s %9.3f %6d %8lu %8lu %7lu %s\n", loss * 100, overlap ? "yes" : "no",
+             (pipeline.now() - start) / (double)simSecond / images, again,
+             display.uartFramesDropped() + pipeline.receiverToDisplay.overflows, display.uartResends, display.messagesBroken,
+             ok ? "ok" : sent ? "not shown" : "failed");
+    }
+  }
+  return allOk;
+}
+
+
+// the PC shows 3 images in turn, 4 rounds, and the Inkplate goes to sleep after every image
+// without the overlapped refresh the Inkplate saves the image before it sleeps instead of after the refresh
+// "first" - the first round, "again" - the rounds after it, which the cache has: s from the PC starting on an image
+// until it was shown (the 2 s refresh included), radio frames on the air per image
+// "saved" - image bytes the cache hits didn't send, uncompressed
+bool measureCache(const PipelineConfig& base, const std::vector<double>& losses){
+  const int screens = 3;
+  const int rounds = 4;
+  std::vector<std::vector<uint8_t> > sequence;
+  for(int i = 0; i < screens; i++)
+    sequence.push_back(testImage(base.air.seed + i));
+  printf("%7s %-6s %-6s %-8s %8s %8s %13s %13s %5s %7s %9s %s\n", "loss %", "cache", "sleep", "overlap", "first s",
+         "again s", "first frames", "again frames", "hits", "misses", "saved", "result");
+  bool allOk = true;
+  for(double loss : losses){
+    for(int variant = 0; variant < 4; variant++){
+      PipelineConfig config = base;
+      config.air.loss = loss;
+      config.displayLightSleep = variant != 2;
+      config.displayOverlapRefresh = variant != 3;
+      config.pcCacheImages = variant > 0;
+      SimPipeline pipeline(config);
+
+      simtime_t sending[2] = {0, 0};
+      unsigned long frames[2] = {0, 0};
+      bool ok = true;
+      for(int i = 0; i < screens * rounds && ok; i++){
+        const std::vector<uint8_t>& image = sequence[i % screens];
+        simtime_t start = pipeline.now();
+        unsigned long framesBefore = pipeline.air.framesOnAir;
+        ok = pipeline.sendImage3Bit(image.data(), imageHeight, imageWidth, 300 * simSecond)
+             && sameImage(pipeline.screen, image);
+        sending[i >= screens] += pipeline.now() - start;
+        frames[i >= screens] += pipeline.air.framesOnAir - framesBefore;
+        pipeline.idle(3 * simSecond); // the Inkplate goes to sleep
+      }
+      allOk &= ok;
+
+      SimPc& pc = pipeline.pc;
+      int again = screens * (rounds - 1);
+      printf("%7.1f %-6s %-6s %-8s %8.3f %8.3f %13lu %13lu %5lu %7lu %9lu %s\n", loss * 100, variant > 0 ? "yes" : "no",
+             config.displayLightSleep ? "light" : "deep", config.displayOverlapRefresh ? "yes" : "no",
+             sending[0] / (double)simSecond / screens,
+             sending[1] / (double)simSecond / again, frames[0] / screens, frames[1] / again,
+             pc.cacheHits, pc.cacheMisses, pc.cacheBytesSaved, ok ? "ok" : "failed");
+    }
+  }
+  return allOk;
+}
+
+
+int main(int argc, char* argv[]){
+  PipelineConfig base;
+  bool wakes = false;
+  bool links = false;
+  bool nodes = false;
+  bool parity = false;
+  bool radioSettings = false;
+  bool checks = false;
+  bool uart = false;
+  bool status = false;
+  bool listen = false;
+  bool refresh = false;
+  bool cache = false;
+  int option;
+  while((option = getopt(argc, argv, "s:b:r:l:j:q:u:e:wknfacgtpdiv")) != -1){
+    switch(option){
+      case 's': base.air.seed = strtoul(optarg, NULL, 10); break;
+      case 'b': base.air.bitErrorRate = atof(optarg); break;
+      case 'r': base.air.reorder = atof(optarg) / 100; break;
+      case 'l': base.air.latency = (simtime_t)(atof(optarg) * simMicrosecond); break;
+      case 'j': base.air.jitter = (simtime_t)(atof(optarg) * simMicrosecond); break;
+      case 'q': base.quantum = (simtime_t)(atof(optarg) * simMicrosecond); break;
+      case 'u':
+        base.receiverToDisplay.byteTime = (simtime_t)(10 * simSecond / atof(optarg)); // 10 bits per byte
+        base.displayToReceiver.byteTime = base.receiverToDisplay.byteTime;
+        break;
+      case 'e': base.receiverToDisplay.bitErrorRate = atof(optarg); break;
+      case 'w': wakes = true; break;
+      case 'k': links = true; break;
+      case 'n': nodes = true; break;
+      case 'f': parity = true; break;
+      case 'a': radioSettings = true; break;
+      case 'c': checks = true; break;
+      case 'g': uart = true; break;
+      case 't': status = true; break;
+      case 'p': listen = true; break;
+      case 'd': refresh = true; break;
+      case 'i': cache = true; break;
+      case 'v': base.verbose = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-s seed] [-b bit error rate] [-r reorder %%] [-l latency us] [-j jitter us] [-q quantum us] [-u baud] [-e bit error rate] [-w] [-k] [-n] [-f] [-a] [-c] [-g] [-t] [-p] [-d] [-i] [-v] [loss %%]...\n", argv[0]);
+        return 2;
+    }
+  }
+  std::vector<double> losses;
+  for(int i = optind; i < argc; i++)
+    losses.push_back(atof(argv[i]) / 100);
+  if(losses.empty() && (wakes || links || listen))
+    losses = {0, 0.01, 0.05}; // a lost flag ack still fails the transfer (TODO in Transmitter::transmitFlag)
+  if(losses.empty() && (nodes || refresh || cache))
+    losses = {0, 0.05};
+  if(losses.empty())
+    losses = {0, 0.01, 0.05, 0.1, 0.2};
+
+  std::vector<uint8_t> image = testImage(base.air.seed);
+  if(wakes)
+    return measureWakes(base, losses, image) ? 0 : 1;
+  if(links)
+    return measureLink(base, losses, image) ? 0 : 1;
+  if(nodes)
+    return measureNodes(base, losses, image) ? 0 : 1;
+  if(parity)
+    return measureParity(base, losses, image) ? 0 : 1;
+  if(radioSettings)
+    return measureRadio(base, image) ? 0 : 1; // the links lose frames by their path loss, not by the loss %
+  if(checks)
+    return measureChecks(base, image) ? 0 : 1;
+  if(uart)
+    return measureUart(base, image) ? 0 : 1;
+  if(status)
+    return measureStatus(base, losses, image) ? 0 : 1;
+  if(listen)
+    return measureListen(base, losses) ? 0 : 1;
+  if(refresh)
+    return measureRefresh(base, losses) ? 0 : 1;
+  if(cache)
+    return measureCache(base, losses) ? 0 : 1;
+
+  printf("%-12s %7s %10s %10s %10s %10s %8s %9s %5s %8s %8s %s\n", "acks", "loss %", "pc s", "shown s", "bytes/s",
+         "frames/air", "retries", "overflow", "ring", "rx full", "wall ms", "result");
+  bool allOk = true;
+  for(double loss : losses){
+    for(bool ackPayloads : {true, false}){
+      PipelineConfig config = base;
+      config.air.loss = loss;
+      config.useAckPayloads = ackPayloads;
+
+      auto wallStart = std::chrono::steady_clock::now();
+      SimPipeline pipeline(config);
+      bool sent = pipeline.sendImage3Bit(image.data(), imageHeight, imageWidth, 300 * simSecond);
+      bool ok = sent && sameImage(pipeline.screen, image);
+      double wall = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wallStart).count();
+      allOk &= ok;
+
+      double pcTime = pipeline.pcFinished / (double)simSecond;
+      printf("%-12s %7.1f %10.3f %10.3f %10.0f %10lu %8lu %9lu %5u %8lu %8.0f %s\n", ackPayloads ? "ack-payload" : "ack-frame",
+             loss * 100, pcTime, pipeline.now() / (double)simSecond, sent ? image.size() / pcTime : 0,
+             pipeline.air.framesOnAir, pipeline.transmitterRadio.retransmits + pipeline.receiverRadio.retransmits,
+             pipeline.pcToTransmitter.overflows + pipeline.receiverToDisplay.overflows, pipeline.receiver.ringPeak(),
+             pipeline.receiverRadio.overruns, wall,
+             ok ? "ok" : sent ? "corrupted" : "failed");
+    }
+  }
+
+  return allOk ? 0 : 1;
+}
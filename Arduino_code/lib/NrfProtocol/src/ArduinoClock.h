@@ -0,0 +1,11 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Clock for the protocol core (Transmitter.h, Receiver.h, DisplayReceiver.h) on the boards
+struct ArduinoClock {
+  unsigned long millis(){ return ::millis(); }
+  unsigned long micros(){ return ::micros(); }
+  void delay(unsigned long ms){ ::delay(ms); }
+  void delayMicroseconds(unsigned int us){ ::delayMicroseconds(us); }
+};
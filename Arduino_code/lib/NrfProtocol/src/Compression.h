@@ -0,0 +1,226 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// Byte oriented LZ compression for image payloads (displayCompressed3BitImageFlag in DisplayReceiver.h).
+// Grayscale images are full of runs and of rows that repeat the one above, both are cheap to encode here.
+// The decoder only keeps the last compressionWindow bytes it produced and takes the stream in any pieces,
+// so the Inkplate can decompress straight into the framebuffer while the data arrives.
+//
+// Token: [0] - type and count, then
+//   0x00 - 0x7F: literals, the next (token + 1) bytes are copied as they are
+//   0x80 - 0xBF: run, the next byte repeated (token & 0x3F) + 3 times
+//   0xC0 - 0xFF: match, [1,2] - distance - 1 (big endian), copies (token & 0x3F) + 3 bytes
+//                from *distance* bytes back, the copy can overlap what it produces
+
+const unsigned int compressionWindow = 2048; // how far back a match can reach, a power of two
+const unsigned int compressionMaxLiterals = 128;
+const unsigned int compressionMinRepeat = 3;  // shortest run or match
+const unsigned int compressionMaxRepeat = 66; // longest run or match
+const uint8_t compressionRunToken = 0x80;
+const uint8_t compressionMatchToken = 0xC0;
+
+
+// worst case size of the compressed data, every byte a literal
+inline unsigned long compressedBound(unsigned long size){
+  return size + (size + compressionMaxLiterals - 1) / compressionMaxLiterals;
+}
+
+
+// Encoder for the PC side (SimPc.h, the benchmark), greedy with hash chains over the window.
+// About 24 KB of tables, keep it off the boards.
+class Compressor {
+public:
+  // compresses *size* bytes into *output*, which must hold compressedBound(size) bytes
+  // returns the compressed size
+  unsigned long compress(const uint8_t input[], unsigned long size, uint8_t output[]){
+    for(unsigned int i = 0; i < hashSize; i++)
+      head[i] = noPosition;
+    unsigned long outputSize = 0;
+    unsigned long literalStart = 0;
+    unsigned long position = 0;
+
+    while(position < size){
+      unsigned long left = size - position;
+      unsigned int longest = left < compressionMaxRepeat ? left : compressionMaxRepeat;
+
+      unsigned int run = 1;
+      while(run < longest && input[position + run] == input[position])
+        run++;
+
+      unsigned int matchLength = 0;
+      unsigned long distance = 0;
+      if(left >= compressionMinRepeat)
+        findMatch(input, position, longest, matchLength, distance);
+
+      unsigned int covered = 0;
+      if(run >= compressionMinRepeat && run + 1 >= matchLength){ // a run is a byte shorter than a match
+        outputSize = flushLiterals(input, literalStart, position, output, outputSize);
+        output[outputSize++] = compressionRunToken | (run - compressionMinRepeat);
+        output[outputSize++] = input[position];
+        covered = run;
+      }
+      else if(matchLength > compressionMinRepeat){ // a 3 byte match would only save the literal token
+        outputSize = flushLiterals(input, literalStart, position, output, outputSize);
+        output[outputSize++] = compressionMatchToken | (matchLength - compressionMinRepeat);
+        output[outputSize++] = (uint8_t)((distance - 1) >> 8);
+        output[outputSize++] = (uint8_t)(distance - 1);
+        covered = matchLength;
+      }
+
+      if(covered == 0){
+        insert(input, size, position++);
+        if(position - literalStart == compressionMaxLiterals){
+          outputSize = flushLiterals(input, literalStart, position, output, outputSize);
+          literalStart = position;
+        }
+      }
+      else{
+        for(unsigned int i = 0; i < covered; i++)
+          insert(input, size, position++);
+        literalStart = position;
+      }
+    }
+    return flushLiterals(input, literalStart, position, output, outputSize);
+  }
+
+private:
+  static const unsigned int hashBits = 12;
+  static const unsigned int hashSize = 1 << hashBits;
+  static const unsigned int maxChain = 32; // candidates checked for every position
+  static const long noPosition = -1;
+
+  long head[hashSize];           // last position with the hash
+  long chain[compressionWindow]; // position before it with the same hash
+
+  static unsigned int hash(const uint8_t data[]){
+    uint32_t value = ((uint32_t)data[0] << 16) | ((uint32_t)data[1] << 8) | data[2];
+    return (value * 2654435761u) >> (32 - hashBits);
+  }
+
+  void insert(const uint8_t input[], unsigned long size, unsigned long position){
+    if(size - position < compressionMinRepeat)
+      return;
+    unsigned int h = hash(&input[position]);
+    chain[position % compressionWindow] = head[h];
+    head[h] = position;
+  }
+
+  void findMatch(const uint8_t input[], unsigned long position, unsigned int longest,
+                 unsigned int& matchLength, unsigned long& distance){
+    long candidate = head[hash(&input[position])];
+    for(unsigned int i = 0; i < maxChain && candidate != noPosition; i++){
+      if(position - candidate > compressionWindow)
+        break;
+      unsigned int length = 0;
+      while(length < longest && input[candidate + length] == input[position + length])
+        length++;
+      if(length > matchLength){
+        matchLength = length;
+        distance = position - candidate;
+        if(length == longest)
+          break;
+      }
+      long previous = chain[candidate % compressionWindow];
+      if(previous >= candidate) // the slot was reused by a newer position
+        break;
+      candidate = previous;
+    }
+  }
+
+  static unsigned long flushLiterals(const uint8_t input[], unsigned long start, unsigned long end,
+                                     uint8_t output[], unsigned long outputSize){
+    while(start < end){
+      unsigned long count = end - start < compressionMaxLiterals ? end - start : compressionMaxLiterals;
+      output[outputSize++] = (uint8_t)(count - 1);
+      memcpy(&output[outputSize], &input[start], count);
+      outputSize += count;
+      start += count;
+    }
+    return outputSize;
+  }
+};
+
+
+// Streaming decoder, takes the compressed data in pieces of any size.
+// The decoded bytes go to *output*(const uint8_t data[], unsigned int size) in order, as they are produced.
+class StreamDecompressor {
+public:
+  void begin(){
+    state = tokenState;
+    position = 0;
+    flushed = 0;
+    memset(window, 0, sizeof(window));
+  }
+
+  unsigned long decodedCount(){ return position; }
+
+  template <class Output>
+  void write(const uint8_t data[], unsigned int size, Output output){
+    for(unsigned int i = 0; i < size; i++){
+      uint8_t value = data[i];
+      switch(state){
+        case tokenState:
+          if(value < compressionRunToken){
+            count = value + 1;
+            state = literalState;
+          }
+          else{
+            count = (value & 0x3F) + compressionMinRepeat;
+            state = value < compressionMatchToken ? runState : distanceHighState;
+          }
+          break;
+        case literalState:
+          put(value, output);
+          if(--count == 0)
+            state = tokenState;
+          break;
+        case runState:
+          while(count-- > 0)
+            put(value, output);
+          state = tokenState;
+          break;
+        case distanceHighState:
+          distanceHigh = value;
+          state = distanceLowState;
+          break;
+        case distanceLowState: {
+          unsigned int distance = ((distanceHigh << 8) | value) + 1;
+          while(count-- > 0)
+            put(window[(position - distance) & windowMask], output);
+          state = tokenState;
+          break;
+        }
+      }
+    }
+    flush(output);
+  }
+
+private:
+  static const unsigned long windowMask = compressionWindow - 1;
+  enum State { tokenState, literalState, runState, distanceHighState, distanceLowState };
+
+  uint8_t window[compressionWindow]; // the last decoded bytes
+  State state = tokenState;
+  unsigned int count = 0;
+  uint8_t distanceHigh = 0;
+  unsigned long position = 0; // decoded bytes so far
+  unsigned long flushed = 0;  // decoded bytes already given to the output
+
+  template <class Output>
+  void put(uint8_t value, Output& output){
+    window[position++ & windowMask] = value;
+    if((position & windowMask) == 0) // the window is full, pass it on before it's overwritten
+      flush(output);
+  }
+
+  template <class Output>
+  void flush(Output& output){
+    if(position == flushed)
+      return;
+    unsigned int start = flushed & windowMask;
+    output(&window[start], (unsigned int)(position - flushed));
+    flushed = position;
+  }
+};
@@ -0,0 +1,762 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "Protocol.h"
+#include "PackedImage.h"
+#include "Compression.h"
+#include "Crc32.h"
+#include "UartFrame.h"
+
+// Receiving controller side (Inkplate): takes flags and data from the nRF receiver on *Port*
+// and draws them on *Display*.
+//
+// Port    - HardwareSerial or anything with available(), read(), write()
+// Display - clearDisplay(), drawPixel(), display(), partialUpdate(), width(), height() and frameBuffer(), frameBufferStride()
+//           for the 3 bit framebuffer (InkplateScreen in Inkplate_serial.ino, SimDisplay.h),
+//           frameBuffer() returns NULL if the image has to be drawn pixel by pixel,
+//           ready() returns false while the display is still starting after a boot
+//           display() may only start the refresh and return (overlapRefresh in Inkplate_serial.ino), frameBuffer() then
+//           hands out a back buffer for the next image, so it keeps coming in while the panel refreshes
+// Clock   - millis() (ArduinoClock.h, SimClock.h)
+//
+// The data comes in UART frames (UartFrame.h), a message starts with a uartMessageFrame. A frame that didn't check out
+// is sent again by the receiver, a message that never gets its end is dropped once the next message frame comes.
+// The payloads go from the frame decoder straight to the framebuffer.
+//
+// After a boot the ready frame goes out before the display is started, which takes longer than the ESP32 itself
+// (display.begin() runs on the other core in Inkplate_serial.ino). A message that comes before the display is
+// ready goes into wakeBuffer (PSRAM on the Inkplate) and is read from there once it is. Without a wakeBuffer,
+// or once it's full, the frames wait in the receiver until the display is ready.//
+// Flag: [0] - type, [1,...,4] - depends on the type
+
+const uint8_t displayBytesFlag = 0x01;       // [0] - 0x01, [1,...,4] - byte count
+const uint8_t displayImageFlag = 0x02;       // [0] - 0x02, [1,2] - image height, [3,4] - image width
+const uint8_t displayStringFlag = 0x03;      // [0] - 0x03, [1,...,4] - string length
+const uint8_t display3BitImageFlag = 0x04;   // [0] - 0x04, [1,2] - image height, [3,4] - image width
+const uint8_t displayRectsFlag = 0x05;       // [0] - 0x05, [1,...,4] - byte count of the rectangles
+const uint8_t displayCompressed3BitImageFlag = 0x06; // [0] - 0x06, [1,...,4] - byte count of the compressed image
+// displayLinkFlag (0x07, Protocol.h) comes from the nRF receiver itself
+const uint8_t displayDense3BitImageFlag = 0x08; // [0] - 0x08, [1,2] - image height, [3,4] - image width, 8 pixels in 3 bytes (PackedImage.h)
+const uint8_t displayCachedImageFlag = 0x09; // [0] - 0x09, [1,...,4] - CRC-32 of the packed pixels of a display sized image, no data
+const unsigned int displayChunkSize = 32;
+
+// Rectangles update part of the last image, the rest of the framebuffer is kept.
+// Rectangle: [0,1] - x, [2,3] - y, [4,5] - width, [6,7] - height, then width * height / 2 bytes of packed 3 bit pixels
+// The PC sends even x and width, so every rectangle starts and ends on a framebuffer byte.
+const unsigned int rectHeaderBytesCount = 8;
+
+// Compressed image: [0,1] - image height, [2,3] - image width, then the packed 3 bit pixels compressed
+// with Compression.h. They are decompressed into the framebuffer while they arrive.
+const unsigned int compressedImageHeaderBytesCount = 4;
+
+// Dense image: denseImageBytes(height * width) bytes of dense 3 bit pixels, unpacked into the framebuffer
+// while they arrive. The blocks of a checked dense image are the unpacked pixels, like for a compressed one.
+
+// Checked message: displayCheckedBit set on the type, the message is followed by a trailer
+// [0,...,3] - CRC-32 of the message (flag and data, big endian), then the CRC-32 of every block: for a whole
+// 3 bit image the packed pixels of checkBlockRows rows (decompressed or unpacked ones for a compressed or dense image), for rectangles
+// the pixels of each rectangle, at most maxImageBlocks.
+// The display is only refreshed once the message checks out, the check frame (checkFlag in Protocol.h) tells the PC
+// which blocks are bad. An image that didn't check out stays in the framebuffer, the PC repairs the bad blocks with
+// rectangles, and since the panel never showed the image, the refresh after them is a whole one.
+const uint8_t displayCheckedBit = 0x80;
+const int checkBlockRows = 8;
+const unsigned int maxImageBlocks = 256; // block indexes are a byte in the check frame
+const unsigned long discardQuietTime = 20; // ms without a frame that end a message that didn't come whole
+
+// Cached image: every display sized image that was shown is kept in the image cache (ImageCache.h) under the CRC-32
+// of its packed pixels, repairs included. displayCachedImageFlag shows one from there, so an image the Inkplate
+// showed before only costs a flag on the radio. It goes out checked, and the check frame answers it: 0 - shown
+// (once the refresh before it is done), checkResend - not cached, the PC sends the whole image.
+// An image is only saved after its refresh (without a back buffer just before the Inkplate sleeps), so the same
+// image sent again before that misses and comes whole.
+
+template <class Port, class Display, class Clock>
+class DisplayReceiver {
+public:
+  DisplayReceiver(Port& port, Display& display, Clock& clock) : port(port), display(display), clock(clock) {}
+
+  void (*log)(const char* message) = NULL; // debug messages, nothing is printed if NULL
+  void (*onBytes)(const uint8_t data[], int size) = NULL; // called with the data of a bytes flag
+  void (*onString)(const char text[], int size) = NULL;   // called with the text of a string flag, a chunk at a time, no '\0'
+  uint16_t session = 0; // pick a random one on every boot (see the wake handshake in Protocol.h)
+  unsigned long linkTimeout = 0; // ms to stay awake after the last message while the PC keeps a link open, 0 without one
+
+  // the image cache (ImageCache.h), both NULL without one
+  bool (*loadImage)(uint32_t key, uint8_t frameBuffer[]) = NULL; // true if it put the image into the framebuffer
+  // a whole image, only called by show() right before display() refreshes that same *frameBuffer*,
+  // so it may keep the pointer and save the image once the refresh is done
+  void (*saveImage)(const uint8_t frameBuffer[]) = NULL;
+
+  unsigned long uartFramesDropped() const { return uartIn.framesDropped(); } // didn't check out
+  unsigned long uartResends = 0;    // asked for, frames missing from the sequence
+  unsigned long messagesBroken = 0; // didn't come whole
+  unsigned long messages = 0;       // all of them, messagesBroken / messages is the rate of dropped transfers
+
+  uint8_t* wakeBuffer = NULL;       // holds a message that comes before the display is ready, NULL - it waits in the receiver
+  unsigned long wakeBufferSize = 0;
+  unsigned long wakeToFirstByte = 0; // ms from the last ready frame to the first message after it
+  unsigned long stagedBytes = 0;    // of the last message that came before the display was ready
+
+  // tells the nRF receiver that data can be sent, call after every wake pulse
+  void signalAwake(){
+    uint8_t payload[readyFrameBytesCount] = {(uint8_t)(session >> 8), (uint8_t)session};
+    uint8_t delimiter = uartFrameDelimiter;
+    port.write(&delimiter, 1); // ends whatever the line had before, a boot may leave noise on it
+    writeFrame(uartReadyFrame, payload, sizeof(payload));
+    synced = false; // the receiver drops what it had, the next message frame starts the sequence
+    framesSinceCredit = 0;
+    awakeAt = clock.millis();
+    firstPending = true;
+  }
+
+  // handles the next flag, call from loop()
+  // returns true if a flag was received
+  bool poll(){
+    if(!pendingStart){
+      if(!pullFrame()){
+        if(framesSinceCredit > 0 && clock.millis() - lastByteAt >= uartCreditRepeat)
+          sendCredits(uartCreditFrame); // the receiver may wait for them to queue the next frames
+        return false;
+      }
+      if(uartIn.type() != uartMessageFrame)
+        return false; // the rest of a message that broke off
+    }
+    pendingStart = false;
+    stagedLeft = 0;
+    frameData = uartIn.payload();
+    frameLeft = uartIn.payloadSize();
+    messages++;
+    if(firstPending){
+      wakeToFirstByte = clock.millis() - awakeAt;
+      firstPending = false;
+    }
+    if(!display.ready() && frameLeft > 0 && needsDisplay(frameData[0]))
+      stageMessage();
+
+    debug("Received packet:");
+    messageCrc.reset();
+    uint8_t flag[flagBytesCount];
+    if(!readBytes(flag, sizeof(flag))){
+      messagesBroken++;
+      return true;
+    }
+    checking = (flag[0] & displayCheckedBit) && flag[0] != displayLinkFlag;
+    showPending = false;
+    cacheMiss = false;
+    blockCount = 0;
+    blockIndex = 0;
+    uint8_t type = flag[0] & ~displayCheckedBit;
+    bool complete = true;
+    // Choose the next step depending on what type of message is transmitting
+    if(type == displayBytesFlag){
+      debug("Receiving bytes flag");
+      complete = receiveBytes(readFlagCount(flag));
+    }
+    else if(type == display3BitImageFlag){
+      debug("Receiving image3bit");
+      display.clearDisplay();
+      int height = (flag[1] << 8) | flag[2];
+      int width = (flag[3] << 8) | flag[4];
+      char message[40];
+      snprintf(message, sizeof(message), "3bit- Height: %d, Width: %d", height, width);
+      debug(message);
+      complete = receiveImage3Bit(height, width);
+    }
+    else if(type == displayDense3BitImageFlag){
+      debug("Receiving dense image3bit");
+      display.clearDisplay();
+      int height = (flag[1] << 8) | flag[2];
+      int width = (flag[3] << 8) | flag[4];
+      complete = receiveDenseImage3Bit(height, width);
+    }
+    else if(type == displayCompressed3BitImageFlag){
+      debug("Receiving compressed image3bit");
+      complete = receiveCompressedImage3Bit(readFlagCount(flag));
+    }
+    else if(type == displayRectsFlag){
+      debug("Receiving rectangles");
+      complete = receiveRects(readFlagCount(flag));
+    }
+    else if(type == displayCachedImageFlag){
+      debug("Cached image");
+      complete = showCachedImage(readFlagCount(flag));
+    }
+    else if(type == displayStringFlag){
+      debug("Receiving string");
+      complete = receiveString(readFlagCount(flag));
+    }
+    else if(flag[0] == displayLinkFlag){
+      linkTimeout = readFlagCount(flag);
+      debug(linkTimeout > 0 ? "Link open" : "Link closed");
+    }
+    else{
+      complete = false; // the type itself is garbled
+    }
+    if(!complete)
+      messagesBroken++;
+    if(checking)
+      checkMessage(complete);
+    checking = false;
+    return true;
+  }
+
+private:
+  Port& port;
+  Display& display;
+  Clock& clock;
+  PackedImageWriter writer;
+  StreamDecompressor decompressor;
+  DenseUnpacker unpacker;
+
+  // where the pixels of the current image or rectangle go (beginPixels)
+  bool copyRows = false;
+  int pixelsX0 = 0, pixelsY0 = 0, pixelsWidth = 0;
+  int pixelX = 0, pixelY = 0;   // next pixel, for drawing pixel by pixel
+  unsigned long pixelBytesLeft = 0;
+
+  // checked messages
+  Crc32 messageCrc;             // of the flag and the data read so far
+  bool checking = false;        // the message has a trailer, the refresh waits for it
+  bool showPending = false;     // the message wants a refresh once it checks out
+  bool showWhole = false;
+  bool imageHidden = false;     // the framebuffer holds an image the panel didn't show, the next refresh is a whole one
+  bool wholeImage = false;      // the framebuffer holds a display sized image, saveImage() gets it when it's shown
+  bool cacheMiss = false;       // the cached image wasn't there, the check answers checkResend
+  unsigned int blockCount = 0;  // blocks of the current message so far
+  unsigned long blockBytes = 0; // packed pixel bytes in a block
+  unsigned int blockIndex = 0;  // the current block
+  unsigned long blockFill = 0;  // bytes of it so far
+  Crc32 blockCrc;
+  uint32_t blockCrcs[maxImageBlocks];
+
+  // UART frames (UartFrame.h)
+  UartFrameDecoder uartIn;
+  const uint8_t* frameData = NULL; // the part of the current frame's payload that wasn't read yet
+  uint8_t frameLeft = 0;
+  bool pendingStart = false;       // the decoder holds a message frame that broke off the last message
+  bool synced = false;             // the sequence is known, otherwise only a message frame is taken
+  uint8_t expected = 0;            // sequence of the next frame from the receiver
+  bool resending = false;          // a frame was missing, the receiver was asked for it again
+  unsigned long droppedBefore = 0; // uartIn.framesDropped() at the last frame in order
+  uint8_t framesSinceCredit = 0;   // frames read since the last credit frame
+  unsigned long creditSentAt = 0;  // or resend frame
+  unsigned long lastByteAt = 0;    // when the last byte came
+
+  // wake up
+  unsigned long awakeAt = 0;       // when the last ready frame went out
+  bool firstPending = false;       // no message came since
+  const uint8_t* stagedData = NULL; // the part of wakeBuffer that wasn't read yet
+  unsigned long stagedLeft = 0;
+
+  void debug(const char* message){
+    if(log)
+      log(message);
+  }
+
+  void writeFrame(uint8_t type, const uint8_t payload[], uint8_t size){
+    uint8_t frame[uartMaxWireBytes];
+    port.write(frame, encodeUartFrame(frame, type, 0, payload, size));
+  }
+
+  // credits the frames read so far, or asks for the ones from the expected one again (see UartFrame.h)
+  void sendCredits(uint8_t type){
+    writeFrame(type, &expected, 1);
+    framesSinceCredit = 0;
+    creditSentAt = clock.millis();
+  }
+
+  // takes bytes from the port until they complete the next frame from the receiver, returns false if there is none yet
+  // the frame stays in the decoder until the next call
+  bool pullFrame(){
+    while(port.available()){
+      lastByteAt = clock.millis();
+      if(!uartIn.push((uint8_t)port.read()))
+        continue;
+      uint8_t type = uartIn.type();
+      if(type != uartMessageFrame && type != uartDataFrame)
+        continue;
+      if(!synced && type == uartMessageFrame){
+        synced = true;
+        expected = uartIn.sequence();
+      }
+      if(!synced || uartIn.sequence() != expected){
+        // one before it was dropped, or a frame from before the resend
+        if(synced && (uint8_t)(uartIn.sequence() - expected) < 0x80 && clock.millis() - creditSentAt >= uartCreditRepeat){
+          debug("UART frame lost");
+          uartResends++;
+          resending = true;
+          sendCredits(uartResendFrame);
+        }
+        continue;
+      }
+      if(resending){
+        debug("UART frames resent");
+        resending = false;
+      }
+      droppedBefore = uartIn.framesDropped();
+      expected++;
+      if(++framesSinceCredit >= uartCreditBatch)
+        sendCredits(uartCreditFrame);
+      return true;
+    }
+    return false;
+  }
+
+  // while it waits for a frame: the last frames, or the credit or resend frame for them, may have got lost
+  void repeatResend(unsigned long now){
+    if(now - lastByteAt < uartCreditRepeat || now - creditSentAt < uartCreditRepeat)
+      return;
+    if(!resending && uartIn.framesDropped() != droppedBefore){
+      debug("UART frame lost");
+      uartResends++;
+      resending = true;
+    }
+    sendCredits(uartResendFrame);
+  }
+
+  // waits for the next frame of the message, returns false after a second without one, or if the next message started
+  bool nextFrame(){
+    if(pendingStart)
+      return false; // came while the message was staged
+    unsigned long startTime = clock.millis();
+    while(!pullFrame()){
+      unsigned long now = clock.millis();
+      if(now - startTime >= 1000){
+        debug("Transmission timed out");
+        synced = false; // the receiver may have nothing left to resend, the next message frame starts over
+        return false;
+      }
+      repeatResend(now);
+    }
+    if(uartIn.type() == uartMessageFrame){
+      debug("Message broke off by the next one");
+      pendingStart = true;
+      return false;
+    }
+    frameData = uartIn.payload();
+    frameLeft = uartIn.payloadSize();
+    return true;
+  }
+
+  // the next bytes of the message, at most *size*, straight from the frame they came in
+  // returns 0 if the message broke off (see nextFrame())
+  unsigned int readChunk(const uint8_t*& data, unsigned int size){
+    if(stagedLeft > 0){
+      if(size > stagedLeft)
+        size = stagedLeft;
+      data = stagedData;
+      stagedData += size;
+      stagedLeft -= size;
+      messageCrc.update(data, size);
+      return size;
+    }
+    while(frameLeft == 0){
+      if(!nextFrame())
+        return 0;
+    }
+    if(size > frameLeft)
+      size = frameLeft;
+    data = frameData;
+    frameData += size;
+    frameLeft -= size;
+    messageCrc.update(data, size);
+    return size;
+  }
+
+  // the flag is always in the message frame, bytes and link flags can be handled while the display is starting
+  static bool needsDisplay(uint8_t flagType){
+    return (flagType & ~displayCheckedBit) != displayBytesFlag && flagType != displayLinkFlag;
+  }
+
+  // keeps the frames of the message that came so far in wakeBuffer until the display is ready, readChunk() reads
+  // them from there first. A frame that doesn't fit stays in the decoder, and the rest waits in the receiver.
+  void stageMessage(){
+    debug("Display not ready, staging the message");
+    unsigned long size = 0;
+    bool full = false;
+    while(!display.ready()){
+      if(frameLeft > 0 && !full){
+        if(size + frameLeft > wakeBufferSize || wakeBuffer == NULL)
+          full = true;
+        else{
+          memcpy(&wakeBuffer[size], frameData, frameLeft);
+          size += frameLeft;
+          frameLeft = 0;
+        }
+      }
+      if(full || pendingStart){
+        clock.delay(1);
+        continue;
+      }
+      if(!pullFrame()){
+        repeatResend(clock.millis());
+        continue;
+      }
+      if(uartIn.type() == uartMessageFrame)
+        pendingStart = true; // the message broke off, it ends where the staged part does
+      else{
+        frameData = uartIn.payload();
+        frameLeft = uartIn.payloadSize();
+      }
+    }
+    stagedData = wakeBuffer;
+    stagedLeft = size;
+    stagedBytes = size;
+  }
+
+  // returns false if the message broke off
+  bool readBytes(uint8_t data[], unsigned int size){
+    while(size > 0){
+      const uint8_t* chunk;
+      unsigned int bytes = readChunk(chunk, size);
+      if(bytes == 0)
+        return false;
+      memcpy(data, chunk, bytes);
+      data += bytes;
+      size -= bytes;
+    }
+    return true;
+  }
+
+  // refreshes the display, after the trailer of a checked message
+  void show(bool whole){
+    if(checking){
+      showPending = true;
+      showWhole = whole;
+      return;
+    }
+    if(wholeImage && saveImage != NULL){
+      uint8_t* frameBuffer = display.frameBuffer();
+      if(framesSinceCredit > 0)
+        sendCredits(uartCreditFrame); // the receiver doesn't have to wait for the save
+      if(frameBuffer != NULL)
+        saveImage(frameBuffer); // nothing may come between this and display(), see saveImage
+    }
+    wholeImage = false;
+    if(whole || imageHidden)
+      display.display();
+    else
+      display.partialUpdate();
+    imageHidden = false;
+  }
+
+  // a whole image starts, *width* x *height*
+  void beginImage(int height, int width){
+    wholeImage = height == display.height() && width == display.width();
+  }
+
+  // the CRC of every block of a whole image's pixels, for the trailer (see displayCheckedBit)
+  void beginBlocks(int height, int width){
+    blockCount = 0;
+    if(!checking || height <= 0 || width <= 0)
+      return;
+    unsigned int blocks = (height + checkBlockRows - 1) / checkBlockRows;
+    if(blocks > maxImageBlocks)
+      return; // only the message CRC, a bad one sends the whole image again
+    blockCount = blocks;
+    blockBytes = (unsigned long)width * checkBlockRows / 2;
+    blockFill = 0;
+    blockIndex = 0;
+    blockCrc.reset();
+  }
+
+  // every rectangle is a block of its own
+  void beginRectBlock(unsigned long size){
+    if(!checking || blockCount >= maxImageBlocks)
+      return;
+    blockCount++;
+    blockBytes = size;
+    blockFill = 0;
+    blockCrc.reset();
+    if(size == 0)
+      blockCrcs[blockIndex++] = blockCrc.value();
+  }
+
+  void addBlockBytes(const uint8_t data[], unsigned int size){
+    while(size > 0 && blockIndex < blockCount){
+      unsigned long bytes = blockBytes - blockFill < size ? blockBytes - blockFill : size;
+      blockCrc.update(data, bytes);
+      data += bytes;
+      size -= bytes;
+      blockFill += bytes;
+      if(blockFill == blockBytes){
+        blockCrcs[blockIndex++] = blockCrc.value();
+        blockCrc.reset();
+        blockFill = 0;
+      }
+    }
+  }
+
+  // drops what's left of a message that didn't come whole, until the UART is quiet or the next message starts
+  void discardRest(){
+    unsigned long quietSince = clock.millis();
+    while(!pendingStart && clock.millis() - quietSince < discardQuietTime){
+      if(!pullFrame())
+        continue;
+      quietSince = clock.millis();
+      pendingStart = uartIn.type() == uartMessageFrame;
+    }
+    frameLeft = 0;
+    stagedLeft = 0;
+  }
+
+  static uint32_t readCrc(const uint8_t data[]){
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+  }
+
+  // reads the trailer of a checked message, answers with a check frame and refreshes if the message checks out
+  // *complete* - all of the message was read, otherwise the trailer can't be found anymore
+  void checkMessage(bool complete){
+    uint8_t result = checkResend;
+    uint8_t bad[maxCheckBlocks] = {0};
+    uint8_t trailer[4];
+    uint32_t crc = messageCrc.value();
+    if(!complete)
+      discardRest();
+    else if(readBytes(trailer, sizeof(trailer))){
+      bool intact = readCrc(trailer) == crc;
+      if(blockFill > 0 && blockIndex < blockCount) // the last block is shorter
+        blockCrcs[blockIndex++] = blockCrc.value();
+      unsigned int badCount = 0;
+      bool blocksRead = true;
+      for(unsigned int i = 0; i < blockCount; i++){
+        if(!readBytes(trailer, sizeof(trailer))){
+          blocksRead = false;
+          break;
+        }
+        if(i >= blockIndex || readCrc(trailer) != blockCrcs[i]){
+          if(badCount < maxCheckBlocks)
+            bad[badCount] = (uint8_t)i;
+          badCount++;
+        }
+      }
+      if(intact && !cacheMiss)
+        result = 0;
+      else if(blocksRead && badCount > 0 && badCount <= maxCheckBlocks)
+        result = (uint8_t)badCount;
+    }
+
+    uint8_t frame[checkFrameBytesCount];
+    frame[0] = result;
+    for(uint8_t i = 0; i < maxCheckBlocks; i++)
+      frame[1 + i] = result != checkResend && i < result ? bad[i] : 0;
+    writeFrame(uartCheckFrame, frame, sizeof(frame));
+    checking = false;
+
+    char message[40];
+    snprintf(message, sizeof(message), "Check: %u", result);
+    debug(message);
+    if(!showPending)
+      return;
+    if(result == 0)
+      show(showWhole);
+    else if(showWhole)
+      imageHidden = true;
+  }
+
+  bool receiveBytes(unsigned long count){
+    while (count > 0) {
+      // Take at most a 32 byte chunk
+      const uint8_t* data;
+      unsigned int bytesReceived = readChunk(data, count > displayChunkSize ? displayChunkSize : count);
+      if(bytesReceived == 0)
+        return false;
+
+      if(onBytes)
+        onBytes(data, bytesReceived);
+      count -= bytesReceived;
+    }
+    return true;
+  }
+
+  // the receive functions return false if the message didn't come whole
+  bool receiveImage3Bit(int height, int width){
+    beginImage(height, width);
+    beginBlocks(height, width);
+    if(!receivePixels(0, 0, width, height))
+      return false;
+
+    show(true);
+    debug("Image 3bit received!");
+    return true;
+  }
+
+  bool receiveRects(unsigned long count){
+    if(!imageHidden)
+      wholeImage = false; // an update, not the repair of an image
+    while(count >= rectHeaderBytesCount){
+      uint8_t header[rectHeaderBytesCount];
+      if(!readBytes(header, sizeof(header)))
+        return false;
+      count -= sizeof(header);
+
+      int x = (header[0] << 8) | header[1];
+      int y = (header[2] << 8) | header[3];
+      int width = (header[4] << 8) | header[5];
+      int height = (header[6] << 8) | header[7];
+      unsigned long size = (unsigned long)width * (unsigned long)height / 2;
+      if(size > count){
+        debug("Rectangle is bigger than the data");
+        return false;
+      }
+      beginRectBlock(size);
+      if(!receivePixels(x, y, width, height))
+        return false;
+      count -= size;
+    }
+
+    show(false);
+    debug("Rectangles received!");
+    return true;
+  }
+
+  bool receiveCompressedImage3Bit(unsigned long count){
+    uint8_t header[compressedImageHeaderBytesCount];
+    if(count < sizeof(header) || !readBytes(header, sizeof(header)))
+      return false;
+    count -= sizeof(header);
+
+    int height = (header[0] << 8) | header[1];
+    int width = (header[2] << 8) | header[3];
+    char message[64];
+    snprintf(message, sizeof(message), "3bit- Height: %d, Width: %d, %lu B", height, width, count);
+    debug(message);
+
+    display.clearDisplay();
+    beginImage(height, width);
+    beginBlocks(height, width);
+    beginPixels(0, 0, width, height);
+    decompressor.begin();
+    while (count > 0) {
+      // Take at most a 32 byte chunk
+      const uint8_t* data;
+      unsigned int bytesReceived = readChunk(data, count > displayChunkSize ? displayChunkSize : count);
+      if(bytesReceived == 0)
+        return false;
+
+      decompressor.write(data, bytesReceived, [this](const uint8_t pixels[], unsigned int size){ writePixels(pixels, size); });
+      count -= bytesReceived;
+    }
+    if(pixelBytesLeft > 0 || decompressor.decodedCount() != (unsigned long)height * (unsigned long)width / 2){
+      debug("Compressed image has the wrong size");
+      return false;
+    }
+
+    show(true);
+    debug("Image 3bit received!");
+    return true;
+  }
+
+  bool receiveDenseImage3Bit(int height, int width){
+    unsigned long count = denseImageBytes((unsigned long)height * (unsigned long)width);
+    beginImage(height, width);
+    beginBlocks(height, width);
+    beginPixels(0, 0, width, height);
+    unpacker.begin();
+    while (count > 0) {
+      // Take at most a 32 byte chunk
+      const uint8_t* data;
+      unsigned int bytesReceived = readChunk(data, count > displayChunkSize ? displayChunkSize : count);
+      if(bytesReceived == 0)
+        return false;
+
+      unpacker.write(data, bytesReceived, [this](const uint8_t pixels[], unsigned int size){ writePixels(pixels, size); });
+      count -= bytesReceived;
+    }
+
+    show(true);
+    debug("Image 3bit received!");
+    return true;
+  }
+
+  // the framebuffer from the image cache, after a miss the PC sends the whole image
+  bool showCachedImage(uint32_t key){
+    wholeImage = false; // it's cached already
+    uint8_t* frameBuffer = display.frameBuffer();
+    if(loadImage == NULL || frameBuffer == NULL || !loadImage(key, frameBuffer)){
+      debug("Image not cached");
+      cacheMiss = true;
+      return true;
+    }
+    show(true);
+    debug("Cached image shown");
+    return true;
+  }
+
+  // receives width * height / 2 bytes of packed pixels into the framebuffer at x, y
+  bool receivePixels(int x0, int y0, int width, int height){
+    unsigned long count = (unsigned long)height * (unsigned long)width / 2;
+    beginPixels(x0, y0, width, height);
+
+    // receive data for the image,
+    // store it in the 3bit buffer
+    while (count > 0) {
+      // Take at most a 32 byte chunk
+      const uint8_t* data;
+      unsigned int bytesReceived = readChunk(data, count > displayChunkSize ? displayChunkSize : count);
+      if(bytesReceived == 0)
+        return false;
+
+      writePixels(data, bytesReceived);
+      count -= bytesReceived;
+    }
+    return true;
+  }
+
+  void beginPixels(int x0, int y0, int width, int height){
+    uint8_t* frameBuffer = display.frameBuffer();
+    copyRows = frameBuffer != NULL && width > 0 && width % 2 == 0 && x0 % 2 == 0;
+    if(copyRows)
+      writer.begin(frameBuffer, display.frameBufferStride(), display.width(), display.height(), x0, y0, width, height);
+    pixelsX0 = x0;
+    pixelsY0 = y0;
+    pixelsWidth = width;
+    pixelX = 0;
+    pixelY = 0;
+    pixelBytesLeft = (unsigned long)height * (unsigned long)width / 2;
+  }
+
+  // the next *size* bytes of packed pixels, anything past the image is dropped
+  void writePixels(const uint8_t data[], unsigned int size){
+    if(size > pixelBytesLeft)
+      size = pixelBytesLeft;
+    pixelBytesLeft -= size;
+    if(blockCount > 0)
+      addBlockBytes(data, size);
+
+    if(copyRows){
+      writer.write(data, size);
+      return;
+    }
+    // for each pixel received, save it to the buffer
+    for (unsigned int i = 0; i < size; i++) {
+      drawNextPixel(data[i] >> 4);
+      drawNextPixel(data[i] & 0x0F);
+    }
+  }
+
+  void drawNextPixel(uint8_t color){
+    display.drawPixel(pixelsX0 + pixelX, pixelsY0 + pixelY, color);  //x, y, pixel color
+    if(++pixelX == pixelsWidth){
+      pixelX = 0;
+      pixelY++;
+    }
+  }
+
+  bool receiveString(unsigned long length){
+    while (length > 0) {
+      const uint8_t* data;
+      unsigned int bytesReceived = readChunk(data, length > displayChunkSize ? displayChunkSize : length);
+      if(bytesReceived == 0)
+        return false;
+
+      if(onString)
+        onString((const char*)data, bytesReceived);
+      length -= bytesReceived;
+    }
+    return true;
+  }
+};
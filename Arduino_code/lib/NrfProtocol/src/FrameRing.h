@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "SlidingWindow.h"
+
+// Frames the radio interrupt took out of the nRF24's RX FIFO, waiting for loop() (Receiver.h).
+// One writer (the interrupt) and one reader (loop()). The counters are single bytes, so both
+// sides see them change atomically even on the AVR, no interrupts have to be turned off to use it.
+//
+// N has to be a power of two up to 128. Every slot takes radioFrameSize + 1 bytes of SRAM.
+
+template <uint8_t N>
+class FrameRing {
+public:
+  // only when the writer can't run (radio interrupt masked)
+  void clear(){
+    head = 0;
+    tail = 0;
+  }
+
+  bool empty() const { return head == tail; }
+  bool full() const { return (uint8_t)(head - tail) >= N; }
+  uint8_t count() const { return head - tail; }
+  uint8_t peak() const { return highWater; } // most frames that were waiting at once
+
+  // writer: buffer for the next frame, push() once it's filled
+  uint8_t* reserve(){ return frames[head % N]; }
+  void push(uint8_t size){
+    sizes[head % N] = size;
+    head = head + 1;
+    if(count() > highWater)
+      highWater = count();
+  }
+
+  // reader: copies the oldest frame out and frees its slot, returns its size
+  uint8_t pop(uint8_t data[]){
+    uint8_t slot = tail % N;
+    uint8_t size = sizes[slot];
+    memcpy(data, frames[slot], size);
+    tail = tail + 1;
+    return size;
+  }
+
+private:
+  uint8_t frames[N][radioFrameSize];
+  uint8_t sizes[N];
+  volatile uint8_t head = 0; // only the writer changes it
+  volatile uint8_t tail = 0; // only the reader changes it
+  uint8_t highWater = 0;
+};
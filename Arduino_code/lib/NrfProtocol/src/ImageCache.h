@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stdint.h>
+#include "Crc32.h"
+
+// Content-addressed cache of whole images on the receiving controller (displayCachedImageFlag in DisplayReceiver.h).
+// An image is found by the CRC-32 of its packed 3 bit pixels. For a display sized image those are the framebuffer,
+// so the PC gets the same key from the image it has, and an image that doesn't read back as its key is a miss.
+//
+// Store - keeps the images in *slots*: read(slot, offset, data, size) and write(slot, offset, data, size),
+//         both return false if they failed (a file per slot on the SD card in Inkplate_serial.ino, SimImageStore.h)
+// Slot: [0,...,3] - key, [4,...,7] - use, 0 for an empty slot (big endian), then the image.
+// The slot used longest ago is replaced. It's emptied before the image goes in, so a write that breaks off
+// (the battery, a deep sleep) never leaves a half image under a key.
+
+const uint8_t maxImageCacheSlots = 32;
+const unsigned int imageCacheHeaderBytes = 8;
+
+template <class Store>
+class ImageCache {
+public:
+  ImageCache(Store& store, uint8_t slots, unsigned long imageBytes)
+    : store(store), slots(slots < maxImageCacheSlots ? slots : maxImageCacheSlots), imageBytes(imageBytes) {}
+
+  unsigned long hits = 0, misses = 0, saves = 0;
+
+  // reads the headers, the images themselves stay in the store (over a deep sleep too)
+  void begin(){
+    useClock = 0;
+    for(uint8_t i = 0; i < slots; i++){
+      uint8_t header[imageCacheHeaderBytes];
+      bool read = store.read(i, 0, header, sizeof(header));
+      keys[i] = read ? readLong(header) : 0;
+      uses[i] = read ? readLong(&header[4]) : 0;
+      if(uses[i] > useClock)
+        useClock = uses[i];
+    }
+  }
+
+  // puts the image with *key* into *frameBuffer*, returns false if it isn't cached
+  bool load(uint32_t key, uint8_t frameBuffer[]){
+    int slot = find(key);
+    if(slot >= 0 && store.read(slot, imageCacheHeaderBytes, frameBuffer, imageBytes) && crcOf(frameBuffer) == key){
+      use(slot, key);
+      hits++;
+      return true;
+    }
+    if(slot >= 0)
+      empty(slot); // doesn't read back as its key anymore
+    misses++;
+    return false;
+  }
+
+  // keeps *frameBuffer*, a whole image that was shown, returns false if the store failed
+  bool save(const uint8_t frameBuffer[]){
+    if(slots == 0)
+      return false;
+    uint32_t key = crcOf(frameBuffer);
+    int slot = find(key);
+    if(slot >= 0)
+      return use(slot, key);
+
+    slot = 0;
+    for(uint8_t i = 1; i < slots; i++){
+      if(uses[i] < uses[slot])
+        slot = i;
+    }
+    if(!empty(slot) || !store.write(slot, imageCacheHeaderBytes, frameBuffer, imageBytes) || !use(slot, key)){
+      uses[slot] = 0;
+      return false;
+    }
+    saves++;
+    return true;
+  }
+
+  uint8_t slotCount() const { return slots; }
+
+private:
+  Store& store;
+  uint8_t slots;
+  unsigned long imageBytes;
+  uint32_t keys[maxImageCacheSlots] = {0};
+  uint32_t uses[maxImageCacheSlots] = {0};   // empty until begin()
+  uint32_t useClock = 0;
+
+  int find(uint32_t key){
+    for(uint8_t i = 0; i < slots; i++){
+      if(uses[i] != 0 && keys[i] == key)
+        return i;
+    }
+    return -1;
+  }
+
+  uint32_t crcOf(const uint8_t frameBuffer[]){
+    Crc32 crc;
+    crc.update(frameBuffer, imageBytes);
+    return crc.value();
+  }
+
+  bool use(uint8_t slot, uint32_t key){
+    keys[slot] = key;
+    uses[slot] = ++useClock;
+    return writeHeader(slot);
+  }
+
+  bool empty(uint8_t slot){
+    keys[slot] = 0;
+    uses[slot] = 0;
+    return writeHeader(slot);
+  }
+
+  bool writeHeader(uint8_t slot){
+    uint8_t header[imageCacheHeaderBytes];
+    writeLong(header, keys[slot]);
+    writeLong(&header[4], uses[slot]);
+    return store.write(slot, 0, header, sizeof(header));
+  }
+
+  static uint32_t readLong(const uint8_t data[]){
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+  }
+
+  static void writeLong(uint8_t data[], uint32_t value){
+    for(int i = 0; i < 4; i++)
+      data[i] = (uint8_t)(value >> (24 - 8 * i));
+  }
+};
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <stdint.h>
+#include "Protocol.h"
+
+// Picks the data rate, PA level and channel of the transfers from how the last bursts went (Transmitter.h).
+//
+// Every write reports its auto retransmit count (ARC) and whether the auto-ack came back strong
+// (RPD, received power above -64 dBm). Every adaptFrames acked writes (a round) the adapter looks at how many of
+// them needed a retransmit, lossy above one in four, clean at most one in the round. It counts the writes rather
+// than the retransmits, and a write that wasn't acked at all doesn't count: a receiver busy with the UART or
+// an ack frame stops acking for a while, which says nothing about the link. A transfer that fails starts
+// the next one a step more robust instead.
+//  - lossy with a weak signal: a higher PA level, at the highest one a slower data rate
+//  - lossy with a strong signal: interference, the next channel of radioHopChannels
+//  - clean for upRounds rounds: the next faster data rate, at the fastest a lower PA level if the signal is strong
+// A faster data rate that turns out lossy right away is tried again only after twice as many rounds as last time.
+// After maxLossyHops hops in a row that landed on a lossy channel again, the loss is the same on every channel
+// and the adapter stays where it is until a round isn't lossy anymore.
+//
+// Settings frame: [0] - radioSettingsFlag | data rate << 2 | PA level, [1] - channel
+// The data rate and PA level are the values of rf24_datarate_e and rf24_pa_dbm_e.
+// The flags always go out on the default settings (radioChannel, 1 Mbps, RF24_PA_LOW), so a receiver that
+// just woke up or missed a switch still hears them. After the flag ack the transmitter sends the settings frame,
+// switches, and sends it again on the new settings until that one is acked. The receiver switches when it reads it,
+// and goes back to the old settings if nothing comes on the new ones for radioSettingsTimeout.
+// Both go back to the default settings after every transfer, the transmitter keeps what it learned for the next one.
+// The receiver also goes back on its own once nothing came for radioSettingsIdleTimeout after the transfer,
+// and a switch to the default settings is never undone, so both always meet there again.
+// Transfers shorter than adaptMinBytes stay on the default settings, the switches would cost more than they save.
+//
+// The RF24_* constants have to be declared before this header is included.
+
+const uint8_t radioSettingsFlag = 0xC0;     // upper nibble of [0]
+const uint8_t radioSettingsBytesCount = 2;  // shorter than a data frame, which has at least a byte and the payloadCount
+const unsigned long radioSettingsTimeout = 50; // ms the receiver waits for a frame on the new settings
+const unsigned long radioSettingsIdleTimeout = 2000; // ms after the transfer, as long as the transmitter tries to get its last ack
+const uint8_t adaptFrames = 16;             // writes in a round
+const unsigned long adaptMinBytes = 1024;   // shorter transfers stay on the default settings
+const uint8_t radioHopChannels[] = {radioChannel, 100, 115, 92, 108}; // above the WiFi channels, like radioChannel
+
+struct RadioSettings {
+  uint8_t channel;
+  uint8_t dataRate; // rf24_datarate_e
+  uint8_t paLevel;  // rf24_pa_dbm_e
+
+  bool operator==(const RadioSettings& other) const {
+    return channel == other.channel && dataRate == other.dataRate && paLevel == other.paLevel;
+  }
+  bool operator!=(const RadioSettings& other) const { return !(*this == other); }
+};
+
+inline RadioSettings defaultRadioSettings(){
+  RadioSettings settings = {radioChannel, RF24_1MBPS, RF24_PA_LOW};
+  return settings;
+}
+
+inline void writeSettingsFrame(uint8_t frame[], const RadioSettings& settings){
+  frame[0] = radioSettingsFlag | (uint8_t)((settings.dataRate & 0x03) << 2) | (settings.paLevel & 0x03);
+  frame[1] = settings.channel;
+}
+
+// returns false if the frame isn't a settings frame
+inline bool readSettingsFrame(const uint8_t frame[], uint8_t size, RadioSettings& settings){
+  if(size != radioSettingsBytesCount || (frame[0] & 0xF0) != radioSettingsFlag)
+    return false;
+  settings.dataRate = (frame[0] >> 2) & 0x03;
+  settings.paLevel = frame[0] & 0x03;
+  settings.channel = frame[1];
+  return settings.dataRate <= RF24_250KBPS && settings.channel <= 125;
+}
+
+
+class LinkAdapter {
+public:
+  uint8_t upRounds = 4;      // clean rounds before a faster data rate is tried
+  uint8_t maxProbeWait = 64; // rounds, the longest wait before a data rate that failed is tried again
+  uint8_t maxLossyHops = 2;  // hops in a row that didn't help before the adapter stops hopping
+
+  void reset(){
+    current = defaultRadioSettings();
+    hop = 0;
+    hopped = false;
+    lossyHops = 0;
+    for(uint8_t i = 0; i < 3; i++)
+      probeWait[i] = upRounds;
+    probing = false;
+    cleanRounds = 0;
+    clear();
+  }
+
+  const RadioSettings& settings() const { return current; }
+
+  // the settings changed outside of update(), the round so far went out on others
+  void restartRound(){
+    clear();
+  }
+
+  // a write of the transfer, *strong* - the auto-ack came back above -64 dBm (testRPD())
+  void record(bool acked, uint8_t retransmits, bool strong){
+    if(!acked)
+      return;
+    frames++;
+    if(retransmits > 0)
+      retriedCount++;
+    if(strong)
+      strongCount++;
+  }
+
+  // call after every write, returns true if the transfer should go on with *next*
+  bool update(RadioSettings& next){
+    if(frames < adaptFrames)
+      return false;
+    bool lossy = retriedCount * 4 > frames;
+    bool clean = retriedCount * adaptFrames <= frames;
+    bool strong = strongCount * 2 > frames;
+    clear();
+
+    next = current;
+    bool afterHop = hopped;
+    hopped = false;
+    if(lossy){
+      cleanRounds = 0;
+      if(afterHop)
+        lossyHops++;
+      if(probing){ // the faster data rate didn't hold, wait longer before the next try
+        uint8_t rate = rateIndex(current.dataRate);
+        probeWait[rate] = probeWait[rate] * 2 > maxProbeWait ? maxProbeWait : probeWait[rate] * 2;
+        probing = false;
+        next.dataRate = rateAt(rate - 1);
+      }
+      else if(strong)
+        hopChannel(next);
+      else if(!slowDown(next))
+        hopChannel(next); // as slow and loud as it gets
+    }
+    else if(clean){
+      lossyHops = 0;
+      if(probing && ++cleanRounds >= 2){ // the faster data rate holds
+        probeWait[rateIndex(current.dataRate)] = upRounds;
+        probing = false;
+        cleanRounds = 0;
+      }
+      else if(!probing){
+        cleanRounds++;
+        uint8_t rate = rateIndex(current.dataRate);
+        if(rate < 2 && cleanRounds >= probeWait[rate + 1]){
+          next.dataRate = rateAt(rate + 1);
+          probing = true;
+          cleanRounds = 0;
+        }
+        else if(rate == 2 && cleanRounds >= upRounds && strong && next.paLevel > RF24_PA_MIN){
+          next.paLevel--; // plenty of margin, save power
+          cleanRounds = 0;
+        }
+      }
+    }
+    else{
+      lossyHops = 0;
+      cleanRounds = 0;
+    }
+
+    if(next == current)
+      return false;
+    current = next;
+    return true;
+  }
+
+  // the switch to the settings from update() didn't go through, both sides stayed on *previous*
+  void rejected(const RadioSettings& previous){
+    if(probing){
+      uint8_t rate = rateIndex(current.dataRate);
+      probeWait[rate] = probeWait[rate] * 2 > maxProbeWait ? maxProbeWait : probeWait[rate] * 2;
+      probing = false;
+    }
+    current = previous;
+    cleanRounds = 0;
+  }
+
+  // the transfer failed, the next one starts a step more robust
+  void failed(){
+    RadioSettings next = current;
+    probing = false;
+    cleanRounds = 0;
+    clear();
+    if(slowDown(next))
+      current = next;
+  }
+
+private:
+  RadioSettings current = defaultRadioSettings();
+  uint8_t hop = 0;                // radioHopChannels[hop] is the current channel
+  bool hopped = false;            // the last update() hopped
+  uint8_t lossyHops = 0;          // hops in a row that landed on a lossy channel
+  uint8_t probeWait[3] = {4, 4, 4}; // clean rounds before each data rate is tried, by rateIndex()
+  bool probing = false;           // the current data rate was just tried
+  uint8_t cleanRounds = 0;
+
+  // since the last update()
+  unsigned int frames = 0;
+  unsigned int retriedCount = 0; // writes that needed a retransmit
+  unsigned int strongCount = 0;
+
+  void clear(){
+    frames = 0;
+    retriedCount = 0;
+    strongCount = 0;
+  }
+
+  // 0 - 250 kbps, 1 - 1 Mbps, 2 - 2 Mbps
+  static uint8_t rateIndex(uint8_t dataRate){
+    return dataRate == RF24_250KBPS ? 0 : dataRate == RF24_1MBPS ? 1 : 2;
+  }
+  static uint8_t rateAt(uint8_t index){
+    return index == 0 ? RF24_250KBPS : index == 1 ? RF24_1MBPS : RF24_2MBPS;
+  }
+
+  void hopChannel(RadioSettings& next){
+    if(lossyHops >= maxLossyHops)
+      return; // the loss follows to every channel
+    hop = (hop + 1) % sizeof(radioHopChannels);
+    next.channel = radioHopChannels[hop];
+    hopped = true;
+  }
+
+  // a higher PA level, or at the highest one a slower data rate, returns false if there is neither
+  bool slowDown(RadioSettings& next) const {
+    if(next.paLevel < RF24_PA_MAX){
+      next.paLevel++;
+      return true;
+    }
+    uint8_t rate = rateIndex(next.dataRate);
+    if(rate == 0)
+      return false;
+    next.dataRate = rateAt(rate - 1);
+    return true;
+  }
+};
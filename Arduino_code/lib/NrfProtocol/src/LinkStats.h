@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+#include "Protocol.h"
+
+// Counters of the transmitter's and the receiver's hot paths, for the PC's status query (statusFlag in Protocol.h).
+//
+// A counter costs an add where it's counted, the ack round trip two micros() calls per radio write. Build with
+// -D NRF_STATS=0 (build_flags in platformio.ini) and all of it compiles away, the status query still answers with zeros.
+// The counters start at 0 on every reset of the board and wrap around, the PC looks at the difference of two queries.
+//
+// Status: [0] - statusFlag, [1,...,4] - byte count of the counters that follow, then every counter big endian,
+// 4 bytes each, in the order of TransmitterStat or ReceiverStat.
+// The receiver answers the transmitter with: [0] - ackFlag, [1,...,4] - statusReceiver, [5,...] - its counters
+
+#ifndef NRF_STATS
+#define NRF_STATS 1
+#endif
+
+const unsigned long statusTransmitter = 0; // count of statusFlag: whose counters
+const unsigned long statusReceiver = 1;    // the current node's (nodeFlag)
+
+enum TransmitterStat : uint8_t {
+  txFramesSent,     // radio writes, flags, payloads, ack requests and broadcasts
+  txFramesLost,     // writes that never got an auto-ack
+  txRetransmits,    // auto retransmits of the writes that got one (ARC)
+  txAckTimeouts,    // flag acks and window acks that didn't come in time
+  txNaks,           // to the PC
+  txRadioResets,
+  txBytes,          // data the PC sent through the transmitter
+  txTransferMillis, // spent in transfers, txBytes * 1000 / txTransferMillis is the throughput in bytes/s
+  txRttMin,         // us from a write to its auto-ack, retransmits included
+  txRttMax,
+  txRttTotal,       // of the writes that got an auto-ack, / (txFramesSent - txFramesLost) is the average
+  txWakeStrobes,    // flags that woke a receiver from low power listening (see Protocol.h)
+  transmitterStatCount
+};
+
+enum ReceiverStat : uint8_t {
+  rxFrames,         // taken out of the radio
+  rxOldPayloads,    // received again, the window ack for it got lost
+  rxFuturePayloads, // too far ahead of the window
+  rxAckFailures,    // ack frames the transmitter didn't auto-ack
+  rxTimeouts,       // transfers that ended without all of the data
+  rxBytes,          // forwarded to the receiving controller
+  receiverStatCount
+};
+
+const uint8_t statusAckBytesCount = flagBytesCount + receiverStatCount * 4; // fills most of a radio frame
+
+
+template <uint8_t N>
+class LinkStats {
+public:
+  void add(uint8_t stat, uint32_t value = 1){
+    if(NRF_STATS)
+      values[stat] += value;
+  }
+
+  // keeps the smallest, the largest and the sum of *value*
+  void sample(uint8_t minStat, uint8_t maxStat, uint8_t totalStat, uint32_t value){
+    if(!NRF_STATS)
+      return;
+    if(values[minStat] == 0 || value < values[minStat])
+      values[minStat] = value;
+    if(value > values[maxStat])
+      values[maxStat] = value;
+    values[totalStat] += value;
+  }
+
+  uint32_t get(uint8_t stat) const { return values[stat]; }
+
+  // the counters big endian, returns the bytes written: N * 4
+  uint8_t write(uint8_t out[]) const {
+    for(uint8_t i = 0; i < N; i++){
+      out[i * 4] = (uint8_t)(values[i] >> 24);
+      out[i * 4 + 1] = (uint8_t)(values[i] >> 16);
+      out[i * 4 + 2] = (uint8_t)(values[i] >> 8);
+      out[i * 4 + 3] = (uint8_t)values[i];
+    }
+    return N * 4;
+  }
+
+private:
+  uint32_t values[N] = {0};
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// 3 bit images travel packed, two pixels per byte, the left pixel in the high nibble (ConvertToBitmap3bit on the PC).
+// The Inkplate's 3 bit framebuffer (DMemory4Bit) has the same layout, so whole rows can be copied into it
+// instead of unpacking every byte into two drawPixel() calls.
+
+const uint32_t packedPixelMask = 0x77777777; // 3 bits of every nibble, like color &= 7 in Inkplate::writePixel()
+
+
+// Whole images can also travel dense, 8 pixels in 3 bytes, the first pixel in the top 3 bits of the first byte
+// (ConvertBitmap3bitToDense on the PC). An 800x600 image is 180 000 bytes instead of 240 000. A last group of fewer
+// than 8 pixels is padded with zeros. The Inkplate unpacks every group into 4 packed bytes and writes those.
+const uint8_t denseGroupPixels = 8;
+const uint8_t denseGroupBytes = 3;
+
+// bytes of a dense image with *pixels* pixels
+inline unsigned long denseImageBytes(unsigned long pixels){
+  return (pixels + denseGroupPixels - 1) / denseGroupPixels * denseGroupBytes;
+}
+
+// 3 dense bytes into 4 packed ones
+inline void unpackDenseGroup(const uint8_t dense[], uint8_t packed[]){
+  uint32_t bits = ((uint32_t)dense[0] << 16) | ((uint32_t)dense[1] << 8) | dense[2];
+  for(uint8_t i = 0; i < 4; i++){
+    uint8_t pair = (uint8_t)(bits >> (18 - 6 * i)); // two pixels, 6 bits
+    packed[i] = ((pair << 1) & 0x70) | (pair & 0x07);
+  }
+}
+
+
+// Unpacks a dense image while it arrives, a group split between two writes waits for the rest.
+// Gives the packed bytes to *output* like StreamDecompressor does, at most unpackedChunk at a time.
+class DenseUnpacker {
+public:
+  void begin(){
+    carried = 0;
+  }
+
+  template <class Output>
+  void write(const uint8_t data[], unsigned int size, Output output){
+    uint8_t packed[unpackedChunk];
+    unsigned int length = 0;
+    while(size > 0){
+      if(carried > 0 || size < denseGroupBytes){
+        while(carried < denseGroupBytes && size > 0){
+          carry[carried++] = *data++;
+          size--;
+        }
+        if(carried < denseGroupBytes)
+          break;
+        unpackDenseGroup(carry, &packed[length]);
+        carried = 0;
+      }
+      else{
+        unpackDenseGroup(data, &packed[length]);
+        data += denseGroupBytes;
+        size -= denseGroupBytes;
+      }
+      length += 4;
+      if(length == sizeof(packed)){
+        output(packed, length);
+        length = 0;
+      }
+    }
+    if(length > 0)
+      output(packed, length);
+  }
+
+private:
+  static const unsigned int unpackedChunk = 64; // 16 groups
+  uint8_t carry[denseGroupBytes];
+  uint8_t carried = 0;
+};
+
+
+// copies *size* packed bytes, a word at a time, dropping the unused 4th bit of every pixel
+inline void copyPackedPixels(uint8_t* destination, const uint8_t* source, unsigned int size){
+  while(size >= sizeof(uint32_t)){
+    uint32_t word;
+    memcpy(&word, source, sizeof(word));
+    word &= packedPixelMask;
+    memcpy(destination, &word, sizeof(word));
+    source += sizeof(word);
+    destination += sizeof(word);
+    size -= sizeof(word);
+  }
+  while(size-- > 0)
+    *destination++ = *source++ & (uint8_t)packedPixelMask;
+}
+
+
+// Writes a packed image with an even width, at an even x, into a 4 bit framebuffer while it arrives.
+// Keeps the current row and column instead of working them out for every byte,
+// the part of the image that doesn't fit on the screen is skipped.
+class PackedImageWriter {
+public:
+  // *frameBuffer* - top left pixel of the screen, *stride* - bytes per framebuffer row,
+  // *screenWidth*, *screenHeight* - framebuffer size, *x*, *y*, *width*, *height* - where the image goes (all in pixels)
+  void begin(uint8_t* frameBuffer, unsigned int stride, int screenWidth, int screenHeight, int x, int y, int width, int height){
+    rowStart = frameBuffer + (unsigned long)y * stride + x / 2;
+    this->stride = stride;
+    rowBytes = width / 2;
+    int visibleWidth = screenWidth - x < width ? screenWidth - x : width;
+    visibleBytes = visibleWidth > 0 ? visibleWidth / 2 : 0;
+    visibleRows = screenHeight - y < height ? screenHeight - y : height;
+    row = 0;
+    column = 0;
+  }
+
+  void write(const uint8_t data[], unsigned int size){
+    while(size > 0){
+      unsigned int span = rowBytes - column; // rest of the current row
+      if(span > size)
+        span = size;
+
+      if(row < visibleRows && column < visibleBytes){
+        unsigned int visible = visibleBytes - column;
+        copyPackedPixels(rowStart + column, data, visible < span ? visible : span);
+      }
+
+      data += span;
+      size -= span;
+      column += span;
+      if(column == rowBytes){
+        column = 0;
+        row++;
+        rowStart += stride;
+      }
+    }
+  }
+
+private:
+  uint8_t* rowStart = NULL;
+  unsigned int stride = 0;
+  unsigned int rowBytes = 0;
+  unsigned int visibleBytes = 0;
+  int visibleRows = 0;
+  int row = 0;
+  unsigned int column = 0;
+};
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "Protocol.h"
+#include "SlidingWindow.h"
+
+// Forward error correction of broadcasts: parity frames that let a receiver rebuild a lost payload
+// without waiting for the next round of window acks and resends.
+//
+// A broadcast goes out without auto-ack, every node misses its own frames, and a missing payload costs
+// an ack request to every node and a resend to all of them. With parity the PC sets parityBits on
+// transmitBroadcastFlag, and after every block of payloads the transmitter sends one parity frame:
+// the XOR of the payloads of the block, shorter ones padded with zeros. A receiver that got all but one
+// payload of a block XORs the parity with the ones it got and has the missing one. Two lost payloads in a
+// block still need the resend, which also completes the block again for a later loss.
+// Blocks start at multiples of the block size, the last one ends with the transfer. A parity frame is only
+// sent the first time a block goes out, a resend is already for a payload the nodes asked for.
+// The other transfers are acked by the radio, a lost frame is sent again within the auto retransmit delay,
+// so they don't use parity.
+//
+// Parity frame: [0,...,29] - XOR of the payloads, [30,31] - first payloadCount of the block + paritySequenceOffset
+// The offset puts it half the sequence space away from every payload in flight, so it can't be taken for one.
+// Costs: the transmitter keeps the parity of the block it's sending (32 bytes), the receiver the XOR of
+// every block that overlaps its window (paritySlots), a payload is one XOR of at most 30 bytes on either side.
+
+const uint8_t parityBits = 0x30;                   // on transmitBroadcastFlag: 0 - no parity, 1, 2, 3 - a parity frame every 2, 4, 8 payloads
+const sequence_t paritySequenceOffset = 0x8000;
+const uint8_t paritySlots = windowSize / 2 + 1;    // blocks of 2 payloads overlapping the receive window
+
+// payloads per parity frame of a transfer flag, 0 - no parity
+inline uint8_t parityBlockPayloads(uint8_t flagType){
+  uint8_t bits = (flagType & parityBits) >> 4;
+  return bits == 0 ? 0 : (uint8_t)(1u << bits);
+}
+
+// parityBits for *blockPayloads* payloads per parity frame, 0 (no parity), 2, 4 or 8
+inline uint8_t parityFlagBits(uint8_t blockPayloads){
+  uint8_t bits = blockPayloads >= 8 ? 3 : blockPayloads >= 4 ? 2 : blockPayloads >= 2 ? 1 : 0;
+  return bits << 4;
+}
+
+
+// transmitter side, add() every payload the first time it goes out
+class ParityEncoder {
+public:
+  void reset(uint8_t blockPayloads){
+    block = blockPayloads;
+    next = 0;
+  }
+
+  bool enabled() const { return block > 0; }
+
+  // *last* - the last payload of the transfer, returns true if the parity frame of its block is ready
+  bool add(unsigned long payloadCount, const uint8_t payload[], uint8_t size, bool last){
+    if(!enabled() || payloadCount != next)
+      return false; // a resend
+    next++;
+    if(payloadCount % block == 0)
+      memset(parity, 0, payloadSize);
+    for(uint8_t i = 0; i < size; i++)
+      parity[i] ^= payload[i];
+    if(payloadCount % block != block - 1u && !last)
+      return false;
+    writeSequence(&parity[payloadSize], toSequence(payloadCount - payloadCount % block) + paritySequenceOffset);
+    return true;
+  }
+
+  const uint8_t* frame() const { return parity; }
+  uint8_t frameLength() const { return radioFrameSize; }
+
+private:
+  uint8_t block = 0;
+  unsigned long next = 0; // the next payload that goes out for the first time
+  uint8_t parity[radioFrameSize];
+};
+
+
+// receiver side, keeps the XOR of the payloads it got of every block in the window
+class ParityDecoder {
+public:
+  // *count* - bytes of the transfer, the size of a rebuilt payload follows from it
+  void reset(uint8_t blockPayloads, unsigned long count){
+    block = blockPayloads;
+    bytes = count;
+    rebuiltPayloads = 0;
+    for(uint8_t i = 0; i < paritySlots; i++)
+      slots[i].received = 0;
+  }
+
+  bool enabled() const { return block > 0; }
+  unsigned long rebuilt() const { return rebuiltPayloads; } // payloads of the transfer that came from parity
+
+  // a payload that went into the receive window
+  void add(unsigned long payloadCount, const uint8_t payload[], uint8_t size){
+    if(!enabled())
+      return;
+    Slot& slot = slotOf(payloadCount - payloadCount % block);
+    slot.received |= 1u << (payloadCount % block);
+    for(uint8_t i = 0; i < size; i++)
+      slot.parity[i] ^= payload[i];
+  }
+
+  // returns false if the frame isn't a parity frame for the window starting at *base*
+  bool addParity(unsigned long base, const uint8_t frame[], uint8_t size){
+    if(!enabled() || size != radioFrameSize)
+      return false;
+    int16_t distance = sequenceDistance(toSequence(base), readSequence(&frame[payloadSize]) - paritySequenceOffset);
+    if(distance >= 0x4000 || distance < -0x4000)
+      return false; // a payload
+    if(distance >= (int16_t)windowSize || -distance >= (int16_t)block || (base + distance) % block != 0)
+      return true; // a block that's long gone, or was never sent
+    Slot& slot = slotOf(base + distance);
+    if(slot.received & parityBit)
+      return true;
+    slot.received |= parityBit;
+    for(uint8_t i = 0; i < payloadSize; i++)
+      slot.parity[i] ^= frame[i];
+    return true;
+  }
+
+  // the only payload missing from a block with its parity, returns false if there is none
+  // the payload has to go through add() once it's stored
+  bool rebuild(unsigned long base, unsigned long& payloadCount, uint8_t payload[], uint8_t& size){
+    if(!enabled())
+      return false;
+    unsigned long payloads = (bytes + payloadSize - 1) / payloadSize;
+    for(uint8_t i = 0; i < paritySlots; i++){
+      const Slot& slot = slots[i];
+      if(!(slot.received & parityBit))
+        continue;
+      unsigned long end = payloads - slot.start < block ? payloads : slot.start + block;
+      uint8_t missing = 0;
+      for(unsigned long p = slot.start; p != end; p++){
+        if(!(slot.received & (1u << (p - slot.start)))){
+          payloadCount = p;
+          missing++;
+        }
+      }
+      if(missing != 1 || payloadCount - base >= windowSize)
+        continue; // the block is complete, or a payload outside of the window is missing
+      unsigned long left = bytes - payloadCount * payloadSize;
+      size = left > payloadSize ? payloadSize : left;
+      memcpy(payload, slot.parity, size);
+      rebuiltPayloads++;
+      return true;
+    }
+    return false;
+  }
+
+private:
+  static const uint16_t parityBit = 0x100; // in Slot::received, above the payloads of a block
+
+  struct Slot {
+    unsigned long start;   // first payloadCount of the block
+    uint16_t received;     // bit i - payload start + i, parityBit - the parity frame
+    uint8_t parity[payloadSize];
+  };
+
+  uint8_t block = 0;
+  unsigned long bytes = 0;
+  unsigned long rebuiltPayloads = 0;
+  Slot slots[paritySlots];
+
+  Slot& slotOf(unsigned long start){
+    Slot& slot = slots[(start / block) % paritySlots];
+    if(slot.start != start || slot.received == 0){
+      slot.start = start;
+      slot.received = 0;
+      memset(slot.parity, 0, payloadSize);
+    }
+    return slot;
+  }
+};
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <stdint.h>
+
+// Flags and radio settings shared by the PC, the transmitter and the receiver.
+//
+// Flag: [0] - type, [1,...,4] - byte count (big endian)
+
+const uint8_t radioAddress[] = "00050"; // node 0, see nodeAddress()
+const uint8_t radioAddressWidth = 5;
+const uint8_t radioChannel = 85;
+
+const unsigned int flagBytesCount = 5;
+const unsigned int payloadSize = 30;     // need 2 bytes free for payloadCount
+const uint8_t transmitBytesFlag = 0x01;     // [0] - 0x01, [1,...,4] - byte count
+const uint8_t transmitBytesWakeFlag = 0x02; // [0] - 0x02, [1,...,4] - byte count -> before sending the data, wakes up the receiver
+const uint8_t stringFlag = 0x03;            // [0] - 0x03, [1,...,4] - string length
+const uint8_t ackFlag = 0xFF;               // acknowledgement
+const uint8_t nakFlag = 0x00;               // negative acknowledgement
+const uint8_t sessionFlag = 0x04;           // [0] - 0x04, [1,...,4] - session of the receiving controller, to the PC before the ack of a wake flag
+const uint8_t openLinkFlag = 0x05;          // [0] - 0x05, [1,...,4] - link timeout in ms -> wakes up the receiving controller, it and the receiver stay awake
+const uint8_t keepLinkFlag = 0x06;          // [0] - 0x06, [1,...,4] - link timeout in ms -> keeps the link open, opens it again if it timed out
+const uint8_t closeLinkFlag = 0x07;         // [0] - 0x07, [1,...,4] - 0
+const uint8_t transmitLinkBytesFlag = 0x08; // [0] - 0x08, [1,...,4] - byte count -> a message on the link, the data starts with the receiving controller's flag
+const uint8_t nodeFlag = 0x09;              // [0] - 0x09, [1,...,4] - node -> the following flags go to this receiver, acked by the transmitter
+const uint8_t groupFlag = 0x0A;             // [0] - 0x0A, [1,...,4] - bitmask of nodes -> the nodes the next broadcast goes to
+const uint8_t transmitBroadcastFlag = 0x0B; // [0] - 0x0B, [1,...,4] - byte count -> a link message to every node of the group at once
+const uint8_t checkFlag = 0x0C;             // [0] - 0x0C, [1,...,4] - CRC-32 of the last transfer -> did it arrive intact, see below
+const uint8_t statusFlag = 0x0D;            // [0] - 0x0D, [1,...,4] - 0 transmitter, 1 receiver -> its counters, see LinkStats.h
+
+// Wake handshake: the receiver pulses the wake pin, the receiving controller answers on the UART with a
+// ready frame once it's ready for data (after a boot, a light sleep, or right away if it was awake).
+// Ready frame: uartReadyFrame (UartFrame.h), [0,1] - session (big endian)
+// The session is random on every boot, so when it changes the PC knows the framebuffer was lost.
+// The ack of a wake flag carries it: [0] - ackFlag, [1,...,4] - byte count, [5,6] - session
+const uint8_t readyFrameBytesCount = 2;
+const uint8_t wakeAckBytesCount = flagBytesCount + 2;
+
+// Link: for a burst of messages the PC opens a link once, instead of waking the boards up for every message.
+// The receiver and the receiving controller stay awake until the link is closed, or gets no message for the
+// link timeout. A message is a single transfer, its data is the receiving controller's flag followed by its data.
+// The receiver still pulses the wake pin for every message and waits for the ready frame, so a message doesn't
+// go out while the receiving controller is busy with the last one, or asleep because the link timed out.
+// The receiver passes the link on with: [0] - displayLinkFlag, [1,...,4] - link timeout in ms, 0 closes it
+const uint8_t displayLinkFlag = 0x07; // next to the flags in DisplayReceiver.h
+
+// Latency budget of a wake flag, measured on the simulated chain (NRF_simulation -w): a light sleep
+// answers in about 4 ms, a boot from deep sleep in the ~80 ms the ESP32 takes to setup(), display.begin()
+// follows while the data comes in (~300 ms with deferDisplayInit off in Inkplate_serial.ino).
+const unsigned long displayWakeTimeout = 1000; // ms the receiver waits for the ready frame, a few boots
+const unsigned long wakeAckTimeout = displayWakeTimeout + 200; // ms the transmitter waits, plus the flag and the ack on air
+const unsigned long displayBusyTimeout = 3000; // ms the receiver waits for the ready frame of a link message, the last image may still be refreshing
+const unsigned long linkAckTimeout = displayBusyTimeout + 200;
+
+// Low power listening: a receiver that got no frame for its sleep timeout powers the radio down and sleeps,
+// but only for listenPeriod. Then it listens for listenWindow, goes back to sleep if nothing came, and stays awake
+// if a frame did. A wake flag (transmitBytesWakeFlag, transmitLinkBytesFlag, openLinkFlag, keepLinkFlag,
+// transmitBroadcastFlag) that the receiver's radio doesn't ack goes out again and again for up to listenStrobeTime.
+// The auto retransmits put a copy on air about every millisecond, so the next listen window catches one and acks it,
+// and the transfer goes on as if the receiver had been awake. A wake waits at most one listen period for that,
+// instead of a nak and another try from the PC.
+// A longer listen period costs less energy and more latency, NRF_simulation -p measures both.
+#ifndef LISTEN_PERIOD
+#define LISTEN_PERIOD 1000 // ms, set it the same in NRF_transmitter and NRF_receiver/platformio.ini, and in Program.cs
+#endif
+const unsigned long listenPeriod = LISTEN_PERIOD;
+const unsigned long listenWindow = 3; // ms, 2 to 3 with millis(), a few copies of the flag
+
+// ms the transmitter repeats a flag to a receiver in low power listening, the watchdog of the AVR runs up to 20 % slow
+inline unsigned long listenStrobeTime(unsigned long period = listenPeriod){
+  return period + period / 4 + 2 * listenWindow;
+}
+
+// Nodes: every receiver has a node number (RECEIVER_NODE in NRF_receiver/platformio.ini), its address is radioAddress
+// with the node added to the first byte, so node 0 keeps radioAddress. The PC picks the receiver with nodeFlag.
+// Broadcast: the receivers also listen on the broadcast address in pipe 2, which only differs from their own
+// address in the first byte, like the nRF24 needs for pipes 2 to 5. The transmitter joins every node of the group
+// with its own transmitBroadcastFlag (taken like a link message, the receiver keeps the receiving controller awake
+// with displayLinkFlag until the data comes), skipping the ones whose radio doesn't answer.
+// It sends every payload once to the broadcast address without auto-ack, then asks each node for its window ack,
+// which is its NAK: the payloads it's missing go out again to all of them. A node that stops answering drops out.
+// The PC can ask for parity frames on the flag, which let the nodes rebuild a lost payload on their own (Parity.h).
+// The transmitter tells the PC which nodes joined, before the ack of the flag, and which got all of the data,
+// after the last payload ack: [0] - groupFlag, [1,...,4] - bitmask of the nodes
+const uint8_t maxNodes = 8;                 // nodes 0 to 7, the transmitter keeps the window state of each in a broadcast
+const uint8_t broadcastAddressByte = 0xC3;  // first address byte of the broadcast, outside of the nodes' range
+const unsigned long broadcastJoinTimeout = linkAckTimeout; // ms the transmitter spends joining the whole group
+const unsigned long broadcastStartTimeout = broadcastJoinTimeout + 1000; // ms a joined receiver waits for the first payload
+
+// Check: the radio acks every payload, but nothing checks the UART to the receiving controller, or that the PC's
+// data is what got through at all. After a transfer the PC sends checkFlag with the CRC-32 of its data (Crc32.h).
+// The receiver compares it with the CRC of the bytes it passed on, and the receiving controller checks a checked
+// message against the CRC trailer that came with it (displayCheckedBit in DisplayReceiver.h) and writes a check frame
+// on the UART: which blocks of a whole image are bad, so the PC only sends those again.
+// Check frame: uartCheckFrame (UartFrame.h), [0] - result, [1,...,26] - bad blocks
+// Result: the number of bad blocks (0 - intact), or checkResend: the message didn't come whole, more than
+// maxCheckBlocks are bad, or it isn't an image. The receiver answers the check with
+// [0] - ackFlag, [1,...,4] - the CRC, [5] - result, [6,...,31] - bad blocks, checkResend also if its own CRC
+// didn't match, or no check frame came within checkTimeout.
+// The transmitter passes every bad block on to the PC, then the ack, or a nak if everything has to go out again:
+// [0] - checkFlag, [1,...,4] - block
+const uint8_t maxCheckBlocks = 26;          // the answer fills a radio frame
+const uint8_t checkResend = 0xFF;
+const uint8_t checkFrameBytesCount = 1 + maxCheckBlocks;
+const uint8_t checkAckBytesCount = flagBytesCount + 1 + maxCheckBlocks;
+const unsigned long checkTimeout = 600; // ms the receiver waits for the check frame, the receiving controller may still be reading, or loading a cached image from the SD card
+const unsigned long checkAckTimeout = checkTimeout + 200;
+
+
+// reads second, third, fourth and fifth byte as integer
+inline unsigned long readFlagCount(const uint8_t flag[]){
+  return ((unsigned long)flag[1] << 24) | ((unsigned long)flag[2] << 16)
+       | ((unsigned long)flag[3] << 8) | (unsigned long)flag[4];
+}
+
+
+inline void writeFlag(uint8_t flag[], uint8_t type, unsigned long count){
+  flag[0] = type;
+  flag[1] = (uint8_t)(count >> 24);
+  flag[2] = (uint8_t)(count >> 16);
+  flag[3] = (uint8_t)(count >> 8);
+  flag[4] = (uint8_t)(count & 0xFF);
+}
+
+
+inline void nodeAddress(uint8_t address[], uint8_t node){
+  for(uint8_t i = 0; i < radioAddressWidth; i++)
+    address[i] = radioAddress[i];
+  address[0] += node;
+}
+
+
+inline void broadcastAddress(uint8_t address[]){
+  nodeAddress(address, 0);
+  address[0] = broadcastAddressByte;
+}
@@ -0,0 +1,614 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "Protocol.h"
+#include "SlidingWindow.h"
+#include "FrameRing.h"
+#include "LinkAdapter.h"
+#include "Parity.h"
+#include "Crc32.h"
+#include "UartFrame.h"
+#include "LinkStats.h"
+
+// Receiver side of the link: takes flags and data from *Radio* and forwards the data
+// to the receiving controller on *Port*.
+//
+// Radio      - RF24 or anything with the same API (SimRadio.h)
+// Port       - HardwareSerial or anything with available(), read(), write(), availableForWrite()
+// Clock      - millis() and delay() (ArduinoClock.h, SimClock.h)
+// Wake       - pulse(), wakes up the receiving controller
+// Interrupts - disable(), enable() the radio's IRQ pin interrupt
+//
+// The radio's IRQ pin calls onRadioInterrupt(), which moves frames from the nRF24's RX FIFO
+// into a ring in SRAM. loop() takes them from there and writes the data to the UART only as far as
+// the receiving controller has credits for (see UartFrame.h), so the radio keeps being emptied while the UART
+// drains. A payload only leaves the window once it's queued for the UART, so a slow UART or a busy
+// receiving controller holds back the window ack and the transmitter waits.
+// If the ring fills up, the frames stay in the nRF24, which stops acking them until loop() catches up.
+// Every payload goes to the UART as a frame of its own, the first one of a message as uartMessageFrame. The last
+// uartCredits frames stay in a queue until the receiving controller credits them, in case it asks for a resend.
+// The hot paths count into stats (LinkStats.h), the transmitter asks for them with statusFlag.
+//
+// The RF24_PA_* constants have to be declared before this header is included.
+
+const uint8_t receiveRingSize = 8; // frames, 264 bytes, with the window, the parity and the UART queue about 850 bytes of the ATmega32U4's 2.5 KB
+
+template <class Radio, class Port, class Clock, class Wake, class Interrupts>
+class Receiver {
+public:
+  Receiver(Radio& radio, Port& port, Clock& clock, Wake& wake, Interrupts& interrupts)
+    : radio(radio), port(port), clock(clock), wake(wake), interrupts(interrupts) {}
+
+  unsigned long idleSince = 0; // when the receiver last woke up, or last got a frame
+  unsigned long wakeLatency = 0; // ms from the last wake pulse to the ready frame (see the budget in Protocol.h)
+  void (*log)(const char* message) = NULL; // debug messages, nothing is printed if NULL
+  uint8_t node = 0; // picks the radio address (see nodes in Protocol.h), set before begin()
+
+  void begin(){
+    interrupts.disable();
+    radio.begin();
+    radio.maskIRQ(true, true, false); // interrupt - (tx_ok, tx_fail, rx_ready), only on received frames
+    radio.enableDynamicPayloads();
+    radio.enableDynamicAck();
+    useSettings(defaultRadioSettings());
+    uint8_t address[radioAddressWidth];
+    nodeAddress(address, node);
+    radio.openWritingPipe(address);
+    radio.openReadingPipe(1, address);  // using pipe 1, pipe 2 takes the broadcasts this node joined
+    radio.enableAckPayload(); // only used if the transmitter asks for it on the transfer flag
+    radio.startListening(); // put radio in RX mode
+    frames.clear();
+    framesLeft = false;
+    uartAcked = uartQueued; // the receiving controller went on without the frames left while the receiver slept
+    uartNext = uartQueued;
+    interrupts.enable();
+  }
+
+  // low power listening (see Protocol.h): powerDown() before the board goes to sleep, listen() every time it wakes up
+  // the radio keeps its registers in power down, the next transfer starts on the default settings
+  void powerDown(){
+    begin();
+    interrupts.disable();
+    radio.powerDown();
+  }
+
+  // powers the radio up and listens for *window* ms, returns true if a frame came: stay awake, poll() takes it
+  // otherwise the radio is powered down again
+  bool listen(unsigned long window){
+    radio.powerUp(); // the oscillator starts up, 1.5 ms
+    radio.startListening();
+    interrupts.enable();
+    unsigned long startTime = clock.millis();
+    while(frames.empty() && clock.millis() - startTime < window){}
+    interrupts.disable();
+    if(frames.empty())
+      pullFrames(); // a frame that came right at the end
+    if(!frames.empty()){
+      interrupts.enable();
+      return true;
+    }
+    radio.powerDown();
+    return false;
+  }
+
+  // call from the radio's IRQ pin interrupt
+  void onRadioInterrupt(){
+    bool txOk, txFail, rxReady;
+    radio.whatHappened(txOk, txFail, rxReady); // releases the IRQ pin, a frame arriving after this pulls it again
+    pullFrames();
+  }
+
+  LinkStats<receiverStatCount> stats; // see LinkStats.h
+
+  uint8_t ringPeak() const { return frames.peak(); } // most frames that waited in the ring at once
+  unsigned long payloadsRebuilt() const { return parity.rebuilt(); } // from parity frames in the last broadcast (Parity.h)
+  unsigned long uartFramesDropped() const { return uartIn.framesDropped(); } // from the receiving controller
+
+  // true while the PC keeps a link open (see Protocol.h), don't go to sleep then
+  bool linkOpen(){ return linkTimeout > 0 && clock.millis() - idleSince < linkTimeout; }
+
+  // handles the next frame from the transmitter, call from loop()
+  void poll(){
+    readPort(); // the last frames of a transfer may still wait for credits
+    uint8_t flag[radioFrameSize];
+    uint8_t size;
+    if(!readFrame(flag, size)){
+      if(settings != defaultRadioSettings() && clock.millis() - settingsSince >= radioSettingsIdleTimeout)
+        switchSettings(defaultRadioSettings()); // the transmitter's switch back got lost (see LinkAdapter.h)
+      return;
+    }
+
+    if(size == 1 && flag[0] == ackRequestFlag){
+      // the transmitter didn't get the last window ack of the previous transfer
+      sendWindowAck();
+      return;
+    }
+    else if((flag[0] & ~ackPayloadModeBit) == transmitBytesFlag){
+      unsigned long count = readFlagCount(flag);
+      ackPayloadTransfer = flag[0] & ackPayloadModeBit;
+
+      sendAck(count);
+      receiveBytes(count, false); // the rest of the message the wake transfer started
+    }
+    else if((flag[0] & ~ackPayloadModeBit) == transmitBytesWakeFlag || (flag[0] & ~ackPayloadModeBit) == transmitLinkBytesFlag
+            || (flag[0] & ~(ackPayloadModeBit | parityBits)) == transmitBroadcastFlag){
+      unsigned long count = readFlagCount(flag);
+      ackPayloadTransfer = flag[0] & ackPayloadModeBit;
+      bool wakeMessage = (flag[0] & ~ackPayloadModeBit) == transmitBytesWakeFlag;
+      bool broadcast = (flag[0] & ~(ackPayloadModeBit | parityBits)) == transmitBroadcastFlag; // taken like a link message
+
+      uint16_t session;
+      if(!wakeDisplay(session, wakeMessage ? displayWakeTimeout : displayBusyTimeout)){
+        debug("Wake signal not received");
+        return;
+      }
+      sendWakeAck(count, session);
+      if(broadcast){
+        // the receiving controller stays awake while the transmitter joins the rest of the group
+        sendLinkFlag(linkTimeout > broadcastStartTimeout ? linkTimeout : broadcastStartTimeout);
+        // only open while in the broadcast, outside of it the data would be taken for flags
+        uint8_t address[radioAddressWidth];
+        broadcastAddress(address);
+        radio.openReadingPipe(2, address);
+        receiveBytes(count, true, broadcastStartTimeout, parityBlockPayloads(flag[0]));
+        radio.closeReadingPipe(2);
+      }
+      else{
+        receiveBytes(count, true);
+      }
+    }
+    else if(flag[0] == openLinkFlag || (flag[0] == keepLinkFlag && !linkOpen())){
+      uint16_t session;
+      if(!wakeDisplay(session)){
+        debug("Wake signal not received");
+        return;
+      }
+      linkTimeout = readFlagCount(flag);
+      sendLinkFlag(linkTimeout);
+      sendWakeAck(linkTimeout, session);
+    }
+    else if(flag[0] == keepLinkFlag || flag[0] == closeLinkFlag){
+      linkTimeout = flag[0] == keepLinkFlag ? readFlagCount(flag) : 0;
+      sendLinkFlag(linkTimeout);
+      sendAck(readFlagCount(flag));
+    }
+    else if(flag[0] == checkFlag){
+      sendCheckAck(readFlagCount(flag));
+    }
+    else if(flag[0] == statusFlag && readFlagCount(flag) == statusReceiver){
+      sendStatus();
+    }
+
+    settingsConfirmed = true;
+    settingsSince = clock.millis(); // late ack requests still come on the transfer's settings
+    clearFrames(); // clear the rx buffer
+    radio.flush_tx(); // clear the tx buffer
+    idleSince = clock.millis(); // don't go to sleep while the transmitter may still want the last ack
+  }
+
+private:
+  Radio& radio;
+  Port& port;
+  Clock& clock;
+  Wake& wake;
+  Interrupts& interrupts;
+  FrameRing<receiveRingSize> frames;   // filled by onRadioInterrupt()
+  volatile bool framesLeft = false;     // the ring was full, frames are still waiting in the nRF24
+  ReceiveWindow<windowSize> window; // kept after the transfer, so late ack requests still get the final ack
+  ParityDecoder parity; // of a broadcast with parity frames (Parity.h)
+  Crc32 transferCrc;    // of the bytes of the last transfer that went to the port, for checkFlag
+  bool messageStart = false; // the next payload starts a message
+
+  // frames to the receiving controller (see UartFrame.h), sequences uartAcked <= uartNext <= uartQueued
+  struct UartSlot {
+    uint8_t type;
+    uint8_t size;
+    uint8_t data[payloadSize];
+  };
+  UartSlot uartQueue[uartCredits]; // slot sequence % uartCredits, from uartAcked to the one before uartQueued
+  uint8_t uartAcked = 0;  // the next sequence the receiving controller expects
+  uint8_t uartNext = 0;   // of the next frame to write, goes back to uartAcked for a resend
+  uint8_t uartQueued = 0; // of the next frame to queue
+  UartFrameDecoder uartIn; // frames from the receiving controller
+  uint8_t replyType = 0;   // of the last ready or check frame, 0 once it was taken
+  uint8_t replySize = 0;
+  uint8_t reply[checkFrameBytesCount];
+  bool ackPayloadTransfer = false; // the transmitter wants window acks as ack payloads (see SlidingWindow.h)
+  unsigned long linkTimeout = 0; // ms of the open link, 0 without one
+  RadioSettings settings = defaultRadioSettings();
+  RadioSettings previousSettings = defaultRadioSettings(); // to go back to if nothing comes on the new settings
+  bool settingsConfirmed = true;  // a frame came on the current settings
+  unsigned long settingsSince = 0; // when they were switched to, or the last frame came
+
+  void debug(const char* message){
+    if(log)
+      log(message);
+  }
+
+  void useSettings(const RadioSettings& next){
+    radio.setChannel(next.channel);
+    radio.setDataRate((rf24_datarate_e)next.dataRate);
+    radio.setPALevel(next.paLevel); // the auto-acks and ack frames go out with it
+    settings = next;
+  }
+
+  // switches while in RX, the frames already received stay in the ring
+  void switchSettings(const RadioSettings& next){
+    interrupts.disable();
+    radio.stopListening();
+    useSettings(next);
+    radio.startListening();
+    interrupts.enable();
+    if(ackPayloadTransfer)
+      sendWindowAck(); // RF24 flushes the ack payload when it leaves RX
+  }
+
+  // a settings frame came (see LinkAdapter.h)
+  void takeSettings(const RadioSettings& next){
+    if(next == settings){
+      settingsConfirmed = true; // sent again on the new settings
+      return;
+    }
+    previousSettings = settings;
+    switchSettings(next);
+    settingsConfirmed = next == defaultRadioSettings(); // never undone, both meet there again
+    debug("Radio settings switched");
+  }
+
+  // moves frames from the RX FIFO into the ring while there is room
+  void pullFrames(){
+    while(!frames.full() && radio.available()){
+      uint8_t size = radio.getDynamicPayloadSize();
+      if(size == 0 || size > radioFrameSize){ // corrupt frame, RF24 flushes it
+        radio.flush_rx();
+        break;
+      }
+      radio.read(frames.reserve(), size);
+      frames.push(size);
+    }
+    framesLeft = frames.full();
+  }
+
+  // takes the oldest received frame, false if there is none
+  // settings frames are taken here, whatever the caller is waiting for
+  bool readFrame(uint8_t data[], uint8_t& size){
+    while(true){
+      if(frames.empty() && framesLeft){ // the interrupt stopped on a full ring and won't fire again for these
+        interrupts.disable();
+        pullFrames();
+        interrupts.enable();
+      }
+      if(frames.empty()){
+        if(!settingsConfirmed && clock.millis() - settingsSince >= radioSettingsTimeout){
+          debug("Radio settings not confirmed");
+          switchSettings(previousSettings); // the transmitter went back too
+          settingsConfirmed = true;
+          settingsSince = clock.millis();
+        }
+        return false;
+      }
+      size = frames.pop(data);
+      stats.add(rxFrames);
+      settingsSince = clock.millis();
+
+      RadioSettings next;
+      if(!readSettingsFrame(data, size, next)){
+        settingsConfirmed = true; // the first frame on the new settings
+        return true;
+      }
+      takeSettings(next);
+    }
+  }
+
+  void clearFrames(){
+    interrupts.disable();
+    radio.flush_rx();
+    frames.clear();
+    framesLeft = false;
+    interrupts.enable();
+  }
+
+  // pulses the wake pin and waits for the receiving controller's ready frame (see Protocol.h)
+  // returns true if it came in time, with the controller's session
+  bool wakeDisplay(uint16_t& session, unsigned long timeout = displayWakeTimeout){
+    readPort();
+    replyType = 0; // a ready frame from before (a boot on its own, a double pulse) isn't the answer
+
+    wake.pulse();
+    unsigned long startTime = clock.millis();
+    while(clock.millis() - startTime < timeout){
+      readPort();
+      if(replyType == uartReadyFrame && replySize == readyFrameBytesCount){
+        replyType = 0;
+        wakeLatency = clock.millis() - startTime;
+        session = ((uint16_t)reply[0] << 8) | reply[1];
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // takes the frames the receiving controller sent, and writes the queued frames it has room for
+  // credit and resend frames are taken here, the last ready or check frame waits in reply for whoever needs it
+  void readPort(){
+    while(port.available()){
+      if(!uartIn.push(port.read()))
+        continue;
+      uint8_t type = uartIn.type();
+      uint8_t size = uartIn.payloadSize();
+      if((type == uartCreditFrame || type == uartResendFrame) && size == 1){
+        uint8_t expected = uartIn.payload()[0];
+        if((uint8_t)(expected - uartAcked) <= (uint8_t)(uartQueued - uartAcked)){ // otherwise one from before
+          uartAcked = expected;
+          if(type == uartResendFrame || (uint8_t)(uartNext - uartAcked) > (uint8_t)(uartQueued - uartAcked))
+            uartNext = uartAcked;
+        }
+      }
+      else if((type == uartReadyFrame || type == uartCheckFrame) && size <= sizeof(reply)){
+        if(type == uartReadyFrame){
+          uartAcked = uartQueued; // only comes between messages, the next one starts over
+          uartNext = uartQueued;
+        }
+        replyType = type;
+        replySize = size;
+        memcpy(reply, uartIn.payload(), size);
+      }
+    }
+    flushFrames();
+  }
+
+  // writes the queued frames, as far as the UART has room for them
+  void flushFrames(){
+    while(uartNext != uartQueued){
+      const UartSlot& slot = uartQueue[uartNext % uartCredits];
+      if(port.availableForWrite() < uartWireBytes(slot.size))
+        return;
+      uint8_t frame[uartMaxWireBytes];
+      port.write(frame, encodeUartFrame(frame, slot.type, uartNext, slot.data, slot.size));
+      uartNext++;
+    }
+  }
+
+  // true if the receiving controller has credits for another frame
+  bool canQueueFrame(){
+    readPort();
+    return (uint8_t)(uartQueued - uartAcked) < uartCredits;
+  }
+
+  // queues a frame to the receiving controller and writes it if the UART has room, see canQueueFrame()
+  void queueFrame(uint8_t type, const uint8_t data[], uint8_t size){
+    UartSlot& slot = uartQueue[uartQueued % uartCredits];
+    slot.type = type;
+    slot.size = size;
+    memcpy(slot.data, data, size);
+    uartQueued++;
+    flushFrames();
+  }
+
+  // tells the receiving controller to stay awake for the link, or that it was closed
+  void sendLinkFlag(unsigned long timeout){
+    uint8_t message[flagBytesCount];
+    writeFlag(message, displayLinkFlag, timeout);
+    unsigned long startTime = clock.millis();
+    while(!canQueueFrame()){ // the receiving controller may still be reading the last message
+      if(clock.millis() - startTime >= displayBusyTimeout)
+        return;
+    }
+    queueFrame(uartMessageFrame, message, sizeof(message));
+  }
+
+  // for sending the ack back to the transmitter
+  bool sendAck(unsigned long payloadCount){
+    uint8_t ackMessage[flagBytesCount];
+    writeFlag(ackMessage, ackFlag, payloadCount);
+    return sendFrame(ackMessage, sizeof(ackMessage));
+  }
+
+  // the ack of a wake flag also tells the PC which session the receiving controller is in
+  bool sendWakeAck(unsigned long payloadCount, uint16_t session){
+    uint8_t ackMessage[wakeAckBytesCount];
+    writeFlag(ackMessage, ackFlag, payloadCount);
+    ackMessage[flagBytesCount] = (uint8_t)(session >> 8);
+    ackMessage[flagBytesCount + 1] = (uint8_t)session;
+    return sendFrame(ackMessage, sizeof(ackMessage));
+  }
+
+  // answers a check with the receiving controller's check frame (see checkFlag in Protocol.h)
+  // *crc* - of the data the PC sent
+  bool sendCheckAck(unsigned long crc){
+    uint8_t ackMessage[checkAckBytesCount];
+    writeFlag(ackMessage, ackFlag, crc);
+    ackMessage[flagBytesCount] = checkResend;
+    memset(&ackMessage[flagBytesCount + 1], 0, maxCheckBlocks);
+    if(crc != transferCrc.value()){
+      debug("Transfer CRC doesn't match");
+      return sendFrame(ackMessage, sizeof(ackMessage));
+    }
+
+    unsigned long startTime = clock.millis();
+    while(clock.millis() - startTime < checkTimeout){
+      readPort(); // the check frame may have come already
+      if(replyType != uartCheckFrame || replySize != checkFrameBytesCount)
+        continue;
+      replyType = 0;
+      if(reply[0] > maxCheckBlocks && reply[0] != checkResend)
+        continue;
+      ackMessage[flagBytesCount] = reply[0];
+      memcpy(&ackMessage[flagBytesCount + 1], &reply[1], maxCheckBlocks);
+      return sendFrame(ackMessage, sizeof(ackMessage));
+    }
+    debug("Check frame not received");
+    return sendFrame(ackMessage, sizeof(ackMessage));
+  }
+
+  // the counters for the PC (see LinkStats.h)
+  bool sendStatus(){
+    uint8_t ackMessage[statusAckBytesCount];
+    writeFlag(ackMessage, ackFlag, statusReceiver);
+    stats.write(&ackMessage[flagBytesCount]);
+    return sendFrame(ackMessage, sizeof(ackMessage));
+  }
+
+  // tells the transmitter which payloads of the current window were received (see SlidingWindow.h)
+  bool sendWindowAck(){
+    uint8_t ackMessage[windowAckBytesCount];
+    window.fillAck(ackMessage, ackFlag);
+
+    if(ackPayloadTransfer){
+      radio.flush_tx(); // only the newest window ack should go out
+      return radio.writeAckPayload(1, ackMessage, sizeof(ackMessage)); // goes out with the auto-ack of the next frame
+    }
+    return sendFrame(ackMessage, sizeof(ackMessage));
+  }
+
+  bool sendFrame(const uint8_t message[], uint8_t size){
+    interrupts.disable();   // whatHappened() would clear the TX flags txStandBy() waits for
+    radio.stopListening();  // put in TX mode
+    radio.flush_tx();       // a leftover ack payload would be sent first
+    radio.writeFast(message, size);  // load response to TX FIFO
+    bool report = radio.txStandBy(150);          // keep retrying for 150 ms
+    radio.startListening();  // put back in RX mode
+    interrupts.enable();
+
+    if(!report)
+      stats.add(rxAckFailures);
+    return report;
+  }
+
+  // writes the payloads that are in order to the port, as far as it has room for them
+  // returns true if any payload left the window
+  bool forwardPayloads(unsigned long& count){
+    bool forwarded = false;
+    uint8_t bytesReceived;
+    const uint8_t* payload;
+    while(count > 0 && (payload = window.front(bytesReceived)) != NULL){
+      if(bytesReceived > count)
+        bytesReceived = count;
+      if(!canQueueFrame())
+        break; // the receiving controller is still busy with the frames before, the payload waits in the window
+      queueFrame(messageStart ? uartMessageFrame : uartDataFrame, payload, bytesReceived);
+      messageStart = false;
+      transferCrc.update(payload, bytesReceived);
+      stats.add(rxBytes, bytesReceived);
+      count -= bytesReceived;
+      window.pop();
+      forwarded = true;
+    }
+    return forwarded;
+  }
+
+  // stores the payloads the parity frames can rebuild, returns true if there was one
+  bool rebuildPayloads(){
+    bool stored = false;
+    unsigned long payloadCount;
+    uint8_t payload[payloadSize];
+    uint8_t size;
+    while(parity.rebuild(window.baseCount(), payloadCount, payload, size)){
+      stored |= window.store(toSequence(payloadCount), payload, size);
+      parity.add(payloadCount, payload, size);
+    }
+    return stored;
+  }
+
+  // receives a window of payloads at a time, out of order payloads wait in the window
+  // until the missing ones are resent, every burst is acked once on the transmitter's ack request
+  // *startsMessage* - the data starts a message for the receiving controller, not the rest of one
+  // *startTimeout* - ms to wait for the first frame
+  // *parityBlock* - payloads per parity frame of a broadcast, 0 for none (see Parity.h)
+  void receiveBytes(unsigned long count, bool startsMessage, unsigned long startTimeout = 1000, uint8_t parityBlock = 0){
+    window.reset();
+    parity.reset(parityBlock, count);
+    transferCrc.reset();
+    messageStart = startsMessage;
+    replyType = 0; // a check frame from before isn't about this transfer
+
+    // Keep receiving bytes until you get all of it
+    unsigned long lastProgress = clock.millis();
+    unsigned long timeout = startTimeout;
+    while(count > 0){
+      if(forwardPayloads(count)){
+        lastProgress = clock.millis();
+        if(ackPayloadTransfer)
+          sendWindowAck(); // the window moved, the next auto-ack should say so
+        continue;
+      }
+      uint8_t waiting;
+      if(window.front(waiting) != NULL){
+        if(clock.millis() - lastProgress >= timeout){
+          debug("UART stalled");
+          stats.add(rxTimeouts);
+          return; // the receiving controller stopped taking frames
+        }
+        continue; // the UART is behind, new frames wait in the ring and the radio until it has room
+      }
+
+      // only wait for a certain ammount of time before canceling transmission
+      uint8_t data[radioFrameSize];
+      uint8_t size;
+      if(!readFrame(data, size)){
+        if (clock.millis() - lastProgress >= timeout) {
+          debug("Transmission timed out");
+          stats.add(rxTimeouts);
+          return; // cancel transmission
+        }
+        continue;
+      }
+      lastProgress = clock.millis();
+      timeout = 1000;
+
+      if(size == 1 && data[0] == ackRequestFlag){
+        sendWindowAck();
+        continue;
+      }
+      if(size <= sequenceBytesCount) // not a data frame
+        continue;
+
+      if(parity.addParity(window.baseCount(), data, size)){
+        if(rebuildPayloads()){
+          forwardPayloads(count);
+          if(ackPayloadTransfer)
+            sendWindowAck();
+        }
+        continue;
+      }
+
+      sequence_t sequence = readSequence(&data[size - sequenceBytesCount]);
+
+      // the packet was already received (the ack got lost), or is too far ahead,
+      // either way the next window ack tells the transmitter what to resend
+      if(!window.store(sequence, data, size - sequenceBytesCount)){
+        if(sequenceDistance(toSequence(window.baseCount()), sequence) >= windowSize){
+          debug("Received future packet");
+          stats.add(rxFuturePayloads);
+        }
+        else{
+          debug("Received old packet");
+          stats.add(rxOldPayloads);
+        }
+        if(ackPayloadTransfer)
+          sendWindowAck();
+        continue;
+      }
+      parity.add(window.extend(sequence), data, size - sequenceBytesCount);
+      rebuildPayloads();
+
+      forwardPayloads(count);
+      if(ackPayloadTransfer)
+        sendWindowAck();
+    }
+
+    // the last window ack only leaves with the auto-ack of the next frame,
+    // stay until the transmitter's ack request picked it up
+    unsigned long startTime = clock.millis();
+    while(ackPayloadTransfer && clock.millis() - startTime < 100){
+      uint8_t data[radioFrameSize];
+      uint8_t size;
+      if(!readFrame(data, size))
+        continue;
+      if(size == 1 && data[0] == ackRequestFlag)
+        return;
+      sendWindowAck(); // a resent payload took it
+    }
+  }
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+// Serial number arithmetic (RFC 1982) for the 16 bit payloadCount carried on air.
+//
+// Both sides count payloads with a 32 bit counter, only the low 16 bits go into the frame.
+// As long as the two counters never drift more than half the sequence space apart
+// (32768 payloads, the window is far smaller), the full value can be rebuilt from the
+// low bits, so a transfer is only limited by the 32 bit byte count of the transfer flag.
+
+typedef uint16_t sequence_t;
+
+const uint8_t sequenceBytesCount = 2;
+
+
+inline sequence_t toSequence(unsigned long payloadCount){
+  return (sequence_t)(payloadCount & 0xFFFF);
+}
+
+
+// signed distance from *from* to *to*, negative if *to* is older
+inline int16_t sequenceDistance(sequence_t from, sequence_t to){
+  return (int16_t)(sequence_t)(to - from);
+}
+
+
+// true if *a* comes before *b*
+inline bool sequenceBefore(sequence_t a, sequence_t b){
+  return sequenceDistance(a, b) > 0;
+}
+
+
+// rebuilds the full payloadCount closest to *reference* that has *sequence* as its low bits
+inline unsigned long extendSequence(unsigned long reference, sequence_t sequence){
+  return reference + (long)sequenceDistance(toSequence(reference), sequence);
+}
+
+
+inline void writeSequence(uint8_t buffer[], unsigned long payloadCount){
+  buffer[0] = (uint8_t)(payloadCount >> 8);
+  buffer[1] = (uint8_t)(payloadCount & 0xFF);
+}
+
+
+inline sequence_t readSequence(const uint8_t buffer[]){
+  return ((sequence_t)buffer[0] << 8) | buffer[1];
+}
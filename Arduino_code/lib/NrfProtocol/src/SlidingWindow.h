@@ -0,0 +1,202 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "Sequence.h"
+
+// Selective repeat ARQ shared by the transmitter and the receiver.
+//
+// Data frame:  [0,...,n-1] - payload, [n,n+1] - payloadCount (low 16 bits, see Sequence.h)
+// Ack request: [0] - ackRequestFlag, sent after a burst of data frames
+// Window ack:  [0] - ackFlag, [1,2] - next expected payloadCount (low 16 bits),
+//              [3,4] - bitmap, bit i set if payload (next + 1 + i) was already received
+//
+// The sender keeps up to windowSize payloads in flight and only turns the radio around
+// once per burst. Every payload the ack doesn't cover was lost and is sent again.
+//
+// Ack payload mode (ackPayloadModeBit set on the transfer flag): the receiver never leaves RX,
+// it loads its window ack with writeAckPayload() after every frame and the nRF24 sends it back
+// with the hardware auto-ack of the next frame. The transmitter never leaves TX, the window ack
+// it reads after a write is one frame behind, an ack request at the end of a burst gets the latest one.
+// Payloads missing below the newest acked one are sent again.
+//
+// Flow control from the PC is credit based: the PC may have windowSize + ingestPayloads payloads
+// without an ack, every ack gives one credit back. The ones the window has no room for yet wait in the
+// transmitter's serial buffer, so when a slot frees up, the next payload is already there instead of
+// a USB round trip away. The window can empty while the transmitter is busy on the radio, so the
+// serial buffer has to hold every credit (SERIAL_RX_BUFFER_SIZE in NRF_transmitter/platformio.ini).
+
+const uint8_t radioFrameSize = 32;      // max nRF24 payload
+const uint8_t windowSize = 8;           // payloads in flight, at most 17 so the bitmap covers the window
+const uint8_t ingestPayloads = 6;       // payloads the PC sends ahead of the window
+const uint8_t windowAckBytesCount = 5;
+const uint8_t ackRequestFlag = 0xFE;    // [0] - 0xFE, asks the receiver for a window ack
+const uint8_t ackPayloadModeBit = 0x40; // set on the transfer flag to use ack payloads instead of ack frames
+
+
+template <uint8_t N>
+class SendWindow {
+public:
+  void reset(){
+    base = 0;
+    next = 0;
+    ackedEnd = 0;
+    for(uint8_t i = 0; i < N; i++)
+      state[i] = emptySlot;
+  }
+
+  unsigned long baseCount() const { return base; } // oldest payload that isn't acked yet
+  unsigned long nextCount() const { return next; } // payloadCount the next pushed payload gets
+  bool full() const { return next - base >= N; }
+  bool empty() const { return next == base; }
+
+  // buffer for the next payload, call push() once it's filled
+  uint8_t* reserve(){
+    return frames[next % N];
+  }
+
+  // appends the payloadCount trailer to the reserved buffer and queues it for sending
+  void push(uint8_t size){
+    uint8_t slot = next % N;
+    writeSequence(&frames[slot][size], next);
+    lengths[slot] = size + sequenceBytesCount;
+    state[slot] = queuedSlot;
+    next++;
+  }
+
+  // finds the oldest payload that still has to be sent, returns false if there is none
+  bool nextDue(unsigned long& payloadCount) const {
+    for(unsigned long i = base; i != next; i++){
+      if(state[i % N] == queuedSlot){
+        payloadCount = i;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  const uint8_t* frame(unsigned long payloadCount) const { return frames[payloadCount % N]; }
+  uint8_t frameLength(unsigned long payloadCount) const { return lengths[payloadCount % N]; }
+  void markSent(unsigned long payloadCount){ state[payloadCount % N] = sentSlot; }
+
+  // applies a window ack, returns how many payloads left the window (in order, starting at the old base)
+  uint8_t applyAck(const uint8_t message[]){
+    unsigned long cumulative = extendSequence(base, readSequence(&message[1]));
+    uint16_t bitmap = ((uint16_t)message[3] << 8) | message[4];
+
+    if(cumulative - base > next - base) // stale ack from before the window, or for payloads that were never sent
+      return 0;
+
+    for(unsigned long i = base; i != cumulative; i++)
+      state[i % N] = ackedSlot;
+    ackedEnd = cumulative;
+    for(uint8_t bit = 0; bit < 16; bit++){
+      unsigned long payloadCount = cumulative + 1 + bit;
+      if(payloadCount - base >= next - base)
+        break;
+      if(bitmap & (1u << bit)){
+        state[payloadCount % N] = ackedSlot;
+        ackedEnd = payloadCount + 1;
+      }
+    }
+
+    uint8_t slid = 0;
+    while(base != next && state[base % N] == ackedSlot){
+      state[base % N] = emptySlot;
+      base++;
+      slid++;
+    }
+    return slid;
+  }
+
+  // everything sent before the ack request and not covered by the ack was lost
+  void requeueUnacked(){
+    for(unsigned long i = base; i != next; i++){
+      if(state[i % N] == sentSlot)
+        state[i % N] = queuedSlot;
+    }
+  }
+
+  // only the payloads the last ack skipped over were lost, the newer ones may still be on their way
+  void requeueGaps(){
+    if(ackedEnd - base > next - base) // everything the ack covered already left the window
+      return;
+    for(unsigned long i = base; i != ackedEnd; i++){
+      if(state[i % N] == sentSlot)
+        state[i % N] = queuedSlot;
+    }
+  }
+
+private:
+  enum SlotState : uint8_t { emptySlot, queuedSlot, sentSlot, ackedSlot };
+
+  uint8_t frames[N][radioFrameSize];
+  uint8_t lengths[N];
+  SlotState state[N];
+  unsigned long base = 0;
+  unsigned long next = 0;
+  unsigned long ackedEnd = 0; // one past the newest payload the last ack covered
+};
+
+
+template <uint8_t N>
+class ReceiveWindow {
+public:
+  void reset(){
+    base = 0;
+    for(uint8_t i = 0; i < N; i++)
+      received[i] = false;
+  }
+
+  unsigned long baseCount() const { return base; } // next payload to be delivered
+
+  // full payloadCount of a received sequence number
+  unsigned long extend(sequence_t sequence) const { return extendSequence(base, sequence); }
+
+  // stores a payload, returns false if it's a duplicate or outside of the window
+  bool store(sequence_t sequence, const uint8_t data[], uint8_t size){
+    unsigned long payloadCount = extend(sequence);
+    if(payloadCount - base >= N)
+      return false;
+    uint8_t slot = payloadCount % N;
+    if(received[slot])
+      return false;
+
+    memcpy(payloads[slot], data, size);
+    lengths[slot] = size;
+    received[slot] = true;
+    return true;
+  }
+
+  // oldest payload if it was received, NULL otherwise
+  const uint8_t* front(uint8_t& size) const {
+    uint8_t slot = base % N;
+    if(!received[slot])
+      return NULL;
+    size = lengths[slot];
+    return payloads[slot];
+  }
+
+  void pop(){
+    received[base % N] = false;
+    base++;
+  }
+
+  void fillAck(uint8_t message[], uint8_t flag) const {
+    uint16_t bitmap = 0;
+    for(uint8_t bit = 0; bit + 1 < N && bit < 16; bit++){
+      if(received[(base + 1 + bit) % N])
+        bitmap |= (1u << bit);
+    }
+    message[0] = flag;
+    writeSequence(&message[1], base);
+    message[3] = (uint8_t)(bitmap >> 8);
+    message[4] = (uint8_t)(bitmap & 0xFF);
+  }
+
+private:
+  uint8_t payloads[N][radioFrameSize - sequenceBytesCount];
+  uint8_t lengths[N];
+  bool received[N];
+  unsigned long base = 0;
+};
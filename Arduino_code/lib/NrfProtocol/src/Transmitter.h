@@ -0,0 +1,753 @@
+#pragma once
+
+#include <stdint.h>
+#include "Protocol.h"
+#include "SlidingWindow.h"
+#include "LinkAdapter.h"
+#include "Parity.h"
+#include "LinkStats.h"
+
+// Transmitter side of the link: takes flags and data from the PC on *Port* and sends them
+// over *Radio*.
+//
+// Radio - RF24 or anything with the same API (SimRadio.h)
+// Port  - HardwareSerial or anything with available(), read(), readBytes(), write()
+// Clock - millis(), micros() and delay() (ArduinoClock.h, SimClock.h)
+//
+// The hot paths count into stats (LinkStats.h), which the PC reads with statusFlag between transfers.
+//
+// The RF24_PA_* constants have to be declared before this header is included.
+
+template <class Radio, class Port, class Clock>
+class Transmitter {
+public:
+  Transmitter(Radio& radio, Port& port, Clock& clock) : radio(radio), port(port), clock(clock) {}
+
+  bool useAckPayloads = true; // window acks ride on the hardware auto-ack, false falls back to ack frames (see SlidingWindow.h)
+  int windowAckTimeout = 20;  // ms to wait for the window ack after an ack request
+  int unansweredFlagTimeout = 20; // ms to wait for the ack of a flag the receiver's radio didn't ack (see sendFlag())
+  uint8_t ackPayloadRetryDelay = 1; // auto retransmit delay (1 + 1) * 250 us, long enough for a 5 byte ack payload
+  uint8_t ackPayloadRetryCount = 15;
+  uint8_t slowAckPayloadRetryDelay = 3; // (3 + 1) * 250 us, the ack payload takes longer at 250 kbps
+  bool adaptRadio = true; // picks the data rate, PA level and channel of the transfers from the link quality (see LinkAdapter.h)
+  int settingsProbeTimeout = 20; // ms to get the settings frame through on the new settings
+  int settingsSwitchTimeout = 300; // ms to keep trying, the receiver may be busy with the UART at the start of a transfer
+  uint8_t ackFrameRetryDelay = 5; // (5 + 1) * 250 us without ack payloads, RF24's default
+  unsigned long wakeStrobeTime = listenStrobeTime(); // ms to repeat a wake flag to a receiver in low power listening, 0 - never (see Protocol.h)
+  uint8_t strobeRetryDelay = 0; // (0 + 1) * 250 us, a sleeping receiver has no ack payload, so the copies go out closer
+  void (*log)(const char* message) = NULL; // debug messages, nothing is printed if NULL
+
+  void begin(){
+    radio.begin();
+    radio.enableDynamicPayloads();
+    radio.enableDynamicAck();
+    openNode(node);
+    setupAckPayloads();
+    useSettings(defaultRadioSettings()); // RF24_PA_LOW, RF24_PA_MAX is the chip's default
+    radio.stopListening(); // put radio in TX mode
+  }
+
+  LinkStats<transmitterStatCount> stats; // see LinkStats.h
+
+  // the settings the next transfer switches to after its flag (see LinkAdapter.h)
+  const RadioSettings& radioSettings() const { return adapter.settings(); }
+
+  void resetRadio(){
+    stats.add(txRadioResets);
+    begin();
+    radio.flush_rx();
+    radio.flush_tx();
+    radio.stopListening(); // put radio in TX mode
+  }
+
+  // handles the next flag from the PC, call from loop()
+  void poll(){
+    if(!port.available())
+      return;
+
+    uint8_t flag[flagBytesCount];
+    port.readBytes(flag, sizeof(flag));
+    // Choose the next step depending on what type of message is transmitting
+    if(flag[0] == transmitBytesFlag){
+      debug("Transmt bytes flag");
+      transmitFlag(flag, 100, 0, "no flag ack");
+    }
+    else if(flag[0] == transmitBytesWakeFlag){
+      transmitFlag(flag, wakeAckTimeout, wakeStrobeTime, "no wake flag ack"); // the receiver waits for the receiving controller first
+    }
+    else if(flag[0] == transmitLinkBytesFlag){
+      transmitFlag(flag, linkAckTimeout, wakeStrobeTime, "no link flag ack"); // the receiving controller may still be busy with the last message
+    }
+    else if(flag[0] == openLinkFlag || flag[0] == keepLinkFlag){
+      forwardFlag(flag, wakeAckTimeout, wakeStrobeTime, "no link ack"); // no data, the count is the link timeout
+    }
+    else if(flag[0] == closeLinkFlag){
+      forwardFlag(flag, 100, 0, "no link ack");
+    }
+    else if(flag[0] == nodeFlag){
+      selectNode(readFlagCount(flag));
+    }
+    else if(flag[0] == groupFlag){
+      group = (uint8_t)readFlagCount(flag); // nodes past maxNodes aren't in it
+      sendAck(readFlagCount(flag));
+    }
+    else if((flag[0] & ~parityBits) == transmitBroadcastFlag){
+      transmitBroadcast(flag);
+    }
+    else if(flag[0] == checkFlag){
+      checkTransfer(flag);
+    }
+    else if(flag[0] == statusFlag){
+      sendStatus(flag);
+    }
+  }
+
+private:
+  Radio& radio;
+  Port& port;
+  Clock& clock;
+  SendWindow<windowSize> window;
+  ParityEncoder parity; // of the broadcast (Parity.h)
+  LinkAdapter adapter;
+  RadioSettings settings = defaultRadioSettings(); // what the radio is on right now
+  uint8_t retransmits = 0; // auto retransmits of the last write() that was acked
+  uint8_t node = 0;  // the receiver the flags go to (see nodes in Protocol.h)
+  uint8_t group = 0; // bitmask of the nodes the next broadcast goes to
+
+  // window state of every node in a broadcast: its last window ack, and when that last moved
+  unsigned long nodeBase[maxNodes];
+  uint16_t nodeBitmap[maxNodes];
+  unsigned long nodeProgress[maxNodes];
+
+  void debug(const char* message){
+    if(log)
+      log(message);
+  }
+
+  uint8_t transferModeBits() const { return useAckPayloads ? ackPayloadModeBit : 0; }
+
+  void setupAckPayloads(){
+    if(!useAckPayloads)
+      return;
+    radio.enableAckPayload();
+    radio.setRetries(ackPayloadRetryDelay, ackPayloadRetryCount);
+  }
+
+  void useSettings(const RadioSettings& next){
+    radio.setChannel(next.channel);
+    radio.setDataRate((rf24_datarate_e)next.dataRate);
+    radio.setPALevel(next.paLevel);
+    settings = next;
+    useRetries();
+    adapter.restartRound(); // the writes so far tell nothing about these
+  }
+
+  // the auto retransmit delay of the transfers, an ack payload takes longer at 250 kbps
+  void useRetries(){
+    if(useAckPayloads)
+      radio.setRetries(settings.dataRate == RF24_250KBPS ? slowAckPayloadRetryDelay : ackPayloadRetryDelay, ackPayloadRetryCount);
+    else
+      radio.setRetries(ackFrameRetryDelay, ackPayloadRetryCount);
+  }
+
+  // tells the receiver to switch to *next* and switches too (see LinkAdapter.h)
+  // returns false if the settings frame didn't get through on the new settings, both are on the old ones then
+  bool switchSettings(const RadioSettings& next){
+    uint8_t frame[radioSettingsBytesCount];
+    writeSettingsFrame(frame, next);
+    RadioSettings previous = settings;
+
+    unsigned long startTime = clock.millis();
+    while(clock.millis() - startTime < (unsigned long)settingsSwitchTimeout){
+      // the receiver switches once it reads it, even if none of the auto-acks made it back
+      bool sent = write(frame, sizeof(frame));
+      useSettings(next);
+      unsigned long probeStart = clock.millis();
+      bool confirmed = write(frame, sizeof(frame));
+      while(!confirmed && clock.millis() - probeStart < (unsigned long)settingsProbeTimeout)
+        confirmed = write(frame, sizeof(frame));
+      radio.flush_rx(); // ack payloads older than the next window ack
+      if(confirmed)
+        return true;
+      useSettings(previous);
+      if(sent)
+        break; // the receiver took it, but nothing gets through on the new settings
+    }
+    debug("radio settings not confirmed");
+    clock.delay(radioSettingsTimeout); // until a receiver that switched went back
+    return false;
+  }
+
+  // switches to the settings the adapter picked from the last round of writes
+  void adaptSettings(){
+    RadioSettings next;
+    if(!adapter.update(next))
+      return;
+    RadioSettings previous = settings;
+    if(switchSettings(next))
+      debug("radio settings switched");
+    else
+      adapter.rejected(previous);
+  }
+
+  // sends to the receiver of *target* and listens for its ack frames
+  void openNode(uint8_t target){
+    uint8_t address[radioAddressWidth];
+    nodeAddress(address, target);
+    radio.openWritingPipe(address);
+    radio.openReadingPipe(1, address);
+  }
+
+  void selectNode(unsigned long target){
+    if(target >= maxNodes){
+      sendNak(target);
+      return;
+    }
+    node = (uint8_t)target;
+    openNode(node);
+    sendAck(target);
+  }
+
+  // forwards the transfer flag, waits for the receiver to ack it and sends the data
+  void transmitFlag(uint8_t flag[], unsigned long ackTimeout, unsigned long strobeTime, const char* noAckMessage){
+    flag[0] |= transferModeBits();
+    if(forwardFlag(flag, ackTimeout, strobeTime, noAckMessage))
+      transmitBytes(readFlagCount(flag));
+  }
+
+  // sends the flag to the receiver and passes its ack on to the PC, or a nak if there is none
+  // returns true if the receiver acked it
+  bool forwardFlag(const uint8_t flag[], unsigned long ackTimeout, unsigned long strobeTime, const char* noAckMessage){
+    unsigned long count = readFlagCount(flag);
+    long session;
+    if(!sendFlag(flag, ackTimeout, strobeTime, session)){
+      debug(noAckMessage);
+      sendNak(count); // the PC doesn't have to wait for its own timeout
+      return false;
+    }
+
+    if(session >= 0){ // the PC gets the receiving controller's session before the ack
+      uint8_t sessionMessage[flagBytesCount];
+      writeFlag(sessionMessage, sessionFlag, session);
+      port.write(sessionMessage, sizeof(sessionMessage));
+    }
+    sendAck(count);
+    return true;
+  }
+
+  // sends the flag to the current node and waits for its ack, *session* is -1 if it wasn't a wake ack
+  // if the receiver's radio doesn't ack the flag, it's asleep or out of range, or it already got the flag and is
+  // sending its ack (a woken receiving controller answers within a few retransmits), which comes right away
+  // so a sleeping receiver doesn't hold up the PC
+  // a receiver still sending its last ack frame (up to 150 ms on a lossy link) doesn't hear the flag either,
+  // so an unanswered flag goes out once more after that wait, for up to *strobeTime* to wake a receiver in
+  // low power listening (see Protocol.h)
+  bool sendFlag(const uint8_t flag[], unsigned long ackTimeout, unsigned long strobeTime, long& session){
+    for(uint8_t attempt = 0; attempt < 2; attempt++){
+      bool answered = attempt > 0 && strobeTime > 0 ? strobeFlag(flag, strobeTime) : write(flag, flagBytesCount);
+      radio.flush_rx(); // drop a stale ack payload that came back with the auto-ack
+
+      bool ackReceived = waitForAck(answered ? ackTimeout : unansweredFlagTimeout);
+      if(!ackReceived){               // waiting for ack timed out
+        if(answered)
+          return false;               // try sending the data again
+        debug("receiver not answering");
+        continue;
+      }
+
+      // read the ack and check if it's correct
+      uint8_t received[radioFrameSize];
+      uint8_t size = radio.getDynamicPayloadSize();
+      radio.read(&received, size);
+      bool wakeAck = size == wakeAckBytesCount;
+      if((size == flagBytesCount || wakeAck) && readFlagCount(received) == readFlagCount(flag)){
+        session = wakeAck ? (long)(((unsigned long)received[flagBytesCount] << 8) | received[flagBytesCount + 1]) : -1;
+        return true;
+      }
+      if(answered)
+        return false; // TODO: instead of return, send the data again
+    }
+    return false;
+  }
+
+  // writes the flag again and again until a receiver in low power listening wakes up for its listen window
+  // and acks one, the auto retransmits of every write keep a copy on air about every 0.7 ms
+  // returns false if it didn't within *strobeTime*
+  bool strobeFlag(const uint8_t flag[], unsigned long strobeTime){
+    radio.setRetries(strobeRetryDelay, ackPayloadRetryCount);
+    bool answered = false;
+    unsigned long startTime = clock.millis();
+    while(!answered && clock.millis() - startTime < strobeTime)
+      answered = radio.write(flag, flagBytesCount); // not in the frame counters, nobody was listening for most of them
+    useRetries();
+    if(!answered){
+      debug("receiver not listening");
+      return false;
+    }
+    stats.add(txWakeStrobes);
+    return true;
+  }
+
+  // asks the receiver if the last transfer arrived intact (see checkFlag in Protocol.h),
+  // passes the bad blocks on to the PC, a nak if the whole transfer has to be sent again
+  void checkTransfer(const uint8_t flag[]){
+    unsigned long crc = readFlagCount(flag);
+    bool answered = write(flag, flagBytesCount);
+    radio.flush_rx();
+
+    uint8_t received[radioFrameSize];
+    uint8_t size = 0;
+    if(waitForAck(answered ? checkAckTimeout : unansweredFlagTimeout)){
+      size = radio.getDynamicPayloadSize();
+      radio.read(&received, size);
+    }
+    if(size != checkAckBytesCount || received[0] != ackFlag || readFlagCount(received) != crc
+       || received[flagBytesCount] > maxCheckBlocks){
+      debug("transfer not intact");
+      sendNak(crc);
+      return;
+    }
+
+    for(uint8_t i = 0; i < received[flagBytesCount]; i++){
+      uint8_t blockMessage[flagBytesCount];
+      writeFlag(blockMessage, checkFlag, received[flagBytesCount + 1 + i]);
+      port.write(blockMessage, sizeof(blockMessage));
+    }
+    sendAck(crc);
+  }
+
+  // answers the PC with the transmitter's counters or the current node's (see LinkStats.h), then the ack,
+  // a nak if the node didn't answer
+  void sendStatus(const uint8_t flag[]){
+    unsigned long source = readFlagCount(flag);
+    uint8_t received[transmitterStatCount * 4 > radioFrameSize ? transmitterStatCount * 4 : radioFrameSize];
+    const uint8_t* counters = received;
+    uint8_t size = 0;
+    if(source == statusTransmitter)
+      size = stats.write(received);
+    else if(source == statusReceiver){
+      bool answered = write(flag, flagBytesCount);
+      radio.flush_rx();
+      if(waitForAck(answered ? 100 : unansweredFlagTimeout)){ // the receiver may be sending its last ack frame
+        size = radio.getDynamicPayloadSize();
+        radio.read(&received, size);
+      }
+      if(size != statusAckBytesCount || received[0] != ackFlag || readFlagCount(received) != source)
+        size = 0;
+      else{
+        counters = &received[flagBytesCount];
+        size -= flagBytesCount;
+      }
+    }
+    if(size == 0){
+      debug("no status");
+      sendNak(source);
+      return;
+    }
+
+    uint8_t statusMessage[flagBytesCount];
+    writeFlag(statusMessage, statusFlag, size);
+    port.write(statusMessage, sizeof(statusMessage));
+    port.write(counters, size);
+    sendAck(source);
+  }
+
+  // for sending the ack back to the sender
+  void sendAck(unsigned long count){
+    uint8_t ackFlagMessage[flagBytesCount];
+    writeFlag(ackFlagMessage, ackFlag, count);
+    port.write(ackFlagMessage, sizeof(ackFlagMessage));
+  }
+
+  // tells the PC which nodes of a broadcast joined, or got all of the data
+  void sendGroup(uint8_t nodes){
+    uint8_t groupMessage[flagBytesCount];
+    writeFlag(groupMessage, groupFlag, nodes);
+    port.write(groupMessage, sizeof(groupMessage));
+  }
+
+  // for sending the nak back to the sender
+  void sendNak(unsigned long count){
+    stats.add(txNaks);
+    uint8_t nakFlagMessage[flagBytesCount];
+    writeFlag(nakFlagMessage, nakFlag, count);
+    port.write(nakFlagMessage, sizeof(nakFlagMessage));
+  }
+
+  // a radio write that wants the auto-ack, counted in stats
+  bool write(const void* data, uint8_t size){
+    unsigned long start = NRF_STATS ? clock.micros() : 0;
+    bool sent = radio.write(data, size);
+    stats.add(txFramesSent);
+    retransmits = sent ? radio.getARC() : 0;
+    if(!sent)
+      stats.add(txFramesLost);
+    else if(NRF_STATS){
+      stats.sample(txRttMin, txRttMax, txRttTotal, clock.micros() - start);
+      stats.add(txRetransmits, retransmits);
+    }
+    return sent;
+  }
+
+  // the failed writes are counted in stats, a debug message for every one would hold up the retries
+  bool sendPayload(const uint8_t data[], int size, unsigned long timeout = 300){
+    unsigned long send_timeout_start = clock.millis();
+    bool sent = write(data, size);
+    adapter.record(sent, retransmits, radio.testRPD()); // RPD latches on the auto-ack
+    while(!sent && clock.millis() - send_timeout_start < timeout){
+      clock.delay(1);
+      sent = write(data, size);
+      adapter.record(sent, retransmits, radio.testRPD());
+    }
+    return sent;
+  }
+
+  bool waitForAck(unsigned long timeout = 100){
+    radio.startListening();         // put in RX mode
+    unsigned long ack_timeout_start = clock.millis();
+    while (!radio.available()) {             // wait for response
+      if (clock.millis() - ack_timeout_start > timeout){    // wait for some time
+        stats.add(txAckTimeouts);
+        radio.stopListening();      // put back in TX mode
+        radio.flush_rx();           // clear the buffer
+        return false;
+      }
+    }
+    radio.stopListening();      // put back in TX mode
+
+    return true;
+  }
+
+  // if the auto-ack of the receiver's ack frame got lost, the receiver sends it again after its retry delay (1.5 ms),
+  // stay in RX to ack that one, or the receiver keeps retrying (and misses the next flag) while this one sends
+  void lingerForAck(){
+    radio.startListening();
+    clock.delay(2);
+    radio.stopListening();
+    radio.flush_rx();
+  }
+
+  // reads the next payloads from the serial port into the free window slots
+  // returns true if at least one payload was read
+  bool fillWindow(unsigned long& count){
+    bool read = false;
+    while(count > 0 && !window.full()){
+      // Take at most *payloadSize* byte chunk
+      int bytesToSend = count > payloadSize ? payloadSize : count;
+      if(port.available() < bytesToSend)
+        break;
+
+      port.readBytes(window.reserve(), bytesToSend);
+      window.push(bytesToSend);
+      stats.add(txBytes, bytesToSend);
+      count -= bytesToSend;
+      read = true;
+    }
+    return read;
+  }
+
+  // sends the data on the settings the adapter learned, the next flag goes out on the default ones again
+  void transmitBytes(unsigned long count){
+    adapter.restartRound(); // the flags went out on the default settings
+    bool adapt = adaptRadio && count >= adaptMinBytes;
+    if(adapt && adapter.settings() != settings && !switchSettings(adapter.settings()))
+      adapt = false; // the receiver didn't come along, this transfer stays on the default settings
+    unsigned long startTime = clock.millis();
+    sendBytes(count, adapt);
+    stats.add(txTransferMillis, clock.millis() - startTime);
+    if(settings != defaultRadioSettings() && !switchSettings(defaultRadioSettings()))
+      useSettings(defaultRadioSettings()); // the receiver went back on its own meanwhile
+  }
+
+  // sends the data as a window of payloads, the receiver acks every burst at once (see SlidingWindow.h)
+  // the PC gets an ack for every payload in order, as soon as it leaves the window
+  // *adapt* - switch to the settings the adapter picks on the way
+  void sendBytes(unsigned long count, bool adapt){
+    debug("Transmitting bytes");
+    window.reset();
+    unsigned long last_progress = clock.millis(); // last time a payload was read or acknowledged
+
+    // Keep sending until every payload is acknowledged
+    while(count > 0 || !window.empty()){
+      if(fillWindow(count))
+        last_progress = clock.millis();
+
+      if(window.empty()){ // waiting for the PC
+        if(clock.millis() - last_progress > 1000){
+          debug("Transmission canceled");
+          return;
+        }
+        continue;
+      }
+
+      // send every payload that wasn't sent yet, or was reported missing
+      unsigned long payloadCount;
+      while(window.nextDue(payloadCount)){
+        bool sent = sendPayload(window.frame(payloadCount), window.frameLength(payloadCount));
+        if(!sent){ // couldn't send the payload
+          debug("Transmission canceled: failed to send payload");
+          sendNak(payloadCount);
+          if(adapt)
+            adapter.failed(); // the next transfer starts a step more robust
+          resetRadio();
+          return;
+        }
+        window.markSent(payloadCount);
+
+        // the auto-ack carries the window ack from the previous frame
+        if(useAckPayloads && radio.available() && readWindowAck())
+          last_progress = clock.millis();
+        if(adapt)
+          adaptSettings(); // with ack payloads the burst goes on as long as the window moves
+
+        if(fillWindow(count)) // don't let the serial buffer overflow while sending the burst
+          last_progress = clock.millis();
+      }
+
+      // ask the receiver which payloads arrived
+      uint8_t ackRequest = ackRequestFlag;
+      bool ackReceived = sendPayload(&ackRequest, sizeof(ackRequest));
+      if(useAckPayloads){
+        ackReceived = ackReceived && radio.available(); // the answer came back with the auto-ack
+        if(!ackReceived)
+          stats.add(txAckTimeouts);
+      }
+      else
+        ackReceived = ackReceived && waitForAck(windowAckTimeout);
+      if(!ackReceived){
+        if(clock.millis() - last_progress > 2000){
+          debug("Transmission canceled: failed to send and ack payload");
+          sendNak(window.baseCount());
+          if(adapt)
+            adapter.failed();
+          radio.stopListening();
+          radio.flush_rx();
+          radio.flush_tx();
+          return;
+        }
+        if(!useAckPayloads) // with ack payloads the receiver may just not have loaded it yet
+          debug("no ack");
+        continue;                     // ask again
+      }
+
+      if(readWindowAck())
+        last_progress = clock.millis();
+      if(adapt)
+        adaptSettings();
+    }
+    if(!useAckPayloads)
+      lingerForAck(); // the next flag would find the receiver still sending the last window ack
+  }
+
+  // reads a window ack (ack frame or ack payload) and reports the acknowledged payloads to the PC
+  // returns true if the window moved
+  bool readWindowAck(){
+    uint8_t received[radioFrameSize];
+    uint8_t size = radio.getDynamicPayloadSize();
+    radio.read(&received, size);
+    if(size != windowAckBytesCount || received[0] != ackFlag)
+      return false;
+
+    unsigned long firstAcked = window.baseCount();
+    uint8_t acked = window.applyAck(received);
+    if(useAckPayloads)
+      window.requeueGaps(); // ack payloads lag behind, newer payloads may not be in it yet
+    else
+      window.requeueUnacked();
+    for(uint8_t i = 0; i < acked; i++)
+      sendAck(firstAcked + i);
+
+    return acked > 0;
+  }
+
+  // sends the data to every node of the group at once (see broadcast in Protocol.h)
+  void transmitBroadcast(uint8_t flag[]){
+    flag[0] |= transferModeBits();
+    unsigned long count = readFlagCount(flag);
+    uint8_t joined = joinGroup(flag);
+    sendGroup(joined);
+    if(joined == 0){
+      debug("no node joined");
+      sendNak(count);
+    }
+    else{
+      sendAck(count);
+      unsigned long startTime = clock.millis();
+      uint8_t done = broadcastBytes(count, joined, parityBlockPayloads(flag[0]));
+      stats.add(txTransferMillis, clock.millis() - startTime);
+      sendGroup(done);
+    }
+    openNode(node); // back to the PC's receiver
+  }
+
+  // sends the broadcast flag to every node of the group, returns the nodes that acked it
+  // the awake nodes join first, a node whose radio doesn't answer is skipped, the others wait in receiveBytes()
+  // meanwhile. The ones that were skipped are woken up from low power listening after that, as long as the join
+  // time lasts, the rest are left to the PC.
+  uint8_t joinGroup(const uint8_t flag[]){
+    uint8_t joined = 0;
+    unsigned long startTime = clock.millis();
+    for(uint8_t pass = 0; pass < 2; pass++){
+      for(uint8_t n = 0; n < maxNodes; n++){
+        unsigned long elapsed = clock.millis() - startTime;
+        if(!(group & (1u << n)) || (joined & (1u << n)) || elapsed >= broadcastJoinTimeout)
+          continue;
+        unsigned long left = broadcastJoinTimeout - elapsed;
+        openNode(n);
+        long session;
+        if(sendFlag(flag, left, pass == 0 ? 0 : wakeStrobeTime < left ? wakeStrobeTime : left, session))
+          joined |= 1u << n;
+      }
+      if(wakeStrobeTime == 0)
+        break;
+    }
+    return joined;
+  }
+
+  // sends every payload once to the broadcast address, and again as long as a node is missing it
+  // the PC gets an ack for every payload once all the nodes have it
+  // *parityBlock* - payloads per parity frame, 0 for none (see Parity.h)
+  // returns the nodes that got all of the data
+  uint8_t broadcastBytes(unsigned long count, uint8_t nodes, uint8_t parityBlock){
+    debug("Broadcasting bytes");
+    window.reset();
+    parity.reset(parityBlock);
+    unsigned long last_progress = clock.millis(); // last time a payload was read or acknowledged by every node
+    for(uint8_t n = 0; n < maxNodes; n++){
+      nodeBase[n] = 0;
+      nodeBitmap[n] = 0;
+      nodeProgress[n] = last_progress;
+    }
+    uint8_t address[radioAddressWidth];
+    broadcastAddress(address);
+
+    while(count > 0 || !window.empty()){
+      if(fillWindow(count))
+        last_progress = clock.millis();
+
+      if(window.empty()){ // waiting for the PC
+        if(clock.millis() - last_progress > 1000){
+          debug("Transmission canceled");
+          return 0;
+        }
+        continue;
+      }
+
+      // every payload that wasn't sent yet, or is missing at any node, goes to all of them
+      radio.openWritingPipe(address);
+      unsigned long payloadCount;
+      while(window.nextDue(payloadCount)){
+        radio.write(window.frame(payloadCount), window.frameLength(payloadCount), true); // no auto-ack
+        stats.add(txFramesSent);
+        window.markSent(payloadCount);
+        bool last = count == 0 && payloadCount + 1 == window.nextCount();
+        if(parity.add(payloadCount, window.frame(payloadCount), window.frameLength(payloadCount) - sequenceBytesCount, last)){
+          radio.write(parity.frame(), parity.frameLength(), true);
+          stats.add(txFramesSent);
+        }
+        if(fillWindow(count)) // don't let the serial buffer overflow while sending the burst
+          last_progress = clock.millis();
+      }
+
+      // the window ack of every node is its NAK, a node that is stuck drops out instead of holding up the others
+      for(uint8_t n = 0; n < maxNodes; n++){
+        if(!(nodes & (1u << n)))
+          continue;
+        if(pollNode(n) || nodeBase[n] == window.nextCount())
+          nodeProgress[n] = clock.millis();
+        else if(clock.millis() - nodeProgress[n] > 2000){
+          debug("node dropped");
+          nodes &= ~(1u << n);
+        }
+      }
+      if(nodes == 0){
+        debug("Transmission canceled: no node left");
+        sendNak(window.baseCount());
+        return 0;
+      }
+      if(applyGroupAck(nodes))
+        last_progress = clock.millis();
+    }
+    return nodes;
+  }
+
+  // asks node *n* for its window ack, returns true if it covers payloads the last one didn't
+  // an unanswered request goes out once more: the data goes to another pipe of the node, so when a multiple
+  // of 4 frames went out since the last request, this one has the same PID and the node drops it as a duplicate
+  bool pollNode(uint8_t n){
+    openNode(n);
+    radio.flush_rx();
+    uint8_t ackRequest = ackRequestFlag;
+    bool answered = false;
+    for(uint8_t attempt = 0; attempt < 2 && !answered; attempt++){
+      if(!write(&ackRequest, sizeof(ackRequest)))
+        return false;
+      answered = useAckPayloads ? radio.available() : waitForAck(windowAckTimeout); // with ack payloads the answer came back with the auto-ack
+    }
+    if(!answered){
+      if(useAckPayloads)
+        stats.add(txAckTimeouts); // waitForAck() counted the others
+      return false;
+    }
+
+    uint8_t received[radioFrameSize];
+    uint8_t size = radio.getDynamicPayloadSize();
+    radio.read(&received, size);
+    if(size != windowAckBytesCount || received[0] != ackFlag)
+      return false;
+
+    unsigned long cumulative = extendSequence(window.baseCount(), readSequence(&received[1]));
+    uint16_t bitmap = ((uint16_t)received[3] << 8) | received[4];
+    if(cumulative - nodeBase[n] > window.nextCount() - nodeBase[n]) // older than the last one (an ack payload lags behind)
+      return false;
+    if(cumulative == nodeBase[n]){
+      bool moved = (bitmap & ~nodeBitmap[n]) != 0;
+      nodeBitmap[n] |= bitmap;
+      return moved;
+    }
+    nodeBase[n] = cumulative;
+    nodeBitmap[n] = bitmap;
+    return true;
+  }
+
+  // true if node *n* has the payload, according to its last window ack
+  bool nodeHas(uint8_t n, unsigned long payloadCount) const {
+    unsigned long offset = payloadCount - window.baseCount();
+    unsigned long nodeOffset = nodeBase[n] - window.baseCount();
+    if(offset < nodeOffset)
+      return true;
+    return offset > nodeOffset && offset - nodeOffset <= 16 && (nodeBitmap[n] & (1u << (offset - nodeOffset - 1)));
+  }
+
+  // acks the payloads every node has, the others are sent again
+  // returns true if the window moved
+  bool applyGroupAck(uint8_t nodes){
+    unsigned long base = window.nextCount(); // oldest payload a node is missing
+    for(uint8_t n = 0; n < maxNodes; n++){
+      if((nodes & (1u << n)) && nodeBase[n] - window.baseCount() < base - window.baseCount())
+        base = nodeBase[n];
+    }
+    uint16_t bitmap = 0;
+    for(uint8_t bit = 0; bit < 16 && base + 1 + bit - window.baseCount() < window.nextCount() - window.baseCount(); bit++){
+      bool everyNode = true;
+      for(uint8_t n = 0; n < maxNodes && everyNode; n++)
+        everyNode = !(nodes & (1u << n)) || nodeHas(n, base + 1 + bit);
+      if(everyNode)
+        bitmap |= 1u << bit;
+    }
+
+    // the same window ack a single receiver would send (SlidingWindow.h)
+    uint8_t groupAck[windowAckBytesCount];
+    groupAck[0] = ackFlag;
+    writeSequence(&groupAck[1], base);
+    groupAck[3] = (uint8_t)(bitmap >> 8);
+    groupAck[4] = (uint8_t)(bitmap & 0xFF);
+
+    unsigned long firstAcked = window.baseCount();
+    uint8_t acked = window.applyAck(groupAck);
+    window.requeueUnacked();
+    for(uint8_t i = 0; i < acked; i++)
+      sendAck(firstAcked + i);
+    return acked > 0;
+  }
+};
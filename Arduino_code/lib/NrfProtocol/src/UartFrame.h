@@ -0,0 +1,168 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "Protocol.h"
+
+// Framing of the UART between the nRF receiver (Receiver.h) and the receiving controller (DisplayReceiver.h).
+//
+// Everything on the UART goes in frames, so a byte that got lost or corrupted only costs its own frame:
+// the reader drops it and picks up again at the next delimiter, instead of reading the rest of the stream
+// shifted (a half written transfer after a timeout, a flipped length, noise after a boot).
+// Frame: [0] - type, [1] - sequence, [2] - payload length, [3,...] - payload, then the CRC-16 (CCITT, big endian)
+// of all of it, COBS encoded (no 0x00 inside the frame) and ended by a 0x00 delimiter.
+// COBS adds one byte to the up to 37 bytes of a frame, a payload of 30 bytes is 37 bytes on the line, 23 % more.
+// A writer whose frame may follow noise on the line (a boot) starts it with a delimiter too, an empty frame is ignored.
+//
+// Receiver to receiving controller, the sequence counts up by one with every frame:
+//  - uartMessageFrame: the first bytes of a transfer that starts a message (wake, link or broadcast transfer),
+//    so the receiving controller knows where the message starts whatever happened to the one before
+//  - uartDataFrame: the bytes that follow
+// Receiving controller to receiver:
+//  - uartReadyFrame: [0,1] - session, the ready frame of the wake handshake (see Protocol.h)
+//  - uartCheckFrame: [0] - result, [1,...,26] - bad blocks, the check frame (see checkFlag in Protocol.h)
+//  - uartCreditFrame: [0] - the next sequence it expects
+//  - uartResendFrame: [0] - the next sequence it expects, the frames from it on have to go out again
+//
+// Backpressure and resends: the receiving controller has room for uartCredits frames in its UART buffer, the receiver
+// sends at most uartCredits frames past the next one the receiving controller expects, and keeps them until they
+// are credited. The receiving controller credits every uartCreditBatch frames it read in order. A frame out of order
+// means the ones before it were dropped, it asks for a resend from the one it expects (go-back-N, at most once
+// every uartCreditRepeat ms) and drops everything until that one comes. While it waits for data it repeats the
+// resend frame every uartCreditRepeat ms, which also makes up for a lost credit or resend frame.
+// A ready frame drops what the receiver still had for the receiving controller, which only sends it between
+// messages, the next message frame starts the sequence over.
+
+const uint8_t uartFrameDelimiter = 0x00;
+const uint8_t uartMessageFrame = 0x01;
+const uint8_t uartDataFrame = 0x02;
+const uint8_t uartReadyFrame = 0x03;
+const uint8_t uartCheckFrame = 0x04;
+const uint8_t uartCreditFrame = 0x05;
+const uint8_t uartResendFrame = 0x06;
+
+const uint8_t uartMaxPayload = 32;                        // displayChunkSize, a radio payload fits
+const uint8_t uartFrameOverhead = 5;                      // type, sequence, length and the CRC
+const uint8_t uartMaxWireBytes = uartMaxPayload + uartFrameOverhead + 2; // the COBS code byte and the delimiter
+const uint8_t uartCredits = 4;                            // a power of two, 148 of the 256 bytes of the ESP32's default UART buffer
+const uint8_t uartCreditBatch = 2;                        // frames read before the credits go back
+const unsigned long uartCreditRepeat = 10;                // ms
+
+
+// bytes on the line for a frame with *size* bytes of payload
+inline uint8_t uartWireBytes(uint8_t size){
+  return size + uartFrameOverhead + 2;
+}
+
+
+// CRC-16/CCITT-FALSE (polynomial 0x1021, starts at 0xFFFF), without a table: about 20 cycles a byte on the AVR
+inline uint16_t crc16Update(uint16_t crc, uint8_t value){
+  uint8_t x = (uint8_t)(crc >> 8) ^ value;
+  x ^= x >> 4;
+  return (uint16_t)((crc << 8) ^ ((uint16_t)x << 12) ^ ((uint16_t)x << 5) ^ x);
+}
+
+
+// COBS encodes *type*, *sequence* and *size* bytes of *payload* with the CRC into *out*, uartMaxWireBytes at most
+// returns the bytes on the line, the delimiter included
+inline uint8_t encodeUartFrame(uint8_t out[], uint8_t type, uint8_t sequence, const uint8_t payload[], uint8_t size){
+  uint8_t length = 1; // out[0] is the first code byte
+  uint8_t code = 0;   // where the current block's code byte goes
+  uint16_t crc = 0xFFFF;
+  uint8_t header[3] = {type, sequence, size};
+  for(uint8_t i = 0; i < (uint8_t)(size + uartFrameOverhead); i++){
+    uint8_t value;
+    if(i < sizeof(header))
+      value = header[i];
+    else if(i < sizeof(header) + size)
+      value = payload[i - sizeof(header)];
+    else
+      value = i == sizeof(header) + size ? (uint8_t)(crc >> 8) : (uint8_t)crc;
+    if(i < sizeof(header) + size)
+      crc = crc16Update(crc, value);
+
+    if(value == 0){ // ends the block, the code byte says where the zero was
+      out[code] = length - code;
+      code = length++;
+    }
+    else
+      out[length++] = value;
+  }
+  out[code] = length - code;
+  out[length++] = uartFrameDelimiter;
+  return length;
+}
+
+
+// Decodes frames from the UART one byte at a time. Anything that doesn't end in a valid frame (a wrong CRC,
+// a length that doesn't match, more bytes than a frame has) is dropped at the next delimiter.
+// A frame stays in the decoder until the next byte is pushed, read its payload before that.
+class UartFrameDecoder {
+public:
+  void reset(){
+    size = 0;
+    blockLeft = 0;
+    blockCode = 0xFF;
+  }
+
+  // returns true once *value* ends a valid frame
+  bool push(uint8_t value){
+    if(value == uartFrameDelimiter){
+      bool valid = size > 0 && size != overflowed && blockLeft == 0 && check();
+      if(!valid && size > 0)
+        badFrames++;
+      if(valid)
+        frames++;
+      reset();
+      return valid;
+    }
+    if(size == overflowed)
+      return false; // waits for the delimiter
+    if(blockLeft == 0){ // a code byte, the block before it ended in a zero unless it was a full one
+      if(blockCode != 0xFF && !append(0))
+        return false;
+      blockCode = value;
+      blockLeft = value - 1;
+      return false;
+    }
+    blockLeft--;
+    append(value);
+    return false;
+  }
+
+  uint8_t type() const { return frame[0]; }
+  uint8_t sequence() const { return frame[1]; }
+  uint8_t payloadSize() const { return frame[2]; }
+  const uint8_t* payload() const { return &frame[3]; }
+
+  unsigned long framesDecoded() const { return frames; }
+  unsigned long framesDropped() const { return badFrames; } // didn't check out
+
+private:
+  static const uint8_t overflowed = 0xFF; // in size, the frame was longer than any valid one
+
+  uint8_t frame[uartMaxPayload + uartFrameOverhead];
+  uint8_t size = 0;        // decoded bytes of the frame so far
+  uint8_t blockLeft = 0;   // bytes left in the current COBS block
+  uint8_t blockCode = 0xFF; // code byte of the current block, the first block has no zero before it
+  unsigned long frames = 0;
+  unsigned long badFrames = 0;
+
+  bool append(uint8_t value){
+    if(size >= sizeof(frame)){
+      size = overflowed;
+      return false;
+    }
+    frame[size++] = value;
+    return true;
+  }
+
+  bool check() const {
+    if(size < uartFrameOverhead || frame[2] != size - uartFrameOverhead)
+      return false;
+    uint16_t crc = 0xFFFF;
+    for(uint8_t i = 0; i < size - 2; i++)
+      crc = crc16Update(crc, frame[i]);
+    return crc == (((uint16_t)frame[size - 2] << 8) | frame[size - 1]);
+  }
+};
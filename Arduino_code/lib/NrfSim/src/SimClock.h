@@ -0,0 +1,27 @@
+#pragma once
+
+#include "SimScheduler.h"
+
+// Clock for the protocol core on a simulated board (see ArduinoClock.h for the real one)
+class SimClock {
+public:
+  explicit SimClock(SimNode& node) : node(node) {}
+
+  simtime_t millisCost = simMicrosecond; // reading the timer isn't free, so busy loops still move time forward
+
+  unsigned long millis(){
+    node.spend(millisCost);
+    return (unsigned long)(node.now() / simMillisecond);
+  }
+
+  unsigned long micros(){
+    node.spend(millisCost);
+    return (unsigned long)(node.now() / simMicrosecond);
+  }
+
+  void delay(unsigned long ms){ node.spend(ms * simMillisecond); }
+  void delayMicroseconds(unsigned int us){ node.spend(us * simMicrosecond); }
+
+private:
+  SimNode& node;
+};
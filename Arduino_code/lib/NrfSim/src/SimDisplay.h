@@ -0,0 +1,137 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include "SimScheduler.h"
+
+// Inkplate look-alike for DisplayReceiver.h, with the same 4 bit framebuffer layout as DMemory4Bit:
+// two pixels per byte, even x in the high nibble
+//
+// With a *refreshNode* (core 0 of the ESP32, see overlapRefresh in Inkplate_serial.ino) display() hands the refresh
+// to that node and returns. Until the next display() the images go into a back buffer, which starts as a copy of the
+// framebuffer, and display() swaps it in once the refresh before it is done.
+class SimDisplay {
+public:
+  SimDisplay(SimNode& node, int width = 800, int height = 600)
+    : node(node), displayWidth(width), displayHeight(height), buffer(width / 2 * height, 0x77) {}
+
+  simtime_t drawPixelCost = 400;          // virtual call, rotation and bounds checks on the ESP32
+  simtime_t refreshTime = 2 * simSecond;  // full 3 bit update of the panel
+  simtime_t backCopyTime = 12 * simMillisecond; // memcpy() of the framebuffer in PSRAM
+  SimNode* refreshNode = NULL;            // refreshes in the background on it, NULL - on the display's node
+  std::function<void()> afterRefresh;     // runs once on the refresh node after the next refresh, before display() can swap
+  bool directAccess = true;               // frameBuffer() hands out the buffer, false draws pixel by pixel
+  const uint8_t* saveBeforeSleep = NULL;  // the shown image the image cache saves before the sleep, drawing cancels it (Inkplate_serial.ino)
+  unsigned long refreshes = 0;            // finished ones
+  unsigned long partialUpdates = 0;
+  simtime_t drawTime = 0;                 // spent in clearDisplay() and drawPixel(), writes to frameBuffer() are free
+
+  bool begin(){ return true; }
+
+  // display.begin() on the other core after a boot, clears the framebuffer and takes *initTime*
+  void start(simtime_t initTime){
+    std::fill(buffer.begin(), buffer.end(), 0x77);
+    backCurrent = false;
+    readyAt = node.now() + initTime;
+  }
+  bool ready() const { return node.now() >= readyAt; }
+  int width() const { return displayWidth; }
+  int height() const { return displayHeight; }
+
+  void clearDisplay(){
+    saveBeforeSleep = NULL;
+    simtime_t cost = displayWidth * displayHeight / 4;
+    node.spend(cost);
+    drawTime += cost;
+    uint8_t* target = directAccess ? frameBuffer() : buffer.data();
+    std::fill(target, target + buffer.size(), 0x77); // white
+  }
+
+  void drawPixel(int16_t x, int16_t y, uint16_t color){
+    saveBeforeSleep = NULL;
+    waitRefresh(); // the refresh reads the framebuffer
+    node.spend(drawPixelCost);
+    drawTime += drawPixelCost;
+    if(x < 0 || y < 0 || x >= displayWidth || y >= displayHeight)
+      return;
+    uint8_t& packed = buffer[y * frameBufferStride() + x / 2];
+    color &= 0x07;
+    packed = x % 2 == 0 ? (packed & 0x0F) | (color << 4) : (packed & 0xF0) | color;
+  }
+
+  void display(){
+    waitRefresh();
+    if(refreshNode == NULL || !directAccess){
+      node.spend(refreshTime);
+      refreshes++;
+      return;
+    }
+    if(backCurrent)
+      buffer.swap(back);
+    backCurrent = false;
+    refreshRunning = true;
+    refreshNode->interrupt(node.now());
+    node.spend(backCopyTime);
+    back = buffer;
+  }
+
+  bool refreshing() const { return refreshRunning; }
+
+  void waitRefresh(){
+    while(refreshRunning)
+      node.spend(simMillisecond);
+  }
+
+  // the loop of the refresh node, *self*
+  void refreshLoop(SimNode& self){
+    if(!refreshRunning){
+      self.sleep();
+      return;
+    }
+    self.spend(refreshTime);
+    refreshes++;
+    std::function<void()> after;
+    after.swap(afterRefresh);
+    if(after)
+      after();
+    refreshRunning = false;
+  }
+
+  // 3 bit mode has no partial refresh, like InkplateScreen in Inkplate_serial.ino
+  void partialUpdate(){
+    partialUpdates++;
+    display();
+  }
+
+  // the back buffer once a refresh started, until display() swaps it in
+  uint8_t* frameBuffer(){
+    saveBeforeSleep = NULL; // whoever asks may draw into it
+    if(!directAccess)
+      return NULL;
+    if(refreshNode != NULL && (refreshRunning || backCurrent)){
+      backCurrent = true;
+      return back.data();
+    }
+    return buffer.data();
+  }
+  const uint8_t* panel() const { return buffer.data(); } // what the last refresh showed, or shows
+  unsigned int frameBufferStride() const { return displayWidth / 2; }
+
+  uint8_t pixel(int x, int y) const {
+    uint8_t packed = buffer[y * frameBufferStride() + x / 2];
+    return x % 2 == 0 ? packed >> 4 : packed & 0x0F;
+  }
+
+private:
+  SimNode& node;
+  int displayWidth;
+  int displayHeight;
+  std::vector<uint8_t> buffer;
+  std::vector<uint8_t> back;
+  bool backCurrent = false;    // back holds the newer image
+  bool refreshRunning = false;
+  simtime_t readyAt = 0;
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "SimScheduler.h"
+
+// The SD card behind the image cache (ImageCache.h, SdImageStore in Inkplate_serial.ino): a file per slot,
+// kept over a deep sleep. Reading and writing take the time the Inkplate's SPI bus does, on *node* (loop())
+// or *otherCore* (the refresh task, which saves the images with overlapRefresh), whichever uses it, and one
+// waits for the other (sdLock in Inkplate_serial.ino).
+class SimImageStore {
+public:
+  SimImageStore(const SimScheduler& scheduler, SimNode& node, SimNode& otherCore)
+    : scheduler(scheduler), node(node), otherCore(otherCore) {}
+
+  simtime_t accessTime = 2 * simMillisecond; // opening the file and seeking, the card's latency
+  simtime_t readByteTime = 700;              // ~1.4 MB/s, the CRC of ImageCache::load() included
+  simtime_t writeByteTime = 1400;            // ~0.7 MB/s
+  bool timed = true;                         // false while the time is part of displayInitTime (startDisplay() reads the headers)
+  unsigned long bytesRead = 0, bytesWritten = 0;
+
+  bool read(uint8_t slot, unsigned long offset, uint8_t data[], unsigned long size){
+    if(timed)
+      use(accessTime + size * readByteTime);
+    if(slot >= files.size() || offset + size > files[slot].size())
+      return false;
+    memcpy(data, &files[slot][offset], size);
+    bytesRead += size;
+    return true;
+  }
+
+  bool write(uint8_t slot, unsigned long offset, const uint8_t data[], unsigned long size){
+    use(accessTime + size * writeByteTime);
+    if(slot >= files.size())
+      files.resize(slot + 1);
+    if(offset > files[slot].size())
+      return false; // SdFile::seekSet() past the end
+    if(offset + size > files[slot].size())
+      files[slot].resize(offset + size);
+    memcpy(&files[slot][offset], data, size);
+    bytesWritten += size;
+    return true;
+  }
+
+private:
+  const SimScheduler& scheduler;
+  SimNode& node;
+  SimNode& otherCore;
+  simtime_t freeAt = 0;
+  std::vector<std::vector<uint8_t>> files;
+
+  void use(simtime_t cost){
+    SimNode& self = scheduler.current() == &otherCore ? otherCore : node;
+    freeAt = std::max(self.now(), freeAt) + cost;
+    self.waitUntil(freeAt);
+  }
+};
@@ -0,0 +1,735 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <deque>
+#include <functional>
+#include <utility>
+#include <vector>
+#include <string>
+#include <Protocol.h>
+#include <SlidingWindow.h>
+#include <Compression.h>
+#include <Parity.h>
+#include <Crc32.h>
+#include <LinkStats.h>
+#include "SimSerial.h"
+
+// The PC side (PC_code/.../Program.cs) on a simulated node: SendInitFlag, SendPayloads,
+// SendByteArray, SendImage3Bit, SendImage3BitUpdate, the link commands (OpenLink, KeepLink, CloseLink)
+// the nodes (SelectNode, SendToNodes, Broadcast), the end to end checks (CheckTransfer, RepairRects) and QueryStatus,
+// with the acks read the way ReadFromArduino does.
+// Keep it in step with Program.cs when the protocol changes.
+
+const uint8_t pcDisplayBytesFlag = 0x01;     // IPBytesFlag
+const uint8_t pcDisplay3BitImageFlag = 0x04; // IPImage3BitFlag
+const uint8_t pcDisplayRectsFlag = 0x05;     // IPRectsFlag
+const uint8_t pcDisplayCompressed3BitImageFlag = 0x06; // IPCompressedImage3BitFlag
+const uint8_t pcDisplayDense3BitImageFlag = 0x08; // IPDense3BitImageFlag
+const uint8_t pcDisplayCachedImageFlag = 0x09; // IPCachedImageFlag
+const int rectTileWidth = 32;                // pixels, the diff is done in tiles of this size
+const int rectTileHeight = 8;
+const uint8_t pcDisplayCheckedBit = 0x80;   // IPCheckedBit, see displayCheckedBit in DisplayReceiver.h
+const int pcCheckBlockRows = 8;             // CheckBlockRows
+const int pcMaxImageBlocks = 256;
+const int maxRepairRounds = 3;              // MaxRepairRounds
+const long pcNak = -1;
+
+class SimPc {
+public:
+  SimPc(SimNode& node, SimSerial& port) : node(node), port(port) {}
+
+  unsigned int credits = windowSize + ingestPayloads; // payloads written without an ack, credits in Program.cs
+  simtime_t ackTimeout = 2 * simSecond; // SendInitFlag
+  simtime_t linkAckWait = 4 * simSecond; // SendInitFlag of a link message, the Inkplate may still be refreshing
+  simtime_t listenWait = listenStrobeTime() * simMillisecond; // more for a wake flag, the receiver may be in low power listening
+  simtime_t linkMargin = 500 * simMillisecond; // a link this close to timing out is kept alive before the next message
+  bool verbose = false;                 // print the transmitter's debug messages
+  simtime_t pollInterval = 20 * simMicrosecond; // the DataReceived handler doesn't run for every byte
+  std::deque<simtime_t> sendTimes;      // when every payload of the last transfer was written to the transmitter
+  std::deque<simtime_t> ackTimes;       // when every payload ack of the last transfer arrived
+  bool compressImages = true;           // send 3 bit images compressed when that makes them smaller (compressImages in Program.cs)
+  bool denseImages = true;              // send the others 8 pixels in 3 bytes (denseImages in Program.cs, PackedImage.h)
+  uint8_t parityBlock = 0;              // payloads per parity frame of a broadcast, 0, 2, 4 or 8 (see Parity.h)
+  bool checkImages = true;              // check images and updates end to end, repair the bad blocks (checkImages in Program.cs)
+  unsigned long lastRepairBytes = 0;    // bytes sent again after the checks of the last sendImage3Bit() or update
+  unsigned long lastImageBytes = 0;     // bytes the last sendImage3Bit() sent, after compression
+  unsigned long lastUpdateBytes = 0;    // bytes the last sendImage3BitUpdate() sent, 0 if nothing changed
+  bool cacheImages = true;              // ask for a whole image from the Inkplate's cache first (cacheImages in Program.cs, ImageCache.h)
+  unsigned long cacheHits = 0, cacheMisses = 0;
+  unsigned long cacheBytesSaved = 0;    // the image bytes the hits didn't send, uncompressed
+  int displayHeight = 600, displayWidth = 800; // E_INK_HEIGHT, E_INK_WIDTH, the cache only keeps images of that size
+  long displaySession = -1;             // the Inkplate's session from the last wake (see Protocol.h)
+  simtime_t wakeAckTime = 0;            // how long the last wake flag took to be acked
+  unsigned long linkTimeout = 0;        // ms of the open link (see Protocol.h), 0 without one
+  uint8_t selectedNode = 0;             // the receiver the transfers go to (SelectNode)
+  simtime_t nodeRetryDelay = 500 * simMillisecond; // SendToNodes tries a node that didn't answer again after this
+  simtime_t nodeDone[maxNodes] = {0};   // when SendToNodes finished with every node
+
+  bool sendByteArray(const uint8_t data[], unsigned long length){
+    uint8_t inkplateFlag[flagBytesCount];
+    writeFlag(inkplateFlag, pcDisplayBytesFlag, length);
+    return sendWithInkplateFlag(inkplateFlag, data, length);
+  }
+
+  // *woken* - the wake flag already went out (sendImage3BitUpdate)
+  bool sendImage3Bit(const uint8_t image[], int height, int width, bool woken = false){
+    unsigned long length = (unsigned long)height * width / 2;
+    lastRepairBytes = 0;
+    bool cached = false;
+    if(cacheImages && checkImages && height == displayHeight && width == displayWidth){ // only whole screens are cached
+      cached = showCachedImage(image, height, width, woken);
+      if(cached){
+        lastImageBytes = 0;
+        cacheHits++;
+        cacheBytesSaved += denseImages ? ((unsigned long)height * width + 7) / 8 * 3 : length;
+      }
+      else{
+        cacheMisses++;
+        woken = false; // the image is a message of its own
+      }
+    }
+
+    // compressed and packed once it's clear the image goes out
+    std::vector<uint8_t> compressed, raw;
+    if(!cached && compressImages)
+      compressed = compressImage3Bit(image, height, width);
+    if(!cached)
+      raw = rawImage3Bit(image, height, width);
+    for(int attempt = 0; !cached; attempt++){
+      bool sent;
+      // a flipped bit spoils the rest of a compressed image, one sent again goes out raw so its blocks can be repaired
+      if(!compressed.empty() && compressed.size() < raw.size() && attempt == 0){
+        uint8_t inkplateFlag[flagBytesCount];
+        writeFlag(inkplateFlag, pcDisplayCompressed3BitImageFlag, compressed.size());
+        lastImageBytes = compressed.size();
+        sent = sendCheckedMessage(inkplateFlag, compressed.data(), compressed.size(), woken, image, height, width);
+      }
+      else{
+        uint8_t inkplateFlag[flagBytesCount] = {denseImages ? pcDisplayDense3BitImageFlag : pcDisplay3BitImageFlag,
+          (uint8_t)(height >> 8), (uint8_t)height, (uint8_t)(width >> 8), (uint8_t)width};
+        lastImageBytes = raw.size();
+        sent = sendCheckedMessage(inkplateFlag, raw.data(), raw.size(), woken, image, height, width);
+      }
+      if(!sent)
+        return false;
+      if(!checkImages)
+        break;
+
+      std::vector<uint8_t> bad;
+      if(checkTransfer(bad) && (bad.empty() || repairBlocks(image, height, width, bad)))
+        break;
+      if(attempt > 0){
+        log("Image still not intact");
+        return false;
+      }
+      log("Image not intact, sending it again");
+      lastRepairBytes += lastImageBytes;
+      woken = false;
+    }
+
+    lastFrame.assign(image, image + length);
+    lastFrameHeight = height;
+    lastFrameWidth = width;
+    lastFrameSession = displaySession;
+    return true;
+  }
+
+  // SendImage3BitUpdate: only the tiles that changed since the last acknowledged image,
+  // the whole image if the Inkplate restarted since then (found out after the rectangles on a link)
+  bool sendImage3BitUpdate(const uint8_t image[], int height, int width){
+    if(lastFrame.empty() || lastFrameHeight != height || lastFrameWidth != width || width % 2 != 0){
+      bool sent = sendImage3Bit(image, height, width);
+      lastUpdateBytes = lastImageBytes;
+      return sent;
+    }
+
+    std::vector<uint8_t> rects = encodeRects(lastFrame.data(), image, height, width);
+    if(rects.empty()){
+      lastUpdateBytes = 0;
+      return true; // nothing changed
+    }
+    if(rects.size() >= lastFrame.size()){
+      bool sent = sendImage3Bit(image, height, width);
+      lastUpdateBytes = lastImageBytes;
+      return sent;
+    }
+
+    if(linkTimeout == 0){
+      if(!wakeDisplay())
+        return false;
+      if(displaySession != lastFrameSession){ // the framebuffer the rectangles go into is gone
+        log("Inkplate restarted, sending the whole image");
+        bool sent = sendImage3Bit(image, height, width, true);
+        lastUpdateBytes = lastImageBytes;
+        return sent;
+      }
+    }
+    lastUpdateBytes = rects.size();
+
+    uint8_t inkplateFlag[flagBytesCount];
+    writeFlag(inkplateFlag, pcDisplayRectsFlag, rects.size());
+    lastRepairBytes = 0;
+    if(!sendCheckedMessage(inkplateFlag, rects.data(), rects.size(), true))
+      return false;
+    std::vector<uint8_t> bad;
+    if(checkImages && (!checkTransfer(bad) || (!bad.empty() && !repairRects(rects, bad)))){
+      log("Update not intact, sending the whole image");
+      unsigned long repaired = lastRepairBytes;
+      bool sent = sendImage3Bit(image, height, width);
+      lastRepairBytes += repaired + lastImageBytes;
+      return sent;
+    }
+    if(displaySession != lastFrameSession){ // on a link the session comes with the message, the rectangles went into an empty framebuffer
+      log("Inkplate restarted, sending the whole image");
+      bool sent = sendImage3Bit(image, height, width);
+      lastUpdateBytes += lastImageBytes;
+      return sent;
+    }
+
+    lastFrame.assign(image, image + lastFrame.size());
+    return true;
+  }
+
+  // OpenLink: keeps the receiver and the Inkplate awake until closeLink(), or *timeout* ms without a message
+  // QueryStatus: the counters of the transmitter or of the current node's receiver (see LinkStats.h)
+  bool queryStatus(unsigned long source, std::vector<uint32_t>& counters){
+    acks.clear();
+    status.clear();
+    if(!sendInitFlag(source, statusFlag))
+      return false;
+    counters.clear();
+    for(size_t i = 0; i + 4 <= status.size(); i += 4)
+      counters.push_back(((uint32_t)status[i] << 24) | ((uint32_t)status[i + 1] << 16) | ((uint32_t)status[i + 2] << 8) | status[i + 3]);
+    return true;
+  }
+
+  bool openLink(unsigned long timeout){
+    acks.clear();
+    if(!sendInitFlag(timeout, openLinkFlag))
+      return false;
+    linkTimeout = timeout;
+    linkUsed = node.now();
+    return true;
+  }
+
+  // KeepLink: for a pause longer than the link timeout, opens the link again if it timed out
+  bool keepLink(){
+    acks.clear();
+    if(linkTimeout == 0 || !sendInitFlag(linkTimeout, keepLinkFlag))
+      return false;
+    linkUsed = node.now();
+    return true;
+  }
+
+  // CloseLink: the boards go back to sleep after their usual timeouts
+  bool closeLink(){
+    acks.clear();
+    linkTimeout = 0;
+    return sendInitFlag(0, closeLinkFlag);
+  }
+
+  // SelectNode: the following transfers go to *target*'s receiver, the last image and the link belong to the old one
+  bool selectNode(uint8_t target){
+    acks.clear();
+    if(!sendInitFlag(target, nodeFlag))
+      return false;
+    if(target != selectedNode){
+      selectedNode = target;
+      lastFrame.clear();
+      displaySession = -1;
+      linkTimeout = 0; // times out on its own
+    }
+    return true;
+  }
+
+  // SendToNodes: runs *job* for every node in *nodes* (a bitmask), taking turns. A node whose receiver doesn't
+  // answer (asleep, out of range, the transmitter naks right away) is tried again after nodeRetryDelay,
+  // the others go on meanwhile. Returns the nodes the job succeeded for before *deadline*.
+  uint8_t sendToNodes(uint8_t nodes, std::function<bool()> job, simtime_t deadline){
+    uint8_t done = 0;
+    simtime_t retryAt[maxNodes] = {0};
+    while((done & nodes) != nodes && node.now() < deadline){
+      bool tried = false;
+      for(uint8_t n = 0; n < maxNodes; n++){
+        if(!(nodes & (1u << n)) || (done & (1u << n)) || node.now() < retryAt[n])
+          continue;
+        tried = true;
+        if(selectNode(n) && job()){
+          done |= 1u << n;
+          nodeDone[n] = node.now();
+        }
+        else{
+          retryAt[n] = node.now() + nodeRetryDelay;
+        }
+      }
+      if(!tried)
+        node.spend(simMillisecond); // every node left is waiting for its retry
+    }
+    return done;
+  }
+
+  // Broadcast: the Inkplate flag and the data to every node in *nodes* at once (see broadcast in Protocol.h)
+  // returns the nodes that got all of it
+  uint8_t broadcast(uint8_t nodes, const uint8_t inkplateFlag[], const uint8_t data[], unsigned long length){
+    std::vector<uint8_t> message(inkplateFlag, inkplateFlag + flagBytesCount);
+    message.insert(message.end(), data, data + length);
+    acks.clear();
+    if(!sendInitFlag(nodes, groupFlag))
+      return 0;
+    acks.clear();
+    if(!sendInitFlag(message.size(), transmitBroadcastFlag | parityFlagBits(parityBlock)))
+      return 0;
+    groupReceived = false;
+    if(!sendPayloads(message.data(), message.size()))
+      return 0;
+
+    simtime_t start = node.now();
+    while(!groupReceived){ // the nodes that got all of it come after the last ack
+      readFromArduino();
+      if(node.now() - start > ackTimeout)
+        return 0;
+    }
+    return group;
+  }
+
+  // BroadcastImage3Bit: one broadcast to *nodes*, the ones that missed it get the image on their own (SendToNodes)
+  // returns the nodes that got it before *deadline*
+  uint8_t broadcastImage3Bit(uint8_t nodes, const uint8_t image[], int height, int width, simtime_t deadline){
+    std::vector<uint8_t> compressed;
+    if(compressImages)
+      compressed = compressImage3Bit(image, height, width);
+    std::vector<uint8_t> raw = rawImage3Bit(image, height, width);
+
+    uint8_t done;
+    if(!compressed.empty() && compressed.size() < raw.size()){
+      uint8_t inkplateFlag[flagBytesCount];
+      writeFlag(inkplateFlag, pcDisplayCompressed3BitImageFlag, compressed.size());
+      done = broadcast(nodes, inkplateFlag, compressed.data(), compressed.size());
+    }
+    else{
+      uint8_t inkplateFlag[flagBytesCount] = {denseImages ? pcDisplayDense3BitImageFlag : pcDisplay3BitImageFlag,
+        (uint8_t)(height >> 8), (uint8_t)height, (uint8_t)(width >> 8), (uint8_t)width};
+      done = broadcast(nodes, inkplateFlag, raw.data(), raw.size());
+    }
+    for(uint8_t n = 0; n < maxNodes; n++){
+      if(done & (1u << n))
+        nodeDone[n] = node.now();
+    }
+    if((done & nodes) == nodes)
+      return done;
+    return done | sendToNodes(nodes & ~done, [&](){ return sendImage3Bit(image, height, width); }, deadline);
+  }
+
+  // EncodeRects: rectangles covering every tile that differs between the two packed 3 bit images
+  // (see displayRectsFlag in DisplayReceiver.h), dirty tiles next to each other in a row become
+  // one rectangle, rows with the same span are merged
+  static std::vector<uint8_t> encodeRects(const uint8_t previous[], const uint8_t image[], int height, int width){
+    struct Rect { int x, y, width, height; };
+    int rowBytes = width / 2;
+    int tileBytes = rectTileWidth / 2;
+    int tilesPerRow = (rowBytes + tileBytes - 1) / tileBytes;
+    std::vector<Rect> rects, open; // open - rectangles the next band can extend
+
+    for(int bandY = 0; bandY < height; bandY += rectTileHeight){
+      int bandHeight = height - bandY < rectTileHeight ? height - bandY : rectTileHeight;
+      std::vector<Rect> stillOpen;
+      int runStart = -1;
+      for(int tile = 0; tile <= tilesPerRow; tile++){
+        bool dirty = false;
+        if(tile < tilesPerRow){
+          int offset = tile * tileBytes;
+          int count = rowBytes - offset < tileBytes ? rowBytes - offset : tileBytes;
+          for(int row = bandY; !dirty && row < bandY + bandHeight; row++)
+            dirty = memcmp(&previous[row * rowBytes + offset], &image[row * rowBytes + offset], count) != 0;
+        }
+        if(dirty && runStart < 0){
+          runStart = tile;
+        }
+        else if(!dirty && runStart >= 0){
+          int x = runStart * rectTileWidth;
+          int runWidth = (tile * rectTileWidth < width ? tile * rectTileWidth : width) - x;
+          Rect rect = {x, bandY, runWidth, bandHeight};
+          for(size_t i = 0; i < open.size(); i++){
+            if(open[i].x == x && open[i].width == runWidth){
+              rect = open[i];
+              rect.height += bandHeight;
+              open.erase(open.begin() + i);
+              break;
+            }
+          }
+          stillOpen.push_back(rect);
+          runStart = -1;
+        }
+      }
+      rects.insert(rects.end(), open.begin(), open.end()); // not extended by this band
+      open = stillOpen;
+    }
+    rects.insert(rects.end(), open.begin(), open.end());
+
+    std::vector<uint8_t> result;
+    for(const Rect& rect : rects){
+      int values[] = {rect.x, rect.y, rect.width, rect.height};
+      for(int value : values){
+        result.push_back((uint8_t)(value >> 8));
+        result.push_back((uint8_t)value);
+      }
+      for(int y = rect.y; y < rect.y + rect.height; y++){
+        const uint8_t* row = &image[y * rowBytes + rect.x / 2];
+        result.insert(result.end(), row, row + rect.width / 2);
+      }
+    }
+    return result;
+  }
+
+  // CompressImage3Bit: height and width, then the compressed pixels (see displayCompressed3BitImageFlag in DisplayReceiver.h)
+  std::vector<uint8_t> compressImage3Bit(const uint8_t image[], int height, int width){
+    unsigned long length = (unsigned long)height * width / 2;
+    std::vector<uint8_t> result(4 + compressedBound(length));
+    result[0] = (uint8_t)(height >> 8);
+    result[1] = (uint8_t)height;
+    result[2] = (uint8_t)(width >> 8);
+    result[3] = (uint8_t)width;
+    result.resize(4 + compressor.compress(image, length, &result[4]));
+    return result;
+  }
+
+  // the pixels of an uncompressed image as they go out, dense (ConvertBitmap3bitToDense) or packed as they are
+  std::vector<uint8_t> rawImage3Bit(const uint8_t image[], int height, int width){
+    unsigned long pixels = (unsigned long)height * width;
+    if(!denseImages)
+      return std::vector<uint8_t>(image, image + pixels / 2);
+    std::vector<uint8_t> dense((pixels + 7) / 8 * 3);
+    for(unsigned long i = 0; i < pixels / 2; i += 4){
+      uint32_t bits = 0;
+      for(unsigned long j = i; j < i + 4; j++){
+        uint8_t packed = j < pixels / 2 ? image[j] : 0;
+        bits = (bits << 6) | ((packed >> 1) & 0x38) | (packed & 0x07);
+      }
+      dense[i / 4 * 3] = (uint8_t)(bits >> 16);
+      dense[i / 4 * 3 + 1] = (uint8_t)(bits >> 8);
+      dense[i / 4 * 3 + 2] = (uint8_t)bits;
+    }
+    return dense;
+  }
+
+  bool sendInitFlag(unsigned long byteCount, uint8_t type = transmitBytesFlag){
+    uint8_t flag[flagBytesCount];
+    writeFlag(flag, type, byteCount);
+    port.write(flag, sizeof(flag));
+
+    simtime_t timeout = type == transmitLinkBytesFlag || (type & ~parityBits) == transmitBroadcastFlag ? linkAckWait : ackTimeout;
+    if(type == transmitBytesWakeFlag || type == transmitLinkBytesFlag || type == openLinkFlag || type == keepLinkFlag)
+      timeout += listenWait;
+    simtime_t start = node.now();
+    while(acks.empty()){
+      readFromArduino();
+      if(node.now() - start > timeout){
+        log("No ack received");
+        return false;
+      }
+    }
+    if(acks.front() == (long)byteCount){
+      acks.pop_front();
+      return true;
+    }
+    return false;
+  }
+
+  // streams the data to the transmitter, keeping up to *credits* payloads in flight
+  bool sendPayloads(const uint8_t data[], unsigned long length){
+    unsigned long payloadCount = 0; // next payload to be acked
+    unsigned long sentCount = 0;    // payloads written to the transmitter
+    unsigned long totalPayloads = (length + payloadSize - 1) / payloadSize;
+    sendTimes.clear();
+    ackTimes.clear();
+    transferCrc.reset();
+    transferCrc.update(data, length);
+    while(payloadCount < totalPayloads){
+      while(sentCount < totalPayloads && sentCount - payloadCount < credits){
+        unsigned long offset = sentCount * payloadSize;
+        unsigned long bytesToSend = length - offset < payloadSize ? length - offset : payloadSize;
+        sendTimes.push_back(node.now());
+        port.write(&data[offset], bytesToSend);
+        sentCount++;
+      }
+
+      // wait for ack and check if it's correct
+      while(acks.empty())
+        readFromArduino();
+      long ack = acks.front();
+      acks.pop_front();
+
+      if(ack == (long)payloadCount){
+        ackTimes.push_back(node.now());
+        payloadCount++;
+      }
+      else if(ack == pcNak){
+        return false;
+      }
+      else{
+        char message[64];
+        snprintf(message, sizeof(message), "Incorrect ack | Expected: %lu, Received: %ld", payloadCount, ack);
+        log(message);
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  SimNode& node;
+  SimSerial& port;
+  std::deque<long> acks;
+  std::string line;
+  Crc32 transferCrc;            // of the data of the last transfer, for checkFlag
+  std::vector<uint8_t> checkBlocks; // bad blocks from the transmitter before the ack of a check
+  std::vector<uint8_t> lastFrame; // last image the transmitter acknowledged
+  Compressor compressor;
+  int lastFrameHeight = 0;
+  int lastFrameWidth = 0;
+  long lastFrameSession = -1;
+  simtime_t linkUsed = 0; // when the link last got a message or was kept alive
+  uint8_t group = 0;        // nodes from the transmitter's last group message
+  bool groupReceived = false;
+  std::vector<uint8_t> status; // counters from the transmitter's last status message
+
+  void log(const char* message){
+    if(verbose)
+      printf("[%10.3f ms] pc: %s\n", node.now() / (double)simMillisecond, message);
+  }
+
+  // the message with a CRC trailer if checkImages (see displayCheckedBit in DisplayReceiver.h)
+  // *image* - the packed pixels of a whole image, the CRC of each of its blocks goes in the trailer too,
+  // rectangles get the CRC of each rectangle
+  bool sendCheckedMessage(const uint8_t inkplateFlag[], const uint8_t data[], unsigned long length, bool woken,
+                          const uint8_t image[] = NULL, int height = 0, int width = 0){
+    if(!checkImages)
+      return sendMessage(inkplateFlag, data, length, woken);
+
+    uint8_t checkedFlag[flagBytesCount];
+    memcpy(checkedFlag, inkplateFlag, flagBytesCount);
+    checkedFlag[0] |= pcDisplayCheckedBit;
+    Crc32 crc;
+    crc.update(checkedFlag, flagBytesCount);
+    crc.update(data, length);
+    std::vector<uint8_t> message(data, data + length);
+    appendCrc(message, crc.value());
+
+    int blocks = (height + pcCheckBlockRows - 1) / pcCheckBlockRows;
+    if(image != NULL && blocks <= pcMaxImageBlocks){
+      unsigned long blockBytes = (unsigned long)width * pcCheckBlockRows / 2;
+      unsigned long imageBytes = (unsigned long)height * width / 2;
+      for(unsigned long offset = 0; offset < imageBytes; offset += blockBytes){
+        crc.reset();
+        crc.update(&image[offset], imageBytes - offset < blockBytes ? imageBytes - offset : blockBytes);
+        appendCrc(message, crc.value());
+      }
+    }
+    if(inkplateFlag[0] == pcDisplayRectsFlag){
+      std::vector<std::pair<unsigned long, unsigned long>> rects = splitRects(data, length);
+      for(size_t i = 0; i < rects.size() && i < (size_t)pcMaxImageBlocks; i++){
+        crc.reset();
+        crc.update(&data[rects[i].first + 8], rects[i].second - 8);
+        appendCrc(message, crc.value());
+      }
+    }
+    return sendMessage(checkedFlag, message.data(), message.size(), woken);
+  }
+
+  static void appendCrc(std::vector<uint8_t>& message, uint32_t crc){
+    for(int shift = 24; shift >= 0; shift -= 8)
+      message.push_back((uint8_t)(crc >> shift));
+  }
+
+  // CheckTransfer: asks if the last transfer arrived intact, *bad* gets the blocks of the image to send again
+  // returns false if the message has to be sent whole again
+  bool checkTransfer(std::vector<uint8_t>& bad){
+    acks.clear();
+    checkBlocks.clear();
+    if(!sendInitFlag(transferCrc.value(), checkFlag))
+      return false;
+    bad = checkBlocks;
+    return true;
+  }
+
+  // ShowCachedImage: asks the Inkplate to show *image* from its cache (see displayCachedImageFlag in DisplayReceiver.h)
+  // returns false if it doesn't have it, or the message didn't get through, the whole image goes out then
+  bool showCachedImage(const uint8_t image[], int height, int width, bool woken){
+    Crc32 crc;
+    crc.update(image, (unsigned long)height * width / 2);
+    uint8_t inkplateFlag[flagBytesCount];
+    writeFlag(inkplateFlag, pcDisplayCachedImageFlag, crc.value());
+    std::vector<uint8_t> bad;
+    return sendCheckedMessage(inkplateFlag, NULL, 0, woken) && checkTransfer(bad) && bad.empty();
+  }
+
+  // offset and size of every rectangle in an encodeRects() message, header included
+  static std::vector<std::pair<unsigned long, unsigned long>> splitRects(const uint8_t rects[], unsigned long length){
+    std::vector<std::pair<unsigned long, unsigned long>> result;
+    unsigned long offset = 0;
+    while(offset + 8 <= length){
+      unsigned long width = (rects[offset + 4] << 8) | rects[offset + 5];
+      unsigned long height = (rects[offset + 6] << 8) | rects[offset + 7];
+      unsigned long size = 8 + width * height / 2;
+      result.push_back(std::make_pair(offset, size));
+      offset += size;
+    }
+    return result;
+  }
+
+  // RepairRects: sends the *bad* rectangles of *rects* again until all of them check out, maxRepairRounds at most
+  bool repairRects(std::vector<uint8_t> rects, std::vector<uint8_t> bad){
+    for(int round = 0; round < maxRepairRounds; round++){
+      std::vector<std::pair<unsigned long, unsigned long>> parts = splitRects(rects.data(), rects.size());
+      std::vector<uint8_t> repair;
+      for(uint8_t index : bad){
+        if(index >= parts.size())
+          return false;
+        repair.insert(repair.end(), &rects[parts[index].first], &rects[parts[index].first + parts[index].second]);
+      }
+      char message[64];
+      snprintf(message, sizeof(message), "Repairing %u rectangles", (unsigned)bad.size());
+      log(message);
+
+      uint8_t inkplateFlag[flagBytesCount];
+      writeFlag(inkplateFlag, pcDisplayRectsFlag, repair.size());
+      lastRepairBytes += repair.size();
+      if(!sendCheckedMessage(inkplateFlag, repair.data(), repair.size(), false))
+        return false;
+      size_t repaired = bad.size();
+      rects = repair;
+      if(checkTransfer(bad) && bad.empty())
+        return true;
+      if(bad.empty()){ // the whole repair again
+        for(size_t i = 0; i < repaired; i++)
+          bad.push_back((uint8_t)i);
+      }
+    }
+    return false;
+  }
+
+  // RepairBlocks: the bad blocks of the image as rectangles
+  bool repairBlocks(const uint8_t image[], int height, int width, const std::vector<uint8_t>& bad){
+    std::vector<uint8_t> rects;
+    std::vector<uint8_t> all;
+    int rowBytes = width / 2;
+    for(uint8_t block : bad){
+      int y = block * pcCheckBlockRows;
+      int rows = height - y < pcCheckBlockRows ? height - y : pcCheckBlockRows;
+      if(rows <= 0)
+        return false;
+      int values[] = {0, y, width, rows};
+      for(int value : values){
+        rects.push_back((uint8_t)(value >> 8));
+        rects.push_back((uint8_t)value);
+      }
+      rects.insert(rects.end(), &image[y * rowBytes], &image[(y + rows) * rowBytes]);
+      all.push_back((uint8_t)all.size());
+    }
+    return repairRects(rects, all);
+  }
+
+  bool sendWithInkplateFlag(const uint8_t inkplateFlag[], const uint8_t data[], unsigned long length){
+    return sendMessage(inkplateFlag, data, length);
+  }
+
+  // one transfer on an open link, otherwise a wake flag with the Inkplate flag and then the data
+  // *woken* - the wake flag already went out
+  bool sendMessage(const uint8_t inkplateFlag[], const uint8_t data[], unsigned long length, bool woken = false){
+    if(linkTimeout > 0)
+      return sendLinkMessage(inkplateFlag, data, length);
+    return (woken || wakeDisplay()) && sendToDisplay(inkplateFlag, data, length);
+  }
+
+  bool sendLinkMessage(const uint8_t inkplateFlag[], const uint8_t data[], unsigned long length){
+    if(node.now() - linkUsed + linkMargin > linkTimeout * simMillisecond && !keepLink())
+      return false;
+
+    std::vector<uint8_t> message(inkplateFlag, inkplateFlag + flagBytesCount);
+    message.insert(message.end(), data, data + length);
+    acks.clear(); // acks still queued belong to the last transfer
+    simtime_t start = node.now();
+    if(!sendInitFlag(message.size(), transmitLinkBytesFlag))
+      return false;
+    wakeAckTime = node.now() - start;
+    if(!sendPayloads(message.data(), message.size()))
+      return false;
+    linkUsed = node.now();
+    return true;
+  }
+
+  // establish communication with receiving controller (send flag), the Inkplate flag is the wake transfer's data
+  bool wakeDisplay(){
+    acks.clear(); // acks still queued belong to the last transfer
+    simtime_t start = node.now();
+    if(!sendInitFlag(flagBytesCount, transmitBytesWakeFlag))
+      return false;
+    wakeAckTime = node.now() - start;
+    return true;
+  }
+
+  bool sendToDisplay(const uint8_t inkplateFlag[], const uint8_t data[], unsigned long length){
+    // the flag goes out as one payload, wait for its ack so a late one isn't taken for the ack of the next init flag
+    if(!sendPayloads(inkplateFlag, flagBytesCount))
+      return false;
+
+    // start sending data
+    acks.clear();
+    if(!sendInitFlag(length))
+      return false;
+
+    return sendPayloads(data, length);
+  }
+
+  void readFromArduino(){
+    if(port.available() < (int)flagBytesCount){
+      node.spend(pollInterval);
+      return;
+    }
+
+    uint8_t flag[flagBytesCount];
+    port.readBytes(flag, sizeof(flag));
+    if(flag[0] == stringFlag){
+      line.clear();
+      int c;
+      while((c = port.read()) != '\n'){
+        if(c >= 0 && c != '\r')
+          line += (char)c;
+        else if(c < 0)
+          node.spend(10 * simMicrosecond);
+      }
+      log(("Transmitter: " + line).c_str());
+    }
+    else if(flag[0] == ackFlag){
+      acks.push_back((long)readFlagCount(flag)); // save ack in queue
+    }
+    else if(flag[0] == sessionFlag){
+      displaySession = (long)readFlagCount(flag);
+    }
+    else if(flag[0] == groupFlag){
+      group = (uint8_t)readFlagCount(flag);
+      groupReceived = true;
+    }
+    else if(flag[0] == checkFlag){
+      checkBlocks.push_back((uint8_t)readFlagCount(flag));
+    }
+    else if(flag[0] == statusFlag){
+      status.clear();
+      for(unsigned long left = readFlagCount(flag); left > 0; ){
+        int c = port.read();
+        if(c < 0){
+          node.spend(10 * simMicrosecond);
+          continue;
+        }
+        status.push_back((uint8_t)c);
+        left--;
+      }
+    }
+    else if(flag[0] == nakFlag){
+      log("NAK received");
+      acks.push_back(pcNak); // save nak in queue
+    }
+  }
+};
@@ -0,0 +1,486 @@
+#pragma once
+
+#include <stdio.h>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "SimScheduler.h"
+#include "SimClock.h"
+#include "SimSerial.h"
+#include "SimRadio.h"
+#include "SimDisplay.h"
+#include "SimImageStore.h"
+#include "SimPc.h"
+#include <Transmitter.h>
+#include <Receiver.h>
+#include <DisplayReceiver.h>
+#include <ImageCache.h>
+
+// The whole PC -> transmitter -> receiver -> Inkplate chain on simulated hardware,
+// running the same protocol code as the boards (Transmitter.h, Receiver.h, DisplayReceiver.h).
+// With more than one node, every receiver has its own Inkplate (a station), node 0 is the first one.
+
+struct PipelineConfig {
+  AirConfig air;
+  SerialConfig pcToTransmitter;      // USB serial into the transmitter's HardwareSerial
+  SerialConfig transmitterToPc;
+  SerialConfig receiverToDisplay;    // Serial1 -> Serial2
+  SerialConfig displayToReceiver;
+  uint8_t nodes = 1;                 // receivers, up to maxNodes (see nodes in Protocol.h)
+  bool useAckPayloads = true;
+  bool adaptRadio = true;            // Transmitter::adaptRadio (see LinkAdapter.h)
+  unsigned long listenPeriod = ::listenPeriod; // ms a sleeping receiver sleeps between its listen windows (see Protocol.h)
+  unsigned int pcCredits = windowSize + ingestPayloads; // payloads the PC writes ahead of the acks
+  bool pcCacheImages = false;        // the PC asks the Inkplate's image cache first (cacheImages in Program.cs), off for measuring transfers
+  simtime_t displayBootTime = 80 * simMillisecond;  // ESP32 deep sleep wake up to setup()
+  simtime_t displayInitTime = 220 * simMillisecond; // display.begin()
+  bool displayDeferInit = true;      // deferDisplayInit in Inkplate_serial.ino, the ready frame goes out before display.begin()
+  unsigned long displayWakeBuffer = 256 * 1024; // wakeBufferSize in Inkplate_serial.ino, 0 - none
+  bool displayLightSleep = true;     // keepFrameBuffer in Inkplate_serial.ino
+  bool displayOverlapRefresh = true; // overlapRefresh in Inkplate_serial.ino, the refresh runs on the other core (see SimDisplay.h)
+  simtime_t displayLightWakeTime = 3 * simMillisecond;
+  uint8_t displayCacheSlots = 8;     // cacheSlots in Inkplate_serial.ino, 0 - no image cache (ImageCache.h)
+  simtime_t quantum = 20 * simMicrosecond; // see SimScheduler, well below the airtime of a frame
+  bool verbose = false;              // print the debug messages of every board
+
+  PipelineConfig(){
+    pcToTransmitter.latency = simMillisecond;
+    pcToTransmitter.rxBufferSize = 512;        // SERIAL_RX_BUFFER_SIZE in NRF_transmitter/platformio.ini
+    pcToTransmitter.txBufferSize = 1 << 20;    // the PC never blocks
+    transmitterToPc.latency = simMillisecond;
+    transmitterToPc.rxBufferSize = 1 << 20;
+    transmitterToPc.seed = 2;
+    receiverToDisplay.rxBufferSize = 256;      // Serial2 on the ESP32
+    receiverToDisplay.seed = 3;
+    displayToReceiver.txBufferSize = 128;
+    displayToReceiver.seed = 4;
+  }
+};
+
+
+class SimPipeline {
+public:
+  // pulses the Inkplate's wake pin, which also interrupts it while it's awake
+  struct Wake {
+    SimNode& self;
+    SimNode& display;
+    bool pulsed = false;
+    void pulse(){
+      self.spend(500 * simMicrosecond);
+      pulsed = true;
+      display.interrupt(self.now());
+    }
+  };
+
+  // the receiver's radio interrupt (the IRQ pin's INT1 on the board)
+  struct RadioInterrupt {
+    SimNode& self;
+    void disable(){ self.disableInterrupt(); }
+    void enable(){ self.enableInterrupt(); }
+  };
+
+  // a receiver and its Inkplate
+  struct Station {
+    Station(SimPipeline& pipeline, uint8_t node)
+      : node(node),
+        receiverToDisplay(lineConfig(pipeline.config.receiverToDisplay, node)),
+        displayToReceiver(lineConfig(pipeline.config.displayToReceiver, node)),
+        receiverNode(pipeline.scheduler.add(receiverNames[node], [&pipeline, this](){ pipeline.receiverSetup(*this); },
+                                            [&pipeline, this](){ pipeline.receiverLoop(*this); })),
+        displayNode(pipeline.scheduler.add(displayNames[node], [](){}, [&pipeline, this](){ pipeline.displayLoop(*this); })),
+        refreshNode(pipeline.scheduler.add(refreshNames[node], [](){}, [this](){ screen.refreshLoop(refreshNode); })),
+        receiverPort(receiverNode, displayToReceiver, receiverToDisplay),
+        displayPort(displayNode, receiverToDisplay, displayToReceiver),
+        receiverClock(receiverNode), displayClock(displayNode),
+        receiverRadio(receiverNode, pipeline.air),
+        screen(displayNode),
+        wake{receiverNode, displayNode},
+        radioInterrupt{receiverNode},
+        receiver(receiverRadio, receiverPort, receiverClock, wake, radioInterrupt),
+        displayReceiver(displayPort, screen, displayClock),
+        imageStore(pipeline.scheduler, displayNode, refreshNode),
+        imageCache(imageStore, pipeline.config.displayCacheSlots, screen.width() / 2 * screen.height()),
+        wakeBuffer(pipeline.config.displayWakeBuffer){
+      receiver.node = node;
+      displayReceiver.wakeBuffer = wakeBuffer.empty() ? NULL : wakeBuffer.data();
+      displayReceiver.wakeBufferSize = wakeBuffer.size();
+      receiverNode.handler = [this](){ receiver.onRadioInterrupt(); };
+      if(pipeline.config.displayOverlapRefresh)
+        screen.refreshNode = &refreshNode;
+      if(pipeline.config.displayCacheSlots > 0){
+        displayReceiver.loadImage = loadCachedImage;
+        displayReceiver.saveImage = saveCachedImage;
+      }
+    }
+
+    uint8_t node;
+    SimSerialLine receiverToDisplay, displayToReceiver;
+    SimNode& receiverNode;
+    SimNode& displayNode;
+    SimNode& refreshNode; // the Inkplate's other core
+    SimSerial receiverPort, displayPort;
+    SimClock receiverClock, displayClock;
+    SimRadio receiverRadio;
+    SimDisplay screen;
+    Wake wake;
+    RadioInterrupt radioInterrupt;
+    Receiver<SimRadio, SimSerial, SimClock, Wake, RadioInterrupt> receiver;
+    DisplayReceiver<SimSerial, SimDisplay, SimClock> displayReceiver;
+    SimImageStore imageStore;            // the SD card
+    ImageCache<SimImageStore> imageCache;
+    std::vector<uint8_t> wakeBuffer;     // ps_malloc() in Inkplate_serial.ino
+    std::vector<uint8_t> displayedBytes; // data of the bytes and string flags the Inkplate received
+
+    bool sleepNow = false; // sleepReceiver()
+    simtime_t sleptTime = 0;    // the receiver with its radio powered down
+    simtime_t listenedTime = 0; // in listen windows, the radio's start up included
+    unsigned long listens = 0;  // listen windows
+
+    // Inkplate (Inkplate_serial.ino)
+    bool displayAwake = false;
+    bool displayBooted = false;
+    unsigned int displayBoots = 0;
+    unsigned long wakeStart = 0;
+
+    // every station's lines get their own seeds
+    static SerialConfig lineConfig(SerialConfig config, uint8_t node){
+      config.seed += 16 * node;
+      return config;
+    }
+  };
+
+  explicit SimPipeline(const PipelineConfig& config = PipelineConfig())
+    : config(config),
+      air(config.air),
+      pcToTransmitter(config.pcToTransmitter), transmitterToPc(config.transmitterToPc),
+      pcNode(scheduler.add("pc", [](){}, [this](){ pcLoop(); })),
+      transmitterNode(scheduler.add("transmitter", [this](){ transmitterSetup(); }, [this](){ transmitterLoop(); })),
+      pcPort(pcNode, transmitterToPc, pcToTransmitter),
+      transmitterPort(transmitterNode, pcToTransmitter, transmitterToPc),
+      transmitterClock(transmitterNode),
+      transmitterRadio(transmitterNode, air),
+      stations(makeStations()),
+      receiverToDisplay(stations[0]->receiverToDisplay), displayToReceiver(stations[0]->displayToReceiver),
+      receiverNode(stations[0]->receiverNode), displayNode(stations[0]->displayNode),
+      receiverRadio(stations[0]->receiverRadio),
+      screen(stations[0]->screen),
+      pc(pcNode, pcPort),
+      transmitter(transmitterRadio, transmitterPort, transmitterClock),
+      receiver(stations[0]->receiver),
+      displayReceiver(stations[0]->displayReceiver),
+      displayedBytes(stations[0]->displayedBytes){
+    scheduler.quantum = config.quantum;
+    transmitter.useAckPayloads = config.useAckPayloads;
+    transmitter.adaptRadio = config.adaptRadio;
+    transmitter.wakeStrobeTime = listenStrobeTime(config.listenPeriod);
+    pc.listenWait = listenStrobeTime(config.listenPeriod) * simMillisecond;
+    pc.verbose = config.verbose;
+    pc.credits = config.pcCredits;
+    pc.cacheImages = config.pcCacheImages;
+    pc.displayHeight = stations[0]->screen.height();
+    pc.displayWidth = stations[0]->screen.width();
+    if(config.verbose)
+      transmitter.log = logBoard;
+    for(std::unique_ptr<Station>& station : stations){
+      if(config.verbose){
+        station->receiver.log = logBoard;
+        station->displayReceiver.log = logBoard;
+      }
+      station->displayReceiver.onBytes = collectBytes;
+      station->displayReceiver.onString = collectString;
+    }
+    active = this;
+  }
+
+  PipelineConfig config;
+  SimScheduler scheduler;
+  SimAir air;
+  SimSerialLine pcToTransmitter, transmitterToPc;
+  SimNode& pcNode;
+  SimNode& transmitterNode;
+  SimSerial pcPort, transmitterPort;
+  SimClock transmitterClock;
+  SimRadio transmitterRadio;
+  std::vector<std::unique_ptr<Station> > stations; // one for every node
+  // node 0
+  SimSerialLine& receiverToDisplay;
+  SimSerialLine& displayToReceiver;
+  SimNode& receiverNode;
+  SimNode& displayNode;
+  SimRadio& receiverRadio;
+  SimDisplay& screen;
+  SimPc pc;
+  Transmitter<SimRadio, SimSerial, SimClock> transmitter;
+  Receiver<SimRadio, SimSerial, SimClock, Wake, RadioInterrupt>& receiver;
+  DisplayReceiver<SimSerial, SimDisplay, SimClock>& displayReceiver;
+
+  // runs *job* on the PC node, returns what it returned (false if it didn't finish within *limit*)
+  bool runOnPc(std::function<bool()> job, simtime_t limit = 60 * simSecond){
+    pcJob = job;
+    pcDone = false;
+    pcResult = false;
+    pcNode.interrupt(scheduler.now());
+    simtime_t start = scheduler.now();
+    scheduler.run(start + limit);
+    if(!pcDone)
+      pcFinished = scheduler.now(); // given up on
+    return pcDone && pcResult;
+  }
+
+  // sends a 3 bit image the way "sendimg3" does and waits until the Inkplate drew it
+  // returns false if the PC gave up, or the image didn't make it within *limit*
+  bool sendImage3Bit(const uint8_t image[], int height, int width, simtime_t limit = 60 * simSecond){
+    unsigned long refreshes = screen.refreshes;
+    simtime_t start = scheduler.now();
+    if(!runOnPc([&](){ return pc.sendImage3Bit(image, height, width); }, limit))
+      return false;
+    return waitForRefresh(refreshes, start, limit);
+  }
+
+  // sends only what changed since the last image, the way "sendupdate" does, and waits until the Inkplate drew it
+  bool sendImage3BitUpdate(const uint8_t image[], int height, int width, simtime_t limit = 60 * simSecond){
+    unsigned long refreshes = screen.refreshes;
+    simtime_t start = scheduler.now();
+    if(!runOnPc([&](){ return pc.sendImage3BitUpdate(image, height, width); }, limit))
+      return false;
+    if(pc.lastUpdateBytes == 0) // nothing changed, nothing to draw
+      return true;
+    return waitForRefresh(refreshes, start, limit);
+  }
+
+  // sends bytes the way "sendbytes" does and waits until the Inkplate got all of them (see displayedBytes)
+  bool sendByteArray(const uint8_t data[], unsigned long length, simtime_t limit = 60 * simSecond){
+    active = this;
+    displayedBytes.clear();
+    simtime_t start = scheduler.now();
+    if(!runOnPc([&](){ return pc.sendByteArray(data, length); }, limit))
+      return false;
+    while(displayedBytes.size() < length){
+      if(scheduler.now() - start > limit)
+        return false;
+      scheduler.run(scheduler.now() + simMillisecond);
+    }
+    return true;
+  }
+
+  // the Inkplate of *node* loses power, the next wake pulse boots it with a cleared framebuffer and a new session
+  void resetDisplay(uint8_t node = 0){
+    stations[node]->displayBooted = false;
+    stations[node]->displayAwake = false;
+  }
+
+  // the receiver of *node* goes to sleep on its next loop, as if it went *sleepTimeout* without a frame
+  void sleepReceiver(uint8_t node){
+    stations[node]->sleepNow = true;
+  }
+
+  // waits until the Inkplate of every node in *nodes* (a bitmask) refreshed once more than in *refreshes*
+  bool waitForRefreshes(const std::vector<unsigned long>& refreshes, uint8_t nodes, simtime_t limit = 60 * simSecond){
+    simtime_t start = scheduler.now();
+    for(size_t i = 0; i < stations.size(); i++){
+      if(!(nodes & (1u << i)))
+        continue;
+      while(stations[i]->screen.refreshes == refreshes[i]){
+        if(scheduler.now() - start > limit)
+          return false;
+        scheduler.run(scheduler.now() + simMillisecond);
+      }
+    }
+    return true;
+  }
+
+  std::vector<unsigned long> refreshCounts() const {
+    std::vector<unsigned long> counts;
+    for(const std::unique_ptr<Station>& station : stations)
+      counts.push_back(station->screen.refreshes);
+    return counts;
+  }
+
+  // lets the boards run on their own for *time*, e.g. until the Inkplate went back to sleep
+  void idle(simtime_t time){
+    scheduler.run(scheduler.now() + time);
+  }
+
+  simtime_t pcFinished = 0;             // when the last job on the PC returned, or ran out of time
+  std::vector<uint8_t>& displayedBytes; // data of the bytes and string flags node 0's Inkplate received
+
+  // time the node that is furthest ahead is at
+  simtime_t now() const {
+    std::vector<const SimNode*> nodes = {&pcNode, &transmitterNode};
+    for(const std::unique_ptr<Station>& station : stations){
+      nodes.push_back(&station->receiverNode);
+      nodes.push_back(&station->displayNode);
+    }
+    simtime_t latest = 0;
+    for(const SimNode* node : nodes){
+      if(!node->asleep() && node->now() > latest)
+        latest = node->now();
+    }
+    return latest;
+  }
+
+private:
+  std::function<bool()> pcJob;
+  bool pcDone = false;
+  bool pcResult = false;
+
+  // receiver (NRF_receiver/src/main.cpp)
+  const unsigned long sleepTimeout = 5000;
+
+  // Inkplate (Inkplate_serial.ino)
+  const unsigned long displaySleepTime = 1500;
+
+  static inline const char* const receiverNames[maxNodes] = {"receiver", "receiver 1", "receiver 2", "receiver 3",
+                                                             "receiver 4", "receiver 5", "receiver 6", "receiver 7"};
+  static inline const char* const displayNames[maxNodes] = {"inkplate", "inkplate 1", "inkplate 2", "inkplate 3",
+                                                            "inkplate 4", "inkplate 5", "inkplate 6", "inkplate 7"};
+  static inline const char* const refreshNames[maxNodes] = {"refresh", "refresh 1", "refresh 2", "refresh 3",
+                                                            "refresh 4", "refresh 5", "refresh 6", "refresh 7"};
+  static inline SimPipeline* active = NULL; // onBytes and log have no context, only one pipeline runs at a time
+
+  std::vector<std::unique_ptr<Station> > makeStations(){
+    std::vector<std::unique_ptr<Station> > result;
+    for(uint8_t node = 0; node < config.nodes && node < maxNodes; node++)
+      result.emplace_back(new Station(*this, node));
+    return result;
+  }
+
+  // the bytes go to the station whose Inkplate is running
+  static void collectBytes(const uint8_t data[], int size){
+    for(std::unique_ptr<Station>& station : active->stations){
+      if(&station->displayNode == active->scheduler.current())
+        station->displayedBytes.insert(station->displayedBytes.end(), data, data + size);
+    }
+  }
+  static void collectString(const char text[], int size){ collectBytes((const uint8_t*)text, size); }
+
+  // the station whose Inkplate is running
+  static Station& runningStation(){
+    for(std::unique_ptr<Station>& station : active->stations){
+      if(&station->displayNode == active->scheduler.current())
+        return *station;
+    }
+    return *active->stations[0];
+  }
+
+  static bool loadCachedImage(uint32_t key, uint8_t frameBuffer[]){ return runningStation().imageCache.load(key, frameBuffer); }
+
+  // saveCachedImage() in Inkplate_serial.ino, the refresh node saves what it showed, without it the display saves it
+  // before it sleeps
+  static void saveCachedImage(const uint8_t frameBuffer[]){
+    Station& station = runningStation();
+    if(station.screen.refreshNode == NULL){
+      station.screen.saveBeforeSleep = frameBuffer;
+      return;
+    }
+    station.screen.waitRefresh(); // display() would wait for it anyway
+    station.screen.afterRefresh = [&station, frameBuffer](){
+      if(frameBuffer == station.screen.panel()) // the one just shown, display() swapped the back buffer in
+        station.imageCache.save(frameBuffer);
+    };
+  }
+
+  static void logBoard(const char* message){ printf("%s: %s\n", active->scheduler.current()->name, message); }
+
+  // the last bytes may still be on their way to the Inkplate when the PC is done
+  bool waitForRefresh(unsigned long refreshes, simtime_t start, simtime_t limit){
+    while(screen.refreshes == refreshes){
+      if(scheduler.now() - start > limit)
+        return false;
+      scheduler.run(scheduler.now() + simMillisecond);
+    }
+    return true;
+  }
+
+  void pcLoop(){
+    if(!pcJob){
+      pcNode.sleep();
+      return;
+    }
+    pcResult = pcJob();
+    pcJob = nullptr;
+    pcDone = true;
+    pcFinished = pcNode.now();
+    scheduler.stop();
+  }
+
+  void transmitterSetup(){
+    transmitter.begin();
+  }
+
+  void transmitterLoop(){
+    transmitter.poll();
+    transmitterClock.delay(2);
+  }
+
+  void receiverSetup(Station& station){
+    station.receiver.begin();
+    station.receiver.idleSince = station.receiverClock.millis();
+  }
+
+  void receiverLoop(Station& station){
+    Receiver<SimRadio, SimSerial, SimClock, Wake, RadioInterrupt>& receiver = station.receiver;
+    receiver.poll();
+    if(station.sleepNow || (!receiver.linkOpen() && station.receiverClock.millis() - receiver.idleSince >= sleepTimeout)){
+      station.sleepNow = false;
+      receiver.powerDown();
+      bool heard = false;
+      while(!heard){ // low power listening (see Protocol.h)
+        simtime_t sleepStart = station.receiverNode.now();
+        station.receiverClock.delay(config.listenPeriod);
+        simtime_t listenStart = station.receiverNode.now();
+        station.sleptTime += listenStart - sleepStart;
+        heard = receiver.listen(listenWindow);
+        station.listenedTime += station.receiverNode.now() - listenStart;
+        station.listens++;
+      }
+      receiver.idleSince = station.receiverClock.millis();
+    }
+  }
+
+  // starts powered off, wakes up on the wake pin
+  void displayLoop(Station& station){
+    DisplayReceiver<SimSerial, SimDisplay, SimClock>& displayReceiver = station.displayReceiver;
+    SimClock& displayClock = station.displayClock;
+    if(!station.displayAwake){
+      station.displayNode.sleep();
+      if(station.displayBooted && config.displayLightSleep){
+        station.displayNode.spend(config.displayLightWakeTime);
+      }
+      else{ // deep sleep starts over, display.begin() clears the framebuffer
+        station.displayNode.spend(config.displayBootTime);
+        if(!config.displayDeferInit)
+          station.displayNode.spend(config.displayInitTime);
+        station.screen.start(config.displayDeferInit ? config.displayInitTime : 0);
+        station.imageStore.timed = !config.displayDeferInit;
+        station.imageCache.begin(); // the SD card kept the images
+        station.imageStore.timed = true;
+        station.displayBooted = true;
+        displayReceiver.session = (uint16_t)(++station.displayBoots * 40503u + station.node); // esp_random() in Inkplate_serial.ino
+      }
+      station.wake.pulsed = false;
+      displayReceiver.signalAwake();
+      station.wakeStart = displayClock.millis();
+      station.displayAwake = true;
+      return;
+    }
+    if(station.wake.pulsed){ // onWakePin() in Inkplate_serial.ino
+      station.wake.pulsed = false;
+      displayReceiver.signalAwake();
+      station.wakeStart = displayClock.millis();
+    }
+    if(displayReceiver.poll())
+      station.wakeStart = displayClock.millis();
+    unsigned long sleepTime = displayReceiver.linkTimeout > displaySleepTime ? displayReceiver.linkTimeout : displaySleepTime;
+    if(displayClock.millis() - station.wakeStart > sleepTime){
+      if(station.screen.saveBeforeSleep != NULL){
+        station.imageCache.save(station.screen.saveBeforeSleep);
+        station.screen.saveBeforeSleep = NULL;
+        return; // sleeps on the next loop, unless a wake pulse came during the save
+      }
+      station.screen.waitRefresh();
+      displayReceiver.linkTimeout = 0;
+      station.displayAwake = false;
+    }
+  }
+};
@@ -0,0 +1,473 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <map>
+#include <math.h>
+#include <random>
+#include <vector>
+#include "SimScheduler.h"
+
+// Simulated nRF24L01 with the RF24 API used by the protocol core, Enhanced ShockBurst included:
+// auto-ack, auto retransmit, ack payloads, duplicate detection (PID) and the 3 frame FIFOs.
+// Every radio is attached to a SimAir, which decides which frames get lost.
+// The IRQ pin is the node's interrupt line (SimNode::raise()), RX_DR pulls it when it isn't masked.
+//
+// Link budget: a frame reaches the other radio with the sender's PA level minus *pathLoss*. Below the
+// sensitivity of the data rate (-94 dBm at 250 kbps, -85 dBm at 1 Mbps, -82 dBm at 2 Mbps) it's more
+// and more likely to be lost, 50 % right at it, 12 % 3 dB above. RPD is set above -64 dBm.
+
+typedef enum { RF24_PA_MIN = 0, RF24_PA_LOW, RF24_PA_HIGH, RF24_PA_MAX, RF24_PA_ERROR } rf24_pa_dbm_e;
+typedef enum { RF24_1MBPS = 0, RF24_2MBPS, RF24_250KBPS } rf24_datarate_e;
+
+struct AirConfig {
+  double loss = 0;          // chance of a frame (data or ack) being lost
+  double bitErrorRate = 0;  // chance of every bit on air being flipped, the CRC drops the frame
+  double reorder = 0;       // chance of a received frame reaching the FIFO after the next one
+  simtime_t latency = 0;    // added to every frame
+  simtime_t jitter = 0;     // random extra latency, up to this much
+  unsigned int seed = 1;
+  double pathLoss = 0;      // dB between the radios, 0 for radios next to each other (no loss from the link budget)
+  std::map<uint8_t, double> channelLoss; // extra chance of losing a frame on a channel (WiFi, other links)
+};
+
+
+class SimRadio;
+
+
+class SimAir {
+public:
+  explicit SimAir(const AirConfig& config = AirConfig()) : config(config), rng(config.seed) {}
+
+  AirConfig config;
+  unsigned long framesOnAir = 0;  // every transmission, retransmits and acks included
+  unsigned long framesLost = 0;   // a broadcast counts once for every receiver that missed it
+  simtime_t timeOnAir = 0;        // airtime of every transmission, acks included
+
+private:
+  friend class SimRadio;
+
+  std::vector<SimRadio*> radios;
+  std::mt19937 rng;
+
+  double uniform(){ return std::uniform_real_distribution<double>(0, 1)(rng); }
+
+  // decides if a frame of *bits* bits makes it through, *linkLoss* - from linkLoss()
+  bool lost(unsigned int bits, double linkLoss = 0){
+    framesOnAir++;
+    return missed(bits, linkLoss);
+  }
+
+  // decides if one receiver gets a frame that is already on air, a broadcast has a chance with every one
+  bool missed(unsigned int bits, double linkLoss = 0){
+    bool dropped = config.loss > 0 && uniform() < config.loss;
+    if(!dropped && linkLoss > 0)
+      dropped = uniform() < linkLoss;
+    if(!dropped && config.bitErrorRate > 0)
+      dropped = uniform() >= pow1m(config.bitErrorRate, bits);
+    if(dropped)
+      framesLost++;
+    return dropped;
+  }
+
+  // dBm at the receiver of a frame sent with *paLevel*
+  double power(uint8_t paLevel) const {
+    static const double paDbm[] = {-18, -12, -6, 0};
+    return paDbm[paLevel < 4 ? paLevel : 3] - config.pathLoss;
+  }
+
+  // chance of losing a frame sent with *paLevel* at *rate* on *channel*, on top of *loss*
+  double linkLoss(uint8_t paLevel, rf24_datarate_e rate, uint8_t channel) const {
+    double result = 0;
+    if(config.pathLoss > 0){
+      double sensitivity = rate == RF24_250KBPS ? -94 : rate == RF24_2MBPS ? -82 : -85;
+      result = 1 / (1 + exp((power(paLevel) - sensitivity) / 1.5));
+      if(result < 1e-6)
+        result = 0;
+    }
+    std::map<uint8_t, double>::const_iterator noise = config.channelLoss.find(channel);
+    if(noise != config.channelLoss.end())
+      result = 1 - (1 - result) * (1 - noise->second);
+    return result;
+  }
+
+  simtime_t delay(){
+    simtime_t jitter = config.jitter > 0 ? (simtime_t)(uniform() * config.jitter) : 0;
+    return config.latency + jitter;
+  }
+
+  // (1 - p) ^ n
+  static double pow1m(double p, unsigned int n){
+    double result = 1, base = 1 - p;
+    for(; n; n >>= 1, base *= base){
+      if(n & 1)
+        result *= base;
+    }
+    return result;
+  }
+};
+
+
+class SimRadio {
+public:
+  SimRadio(SimNode& node, SimAir& air) : node(node), air(air){
+    air.radios.push_back(this);
+  }
+
+  unsigned long retransmits = 0; // auto retransmits
+  unsigned long failures = 0;    // writes that ran out of retries (MAX_RT)
+  unsigned long overruns = 0;    // frames dropped because the RX FIFO was full
+
+  bool begin(){
+    spi(8);
+    listening = false;
+    powered = true;
+    dynamicAck = false;
+    ackPayloads = false;
+    channel = 76;
+    dataRate = RF24_1MBPS;
+    paLevel = RF24_PA_MAX;
+    retryDelay = 5;
+    retryCount = 15;
+    rxFifo.clear();
+    txFifo.clear();
+    rxReady = false;
+    rxReadyMasked = false;
+    memset(pipeOpen, 0, sizeof(pipeOpen));
+    return true;
+  }
+
+  bool isChipConnected(){ spi(1); return true; }
+  void setPALevel(uint8_t level, bool lnaEnable = true){ spi(1); paLevel = level; }
+  uint8_t getARC(){ spi(1); return arc; }
+  bool testRPD(){ spi(1); return rpd; }
+  uint8_t getPALevel(){ spi(1); return paLevel; }
+  bool setDataRate(rf24_datarate_e rate){ spi(1); dataRate = rate; return true; }
+  rf24_datarate_e getDataRate(){ spi(1); return dataRate; }
+  void setChannel(uint8_t value){ spi(1); channel = value; }
+  uint8_t getChannel(){ spi(1); return channel; }
+  void setRetries(uint8_t delay, uint8_t count){ spi(1); retryDelay = delay; retryCount = count; }
+  void enableDynamicPayloads(){ spi(2); }
+  void enableDynamicAck(){ spi(1); dynamicAck = true; }
+  void enableAckPayload(){ spi(2); ackPayloads = true; }
+  void disableAckPayload(){ spi(2); ackPayloads = false; }
+  void maskIRQ(bool tx_ok, bool tx_fail, bool rx_ready){ spi(1); rxReadyMasked = rx_ready; }
+
+  // reads and clears the status flags, releases the IRQ pin
+  void whatHappened(bool& tx_ok, bool& tx_fail, bool& rx_ready){
+    spi(1);
+    tx_ok = false;
+    tx_fail = false;
+    rx_ready = rxReady;
+    rxReady = false;
+  }
+  void powerDown(){ spi(1); powered = false; listening = false; }
+  void powerUp(){ spi(1); powered = true; node.spend(1500 * simMicrosecond); } // oscillator start up
+
+  void openWritingPipe(const uint8_t* address){
+    spi(12);
+    memcpy(txAddress, address, addressWidth);
+    memcpy(pipeAddress[0], address, addressWidth); // for the auto-ack
+  }
+
+  void openReadingPipe(uint8_t pipe, const uint8_t* address){
+    spi(7);
+    if(pipe > 5)
+      return;
+    memcpy(pipeAddress[pipe], address, addressWidth);
+    pipeOpen[pipe] = true;
+  }
+
+  void closeReadingPipe(uint8_t pipe){ spi(1); pipeOpen[pipe] = false; }
+
+  void startListening(){
+    spi(2);
+    node.spend(settleTime); // frames that arrive before RX settled are missed
+    listening = true;
+  }
+
+  void stopListening(){
+    spi(2);
+    listening = false;
+    node.spend(settleTime);
+  }
+
+  bool available(uint8_t* pipe = NULL){
+    spi(1);
+    if(rxFifo.empty())
+      return false;
+    if(pipe)
+      *pipe = rxFifo.front().pipe;
+    return true;
+  }
+
+  uint8_t getDynamicPayloadSize(){
+    spi(2);
+    return rxFifo.empty() ? 0 : rxFifo.front().size;
+  }
+
+  void read(void* buffer, uint8_t length){
+    spi(length + 1);
+    if(rxFifo.empty())
+      return;
+    Frame& frame = rxFifo.front();
+    memcpy(buffer, frame.data, length < frame.size ? length : frame.size);
+    rxFifo.pop_front();
+  }
+
+  bool rxFifoFull(){ spi(1); return rxFifo.size() >= fifoSize; }
+
+  uint8_t flush_rx(){ spi(1); rxFifo.clear(); return 0; }
+  uint8_t flush_tx(){ spi(1); txFifo.clear(); ackSent = false; return 0; }
+
+  // blocking write, true once the auto-ack came back (or right away with *multicast*)
+  bool write(const void* buffer, uint8_t length, const bool multicast = false){
+    if(!writeFast(buffer, length, multicast))
+      return false;
+    if(transmit()){
+      txFifo.pop_front();
+      return true;
+    }
+    failures++;
+    txFifo.clear(); // RF24 flushes after MAX_RT
+    return false;
+  }
+
+  // loads the TX FIFO, txStandBy() sends it
+  bool writeFast(const void* buffer, uint8_t length, const bool multicast = false){
+    spi(length + 1);
+    if(txFifo.size() >= fifoSize)
+      return false;
+    txFifo.push_back(makeFrame(buffer, length, multicast && dynamicAck));
+    txFifo.back().pid = pid = (pid + 1) & 3; // retransmits keep the PID, so the receiver can spot duplicates
+    return true;
+  }
+
+  // sends everything in the TX FIFO, retransmitting until *timeout* ms passed
+  bool txStandBy(uint32_t timeout = 95, bool startTx = false){
+    simtime_t start = node.now();
+    while(!txFifo.empty()){
+      if(transmit()){
+        txFifo.pop_front();
+        continue;
+      }
+      if(node.now() - start > timeout * simMillisecond){
+        failures++;
+        txFifo.clear();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // loaded into the TX FIFO, goes out with the auto-ack of the next frame on *pipe*
+  bool writeAckPayload(uint8_t pipe, const void* buffer, uint8_t length){
+    spi(length + 1);
+    if(txFifo.size() >= fifoSize)
+      return false;
+    txFifo.push_back(makeFrame(buffer, length, false));
+    return true;
+  }
+
+private:
+  static const uint8_t fifoSize = 3;
+  static const uint8_t maxPayload = 32;
+  static const uint8_t addressWidth = 5;
+  static const simtime_t settleTime = 130 * simMicrosecond; // TX <-> RX switch, PLL settling
+
+  struct Frame {
+    uint8_t data[maxPayload];
+    uint8_t size;
+    uint8_t pipe;
+    uint8_t pid;
+    bool noAck;
+  };
+
+  SimNode& node;
+  SimAir& air;
+
+  bool powered = true;
+  bool listening = false;
+  bool dynamicAck = false;
+  bool ackPayloads = false;
+  uint8_t channel = 76;
+  uint8_t paLevel = RF24_PA_MAX;
+  rf24_datarate_e dataRate = RF24_1MBPS;
+  uint8_t retryDelay = 5;
+  uint8_t retryCount = 15;
+  uint8_t txAddress[addressWidth] = {0};
+  uint8_t pipeAddress[6][addressWidth] = {{0}};
+  bool pipeOpen[6] = {false};
+  uint8_t pid = 0;
+
+  std::deque<Frame> rxFifo;
+  std::deque<Frame> txFifo;
+  bool ackSent = false;    // the front of the TX FIFO went out as an ack payload
+  bool rxReady = false;    // RX_DR, until whatHappened() clears it
+  bool rxReadyMasked = false;
+  int lastPid[6] = {-1, -1, -1, -1, -1, -1};
+  uint16_t lastCrc[6] = {0};
+  uint8_t arc = 0;         // retransmits of the last write
+  bool rpd = false;        // the last received frame (an auto-ack too) was above -64 dBm
+  bool held = false;       // a frame waiting for the next one (reordering)
+  Frame heldFrame;
+
+  // SPI transfer of *bytes* bytes at 8 MHz, plus the call overhead
+  // the interrupt waits until the transfer is done, like SPI.usingInterrupt() on the board
+  void spi(unsigned int bytes){
+    node.disableInterrupt();
+    node.spend((4 + bytes) * simMicrosecond);
+    node.enableInterrupt();
+  }
+
+  // a frame landed in the RX FIFO
+  void received(){
+    if(rxReadyMasked)
+      return;
+    if(!rxReady) // the IRQ pin only falls once until the flag is cleared
+      node.raise();
+    rxReady = true;
+  }
+
+  simtime_t bitTime() const { return dataRate == RF24_250KBPS ? 4 * simMicrosecond : dataRate == RF24_2MBPS ? simMicrosecond / 2 : simMicrosecond; }
+
+  // preamble, address, packet control field, payload, CRC
+  unsigned int frameBits(uint8_t payload) const { return 8 + addressWidth * 8 + 9 + payload * 8 + 16; }
+  simtime_t airtime(uint8_t payload) const {
+    return frameBits(payload) * bitTime();
+  }
+
+  Frame makeFrame(const void* buffer, uint8_t length, bool noAck){
+    Frame frame;
+    if(length > maxPayload)
+      length = maxPayload;
+    memcpy(frame.data, buffer, length);
+    frame.size = length;
+    frame.pipe = 0;
+    frame.pid = 0;
+    frame.noAck = noAck;
+    return frame;
+  }
+
+  static uint16_t checksum(const Frame& frame){
+    uint16_t sum = frame.size;
+    for(uint8_t i = 0; i < frame.size; i++)
+      sum = sum * 31 + frame.data[i];
+    return sum;
+  }
+
+  // the pipe a frame for *address* ends up in, -1 if this radio doesn't take it
+  int matchPipe(const uint8_t* address, uint8_t frameChannel, rf24_datarate_e frameRate) const {
+    if(!powered || !listening || frameChannel != channel || frameRate != dataRate)
+      return -1;
+    for(uint8_t pipe = 0; pipe < 6; pipe++){
+      if(pipeOpen[pipe] && memcmp(pipeAddress[pipe], address, addressWidth) == 0)
+        return pipe;
+    }
+    return -1;
+  }
+
+  // a frame arrived, returns true if it gets acked, *ack* is set to the ack payload (if there is one)
+  bool receive(Frame frame, uint8_t pipe, const Frame*& ack, double power){
+    ack = NULL;
+    rpd = power > -64;
+    bool duplicate = lastPid[pipe] == frame.pid && lastCrc[pipe] == checksum(frame);
+    if(!duplicate){
+      if(rxFifo.size() >= fifoSize){ // no room, the frame is dropped and not acked
+        overruns++;
+        return false;
+      }
+      if(ackSent && !txFifo.empty()){ // the last ack payload got through, a new frame came
+        txFifo.pop_front();
+      }
+      ackSent = false;
+      lastPid[pipe] = frame.pid;
+      lastCrc[pipe] = checksum(frame);
+      frame.pipe = pipe;
+      if(held){
+        rxFifo.push_back(frame);
+        if(rxFifo.size() < fifoSize)
+          rxFifo.push_back(heldFrame);
+        held = false;
+        received();
+      }
+      else if(air.config.reorder > 0 && air.uniform() < air.config.reorder){
+        heldFrame = frame;
+        held = true;
+      }
+      else{
+        rxFifo.push_back(frame);
+        received();
+      }
+    }
+    if(frame.noAck)
+      return false;
+    if(ackPayloads && !txFifo.empty()){
+      ack = &txFifo.front();
+      ackSent = true;
+    }
+    return true;
+  }
+
+  // sends the front of the TX FIFO with auto retransmits, true once it's acked
+  bool transmit(){
+    Frame& frame = txFifo.front();
+    for(uint8_t attempt = 0; attempt <= retryCount; attempt++){
+      arc = attempt;
+      if(attempt > 0)
+        retransmits++;
+      node.spend(settleTime);
+      node.spend(airtime(frame.size));
+      air.timeOnAir += airtime(frame.size);
+      simtime_t arrival = node.now() + air.delay();
+      node.waitUntil(arrival);
+
+      if(frame.noAck){ // every radio listening on the address may get it, none of them acks
+        air.framesOnAir++;
+        for(SimRadio* radio : air.radios){
+          const Frame* ack;
+          int pipe = radio != this ? radio->matchPipe(txAddress, channel, dataRate) : -1;
+          if(pipe >= 0 && !air.missed(frameBits(frame.size), air.linkLoss(paLevel, dataRate, channel)))
+            radio->receive(frame, pipe, ack, air.power(paLevel));
+        }
+        return true;
+      }
+
+      SimRadio* receiver = NULL;
+      int pipe = -1;
+      for(SimRadio* radio : air.radios){
+        if(radio != this && (pipe = radio->matchPipe(txAddress, channel, dataRate)) >= 0){
+          receiver = radio;
+          break;
+        }
+      }
+      bool delivered = !air.lost(frameBits(frame.size), air.linkLoss(paLevel, dataRate, channel)) && receiver != NULL;
+      const Frame* ack = NULL;
+      bool acked = delivered && receiver->receive(frame, pipe, ack, air.power(paLevel));
+
+      if(acked){
+        uint8_t ackSize = ack ? ack->size : 0;
+        Frame ackFrame;
+        if(ack)
+          ackFrame = *ack;
+        node.spend(settleTime + airtime(ackSize));
+        air.timeOnAir += airtime(ackSize);
+        if(!air.lost(frameBits(ackSize), air.linkLoss(receiver->paLevel, dataRate, channel))){
+          rpd = air.power(receiver->paLevel) > -64;
+          if(ack && rxFifo.size() < fifoSize){
+            ackFrame.pipe = 0;
+            rxFifo.push_back(ackFrame);
+            received();
+          }
+          return true;
+        }
+      }
+      else{
+        node.spend(settleTime + airtime(0)); // waited for the ack anyway
+      }
+      node.spend((retryDelay + 1) * 250 * simMicrosecond);
+    }
+    return false;
+  }
+};
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <ucontext.h>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Runs every simulated board as a coroutine on a shared virtual clock (nanoseconds).
+//
+// Each node has its own time, which only moves forward when the board spends it:
+// every simulated call (millis(), radio.available(), ...) costs a little time, delay() costs more.
+// The scheduler always resumes the node that is furthest behind, so when a node acts at time t,
+// everything the other nodes did before t already happened. That keeps a run deterministic
+// and lets one node look at another one's state (a radio listening, a serial buffer) directly.
+//
+// Nodes spend most of their time polling, so with a *quantum* > 0 a node may run up to that far
+// ahead of the others before it gives way. A node then sees the others' actions up to a quantum late,
+// but there are far fewer switches. The run stays deterministic.
+
+typedef uint64_t simtime_t;
+const simtime_t simMicrosecond = 1000;
+const simtime_t simMillisecond = 1000 * simMicrosecond;
+const simtime_t simSecond = 1000 * simMillisecond;
+const simtime_t simForever = ~(simtime_t)0;
+
+class SimScheduler;
+
+
+class SimNode {
+public:
+  SimNode(SimScheduler& scheduler, const char* name, std::function<void()> setup, std::function<void()> loop,
+          size_t stackSize = 256 * 1024);
+  ~SimNode(){ free(stack); }
+
+  const char* const name;
+
+  simtime_t now() const { return time; }
+
+  // the node is busy for *ns* nanoseconds
+  void spend(simtime_t ns);
+
+  // blocks until *t*, does nothing if it already passed
+  void waitUntil(simtime_t t){
+    if(t > time)
+      spend(t - time);
+  }
+
+  // stops the node until another node calls interrupt(), like a board in deep sleep
+  void sleep();
+  void interrupt(simtime_t t);
+  bool asleep() const { return sleeping; }
+
+  // Interrupt line of the node (one is enough for a board here). After raise(), *handler* runs on the
+  // node the next time it spends time, unless the interrupt is disabled, then it runs once it's enabled
+  // again. A handler doesn't interrupt itself.
+  std::function<void()> handler;
+  void raise(){ pending = true; }
+  void disableInterrupt(){ disabled++; }
+  void enableInterrupt(){ disabled--; }
+
+private:
+  friend class SimScheduler;
+
+  SimScheduler& scheduler;
+  std::function<void()> setup;
+  std::function<void()> loop;
+  ucontext_t context; // only used to start the node on its own stack
+  void* jump[5];      // where the node continues, see SimScheduler::resume()
+  void* stack;
+  bool started = false;
+  simtime_t time = 0;
+  bool sleeping = false;
+  bool pending = false;
+  int disabled = 0;
+  bool inHandler = false;
+
+  void yield();
+  void serviceInterrupt();
+  static void entry(int high, int low);
+};
+
+
+class SimScheduler {
+public:
+  simtime_t quantum = 0; // how far a node may run ahead of the others, 0 runs them in lockstep
+
+  SimNode& add(const char* name, std::function<void()> setup, std::function<void()> loop){
+    nodes.emplace_back(new SimNode(*this, name, setup, loop));
+    return *nodes.back();
+  }
+
+  // runs the nodes until stop() is called or every node is past *until*
+  // returns false if it ran out of time
+  bool run(simtime_t until = simForever){
+    stopped = false;
+    while(!stopped){
+      SimNode* next = earliest();
+      if(next == NULL || next->time > until)
+        return false;
+      running = next;
+      yieldAt = threshold(next);
+      if(__builtin_setjmp(mainJump) == 0)
+        resume(next);
+    }
+    return true;
+  }
+
+  void stop(){ stopped = true; }
+
+  const SimNode* current() const { return running; } // node that runs (or ran last)
+
+  // time of the node that is furthest behind
+  simtime_t now() const {
+    SimNode* node = earliest();
+    return node ? node->time : simForever;
+  }
+
+private:
+  friend class SimNode;
+
+  std::vector<std::unique_ptr<SimNode> > nodes;
+  void* mainJump[5];
+  bool stopped = false;
+  SimNode* running = NULL;
+  simtime_t yieldAt = 0; // the running node gives way once its time gets here, see behind()
+
+  // switches to *node* (__builtin_longjmp has to be called outside of the function with the __builtin_setjmp)
+  // swapcontext() would be simpler, but it saves the signal mask with a system call on every switch,
+  // which made the simulation ten times slower
+  __attribute__((noinline)) static void resume(SimNode* node){
+    if(!node->started){
+      node->started = true;
+      setcontext(&node->context);
+    }
+    __builtin_longjmp(node->jump, 1);
+  }
+
+  __attribute__((noinline)) void suspend(){
+    __builtin_longjmp(mainJump, 1);
+  }
+
+  // node that runs next, nodes added first win ties so runs are deterministic
+  SimNode* earliest() const {
+    SimNode* best = NULL;
+    for(const std::unique_ptr<SimNode>& node : nodes){
+      if(best == NULL || node->time < best->time)
+        best = node.get();
+    }
+    return best;
+  }
+
+  // true if another node has to run before *node* can continue
+  // only the running node's time moves, so the time it has to give way at is worked out once when it's resumed,
+  // a station adds two nodes and every spend() comes here
+  bool behind(const SimNode* node) const {
+    return stopped || node->time >= yieldAt;
+  }
+
+  // another node needs *node* once it's a quantum ahead of it, or exactly that with the other one added first
+  simtime_t threshold(const SimNode* node) const {
+    simtime_t result = simForever;
+    bool before = true; // *other* was added before *node*
+    for(const std::unique_ptr<SimNode>& other : nodes){
+      if(other.get() == node){
+        before = false;
+        continue;
+      }
+      if(other->time == simForever) // asleep
+        continue;
+      simtime_t at = other->time + quantum + (before ? 0 : 1);
+      if(at < result)
+        result = at;
+    }
+    return result;
+  }
+
+  // a sleeping node got interrupted by the running one
+  void woken(const SimNode* node){
+    if(running == NULL || running == node)
+      return;
+    bool before = false; // *node* was added before the running one
+    for(const std::unique_ptr<SimNode>& other : nodes){
+      if(other.get() == running)
+        break;
+      if(other.get() == node){
+        before = true;
+        break;
+      }
+    }
+    simtime_t at = node->time + quantum + (before ? 0 : 1);
+    if(at < yieldAt)
+      yieldAt = at;
+  }
+};
+
+
+inline SimNode::SimNode(SimScheduler& scheduler, const char* name, std::function<void()> setup, std::function<void()> loop,
+                        size_t stackSize)
+  : name(name), scheduler(scheduler), setup(setup), loop(loop){
+  stack = malloc(stackSize);
+  getcontext(&context);
+  context.uc_stack.ss_sp = stack;
+  context.uc_stack.ss_size = stackSize;
+  context.uc_link = NULL;
+  uintptr_t self = (uintptr_t)this;
+  makecontext(&context, (void (*)())entry, 2, (int)(self >> 32), (int)(self & 0xFFFFFFFF));
+}
+
+
+inline void SimNode::entry(int high, int low){
+  SimNode* node = (SimNode*)(((uintptr_t)(unsigned int)high << 32) | (uintptr_t)(unsigned int)low);
+  node->setup();
+  while(true)
+    node->loop();
+}
+
+
+inline void SimNode::interrupt(simtime_t t){
+  if(sleeping && t < time){
+    time = t;
+    scheduler.woken(this);
+  }
+}
+
+
+inline void SimNode::spend(simtime_t ns){
+  time += ns;
+  if(scheduler.behind(this))
+    yield();
+  if(pending)
+    serviceInterrupt();
+}
+
+
+inline void SimNode::serviceInterrupt(){
+  if(disabled > 0 || inHandler || !handler)
+    return;
+  pending = false;
+  inHandler = true;
+  handler();
+  inHandler = false;
+}
+
+
+inline void SimNode::sleep(){
+  sleeping = true;
+  time = simForever;
+  yield();
+  sleeping = false;
+}
+
+
+inline void SimNode::yield(){
+  if(__builtin_setjmp(jump) == 0)
+    scheduler.suspend();
+}
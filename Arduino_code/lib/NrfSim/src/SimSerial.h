@@ -0,0 +1,176 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <random>
+#include "SimScheduler.h"
+
+// Simulated UART (or USB serial) between two nodes, one SimSerialLine per direction.
+// Bytes take *byteTime* each on the line and land in the reader's receive buffer,
+// if the buffer is full they are lost like on a real HardwareSerial.
+
+struct SerialConfig {
+  simtime_t byteTime = 10 * simMicrosecond; // 1 Mbaud, 10 bits per byte
+  simtime_t latency = 0;       // added before the line, e.g. USB frames
+  size_t rxBufferSize = 64;    // HardwareSerial on the AVR boards
+  size_t txBufferSize = 64;    // write() blocks once this much is waiting
+  double bitErrorRate = 0;     // chance of every bit on the line being flipped
+  unsigned int seed = 1;
+};
+
+
+class SimSerialLine {
+public:
+  explicit SimSerialLine(const SerialConfig& config = SerialConfig()) : config(config), rng(config.seed) {}
+
+  SerialConfig config;
+  unsigned long bytesSent = 0;
+  unsigned long overflows = 0;  // bytes lost because the receive buffer was full
+  unsigned long corrupted = 0;  // bytes with flipped bits
+  simtime_t burstEnd = 0;       // when the last byte of the burst from corruptBurst() arrived
+
+  // flips bits in *length* bytes in a row, starting *after* bytes from the next one written
+  void corruptBurst(unsigned long after, unsigned long length){
+    burstStart = bytesSent + after;
+    burstLength = length;
+  }
+
+private:
+  friend class SimSerial;
+
+  std::deque<std::pair<simtime_t, uint8_t> > inFlight; // arrival time, byte
+  std::deque<uint8_t> received;
+  simtime_t lineFree = 0;
+  std::mt19937 rng;
+  unsigned long burstStart = 0, burstLength = 0;
+
+  // writes one byte at *now*, returns when the writer can continue
+  simtime_t send(simtime_t now, uint8_t value){
+    simtime_t start = now + config.latency > lineFree ? now + config.latency : lineFree;
+    simtime_t queued = start - (now + config.latency);
+    simtime_t resume = now;
+    if(queued > config.txBufferSize * config.byteTime) // wait for room in the transmit buffer
+      resume = now + queued - config.txBufferSize * config.byteTime;
+
+    if(config.bitErrorRate > 0){
+      std::bernoulli_distribution flip(config.bitErrorRate);
+      uint8_t errors = 0;
+      for(uint8_t bit = 0; bit < 8; bit++){
+        if(flip(rng))
+          errors |= 1 << bit;
+      }
+      if(errors){
+        value ^= errors;
+        corrupted++;
+      }
+    }
+
+    lineFree = start + config.byteTime;
+    if(bytesSent - burstStart < burstLength){
+      value ^= (uint8_t)(1 + rng() % 255);
+      corrupted++;
+      burstEnd = lineFree;
+    }
+    inFlight.push_back(std::make_pair(lineFree, value));
+    bytesSent++;
+    return resume;
+  }
+
+  // moves the bytes that arrived by *now* into the receive buffer
+  void settle(simtime_t now){
+    while(!inFlight.empty() && inFlight.front().first <= now){
+      if(received.size() < config.rxBufferSize)
+        received.push_back(inFlight.front().second);
+      else
+        overflows++;
+      inFlight.pop_front();
+    }
+  }
+};
+
+
+// HardwareSerial look-alike for one end of a serial link
+class SimSerial {
+public:
+  SimSerial(SimNode& node, SimSerialLine& rx, SimSerialLine& tx) : node(node), rx(rx), tx(tx) {}
+
+  simtime_t callCost = simMicrosecond; // available(), read(), ...
+
+  void begin(unsigned long){}
+  void setTimeout(unsigned long ms){ timeout = ms; }
+
+  int available(){
+    node.spend(callCost);
+    rx.settle(node.now());
+    return (int)rx.received.size();
+  }
+
+  int peek(){
+    if(!available())
+      return -1;
+    return rx.received.front();
+  }
+
+  int read(){
+    if(!available())
+      return -1;
+    uint8_t value = rx.received.front();
+    rx.received.pop_front();
+    return value;
+  }
+
+  // like Stream::readBytes(), waits up to the timeout for every byte
+  size_t readBytes(uint8_t* buffer, size_t length){
+    size_t count = 0;
+    simtime_t start = node.now();
+    while(count < length){
+      int value = read();
+      if(value >= 0){
+        buffer[count++] = (uint8_t)value;
+        start = node.now();
+        continue;
+      }
+      if(node.now() - start >= timeout * simMillisecond)
+        break;
+      node.spend(rx.config.byteTime);
+    }
+    return count;
+  }
+  size_t readBytes(char* buffer, size_t length){ return readBytes((uint8_t*)buffer, length); }
+
+  // room in the transmit buffer, write() doesn't block for this many bytes
+  int availableForWrite(){
+    node.spend(callCost);
+    simtime_t queuedUntil = node.now() + tx.config.latency;
+    if(tx.lineFree <= queuedUntil)
+      return (int)tx.config.txBufferSize;
+    simtime_t queued = (tx.lineFree - queuedUntil + tx.config.byteTime - 1) / tx.config.byteTime;
+    return queued >= tx.config.txBufferSize ? 0 : (int)(tx.config.txBufferSize - queued);
+  }
+
+  size_t write(uint8_t value){
+    node.spend(callCost);
+    node.waitUntil(tx.send(node.now(), value));
+    return 1;
+  }
+
+  size_t write(const uint8_t* buffer, size_t size){
+    for(size_t i = 0; i < size; i++)
+      write(buffer[i]);
+    return size;
+  }
+  size_t write(const char* buffer, size_t size){ return write((const uint8_t*)buffer, size); }
+
+  size_t print(const char* text){ return write(text, strlen(text)); }
+  size_t println(const char* text = ""){ return print(text) + print("\r\n"); }
+
+  // waits until everything written went out on the line
+  void flush(){ node.waitUntil(tx.lineFree); }
+
+private:
+  SimNode& node;
+  SimSerialLine& rx;
+  SimSerialLine& tx;
+  unsigned long timeout = 1000;
+};
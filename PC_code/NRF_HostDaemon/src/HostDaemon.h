@@ -0,0 +1,305 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "HostLink.h"
+
+// Drives HostLinks on any number of transmitter ports from one thread, with epoll on non-blocking ports: a port
+// is read when the transmitter wrote something and written when there's room, the thread sleeps until one of
+// them or the next timeout. Program.cs spins on a core until the next ack instead, one transfer at a time.
+//
+// Jobs wait in one queue, highest priority first, and go out on the first idle port they may use. submit() and
+// stop() can be called from any thread, everything else (the callbacks too) runs on the thread in run().
+// A failed job goes back into the queue while it has retries left, the port it failed on rests a while.
+
+class HostDaemon {
+public:
+  bool verbose = false;            // print the transmitter's debug messages
+  unsigned long openDelay = 2000;  // ms before the first job on a port, opening it resets a Nano
+
+  HostDaemon(){
+    epoll = epoll_create1(EPOLL_CLOEXEC);
+    wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    watch(wakeup, [this](){
+      uint64_t count;
+      while(read(wakeup, &count, sizeof(count)) > 0);
+    });
+  }
+
+  ~HostDaemon(){
+    for(std::unique_ptr<Port>& port : ports)
+      close(port->fd);
+    close(wakeup);
+    close(epoll);
+  }
+
+  // opens a transmitter's serial port (or a pty), returns its index or -1
+  int addPort(const char* path, speed_t baud = B1000000){
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if(fd < 0){
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+      return -1;
+    }
+    termios tty;
+    if(tcgetattr(fd, &tty) == 0){ // raw, 8N1, no flow control, like OpenPort
+      cfmakeraw(&tty);
+      cfsetspeed(&tty, baud);
+      tty.c_cflag |= CLOCAL | CREAD;
+      tty.c_cflag &= ~(CSTOPB | CRTSCTS);
+      tcsetattr(fd, TCSANOW, &tty);
+      tcflush(fd, TCIOFLUSH);
+    }
+
+    int index = (int)ports.size();
+    ports.emplace_back(new Port());
+    Port& port = *ports.back();
+    port.fd = fd;
+    port.name = path;
+    port.link.port = index;
+    port.link.rest(now(), openDelay);
+    port.link.log = [this, index](const char* message){
+      if(verbose)
+        printf("[port %d] %s\n", index, message);
+    };
+    port.link.finished = [this](HostJob& job){ finished.push_back(std::move(job)); };
+    watch(fd, [this, index](){ readPort(index); }, &port.events);
+    return index;
+  }
+
+  // calls *readable* on the daemon's thread whenever *fd* has something to read, e.g. commands on stdin
+  // returns false if epoll can't wait for it (a regular file)
+  bool watch(int fd, std::function<void()> readable, uint32_t* events = NULL){
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if(epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) != 0)
+      return false;
+    watchers[fd] = std::move(readable);
+    if(events)
+      *events = EPOLLIN;
+    return true;
+  }
+
+  void unwatch(int fd){
+    epoll_ctl(epoll, EPOLL_CTL_DEL, fd, NULL);
+    watchers.erase(fd);
+  }
+
+  // queues *job*, returns its id
+  unsigned long submit(HostJob job){
+    std::lock_guard<std::mutex> guard(lock);
+    job.id = ++lastId;
+    unsigned long id = job.id;
+    submitted.push_back(std::move(job));
+    signal();
+    return id;
+  }
+
+  // run() returns once the jobs that are going out finished, the queued ones are dropped
+  void stop(){
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+    signal();
+  }
+
+  void run(){
+    epoll_event events[16];
+    while(true){
+      takeSubmitted();
+      unsigned long time = now();
+      for(std::unique_ptr<Port>& port : ports)
+        port->link.poll(time);
+      complete();
+      if(stopped())
+        return;
+      dispatch(now());
+      for(size_t i = 0; i < ports.size(); i++)
+        writePort(i);
+
+      int count = epoll_wait(epoll, events, 16, timeout());
+      for(int i = 0; i < count; i++){
+        if(events[i].events & EPOLLOUT){
+          for(size_t p = 0; p < ports.size(); p++){
+            if(ports[p]->fd == events[i].data.fd)
+              writePort(p);
+          }
+        }
+        if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+          std::map<int, std::function<void()>>::iterator watcher = watchers.find(events[i].data.fd);
+          if(watcher != watchers.end())
+            watcher->second();
+        }
+      }
+    }
+  }
+
+  int portCount() const { return (int)ports.size(); }
+  HostLink& link(int port){ return ports[port]->link; }
+  const char* portName(int port) const { return ports[port]->name.c_str(); }
+  size_t queued() const { return queue.size(); } // on the daemon's thread
+
+  static unsigned long now(){
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (unsigned long)time.tv_sec * 1000 + time.tv_nsec / 1000000;
+  }
+
+private:
+  struct Port {
+    int fd = -1;
+    std::string name;
+    HostLink link;
+    uint32_t events = 0;     // what epoll waits for on the port
+    size_t written = 0;      // of the link's output
+  };
+
+  int epoll = -1;
+  int wakeup = -1;           // eventfd, submit() and stop() from other threads
+  std::vector<std::unique_ptr<Port>> ports;
+  std::map<int, std::function<void()>> watchers;
+  std::map<std::pair<int, unsigned long>, HostJob> queue; // by (-priority, id)
+  std::vector<HostJob> finished;
+
+  std::mutex lock;           // the members below
+  std::vector<HostJob> submitted;
+  unsigned long lastId = 0;
+  bool stopping = false;
+
+  void signal(){
+    uint64_t one = 1;
+    if(write(wakeup, &one, sizeof(one)) < 0){} // full, it's woken up anyway
+  }
+
+  void takeSubmitted(){
+    std::lock_guard<std::mutex> guard(lock);
+    for(HostJob& job : submitted){
+      if(job.port >= (int)ports.size()){
+        job.result.id = job.id;
+        job.result.error = "No such port";
+        finished.push_back(std::move(job));
+        continue;
+      }
+      std::pair<int, unsigned long> key(-job.priority, job.id);
+      queue.emplace(key, std::move(job));
+    }
+    submitted.clear();
+  }
+
+  bool stopped(){
+    std::lock_guard<std::mutex> guard(lock);
+    if(!stopping)
+      return false;
+    for(std::unique_ptr<Port>& port : ports){
+      if(port->link.sending())
+        return false;
+    }
+    return true;
+  }
+
+  // the callbacks of the jobs that ended, the failed ones with retries left go back into the queue
+  void complete(){
+    std::vector<HostJob> ended;
+    ended.swap(finished);
+    for(HostJob& job : ended){
+      if(!job.result.ok && job.result.attempts > 0 && job.result.attempts <= job.retries){
+        std::pair<int, unsigned long> key(-job.priority, job.id);
+        queue.emplace(key, std::move(job));
+        continue;
+      }
+      if(job.done)
+        job.done(job.result);
+    }
+  }
+
+  // the first job every idle port may take
+  void dispatch(unsigned long time){
+    for(std::unique_ptr<Port>& port : ports){
+      if(!port->link.idle(time))
+        continue;
+      for(std::map<std::pair<int, unsigned long>, HostJob>::iterator i = queue.begin(); i != queue.end(); ++i){
+        if(i->second.port >= 0 && i->second.port != port->link.port)
+          continue;
+        HostJob job = std::move(i->second);
+        queue.erase(i);
+        port->link.start(job, time);
+        break;
+      }
+    }
+  }
+
+  // ms epoll may sleep: until the next timeout of a port, -1 without one
+  int timeout(){
+    unsigned long time = now();
+    long shortest = -1;
+    for(std::unique_ptr<Port>& port : ports){
+      if(!port->link.waiting(time))
+        continue;
+      long left = (long)port->link.timeLeft(time);
+      if(shortest < 0 || left < shortest)
+        shortest = left;
+    }
+    return (int)(shortest > 0 ? shortest + 1 : shortest);
+  }
+
+  void readPort(size_t index){
+    Port& port = *ports[index];
+    uint8_t buffer[4096];
+    while(true){
+      ssize_t count = read(port.fd, buffer, sizeof(buffer));
+      if(count > 0){
+        port.link.receive(buffer, (size_t)count, now());
+        continue;
+      }
+      if(count < 0 && errno == EINTR)
+        continue;
+      if(count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+        fprintf(stderr, "%s: %s\n", port.name.c_str(), count == 0 ? "closed" : strerror(errno));
+        unwatch(port.fd); // the job times out
+      }
+      break;
+    }
+    writePort(index); // the acks freed credits
+  }
+
+  void writePort(size_t index){
+    Port& port = *ports[index];
+    std::vector<uint8_t>& out = port.link.output();
+    while(port.written < out.size()){
+      ssize_t count = write(port.fd, &out[port.written], out.size() - port.written);
+      if(count > 0){
+        port.written += (size_t)count;
+        continue;
+      }
+      if(count < 0 && errno == EINTR)
+        continue;
+      break;
+    }
+    if(port.written == out.size()){
+      out.clear();
+      port.written = 0;
+    }
+    uint32_t events = EPOLLIN | (out.empty() ? 0u : (uint32_t)EPOLLOUT);
+    if(events != port.events && watchers.count(port.fd)){
+      epoll_event event = {};
+      event.events = events;
+      event.data.fd = port.fd;
+      epoll_ctl(epoll, EPOLL_CTL_MOD, port.fd, &event);
+      port.events = events;
+    }
+  }
+};
@@ -0,0 +1,617 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+#include <Protocol.h>
+#include <SlidingWindow.h>
+#include <Compression.h>
+#include <Crc32.h>
+
+// The PC side of the protocol for one transmitter port, as a state machine instead of the blocking calls of
+// Program.cs: receive() takes whatever came in on the port, poll() the time, and both leave what has to go out in
+// output(). Nothing here waits, so one thread (HostDaemon.h) drives any number of ports.
+//
+// A job is a message to the Inkplate, the way SendByteArray, SendString and SendImage3Bit send it: the wake flag,
+// the Inkplate flag as one payload, the init flag and the data, *credits* payloads ahead of the acks. Images are
+// compressed when that makes them smaller, dense otherwise, checked end to end and their bad blocks repaired
+// (CheckTransfer, RepairBlocks, RepairRects). Every step is a list of Steps, a flag that waits for its ack or
+// a run of payloads. Keep it in step with Program.cs when the protocol changes.
+
+enum HostJobType {
+  hostBytes,    // SendByteArray, IPBytesFlag
+  hostString,   // SendString, IPStringFlag, the text UTF-8
+  hostImage3Bit // SendImage3Bit, packed 3 bit pixels, the left one in the high nibble
+};
+
+struct HostJobResult {
+  unsigned long id = 0;
+  bool ok = false;
+  int port = -1;
+  unsigned int attempts = 0;   // times the job started, retries included
+  unsigned long bytesSent = 0; // to the transmitter, flags, repairs and resends included
+  unsigned long millis = 0;    // from the first start to the end
+  std::string error;
+};
+
+struct HostJob {
+  unsigned long id = 0;        // set by HostDaemon::submit()
+  HostJobType type = hostBytes;
+  std::vector<uint8_t> data;
+  int height = 0, width = 0;   // of an image
+  int priority = 0;            // higher goes first, jobs of the same priority in the order they came
+  int port = -1;               // the port it has to go out on, -1 any
+  int node = -1;               // the receiver it goes to (SelectNode), -1 whichever the port has selected
+  unsigned int retries = 0;    // times it's queued again after it failed
+  std::function<void(const HostJobResult&)> done; // runs on the daemon's thread
+
+  HostJobResult result;        // so far, kept over the retries
+  unsigned long started = 0;   // ms, the first start
+};
+
+const uint8_t hostBytesFlag = 0x01;            // IPBytesFlag
+const uint8_t hostStringFlag = 0x03;           // IPStringFlag
+const uint8_t hostRectsFlag = 0x05;            // IPRectsFlag
+const uint8_t hostCompressed3BitImageFlag = 0x06; // IPCompressedImage3BitFlag
+const uint8_t hostDense3BitImageFlag = 0x08;   // IPDense3BitImageFlag
+const uint8_t hostCachedImageFlag = 0x09;      // IPCachedImageFlag
+const uint8_t hostCheckedBit = 0x80;           // IPCheckedBit
+const int hostCheckBlockRows = 8;              // checkBlockRows
+const int hostMaxImageBlocks = 256;            // maxImageBlocks
+const int hostMaxRepairRounds = 3;             // maxRepairRounds
+const int hostDisplayHeight = 600;             // MyImageExtensions.inkplateHeight, E_INK_HEIGHT
+const int hostDisplayWidth = 800;              // MyImageExtensions.inkplateWidth, E_INK_WIDTH
+
+
+class HostLink {
+public:
+  unsigned int credits = windowSize + ingestPayloads; // payloads written without an ack
+  unsigned long ackTimeout = 2000;         // ms, SendInitFlag
+  unsigned long listenWait = listenStrobeTime(); // ms more for a wake flag, the receiver may be in low power listening
+  unsigned long payloadTimeout = 5000;     // ms without an ack before a transfer is given up, the transmitter naks well before
+  unsigned long recoverTime = 1500;        // ms the port rests after a failed job, the boards give up on the transfer meanwhile
+  bool compressImages = true;              // compressImages in Program.cs
+  bool checkImages = true;                 // checkImages in Program.cs
+  bool cacheImages = true;                 // cacheImages in Program.cs, needs checkImages
+  std::function<void(const char*)> log;    // the transmitter's debug messages and what goes wrong
+  std::function<void(HostJob&)> finished;  // the job is done, failed or not, see job.result
+
+  // counters since the port opened
+  unsigned long jobsDone = 0, jobsFailed = 0;
+  unsigned long naks = 0, timeouts = 0;
+  unsigned long cacheHits = 0, cacheMisses = 0; // images the Inkplate showed from its cache, and the lookups that failed
+  unsigned long cacheBytesSaved = 0;       // the image bytes the hits didn't send, uncompressed (dense)
+  long session = -1;                       // the Inkplate's session from the last wake (see Protocol.h)
+  std::vector<uint8_t> status;             // counters from the last status message (see LinkStats.h)
+
+  int port = -1;                           // index in HostDaemon, for the results
+
+  // no job and not resting
+  bool idle(unsigned long now) const { return !busy && (long)(now - restUntil) >= 0; }
+
+  // the port isn't used before *now* + *ms*, e.g. a Nano that resets when the port opens
+  void rest(unsigned long now, unsigned long ms){ restUntil = now + ms; }
+
+  void start(HostJob& job, unsigned long now){
+    this->job = std::move(job);
+    if(this->job.result.attempts++ == 0)
+      this->job.started = now;
+    this->job.result.id = this->job.id;
+    this->job.result.port = port;
+    this->job.result.error.clear();
+    busy = true;
+    attempt = 0;
+    lookup = cacheImages && checkImages && this->job.type == hostImage3Bit
+          && this->job.height == hostDisplayHeight && this->job.width == hostDisplayWidth; // only whole screens are cached
+    stage = this->job.node >= 0 && this->job.node != selectedNode ? stageNode : stageMessage;
+    prepare(now);
+  }
+
+  void receive(const uint8_t data[], size_t size, unsigned long now){
+    for(size_t i = 0; i < size; i++)
+      parse(data[i], now);
+  }
+
+  // timeouts
+  void poll(unsigned long now){
+    if(!busy || steps.empty() || (long)(now - deadline) < 0)
+      return;
+    timeouts++;
+    stepFailed(steps[step].payloads ? "No ack for the payloads" : "No ack received", now);
+  }
+
+  // ms until poll() has something to do
+  unsigned long timeLeft(unsigned long now) const {
+    unsigned long until = busy ? deadline : restUntil;
+    return (long)(until - now) <= 0 ? 0 : until - now;
+  }
+
+  bool waiting(unsigned long now) const { return busy || (long)(restUntil - now) > 0; }
+  bool sending() const { return busy; }
+
+  std::vector<uint8_t>& output(){ return out; }
+
+private:
+  enum Stage { stageNode, stageMessage, stageCheck, stageRepair };
+
+  struct Step {
+    bool payloads;           // a run of payloads, otherwise a flag
+    uint8_t type;            // of the flag
+    unsigned long count;     // of the flag, the ack it waits for
+    unsigned long timeout;
+    std::vector<uint8_t> data;
+  };
+
+  HostJob job;
+  bool busy = false;
+  unsigned long restUntil = 0;
+  int selectedNode = 0;
+  std::vector<uint8_t> out;
+
+  // the job
+  Stage stage = stageMessage;
+  int attempt = 0;               // 1 - the image goes out again, raw
+  bool lookup = false;           // the message asks the Inkplate for the image from its cache (ShowCachedImage)
+                                 // it's saved after its refresh, the same image again right after misses
+  int repairRound = 0;
+  std::vector<uint8_t> rects;    // the rectangles of the last repair
+  std::vector<uint8_t> bad;      // blocks or rectangles the last check found bad
+  bool checkAcked = false;
+  std::vector<Step> steps;
+  size_t step = 0;
+  unsigned long deadline = 0;
+  unsigned long sent = 0, acked = 0; // payloads of the current step
+  uint32_t transferCrc = 0;      // of the data of the last message, for checkFlag
+
+  // the transmitter's stream (ReadFromArduino)
+  uint8_t flag[flagBytesCount];
+  unsigned int flagLength = 0;
+  bool inLine = false;           // a debug message after a stringFlag, up to '\n'
+  unsigned long statusLeft = 0;  // counters after a statusFlag
+  std::string line;
+
+  void debug(const char* message){
+    if(log)
+      log(message);
+  }
+
+  void parse(uint8_t value, unsigned long now){
+    if(inLine){
+      if(value == '\n'){
+        inLine = false;
+        debug(("Transmitter: " + line).c_str());
+      }
+      else if(value != '\r'){
+        line += (char)value;
+      }
+      return;
+    }
+    if(statusLeft > 0){
+      status.push_back(value);
+      statusLeft--;
+      return;
+    }
+    flag[flagLength++] = value;
+    if(flagLength < flagBytesCount)
+      return;
+    flagLength = 0;
+    unsigned long count = readFlagCount(flag);
+    if(flag[0] == stringFlag){
+      inLine = true;
+      line.clear();
+    }
+    else if(flag[0] == ackFlag){
+      onAck(count, now);
+    }
+    else if(flag[0] == nakFlag){
+      naks++;
+      debug("NAK received");
+      if(busy && !steps.empty())
+        stepFailed("NAK received", now);
+    }
+    else if(flag[0] == sessionFlag){
+      session = (long)count;
+    }
+    else if(flag[0] == checkFlag){
+      bad.push_back((uint8_t)count);
+    }
+    else if(flag[0] == statusFlag){
+      status.clear();
+      statusLeft = count;
+    }
+  }
+
+  void onAck(unsigned long count, unsigned long now){
+    if(!busy || steps.empty())
+      return; // left over from a transfer that was given up
+    Step& current = steps[step];
+    if(!current.payloads){
+      if(count != current.count){
+        stepFailed("Incorrect ack of a flag", now);
+        return;
+      }
+      if(current.type == checkFlag)
+        checkAcked = true;
+      next(now);
+      return;
+    }
+    if(count != acked){
+      char message[64];
+      snprintf(message, sizeof(message), "Incorrect ack | Expected: %lu, Received: %lu", acked, count);
+      fail(message, now);
+      return;
+    }
+    acked++;
+    deadline = now + payloadTimeout;
+    if(acked == payloadsOf(current))
+      next(now);
+    else
+      writePayloads();
+  }
+
+  static unsigned long payloadsOf(const Step& s){
+    return (s.data.size() + payloadSize - 1) / payloadSize;
+  }
+
+  void addFlag(uint8_t type, unsigned long count, unsigned long timeout){
+    steps.push_back(Step{false, type, count, timeout, std::vector<uint8_t>()});
+  }
+
+  void addPayloads(std::vector<uint8_t> data){
+    steps.push_back(Step{true, 0, 0, 0, std::move(data)});
+  }
+
+  // the steps of the current stage, runs the first one
+  void prepare(unsigned long now){
+    steps.clear();
+    step = 0;
+    if(stage == stageNode){
+      addFlag(nodeFlag, (unsigned long)job.node, ackTimeout);
+    }
+    else if(stage == stageMessage){
+      prepareMessage();
+    }
+    else if(stage == stageCheck){
+      bad.clear();
+      checkAcked = false;
+      addFlag(checkFlag, transferCrc, ackTimeout);
+    }
+    else{
+      prepareRepair();
+    }
+    run(now);
+  }
+
+  // SendToInkplate: the wake flag, the Inkplate flag, then the data
+  void addMessage(const uint8_t inkplateFlag[], std::vector<uint8_t> data){
+    Crc32 crc;
+    crc.update(data.data(), data.size());
+    transferCrc = crc.value();
+    unsigned long length = data.size();
+    addFlag(transmitBytesWakeFlag, flagBytesCount, ackTimeout + listenWait);
+    addPayloads(std::vector<uint8_t>(inkplateFlag, inkplateFlag + flagBytesCount));
+    addFlag(transmitBytesFlag, length, ackTimeout);
+    addPayloads(std::move(data));
+  }
+
+  void prepareMessage(){
+    uint8_t inkplateFlag[flagBytesCount];
+    if(job.type != hostImage3Bit){
+      writeFlag(inkplateFlag, job.type == hostString ? hostStringFlag : hostBytesFlag, job.data.size());
+      addMessage(inkplateFlag, job.data);
+      return;
+    }
+
+    int height = job.height, width = job.width;
+    if(lookup){
+      Crc32 crc;
+      crc.update(job.data.data(), (size_t)height * width / 2);
+      writeFlag(inkplateFlag, hostCachedImageFlag, crc.value());
+      addCheckedMessage(inkplateFlag, std::vector<uint8_t>(), false);
+      return;
+    }
+    std::vector<uint8_t> data;
+    if(compressImages && attempt == 0) // a flipped bit spoils the rest of a compressed image, the second attempt goes out raw
+      data = compressImage3Bit(job.data.data(), height, width);
+    std::vector<uint8_t> raw = denseImage3Bit(job.data.data(), height, width);
+    if(!data.empty() && data.size() < raw.size()){
+      writeFlag(inkplateFlag, hostCompressed3BitImageFlag, data.size());
+    }
+    else{
+      uint8_t dense[flagBytesCount] = {hostDense3BitImageFlag, (uint8_t)(height >> 8), (uint8_t)height,
+                                       (uint8_t)(width >> 8), (uint8_t)width};
+      memcpy(inkplateFlag, dense, flagBytesCount);
+      data.swap(raw);
+    }
+    addCheckedMessage(inkplateFlag, data, true);
+  }
+
+  // SendChecked: the CRC trailer, of the message, then of every block of the image or of every rectangle
+  void addCheckedMessage(const uint8_t inkplateFlag[], std::vector<uint8_t> data, bool image){
+    if(!checkImages){
+      addMessage(inkplateFlag, std::move(data));
+      return;
+    }
+    uint8_t checkedFlag[flagBytesCount];
+    memcpy(checkedFlag, inkplateFlag, flagBytesCount);
+    checkedFlag[0] |= hostCheckedBit;
+    Crc32 crc;
+    crc.update(checkedFlag, flagBytesCount);
+    crc.update(data.data(), data.size());
+    size_t length = data.size();
+    appendCrc(data, crc.value());
+
+    if(image && (job.height + hostCheckBlockRows - 1) / hostCheckBlockRows <= hostMaxImageBlocks){
+      unsigned long blockBytes = (unsigned long)job.width * hostCheckBlockRows / 2;
+      unsigned long imageBytes = (unsigned long)job.height * job.width / 2;
+      for(unsigned long offset = 0; offset < imageBytes; offset += blockBytes){
+        crc.reset();
+        crc.update(&job.data[offset], imageBytes - offset < blockBytes ? imageBytes - offset : blockBytes);
+        appendCrc(data, crc.value());
+      }
+    }
+    if(inkplateFlag[0] == hostRectsFlag){
+      std::vector<std::pair<unsigned long, unsigned long>> parts = splitRects(data.data(), length);
+      for(size_t i = 0; i < parts.size() && i < (size_t)hostMaxImageBlocks; i++){
+        crc.reset();
+        crc.update(&data[parts[i].first + 8], parts[i].second - 8);
+        appendCrc(data, crc.value());
+      }
+    }
+    addMessage(checkedFlag, std::move(data));
+  }
+
+  // RepairRects: the bad ones of *rects*, which start out as the bad blocks of the image (RepairBlocks)
+  void prepareRepair(){
+    std::vector<std::pair<unsigned long, unsigned long>> parts = splitRects(rects.data(), rects.size());
+    std::vector<uint8_t> repair;
+    for(uint8_t index : bad){
+      repair.insert(repair.end(), &rects[parts[index].first], &rects[parts[index].first + parts[index].second]);
+    }
+    char message[64];
+    snprintf(message, sizeof(message), "Repairing %u rectangles", (unsigned)bad.size());
+    debug(message);
+
+    rects = repair;
+    uint8_t inkplateFlag[flagBytesCount];
+    writeFlag(inkplateFlag, hostRectsFlag, repair.size());
+    addCheckedMessage(inkplateFlag, repair, false);
+  }
+
+  // the bad blocks of the image as rectangles, false if one isn't a block of it (checkResend)
+  bool blocksToRects(){
+    rects.clear();
+    std::vector<uint8_t> all;
+    int rowBytes = job.width / 2;
+    for(uint8_t block : bad){
+      int y = block * hostCheckBlockRows;
+      int rows = job.height - y < hostCheckBlockRows ? job.height - y : hostCheckBlockRows;
+      if(rows <= 0)
+        return false;
+      int values[] = {0, y, job.width, rows};
+      for(int value : values){
+        rects.push_back((uint8_t)(value >> 8));
+        rects.push_back((uint8_t)value);
+      }
+      rects.insert(rects.end(), &job.data[(size_t)y * rowBytes], &job.data[(size_t)(y + rows) * rowBytes]);
+      all.push_back((uint8_t)all.size());
+    }
+    bad = all;
+    return true;
+  }
+
+  void run(unsigned long now){
+    Step& current = steps[step];
+    if(current.payloads && current.data.empty()){
+      next(now);
+      return;
+    }
+    if(current.payloads){
+      sent = acked = 0;
+      deadline = now + payloadTimeout;
+      writePayloads();
+      return;
+    }
+    uint8_t bytes[flagBytesCount];
+    writeFlag(bytes, current.type, current.count);
+    out.insert(out.end(), bytes, bytes + flagBytesCount);
+    job.result.bytesSent += flagBytesCount;
+    deadline = now + current.timeout;
+  }
+
+  void writePayloads(){
+    Step& current = steps[step];
+    unsigned long total = payloadsOf(current);
+    while(sent < total && sent - acked < credits){
+      unsigned long offset = sent * payloadSize;
+      unsigned long size = current.data.size() - offset < payloadSize ? current.data.size() - offset : payloadSize;
+      out.insert(out.end(), &current.data[offset], &current.data[offset + size]);
+      job.result.bytesSent += size;
+      sent++;
+    }
+  }
+
+  // the step is done, on to the next one or the next stage
+  void next(unsigned long now){
+    if(++step < steps.size()){
+      run(now);
+      return;
+    }
+    steps.clear();
+    if(stage == stageNode){
+      selectedNode = job.node;
+      stage = stageMessage;
+    }
+    else if(stage == stageMessage && (job.type != hostImage3Bit || !checkImages)){
+      complete(now);
+      return;
+    }
+    else if(stage == stageMessage){
+      stage = stageCheck;
+    }
+    else if(stage == stageRepair){
+      repairRound++;
+      stage = stageCheck;
+    }
+    else if(lookup){ // the check of a lookup, intact if the Inkplate showed the image
+      if(checkAcked && bad.empty()){
+        cacheHits++;
+        cacheBytesSaved += ((unsigned long)job.height * job.width + 7) / 8 * 3; // denseImage3Bit()
+        complete(now);
+        return;
+      }
+      cacheMiss("Image not cached");
+    }
+    else if(!checkAcked || !bad.empty()){ // a check that found something
+      if(!repairable()){
+        if(attempt > 0){
+          fail("Image still not intact", now);
+          return;
+        }
+        debug("Image not intact, sending it again");
+        attempt++;
+        stage = stageMessage;
+      }
+      else{
+        stage = stageRepair;
+      }
+    }
+    else{
+      complete(now);
+      return;
+    }
+    prepare(now);
+  }
+
+  // the bad blocks of a check can be repaired with rectangles, otherwise the image goes out whole
+  bool repairable(){
+    bool repair;
+    if(rects.empty()) // the check of the image
+      repair = checkAcked && !bad.empty() && blocksToRects();
+    else
+      repair = repairRound < hostMaxRepairRounds && repairableRects();
+    if(!repair){
+      rects.clear();
+      repairRound = 0;
+    }
+    return repair;
+  }
+
+  // the bad rectangles of the last repair, all of them if the check didn't say which
+  bool repairableRects(){
+    size_t count = splitRects(rects.data(), rects.size()).size();
+    if(bad.empty()){
+      for(size_t i = 0; i < count; i++)
+        bad.push_back((uint8_t)i);
+    }
+    for(uint8_t index : bad){
+      if(index >= count)
+        return false;
+    }
+    return true;
+  }
+
+  // a check that didn't get its ack only means the message has to go out again
+  void stepFailed(const char* error, unsigned long now){
+    if(stage == stageMessage && lookup){ // the image goes out whole, like a miss
+      cacheMiss(error);
+      prepare(now);
+      return;
+    }
+    if(stage != stageCheck){
+      fail(error, now);
+      return;
+    }
+    debug(error);
+    checkAcked = false;
+    step = steps.size() - 1;
+    next(now);
+  }
+
+  // the lookup didn't show the image, it goes out whole
+  void cacheMiss(const char* error){
+    debug(error);
+    cacheMisses++;
+    lookup = false;
+    stage = stageMessage;
+  }
+
+  void complete(unsigned long now){
+    jobsDone++;
+    job.result.ok = true;
+    end(now);
+  }
+
+  void fail(const char* error, unsigned long now){
+    debug(error);
+    jobsFailed++;
+    job.result.ok = false;
+    job.result.error = error;
+    restUntil = now + recoverTime;
+    selectedNode = -1; // not sure the node flag made it
+    end(now);
+  }
+
+  void end(unsigned long now){
+    busy = false;
+    steps.clear();
+    rects.clear();
+    repairRound = 0;
+    job.result.millis = now - job.started;
+    if(finished)
+      finished(job);
+  }
+
+  static void appendCrc(std::vector<uint8_t>& message, uint32_t crc){
+    for(int shift = 24; shift >= 0; shift -= 8)
+      message.push_back((uint8_t)(crc >> shift));
+  }
+
+  // offset and size of every rectangle, header included (SplitRects)
+  static std::vector<std::pair<unsigned long, unsigned long>> splitRects(const uint8_t data[], unsigned long length){
+    std::vector<std::pair<unsigned long, unsigned long>> result;
+    unsigned long offset = 0;
+    while(offset + 8 <= length){
+      unsigned long width = (data[offset + 4] << 8) | data[offset + 5];
+      unsigned long height = (data[offset + 6] << 8) | data[offset + 7];
+      unsigned long size = 8 + width * height / 2;
+      result.push_back(std::make_pair(offset, size));
+      offset += size;
+    }
+    return result;
+  }
+
+  // CompressImage3Bit: height and width, then the compressed pixels
+  static std::vector<uint8_t> compressImage3Bit(const uint8_t image[], int height, int width){
+    unsigned long length = (unsigned long)height * width / 2;
+    std::vector<uint8_t> result(4 + compressedBound(length));
+    result[0] = (uint8_t)(height >> 8);
+    result[1] = (uint8_t)height;
+    result[2] = (uint8_t)(width >> 8);
+    result[3] = (uint8_t)width;
+    Compressor compressor;
+    result.resize(4 + compressor.compress(image, length, &result[4]));
+    return result;
+  }
+
+  // ConvertBitmap3bitToDense: 8 pixels in 3 bytes, the first one in the top 3 bits
+  static std::vector<uint8_t> denseImage3Bit(const uint8_t image[], int height, int width){
+    unsigned long pixels = (unsigned long)height * width;
+    std::vector<uint8_t> dense((pixels + 7) / 8 * 3);
+    for(unsigned long i = 0; i < pixels / 2; i += 4){
+      uint32_t bits = 0;
+      for(unsigned long j = i; j < i + 4; j++){
+        uint8_t packed = j < pixels / 2 ? image[j] : 0;
+        bits = (bits << 6) | ((packed >> 1) & 0x38) | (packed & 0x07);
+      }
+      dense[i / 4 * 3] = (uint8_t)(bits >> 16);
+      dense[i / 4 * 3 + 1] = (uint8_t)(bits >> 8);
+      dense[i / 4 * 3 + 2] = (uint8_t)bits;
+    }
+    return dense;
+  }
+};
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "HostDaemon.h"
+
+// Host daemon for one or more transmitters (see HostDaemon.h): takes commands on stdin, one per line, queues them
+// and sends them on whichever port is free, printing a line for every job that ended.
+//
+// usage: program [-v] [-w open delay ms] [-r retries] [-c on|off] [-i on|off] port...
+//
+// commands, options (priority=N, port=N, node=N, retries=N) go right after the command:
+//  send <count>                   - test bytes 0, 1, 2, ... (send in Program.cs)
+//  sendfile <file>                - the bytes of a file
+//  string <text>                  - a string for the Inkplate
+//  image <file> [height width]    - packed 3 bit pixels (NRF_ImagePrep -f packed), 600 x 800 by default
+//  status                         - the queue and the counters of every port, the Inkplate's image cache too
+//  quit                           - stops once the jobs that are going out finished
+// At the end of stdin it stops once every job ended.
+
+HostDaemon host;
+unsigned int retries = 3;
+unsigned long pending = 0; // jobs submitted that didn't end yet
+bool inputClosed = false;
+std::string input;
+
+
+bool readFile(const char* path, std::vector<uint8_t>& data){
+  FILE* file = fopen(path, "rb");
+  if(!file)
+    return false;
+  data.clear();
+  uint8_t buffer[65536];
+  size_t count;
+  while((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    data.insert(data.end(), buffer, buffer + count);
+  fclose(file);
+  return true;
+}
+
+
+void printResult(const HostJobResult& result){
+  if(result.ok)
+    printf("job %lu done on port %d: %lu bytes in %lu ms", result.id, result.port, result.bytesSent, result.millis);
+  else
+    printf("job %lu failed on port %d: %s", result.id, result.port, result.error.c_str());
+  printf(result.attempts > 1 ? " (%u attempts)\n" : "\n", result.attempts);
+  fflush(stdout);
+  pending--;
+  if(inputClosed && pending == 0)
+    host.stop();
+}
+
+
+void printStatus(){
+  printf("%zu jobs queued, %lu not ended\n", host.queued(), pending);
+  for(int i = 0; i < host.portCount(); i++){
+    HostLink& link = host.link(i);
+    printf("port %d %s: %s, %lu done, %lu failed, %lu naks, %lu timeouts, session %ld, cache %lu hits %lu misses"
+           " %lu bytes not sent\n", i, host.portName(i), link.sending() ? "sending" : "idle", link.jobsDone,
+           link.jobsFailed, link.naks, link.timeouts, link.session, link.cacheHits, link.cacheMisses, link.cacheBytesSaved);
+  }
+  fflush(stdout);
+}
+
+
+void command(const std::string& line){
+  std::vector<std::string> words;
+  size_t position = 0;
+  while(true){
+    size_t start = line.find_first_not_of(" \t\r", position);
+    if(start == std::string::npos)
+      break;
+    size_t end = line.find_first_of(" \t\r", start);
+    words.push_back(line.substr(start, end == std::string::npos ? std::string::npos : end - start));
+    if(end == std::string::npos)
+      break;
+    position = end;
+  }
+  if(words.empty())
+    return;
+
+  HostJob job;
+  job.retries = retries;
+  size_t arg = 1;
+  for(; arg < words.size(); arg++){
+    size_t equals = words[arg].find('=');
+    if(equals == std::string::npos)
+      break;
+    std::string key = words[arg].substr(0, equals);
+    int value = atoi(words[arg].c_str() + equals + 1);
+    if(key == "priority")
+      job.priority = value;
+    else if(key == "port")
+      job.port = value;
+    else if(key == "node")
+      job.node = value;
+    else if(key == "retries")
+      job.retries = value;
+    else
+      break;
+  }
+  size_t args = words.size() - arg;
+
+  const std::string& name = words[0];
+  if(name == "status"){
+    printStatus();
+    return;
+  }
+  if(name == "quit"){
+    host.stop();
+    return;
+  }
+  if(name == "send" && args == 1){
+    long count = atol(words[arg].c_str());
+    for(long i = 0; i < count; i++)
+      job.data.push_back((uint8_t)i);
+  }
+  else if(name == "sendfile" && args == 1){
+    if(!readFile(words[arg].c_str(), job.data)){
+      printf("%s: can't read\n", words[arg].c_str());
+      return;
+    }
+  }
+  else if(name == "string" && args >= 1){
+    job.type = hostString;
+    size_t start = 0;
+    for(size_t i = 0; i < arg; i++) // the text as it was typed, spaces included
+      start = line.find(words[i], start) + words[i].size();
+    start = line.find(words[arg], start);
+    std::string text = line.substr(start);
+    job.data.assign(text.begin(), text.end());
+  }
+  else if(name == "image" && (args == 1 || args == 3)){
+    job.type = hostImage3Bit;
+    job.height = args == 3 ? atoi(words[arg + 1].c_str()) : hostDisplayHeight;
+    job.width = args == 3 ? atoi(words[arg + 2].c_str()) : hostDisplayWidth;
+    if(!readFile(words[arg].c_str(), job.data)){
+      printf("%s: can't read\n", words[arg].c_str());
+      return;
+    }
+    if(job.width <= 0 || job.width % 2 != 0 || job.height <= 0 || job.data.size() != (size_t)job.height * job.width / 2){
+      printf("%s: not a packed 3 bit image of %d x %d\n", words[arg].c_str(), job.height, job.width);
+      return;
+    }
+  }
+  else{
+    printf("unknown command: %s\n", line.c_str());
+    return;
+  }
+  if(job.data.empty()){
+    printf("nothing to send\n");
+    return;
+  }
+  job.done = printResult;
+  pending++;
+  unsigned long id = host.submit(job);
+  printf("job %lu queued\n", id);
+  fflush(stdout);
+}
+
+
+void readInput(){
+  char buffer[4096];
+  ssize_t count = read(STDIN_FILENO, buffer, sizeof(buffer));
+  if(count <= 0){
+    if(count < 0)
+      return;
+    inputClosed = true;
+    host.unwatch(STDIN_FILENO);
+    if(!input.empty())
+      command(input);
+    input.clear();
+    if(pending == 0)
+      host.stop();
+    return;
+  }
+  input.append(buffer, (size_t)count);
+  size_t end;
+  while((end = input.find('\n')) != std::string::npos){
+    std::string line = input.substr(0, end);
+    input.erase(0, end + 1);
+    command(line);
+  }
+}
+
+
+void usage(){
+  fprintf(stderr, "usage: program [-v] [-w open delay ms] [-r retries] [-c on|off] [-i on|off] port...\n");
+  exit(2);
+}
+
+
+int main(int argc, char* argv[]){
+  std::vector<const char*> ports;
+  bool check = true;
+  bool cache = true;
+  for(int i = 1; i < argc; i++){
+    bool hasValue = i + 1 < argc;
+    if(strcmp(argv[i], "-v") == 0)
+      host.verbose = true;
+    else if(strcmp(argv[i], "-w") == 0 && hasValue)
+      host.openDelay = atol(argv[++i]);
+    else if(strcmp(argv[i], "-r") == 0 && hasValue)
+      retries = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-c") == 0 && hasValue)
+      check = strcmp(argv[++i], "off") != 0;
+    else if(strcmp(argv[i], "-i") == 0 && hasValue)
+      cache = strcmp(argv[++i], "off") != 0;
+    else if(argv[i][0] == '-')
+      usage();
+    else
+      ports.push_back(argv[i]);
+  }
+  if(ports.empty())
+    usage();
+
+  for(const char* path : ports){
+    int port = host.addPort(path);
+    if(port < 0)
+      return 1;
+    host.link(port).checkImages = check;
+    host.link(port).cacheImages = cache;
+  }
+  if(!host.watch(STDIN_FILENO, readInput)){ // a file, all of it goes into the queue first
+    fcntl(STDIN_FILENO, F_SETFL, 0);
+    while(!inputClosed)
+      readInput();
+  }
+  host.run();
+  return 0;
+}
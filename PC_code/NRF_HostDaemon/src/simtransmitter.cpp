@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <SimPipeline.h>
+#include <Crc32.h>
+
+// A transmitter behind a pty, for trying the daemon without the boards: the simulated chain of NRF_simulation
+// (transmitter, receiver and Inkplate, see SimPipeline.h) with the PC's end of the USB serial on a pseudo terminal.
+// It prints the pty's path first, the daemon opens it like a serial port. The simulation runs in real time.
+// Every refresh of the Inkplate prints the CRC-32 of the framebuffer, which is the CRC-32 of the packed 3 bit image
+// that was sent (crc32 of the NRF_ImagePrep -f packed file).
+//
+// usage: program [-l loss %] [-e bit error rate of the UART to the Inkplate] [-s seed] [-v]
+
+struct timespec wallStart;
+
+
+// ms since the start
+double wallMillis(){
+  timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (time.tv_sec - wallStart.tv_sec) * 1000.0 + (time.tv_nsec - wallStart.tv_nsec) / 1e6;
+}
+
+
+int main(int argc, char* argv[]){
+  PipelineConfig config;
+  for(int i = 1; i < argc; i++){
+    bool hasValue = i + 1 < argc;
+    if(strcmp(argv[i], "-l") == 0 && hasValue)
+      config.air.loss = atof(argv[++i]) / 100;
+    else if(strcmp(argv[i], "-e") == 0 && hasValue)
+      config.receiverToDisplay.bitErrorRate = atof(argv[++i]);
+    else if(strcmp(argv[i], "-s") == 0 && hasValue)
+      config.air.seed = config.receiverToDisplay.seed = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-v") == 0)
+      config.verbose = true;
+    else{
+      fprintf(stderr, "usage: program [-l loss %%] [-e bit error rate] [-s seed] [-v]\n");
+      return 2;
+    }
+  }
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0){
+    perror("pty");
+    return 1;
+  }
+  const char* path = ptsname(master);
+  int slave = open(path, O_RDWR | O_NOCTTY); // kept open, so the pty stays up while nothing else has it open
+  termios tty;
+  tcgetattr(slave, &tty);
+  cfmakeraw(&tty);
+  tcsetattr(slave, TCSANOW, &tty);
+  fcntl(master, F_SETFL, O_NONBLOCK);
+  printf("%s\n", path);
+  fflush(stdout);
+
+  SimPipeline pipeline(config);
+  SimNode& pc = pipeline.pcNode;
+  clock_gettime(CLOCK_MONOTONIC, &wallStart);
+  pipeline.runOnPc([&](){
+    simtime_t start = pc.now();
+    unsigned long refreshes = 0;
+    size_t bytes = 0;
+    std::vector<uint8_t> out;
+    while(true){
+      uint8_t buffer[4096];
+      ssize_t count = read(master, buffer, sizeof(buffer));
+      if(count > 0)
+        pipeline.pcPort.write(buffer, (size_t)count);
+
+      out.clear();
+      while(pipeline.pcPort.available() > 0)
+        out.push_back((uint8_t)pipeline.pcPort.read());
+      for(size_t written = 0; written < out.size(); ){
+        ssize_t done = write(master, &out[written], out.size() - written);
+        if(done > 0)
+          written += (size_t)done;
+        else
+          usleep(1000); // the pty is full, nobody reads it
+      }
+
+      if(pipeline.screen.refreshes != refreshes){
+        refreshes = pipeline.screen.refreshes;
+        Crc32 crc;
+        crc.update(pipeline.screen.panel(), pipeline.screen.width() / 2 * pipeline.screen.height());
+        printf("inkplate: refresh %lu, framebuffer CRC-32 %08x\n", refreshes, crc.value());
+        fflush(stdout);
+      }
+      if(pipeline.displayedBytes.size() != bytes){
+        bytes = pipeline.displayedBytes.size();
+        printf("inkplate: %zu bytes received\n", bytes);
+        fflush(stdout);
+      }
+
+      // the boards run ahead to the next step, then wait for the wall clock to catch up
+      pc.spend(200 * simMicrosecond);
+      double ahead = (pc.now() - start) / (double)simMillisecond - wallMillis();
+      if(ahead > 1)
+        usleep((useconds_t)(ahead * 1000));
+    }
+    return true;
+  }, 365ull * 24 * 3600 * simSecond);
+  close(slave);
+  return 0;
+}
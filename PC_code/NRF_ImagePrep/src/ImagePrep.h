@@ -0,0 +1,557 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Image preparation for the Inkplate, the steps of Convert3BitImageForInkplate and ConvertImageForInkplate in
+// Program.cs with the arithmetic of ImageSharp 3.1, so the bytes come out the same:
+//  - Grayscale(): BT.709 luma, on floats scaled to 0..1
+//  - Dither(): ordered, Bayer 8x8, to the nearest color of the web safe palette (6 levels of gray for a gray image)
+//  - Resize() to 800x600: bicubic, stretched, on premultiplied floats, the kernels summed with FMA in the order of
+//    ImageSharp's ResizeKernel on a CPU with AVX2 and FMA
+//  - ConvertToBitmap3bit(): (R + G + B) / 3 brought to 0..7, two pixels per byte, the left one in the high nibble
+//
+// After Grayscale() R, G and B are the same and stay the same, so prepare() works on one channel. The luma is a
+// loop the compiler vectorizes, the dither a table, the resize runs on *threads* threads over rows and columns.
+// prepareReference() does it pixel by pixel on all four channels, the way ImageSharp walks the image, the benchmark
+// (src/benchmark.cpp) checks that both give the same bytes.
+//
+// Build with -ffp-contract=off (platformio.ini): a multiply and an add that the compiler fuses, and ImageSharp
+// doesn't, can move a pixel to the next level.
+
+const int inkplateWidth = 800;
+const int inkplateHeight = 600;
+
+enum PrepFormat {
+  prepPacked, // ConvertToBitmap3bit, IPImage3BitFlag
+  prepDense,  // ConvertBitmap3bitToDense, IPDense3BitImageFlag
+  prepGray    // GetAsByteMatrix of ConvertImageForInkplate (no dither), a byte per pixel
+};
+
+struct RgbImage {
+  int width = 0, height = 0;
+  std::vector<uint8_t> pixels; // R, G, B
+};
+
+struct GrayImage {
+  int width = 0, height = 0;
+  std::vector<uint8_t> pixels;
+};
+
+const float byteToUnit = 1.0f / 255; // ImageSharp scales bytes with a multiply, not a division
+const float lumaR = .2126f, lumaG = .7152f, lumaB = .0722f; // KnownFilterMatrices.CreateGrayscaleBt709Filter
+const int ditherSize = 8;
+const int webSafeColors = 216;
+
+
+// rounds to even and saturates, ImageSharp's NormalizedFloatToByteSaturate (cvtps2dq)
+inline uint8_t unitToByte(float value){
+  float scaled = value * 255.0f;
+  float rounded = (scaled + 12582912.0f) - 12582912.0f; // 1.5 * 2^23, the fraction goes with the default rounding
+  return rounded <= 0 ? 0 : rounded >= 255 ? 255 : (uint8_t)rounded;
+}
+
+inline uint8_t luma(uint8_t r, uint8_t g, uint8_t b){
+  return unitToByte(r * byteToUnit * lumaR + g * byteToUnit * lumaG + b * byteToUnit * lumaB);
+}
+
+// ConvertToBitmap3bit
+inline uint8_t grayTo3Bit(uint8_t gray){
+  return (uint8_t)((gray * 7 + 254) / 255);
+}
+
+
+// OrderedDitherFactory.CreateDitherMatrix, [y][x]
+inline uint32_t bayer(uint32_t x, uint32_t y, uint32_t order){
+  uint32_t result = 0;
+  for(uint32_t i = 0; i < order; i++){
+    result = (((result << 1) | ((x & 1) ^ (y & 1))) << 1) | (x & 1);
+    x >>= 1;
+    y >>= 1;
+  }
+  return result;
+}
+
+// what OrderedDither adds to every channel at x, y for a palette of *colors*
+inline float ditherFactor(int x, int y, int colors){
+  int spread = (int)(255 / std::max(1.0, sqrt((double)colors) - 1));
+  float threshold = (bayer(x % ditherSize, y % ditherSize, 3) + 1) / (float)(ditherSize * ditherSize) - .5f;
+  return spread * threshold * 1.0f; // DitherScale
+}
+
+inline uint8_t addDither(uint8_t value, float factor){
+  float attempt = value + factor;
+  return (uint8_t)(attempt < 0 ? 0 : attempt > 255 ? 255 : attempt);
+}
+
+
+// The bicubic kernels of a resize along one axis, ImageSharp's ResizeKernelMap and PeriodicKernelMap:
+// the weights are worked out in doubles, normalized and stored as floats. Destination pixels a whole period apart
+// have the same kernel, the periodic map copies it instead of working it out again, which can differ in the last bit.
+class KernelMap {
+public:
+  std::vector<int> left;       // first source pixel of every destination pixel
+  std::vector<int> length;
+  std::vector<float> weights;  // maxLength of them per destination pixel
+  int maxLength = 0;
+
+  void build(int sourceLength, int destinationLength){
+    ratio = (double)sourceLength / destinationLength;
+    scale = ratio < 1 ? 1 : ratio;
+    radius = (int)ceil(scale * 2); // BicubicResampler.Radius
+    this->sourceLength = sourceLength;
+    maxLength = radius * 2 + 1;
+    left.assign(destinationLength, 0);
+    length.assign(destinationLength, 0);
+    weights.assign((size_t)destinationLength * maxLength, 0);
+    values.assign(maxLength, 0);
+
+    int period = destinationLength / gcd(sourceLength, destinationLength);
+    double center0 = (ratio - 1) * 0.5;
+    int cornerInterval = (int)ceil((radius - center0 - 1) / ratio);
+    if(2 * (cornerInterval + period) >= destinationLength){
+      for(int i = 0; i < destinationLength; i++)
+        buildKernel(i);
+      return;
+    }
+    int repeatStart = cornerInterval + period;
+    for(int i = 0; i < repeatStart; i++)
+      buildKernel(i);
+    int bottomStart = destinationLength - cornerInterval;
+    for(int i = repeatStart; i < bottomStart; i++){
+      left[i] = (int)tolerantCeiling((i + .5) * ratio - .5 - radius);
+      length[i] = length[i - period];
+      memcpy(&weights[(size_t)i * maxLength], &weights[(size_t)(i - period) * maxLength], maxLength * sizeof(float));
+    }
+    for(int i = bottomStart; i < destinationLength; i++)
+      buildKernel(i);
+  }
+
+  const float* weightsOf(int i) const { return &weights[(size_t)i * maxLength]; }
+
+private:
+  double ratio = 1, scale = 1;
+  int radius = 0;
+  int sourceLength = 0;
+  std::vector<double> values;  // of the kernel being worked out, maxLength of them
+
+  static int gcd(int a, int b){
+    while(b != 0){
+      int r = a % b;
+      a = b;
+      b = r;
+    }
+    return a;
+  }
+
+  // TolerantMath with its default epsilon
+  static double tolerantCeiling(double a){
+    return fabs(remainder(a, 1)) < 1e-8 ? nearbyint(a) : ceil(a);
+  }
+  static double tolerantFloor(double a){
+    return fabs(remainder(a, 1)) < 1e-8 ? nearbyint(a) : floor(a);
+  }
+
+  static float bicubic(float x){
+    if(x < 0)
+      x = -x;
+    if(x <= 1)
+      return ((1.5f * x) - 2.5f) * x * x + 1;
+    if(x < 2)
+      return ((((-0.5f * x) + 2.5f) * x) - 4) * x + 2;
+    return 0;
+  }
+
+  void buildKernel(int i){
+    double center = (i + .5) * ratio - .5;
+    int first = (int)tolerantCeiling(center - radius);
+    if(first < 0)
+      first = 0;
+    int last = (int)tolerantFloor(center + radius);
+    if(last > sourceLength - 1)
+      last = sourceLength - 1;
+    left[i] = first;
+    length[i] = last - first + 1;
+
+    double sum = 0;
+    for(int j = first; j <= last; j++){
+      double value = bicubic((float)((j - center) / scale));
+      sum += value;
+      values[j - first] = value;
+    }
+    float* kernel = &weights[(size_t)i * maxLength];
+    for(int j = 0; j < length[i]; j++)
+      kernel[j] = (float)(sum > 0 ? values[j] / sum : values[j]);
+  }
+};
+
+
+// Sums *length* rows of *lanes* floats, *stride* floats apart, with *weights*, the way ResizeKernel.ConvolveCore does
+// for every lane: fused multiply-adds into four sums (rows 0, 1, 2, 3 of every 4), the third and fourth added to the
+// first two, the rows left in pairs and a last one on its own. *scratch* holds 3 * lanes floats.
+inline void convolveLanes(const float* rows, size_t stride, const float* weights, int length, int lanes, float* out, float* scratch){
+  float* __restrict s0 = out;
+  float* __restrict s1 = scratch;
+  float* __restrict s2 = scratch + lanes;
+  float* __restrict s3 = scratch + 2 * lanes;
+  for(int l = 0; l < lanes; l++)
+    s0[l] = s1[l] = s2[l] = s3[l] = 0;
+  int i = 0;
+  for(; i + 4 <= length; i += 4){
+    const float* __restrict r0 = rows + i * stride;
+    const float* __restrict r1 = r0 + stride;
+    const float* __restrict r2 = r1 + stride;
+    const float* __restrict r3 = r2 + stride;
+    float w0 = weights[i], w1 = weights[i + 1], w2 = weights[i + 2], w3 = weights[i + 3];
+    for(int l = 0; l < lanes; l++){
+      s0[l] = fmaf(r0[l], w0, s0[l]);
+      s1[l] = fmaf(r1[l], w1, s1[l]);
+      s2[l] = fmaf(r2[l], w2, s2[l]);
+      s3[l] = fmaf(r3[l], w3, s3[l]);
+    }
+  }
+  for(int l = 0; l < lanes; l++){
+    s0[l] += s2[l];
+    s1[l] += s3[l];
+  }
+  if(length - i >= 2){
+    const float* r0 = rows + i * stride;
+    const float* r1 = r0 + stride;
+    for(int l = 0; l < lanes; l++){
+      s0[l] = fmaf(r0[l], weights[i], s0[l]);
+      s1[l] = fmaf(r1[l], weights[i + 1], s1[l]);
+    }
+    i += 2;
+  }
+  for(int l = 0; l < lanes; l++)
+    s0[l] += s1[l];
+  if(i < length){
+    const float* r0 = rows + i * stride;
+    for(int l = 0; l < lanes; l++)
+      s0[l] = fmaf(r0[l], weights[i], s0[l]);
+  }
+}
+
+
+// convolveLanes() of a single lane
+inline float convolve(const float* values, const float* weights, int length){
+  float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  int i = 0;
+  for(; i + 4 <= length; i += 4){
+    s0 = fmaf(values[i], weights[i], s0);
+    s1 = fmaf(values[i + 1], weights[i + 1], s1);
+    s2 = fmaf(values[i + 2], weights[i + 2], s2);
+    s3 = fmaf(values[i + 3], weights[i + 3], s3);
+  }
+  s0 += s2;
+  s1 += s3;
+  if(length - i >= 2){
+    s0 = fmaf(values[i], weights[i], s0);
+    s1 = fmaf(values[i + 1], weights[i + 1], s1);
+    i += 2;
+  }
+  s0 += s1;
+  if(i < length)
+    s0 = fmaf(values[i], weights[i], s0);
+  return s0;
+}
+
+
+// runs work(begin, end) for parts of [0, count) on *threads* threads
+template <class Work>
+void parallelFor(int count, int threads, Work work){
+  if(threads <= 1 || count < threads * 4){
+    work(0, count);
+    return;
+  }
+  std::vector<std::thread> workers;
+  for(int t = 0; t < threads; t++){
+    int begin = (int)((long)count * t / threads);
+    int end = (int)((long)count * (t + 1) / threads);
+    workers.emplace_back([=, &work](){ work(begin, end); });
+  }
+  for(std::thread& worker : workers)
+    worker.join();
+}
+
+
+// Grayscale(), and with *dither* Dither() on top
+inline void grayscale(const RgbImage& image, bool dither, int threads, GrayImage& gray){
+  gray.width = image.width;
+  gray.height = image.height;
+  gray.pixels.resize((size_t)image.width * image.height);
+
+  // the value after Dither() of every gray level on every cell of the dither matrix
+  static uint8_t ditherTable[ditherSize * ditherSize][256];
+  static bool ditherTableBuilt = false;
+  if(dither && !ditherTableBuilt){
+    for(int cell = 0; cell < ditherSize * ditherSize; cell++){
+      float factor = ditherFactor(cell % ditherSize, cell / ditherSize, webSafeColors);
+      for(int value = 0; value < 256; value++)
+        ditherTable[cell][value] = (addDither(value, factor) + 25) / 51 * 51; // the nearest gray of the palette
+    }
+    ditherTableBuilt = true;
+  }
+
+  parallelFor(image.height, threads, [&](int begin, int end){
+    for(int y = begin; y < end; y++){
+      const uint8_t* in = &image.pixels[(size_t)y * image.width * 3];
+      uint8_t* out = &gray.pixels[(size_t)y * image.width];
+      for(int x = 0; x < image.width; x++)
+        out[x] = luma(in[x * 3], in[x * 3 + 1], in[x * 3 + 2]);
+      if(!dither)
+        continue;
+      const uint8_t (*row)[256] = &ditherTable[(y % ditherSize) * ditherSize];
+      for(int x = 0; x < image.width; x++)
+        out[x] = row[x % ditherSize][out[x]];
+    }
+  });
+}
+
+
+// Resize() of a gray image, ResizeWorker: a horizontal pass over every source row, then a vertical one
+inline void resize(const GrayImage& source, int width, int height, int threads, GrayImage& result){
+  result.width = width;
+  result.height = height;
+  if(source.width == width && source.height == height){ // ImageSharp copies the pixels
+    result.pixels = source.pixels;
+    return;
+  }
+  result.pixels.resize((size_t)width * height);
+  KernelMap horizontal, vertical;
+  horizontal.build(source.width, width);
+  vertical.build(source.height, height);
+  const float opaque = 255 * byteToUnit; // alpha, the pixels are premultiplied with it
+
+  // the horizontal pass, a row of source pixels at a time
+  std::vector<float> firstPass((size_t)source.height * width);
+  std::vector<float> firstAlpha(width);
+  std::vector<float> ones(horizontal.maxLength, opaque);
+  for(int x = 0; x < width; x++)
+    firstAlpha[x] = convolve(ones.data(), horizontal.weightsOf(x), horizontal.length[x]);
+  parallelFor(source.height, threads, [&](int begin, int end){
+    std::vector<float> row(source.width);
+    for(int y = begin; y < end; y++){
+      const uint8_t* in = &source.pixels[(size_t)y * source.width];
+      for(int x = 0; x < source.width; x++)
+        row[x] = in[x] * byteToUnit * opaque; // Premultiply
+      float* out = &firstPass[(size_t)y * width];
+      for(int x = 0; x < width; x++)
+        out[x] = convolve(&row[horizontal.left[x]], horizontal.weightsOf(x), horizontal.length[x]);
+    }
+  });
+
+  parallelFor(height, threads, [&](int begin, int end){
+    std::vector<float> values(width), alpha(width), scratch(3 * width);
+    for(int y = begin; y < end; y++){
+      convolveLanes(&firstPass[(size_t)vertical.left[y] * width], width, vertical.weightsOf(y), vertical.length[y], width,
+                    values.data(), scratch.data());
+      convolveLanes(firstAlpha.data(), 0, vertical.weightsOf(y), vertical.length[y], width, alpha.data(), scratch.data());
+      uint8_t* out = &result.pixels[(size_t)y * width];
+      for(int x = 0; x < width; x++)
+        out[x] = unitToByte(values[x] / alpha[x]); // UnPremultiply
+    }
+  });
+}
+
+
+// the bytes that go to the Inkplate, from the gray image after Resize()
+inline void encode(const GrayImage& gray, PrepFormat format, std::vector<uint8_t>& out){
+  int width = gray.width, height = gray.height;
+  if(format == prepGray){
+    out = gray.pixels;
+    return;
+  }
+  // ConvertToBitmap3bit, with its (i * Height + j) for the high nibble
+  std::vector<uint8_t> packed((size_t)width * height / 2);
+  for(int i = 0; i < height; i++){
+    const uint8_t* row = &gray.pixels[(size_t)i * width];
+    for(int j = 0; j < width; j++){
+      size_t index = ((size_t)i * width + j) / 2;
+      if(index >= packed.size())
+        break;
+      uint8_t level = grayTo3Bit(row[j]);
+      if(((long)i * height + j) % 2 == 0)
+        packed[index] = (uint8_t)(level << 4);
+      else
+        packed[index] = (uint8_t)(level | (packed[index] & 0xF0));
+    }
+  }
+  if(format == prepPacked){
+    out.swap(packed);
+    return;
+  }
+  // ConvertBitmap3bitToDense
+  size_t pixels = (size_t)width * height;
+  out.assign((pixels + 7) / 8 * 3, 0);
+  for(size_t i = 0; i < packed.size(); i += 4){
+    uint32_t bits = 0;
+    for(size_t j = i; j < i + 4; j++){
+      uint8_t value = j < packed.size() ? packed[j] : 0;
+      bits = (bits << 6) | ((value >> 1) & 0x38) | (value & 0x07);
+    }
+    out[i / 4 * 3] = (uint8_t)(bits >> 16);
+    out[i / 4 * 3 + 1] = (uint8_t)(bits >> 8);
+    out[i / 4 * 3 + 2] = (uint8_t)bits;
+  }
+}
+
+
+// *matrix* gets the gray image after Resize(), what WriteAsByteMatrixToTextFile writes
+inline void prepare(const RgbImage& image, PrepFormat format, int width, int height, int threads,
+                    std::vector<uint8_t>& out, GrayImage* matrix = NULL){
+  GrayImage gray, resized;
+  grayscale(image, format != prepGray, threads, gray);
+  resize(gray, width, height, threads, resized);
+  encode(resized, format, out);
+  if(matrix)
+    *matrix = resized;
+}
+
+
+// The same pixel by pixel on R, G, B and A, one thread: Grayscale() as a color matrix, Dither() with a search of the
+// whole palette, Resize() on a Vector4 a pixel. Slow, but close to how ImageSharp goes about it.
+struct Pixel4 {
+  float v[4];
+};
+
+inline void prepareReference(const RgbImage& image, PrepFormat format, int width, int height,
+                             std::vector<uint8_t>& out, GrayImage* matrix = NULL){
+  int w = image.width, h = image.height;
+  std::vector<uint8_t> rgba((size_t)w * h * 4);
+  for(size_t i = 0; i < (size_t)w * h; i++){
+    float x = image.pixels[i * 3] * byteToUnit, y = image.pixels[i * 3 + 1] * byteToUnit;
+    float z = image.pixels[i * 3 + 2] * byteToUnit, a = 255 * byteToUnit;
+    const float matrixRows[3][3] = {{lumaR, lumaG, lumaB}, {lumaR, lumaG, lumaB}, {lumaR, lumaG, lumaB}};
+    for(int c = 0; c < 3; c++)
+      rgba[i * 4 + c] = unitToByte(x * matrixRows[c][0] + y * matrixRows[c][1] + z * matrixRows[c][2] + a * 0 + 0);
+    rgba[i * 4 + 3] = unitToByte(a);
+  }
+
+  if(format != prepGray){
+    std::vector<float> palette;
+    for(int r = 0; r < 6; r++)
+      for(int g = 0; g < 6; g++)
+        for(int b = 0; b < 6; b++){
+          palette.push_back(r * 51 * byteToUnit);
+          palette.push_back(g * 51 * byteToUnit);
+          palette.push_back(b * 51 * byteToUnit);
+          palette.push_back(1);
+        }
+    for(int y = 0; y < h; y++){
+      for(int x = 0; x < w; x++){
+        uint8_t* pixel = &rgba[((size_t)y * w + x) * 4];
+        float factor = ditherFactor(x, y, webSafeColors);
+        float attempt[4];
+        for(int c = 0; c < 4; c++)
+          attempt[c] = addDither(pixel[c], factor) * byteToUnit;
+        int best = 0;
+        float bestDistance = 1e30f;
+        for(int p = 0; p < webSafeColors; p++){
+          float distance = 0;
+          for(int c = 0; c < 4; c++){
+            float d = attempt[c] - palette[p * 4 + c];
+            distance += d * d;
+          }
+          if(distance < bestDistance){
+            bestDistance = distance;
+            best = p;
+          }
+        }
+        for(int c = 0; c < 3; c++)
+          pixel[c] = unitToByte(palette[best * 4 + c]);
+        pixel[3] = 255;
+      }
+    }
+  }
+
+  GrayImage gray;
+  gray.width = width;
+  gray.height = height;
+  gray.pixels.resize((size_t)width * height);
+  if(w == width && h == height){
+    for(size_t i = 0; i < gray.pixels.size(); i++)
+      gray.pixels[i] = (uint8_t)((rgba[i * 4] + rgba[i * 4 + 1] + rgba[i * 4 + 2]) / 3);
+  }
+  else{
+    KernelMap horizontal, vertical;
+    horizontal.build(w, width);
+    vertical.build(h, height);
+    std::vector<Pixel4> row(w), transposed((size_t)width * h);
+    float scratch[12];
+    for(int y = 0; y < h; y++){
+      for(int x = 0; x < w; x++){
+        const uint8_t* pixel = &rgba[((size_t)y * w + x) * 4];
+        float alpha = pixel[3] * byteToUnit;
+        for(int c = 0; c < 3; c++)
+          row[x].v[c] = pixel[c] * byteToUnit * alpha; // Premultiply
+        row[x].v[3] = alpha;
+      }
+      for(int x = 0; x < width; x++){
+        convolveLanes(row[horizontal.left[x]].v, 4, horizontal.weightsOf(x), horizontal.length[x], 4,
+                      transposed[(size_t)x * h + y].v, scratch);
+      }
+    }
+    for(int y = 0; y < height; y++){
+      for(int x = 0; x < width; x++){
+        Pixel4 sum;
+        convolveLanes(transposed[(size_t)x * h + vertical.left[y]].v, 4, vertical.weightsOf(y), vertical.length[y], 4,
+                      sum.v, scratch);
+        uint8_t channels[3];
+        for(int c = 0; c < 3; c++)
+          channels[c] = unitToByte(sum.v[c] / sum.v[3]); // UnPremultiply
+        gray.pixels[(size_t)y * width + x] = (uint8_t)((channels[0] + channels[1] + channels[2]) / 3);
+      }
+    }
+  }
+  encode(gray, format, out);
+  if(matrix)
+    *matrix = gray;
+}
+
+
+// a number of the PNM header, after whitespace and comments
+inline bool readNumber(const std::vector<uint8_t>& data, size_t& position, int& value){
+  while(position < data.size()){
+    if(data[position] == '#'){
+      while(position < data.size() && data[position] != '\n')
+        position++;
+    }
+    else if(isspace(data[position]))
+      position++;
+    else
+      break;
+  }
+  if(position >= data.size() || !isdigit(data[position]))
+    return false;
+  value = 0;
+  while(position < data.size() && isdigit(data[position]) && value < 1000000)
+    value = value * 10 + (data[position++] - '0');
+  return true;
+}
+
+
+inline bool decodePnm(const std::vector<uint8_t>& data, RgbImage& image){
+  if(data.size() < 2 || data[0] != 'P' || (data[1] != '6' && data[1] != '5'))
+    return false;
+  int channels = data[1] == '6' ? 3 : 1;
+  size_t position = 2;
+  int maxValue;
+  if(!readNumber(data, position, image.width) || !readNumber(data, position, image.height) ||
+     !readNumber(data, position, maxValue) || maxValue != 255 || image.width <= 0 || image.height <= 0)
+    return false;
+  position++; // the single whitespace before the pixels
+  size_t pixels = (size_t)image.width * image.height;
+  if(data.size() - position < pixels * channels)
+    return false;
+  image.pixels.resize(pixels * 3);
+  for(size_t i = 0; i < pixels; i++)
+    for(int c = 0; c < 3; c++)
+      image.pixels[i * 3 + c] = data[position + i * channels + (channels == 3 ? c : 0)];
+  return true;
+}
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ImagePrep.h"
+
+// Time to prepare an image for the Inkplate: prepareReference(), pixel by pixel on four channels like ImageSharp,
+// against prepare() on one thread and on all of them, for a few sizes and every format. Both have to give the same
+// bytes, the program fails if they don't.
+// The reference shares the kernels and the rounding with prepare(), what Program.cs gives comes from the fixtures:
+// <name>.ppm in the fixture directory, with <name>.packed and <name>.gray made by the C# program from it
+// (dotnet run -- fixtures <dir> in NRF_Transmitter). prepare() has to give those bytes, a fixture without them is
+// reported as unchecked.
+//
+// usage: program [runs] [fixture dir, fixtures by default]
+
+typedef std::chrono::steady_clock Clock;
+
+
+// a gradient with a few boxes and some noise, so the dither and the resize have something to do
+RgbImage syntheticImage(int width, int height, unsigned seed){
+  RgbImage image;
+  image.width = width;
+  image.height = height;
+  image.pixels.resize((size_t)width * height * 3);
+  std::mt19937 rng(seed);
+  for(int y = 0; y < height; y++){
+    for(int x = 0; x < width; x++){
+      uint8_t* pixel = &image.pixels[((size_t)y * width + x) * 3];
+      pixel[0] = (uint8_t)(x * 255 / width);
+      pixel[1] = (uint8_t)(y * 255 / height);
+      pixel[2] = (uint8_t)((x + y) * 127 / (width + height) + rng() % 64);
+      if((x / 97 + y / 61) % 5 == 0)
+        pixel[0] = pixel[1] = pixel[2] = (uint8_t)(rng() % 256);
+    }
+  }
+  return image;
+}
+
+
+bool readFile(const std::string& path, std::vector<uint8_t>& data){
+  FILE* file = fopen(path.c_str(), "rb");
+  if(!file)
+    return false;
+  data.clear();
+  uint8_t buffer[65536];
+  size_t count;
+  while((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    data.insert(data.end(), buffer, buffer + count);
+  fclose(file);
+  return true;
+}
+
+
+// prepare() against the bytes Program.cs made of every fixture, returns the number that differ
+int checkFixtures(const std::string& directory, int threads){
+  const char* names[] = {"up", "down"}; // 160x120 scaled up, 1700x40 scaled down across and up along
+  const PrepFormat formats[] = {prepPacked, prepGray};
+  const char* extensions[] = {".packed", ".gray"};
+  int mismatches = 0;
+  printf("%-10s %-7s %s\n", "fixture", "format", "Program.cs");
+  for(const char* name : names){
+    std::vector<uint8_t> data;
+    RgbImage image;
+    if(!readFile(directory + "/" + name + ".ppm", data) || !decodePnm(data, image)){
+      fprintf(stderr, "%s/%s.ppm can't be read\n", directory.c_str(), name);
+      mismatches++;
+      continue;
+    }
+    for(int f = 0; f < 2; f++){
+      std::vector<uint8_t> expected, out;
+      const char* result = "unchecked, no golden bytes";
+      if(readFile(directory + "/" + name + extensions[f], expected)){
+        prepare(image, formats[f], inkplateWidth, inkplateHeight, threads, out);
+        size_t first = 0;
+        while(first < expected.size() && first < out.size() && expected[first] == out[first])
+          first++;
+        if(first == expected.size() && first == out.size())
+          result = "same";
+        else{
+          result = "MISMATCH";
+          mismatches++;
+          fprintf(stderr, "%s %s: prepare() differs from Program.cs at byte %zu\n", name, extensions[f] + 1, first);
+        }
+      }
+      printf("%-10s %-7s %s\n", name, extensions[f] + 1, result);
+    }
+  }
+  return mismatches;
+}
+
+
+template <class Prepare>
+double bestMillis(int runs, Prepare prepare){
+  double best = 1e30;
+  for(int run = 0; run < runs; run++){
+    Clock::time_point start = Clock::now();
+    prepare();
+    double millis = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    if(millis < best)
+      best = millis;
+  }
+  return best;
+}
+
+
+int main(int argc, char* argv[]){
+  int runs = argc > 1 ? atoi(argv[1]) : 3;
+  std::string fixtures = argc > 2 ? argv[2] : "fixtures";
+  int threads = (int)std::thread::hardware_concurrency();
+  if(threads < 1)
+    threads = 1;
+  // 13600 wide is a 17x downscale, kernels of 69 taps
+  const int sizes[][2] = {{800, 600}, {1920, 1080}, {1024, 768}, {640, 480}, {333, 217}, {13600, 600}};
+  const char* formatNames[] = {"packed", "dense", "gray"};
+
+  printf("%d threads, best of %d runs\n", threads, runs);
+  printf("%-10s %-7s %10s %10s %10s %8s %s\n", "source", "format", "reference", "1 thread", "threads", "speedup", "bytes");
+  int mismatches = 0;
+  for(const int* size : sizes){
+    RgbImage image = syntheticImage(size[0], size[1], size[0] * 31 + size[1]);
+    for(int f = 0; f < 3; f++){
+      PrepFormat format = (PrepFormat)f;
+      std::vector<uint8_t> reference, single, parallel;
+      double referenceMillis = bestMillis(runs, [&](){
+        prepareReference(image, format, inkplateWidth, inkplateHeight, reference);
+      });
+      double singleMillis = bestMillis(runs, [&](){
+        prepare(image, format, inkplateWidth, inkplateHeight, 1, single);
+      });
+      double parallelMillis = bestMillis(runs, [&](){
+        prepare(image, format, inkplateWidth, inkplateHeight, threads, parallel);
+      });
+      bool same = reference == single && reference == parallel;
+      if(!same){
+        mismatches++;
+        size_t first = 0;
+        while(first < reference.size() && first < single.size() && reference[first] == single[first])
+          first++;
+        fprintf(stderr, "%dx%d %s: prepare() differs from prepareReference() at byte %zu\n", size[0], size[1],
+                formatNames[f], first);
+      }
+      char source[16];
+      snprintf(source, sizeof(source), "%dx%d", size[0], size[1]);
+      printf("%-10s %-7s %8.1fms %8.1fms %8.1fms %7.1fx %zu%s\n", source, formatNames[f], referenceMillis, singleMillis,
+             parallelMillis, referenceMillis / parallelMillis, parallel.size(), same ? "" : " MISMATCH");
+    }
+  }
+  printf("\n");
+  mismatches += checkFixtures(fixtures, threads);
+  return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ImagePrep.h"
+
+// Prepares images for the Inkplate without the C# program: the bytes that SendImage3Bit, BroadcastImage3Bit and
+// SendImage of Program.cs put after their flag, from binary PPM (P6) or PGM (P5) images with a maxval of 255.
+// Any other format can be brought to one first, e.g. with ImageMagick: magick photo.jpg photo.ppm
+//
+// Prepared images go into a cache directory, named after a hash of the input and the options, an image that
+// was prepared before is read from there.
+//
+// usage: program [-f packed|dense|gray] [-W width] [-H height] [-j threads] [-c cache dir] [-o out dir] [-m] image...
+//  -f  packed - 2 pixels per byte (IPImage3BitFlag), dense - 8 pixels in 3 bytes (IPDense3BitImageFlag, default),
+//      gray - a byte per pixel, the byte map of ConvertImageForInkplate
+//  -m  also writes <image>.txt, the gray image before the 3 bit conversion the way WriteAsByteMatrixToTextFile
+//      writes byteMap.txt, to compare with the C# program
+
+const char* const prepVersion = "imageprep 1"; // part of the cache key, change it when the output changes
+
+const char* formatNames[] = {"packed", "dense", "gray"};
+
+
+bool readFile(const std::string& path, std::vector<uint8_t>& data){
+  FILE* file = fopen(path.c_str(), "rb");
+  if(!file)
+    return false;
+  data.clear();
+  uint8_t buffer[65536];
+  size_t count;
+  while((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    data.insert(data.end(), buffer, buffer + count);
+  fclose(file);
+  return true;
+}
+
+
+bool writeFile(const std::string& path, const std::vector<uint8_t>& data){
+  FILE* file = fopen(path.c_str(), "wb");
+  if(!file)
+    return false;
+  bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+  return fclose(file) == 0 && written;
+}
+
+
+// FNV-1a, 64 bits
+uint64_t hashBytes(uint64_t hash, const void* data, size_t size){
+  const uint8_t* bytes = (const uint8_t*)data;
+  for(size_t i = 0; i < size; i++){
+    hash ^= bytes[i];
+    hash *= 0x100000001B3ull;
+  }
+  return hash;
+}
+
+
+// the same text as WriteAsByteMatrixToTextFile: a line of [0xHH, ...] per row
+bool writeMatrix(const std::string& path, const GrayImage& gray){
+  FILE* file = fopen(path.c_str(), "wb");
+  if(!file)
+    return false;
+  for(int y = 0; y < gray.height; y++){
+    fputc('[', file);
+    for(int x = 0; x < gray.width; x++)
+      fprintf(file, x + 1 < gray.width ? "0x%02X, " : "0x%02X", gray.pixels[(size_t)y * gray.width + x]);
+    fputs("]\r\n", file);
+  }
+  return fclose(file) == 0;
+}
+
+
+std::string baseName(const std::string& path){
+  size_t slash = path.find_last_of("/\\");
+  std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+  size_t dot = name.find_last_of('.');
+  return dot == std::string::npos || dot == 0 ? name : name.substr(0, dot);
+}
+
+
+void usage(){
+  fprintf(stderr, "usage: program [-f packed|dense|gray] [-W width] [-H height] [-j threads] [-c cache dir] "
+                  "[-o out dir] [-m] image...\n");
+  exit(2);
+}
+
+
+int main(int argc, char* argv[]){
+  PrepFormat format = prepDense;
+  int width = inkplateWidth, height = inkplateHeight;
+  int threads = (int)std::thread::hardware_concurrency();
+  std::string cacheDir = ".imagecache", outDir = ".";
+  bool matrix = false;
+  std::vector<std::string> inputs;
+
+  for(int i = 1; i < argc; i++){
+    bool hasValue = i + 1 < argc;
+    if(strcmp(argv[i], "-f") == 0 && hasValue){
+      const char* name = argv[++i];
+      int f = 0;
+      while(f < 3 && strcmp(name, formatNames[f]) != 0)
+        f++;
+      if(f == 3)
+        usage();
+      format = (PrepFormat)f;
+    }
+    else if(strcmp(argv[i], "-W") == 0 && hasValue)
+      width = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-H") == 0 && hasValue)
+      height = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-j") == 0 && hasValue)
+      threads = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-c") == 0 && hasValue)
+      cacheDir = argv[++i];
+    else if(strcmp(argv[i], "-o") == 0 && hasValue)
+      outDir = argv[++i];
+    else if(strcmp(argv[i], "-m") == 0)
+      matrix = true;
+    else if(argv[i][0] == '-')
+      usage();
+    else
+      inputs.push_back(argv[i]);
+  }
+  if(inputs.empty() || width <= 0 || height <= 0 || width % 2 != 0)
+    usage();
+  if(threads < 1)
+    threads = 1;
+  std::error_code error;
+  std::filesystem::create_directories(cacheDir, error);
+  std::filesystem::create_directories(outDir, error);
+
+  int failed = 0;
+  for(const std::string& input : inputs){
+    std::vector<uint8_t> data, out;
+    RgbImage image;
+    if(!readFile(input, data)){
+      fprintf(stderr, "%s: can't read\n", input.c_str());
+      failed++;
+      continue;
+    }
+
+    int size[2] = {width, height};
+    uint64_t hash = hashBytes(0xCBF29CE484222325ull, prepVersion, strlen(prepVersion));
+    hash = hashBytes(hash, formatNames[format], strlen(formatNames[format]));
+    hash = hashBytes(hash, size, sizeof(size));
+    hash = hashBytes(hash, data.data(), data.size());
+    char key[17];
+    snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+    std::string cached = cacheDir + "/" + key + "." + formatNames[format];
+    std::string output = outDir + "/" + baseName(input) + "." + formatNames[format];
+
+    // the byte matrix isn't cached, it's for comparing
+    bool hit = !matrix && readFile(cached, out);
+    if(!hit){
+      if(!decodePnm(data, image)){
+        fprintf(stderr, "%s: not a binary PPM or PGM with maxval 255\n", input.c_str());
+        failed++;
+        continue;
+      }
+      GrayImage gray;
+      prepare(image, format, width, height, threads, out, matrix ? &gray : NULL);
+      // renamed when it's complete, an interrupted run doesn't leave half an image in the cache
+      if(!writeFile(cached + ".tmp", out) || (std::filesystem::rename(cached + ".tmp", cached, error), error))
+        fprintf(stderr, "%s: can't write to the cache %s\n", input.c_str(), cacheDir.c_str());
+      if(matrix && !writeMatrix(outDir + "/" + baseName(input) + ".txt", gray)){
+        fprintf(stderr, "%s: can't write the byte matrix\n", input.c_str());
+        failed++;
+      }
+    }
+    if(!writeFile(output, out)){
+      fprintf(stderr, "%s: can't write\n", output.c_str());
+      failed++;
+      continue;
+    }
+    printf("%s -> %s, %zu bytes%s\n", input.c_str(), output.c_str(), out.size(), hit ? " (cached)" : "");
+  }
+  return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,159 @@
+﻿using System;
+
+namespace NRF_Transmitter
+{
+    // Byte oriented LZ compression for 3 bit images, the same format as Compression.h in Arduino_code/lib/NrfProtocol.
+    // The Inkplate decompresses it while the data arrives, keeping only the last compressionWindow bytes.
+    //
+    // Token: [0] - type and count, then
+    //   0x00 - 0x7F: literals, the next (token + 1) bytes are copied as they are
+    //   0x80 - 0xBF: run, the next byte repeated (token & 0x3F) + 3 times
+    //   0xC0 - 0xFF: match, [1,2] - distance - 1 (big endian), copies (token & 0x3F) + 3 bytes from distance bytes back
+    public static class Compression
+    {
+        public const int compressionWindow = 2048; // how far back a match can reach, same on the Inkplate
+        private const int maxLiterals = 128;
+        private const int minRepeat = 3;  // shortest run or match
+        private const int maxRepeat = 66; // longest run or match
+        private const byte runToken = 0x80;
+        private const byte matchToken = 0xC0;
+        private const int hashBits = 12;
+        private const int maxChain = 32; // candidates checked for every position
+
+
+
+        // [0,1] - image height, [2,3] - image width, then the compressed pixels (IPCompressedImage3BitFlag)
+        public static byte[] CompressImage3Bit(byte[] img, int height, int width)
+        {
+            byte[] compressed = Compress(img);
+            byte[] result = new byte[4 + compressed.Length];
+            result[0] = (byte)(height >> 8);
+            result[1] = (byte)height;
+            result[2] = (byte)(width >> 8);
+            result[3] = (byte)width;
+            Array.Copy(compressed, 0, result, 4, compressed.Length);
+            return result;
+        }
+
+
+
+        // greedy, with hash chains over the window
+        public static byte[] Compress(byte[] input)
+        {
+            int[] head = new int[1 << hashBits];
+            int[] chain = new int[compressionWindow];
+            Array.Fill(head, -1);
+            var output = new List<byte>(input.Length / 2);
+            int literalStart = 0;
+            int position = 0;
+
+            while (position < input.Length)
+            {
+                int longest = Math.Min(input.Length - position, maxRepeat);
+
+                int run = 1;
+                while (run < longest && input[position + run] == input[position])
+                    run++;
+
+                int matchLength = 0;
+                int distance = 0;
+                if (input.Length - position >= minRepeat)
+                    FindMatch(input, position, longest, head, chain, ref matchLength, ref distance);
+
+                int covered = 0;
+                if (run >= minRepeat && run + 1 >= matchLength) // a run is a byte shorter than a match
+                {
+                    FlushLiterals(input, literalStart, position, output);
+                    output.Add((byte)(runToken | (run - minRepeat)));
+                    output.Add(input[position]);
+                    covered = run;
+                }
+                else if (matchLength > minRepeat) // a 3 byte match would only save the literal token
+                {
+                    FlushLiterals(input, literalStart, position, output);
+                    output.Add((byte)(matchToken | (matchLength - minRepeat)));
+                    output.Add((byte)((distance - 1) >> 8));
+                    output.Add((byte)(distance - 1));
+                    covered = matchLength;
+                }
+
+                if (covered == 0)
+                {
+                    Insert(input, position++, head, chain);
+                    if (position - literalStart == maxLiterals)
+                    {
+                        FlushLiterals(input, literalStart, position, output);
+                        literalStart = position;
+                    }
+                }
+                else
+                {
+                    for (int i = 0; i < covered; i++)
+                        Insert(input, position++, head, chain);
+                    literalStart = position;
+                }
+            }
+            FlushLiterals(input, literalStart, position, output);
+            return output.ToArray();
+        }
+
+
+
+        private static int Hash(byte[] data, int position)
+        {
+            uint value = ((uint)data[position] << 16) | ((uint)data[position + 1] << 8) | data[position + 2];
+            return (int)((value * 2654435761u) >> (32 - hashBits));
+        }
+
+
+
+        private static void Insert(byte[] input, int position, int[] head, int[] chain)
+        {
+            if (input.Length - position < minRepeat)
+                return;
+            int hash = Hash(input, position);
+            chain[position % compressionWindow] = head[hash];
+            head[hash] = position;
+        }
+
+
+
+        private static void FindMatch(byte[] input, int position, int longest, int[] head, int[] chain, ref int matchLength, ref int distance)
+        {
+            int candidate = head[Hash(input, position)];
+            for (int i = 0; i < maxChain && candidate != -1; i++)
+            {
+                if (position - candidate > compressionWindow)
+                    break;
+                int length = 0;
+                while (length < longest && input[candidate + length] == input[position + length])
+                    length++;
+                if (length > matchLength)
+                {
+                    matchLength = length;
+                    distance = position - candidate;
+                    if (length == longest)
+                        break;
+                }
+                int previous = chain[candidate % compressionWindow];
+                if (previous >= candidate) // the slot was reused by a newer position
+                    break;
+                candidate = previous;
+            }
+        }
+
+
+
+        private static void FlushLiterals(byte[] input, int start, int end, List<byte> output)
+        {
+            while (start < end)
+            {
+                int count = Math.Min(end - start, maxLiterals);
+                output.Add((byte)(count - 1));
+                for (int i = 0; i < count; i++)
+                    output.Add(input[start + i]);
+                start += count;
+            }
+        }
+    }
+}
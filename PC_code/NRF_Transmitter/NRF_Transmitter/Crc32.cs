@@ -0,0 +1,49 @@
+﻿using System;
+
+namespace NRF_Transmitter
+{
+    // CRC-32 (IEEE 802.3, the one of zlib), the same as Crc32.h in Arduino_code/lib/NrfProtocol,
+    // for checking images end to end (see checkFlag in Protocol.h)
+    public class Crc32
+    {
+        private static readonly uint[] table = MakeTable();
+        private uint state = 0xFFFFFFFF;
+
+        public void Reset()
+        {
+            state = 0xFFFFFFFF;
+        }
+
+        public void Update(byte[] data, int offset, int count)
+        {
+            uint crc = state;
+            for (int i = offset; i < offset + count; i++)
+                crc = table[(byte)crc ^ data[i]] ^ (crc >> 8);
+            state = crc;
+        }
+
+        public uint Value => ~state;
+
+        public static uint Of(byte[] data, int offset, int count)
+        {
+            var crc = new Crc32();
+            crc.Update(data, offset, count);
+            return crc.Value;
+        }
+
+
+
+        private static uint[] MakeTable()
+        {
+            uint[] result = new uint[256];
+            for (uint i = 0; i < 256; i++)
+            {
+                uint crc = i;
+                for (int bit = 0; bit < 8; bit++)
+                    crc = (crc & 1) != 0 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+                result[i] = crc;
+            }
+            return result;
+        }
+    }
+}
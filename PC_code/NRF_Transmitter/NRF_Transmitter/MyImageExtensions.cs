@@ -132,5 +132,29 @@ namespace NRF_Transmitter
 
             return bitmap3Bit;
         }
+
+
+
+        // 8 pixels in 3 bytes, the first pixel in the top 3 bits of the first byte (see PackedImage.h on the Inkplate)
+        // a last group of fewer than 8 pixels is padded with zeros
+        public static byte[] ConvertBitmap3bitToDense(byte[] bitmap3Bit, int height, int width)
+        {
+            int packedBytes = height * width / 2;
+            byte[] dense = new byte[(height * width + 7) / 8 * 3];
+
+            for (int i = 0; i < packedBytes; i += 4)
+            {
+                int bits = 0;
+                for (int j = i; j < i + 4; j++)
+                {
+                    byte packed = j < packedBytes ? bitmap3Bit[j] : (byte)0;
+                    bits = (bits << 6) | ((packed >> 1) & 0x38) | (packed & 0x07);
+                }
+                dense[i / 4 * 3] = (byte)(bits >> 16);
+                dense[i / 4 * 3 + 1] = (byte)(bits >> 8);
+                dense[i / 4 * 3 + 2] = (byte)bits;
+            }
+            return dense;
+        }
     }
 }
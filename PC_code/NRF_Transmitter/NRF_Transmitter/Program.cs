@@ -25,9 +25,28 @@ class Program
     private const int flagBytesCount = 5;
     private const int inkplateFlagBytesCount = 5;
     private const int payloadSize = 30;
+    private const int windowSize = 8; // payloads in flight, same as windowSize in SlidingWindow.h
+    private const int ingestPayloads = 6; // payloads written ahead of the window, same as ingestPayloads in SlidingWindow.h
+    private const int credits = windowSize + ingestPayloads; // payloads written to the transmitter without an ack
     private const byte bytesFlag = 0x01; // flag => [0] - 0x01, [1,..,4] - byte count
     private const byte bytesWakeFlag = 0x02; // flag => [0] - 0x02, [1,..,4] - byte count
     private const byte stringFlag = 0x03;
+    private const byte sessionFlag = 0x04; // flag => [0] - 0x04, [1,..,4] - session of the Inkplate, before the ack of a wake flag
+    private const byte openLinkFlag = 0x05; // flag => [0] - 0x05, [1,..,4] - link timeout in ms (see Protocol.h)
+    private const byte keepLinkFlag = 0x06; // flag => [0] - 0x06, [1,..,4] - link timeout in ms
+    private const byte closeLinkFlag = 0x07; // flag => [0] - 0x07, [1,..,4] - 0
+    private const byte linkBytesFlag = 0x08; // flag => [0] - 0x08, [1,..,4] - byte count of the Inkplate flag and its data
+    private const byte nodeFlag = 0x09; // flag => [0] - 0x09, [1,..,4] - node, the following transfers go to its receiver
+    private const byte groupFlag = 0x0A; // flag => [0] - 0x0A, [1,..,4] - bitmask of nodes, the next broadcast goes to them
+    private const byte broadcastFlag = 0x0B; // flag => [0] - 0x0B, [1,..,4] - byte count of the Inkplate flag and its data
+    private const byte parityBits = 0x30; // on broadcastFlag, 1, 2, 3 - a parity frame every 2, 4, 8 payloads (see Parity.h)
+    private const byte checkFlag = 0x0C; // flag => [0] - 0x0C, [1,..,4] - CRC-32 of the last transfer, did it reach the Inkplate intact (see Protocol.h)
+    private const byte statusFlag = 0x0D; // flag => [0] - 0x0D, [1,..,4] - 0 transmitter, 1 receiver, the counters come back (see LinkStats.h)
+    private const int maxNodes = 8; // nodes 0 to 7, same as maxNodes in Protocol.h
+    private const int nodeRetryDelay = 500; // ms, SendToNodes tries a node that didn't answer again after this
+    private const int linkAckTimeout = 4000; // ms, the Inkplate may still be refreshing the last image before it takes a link message
+    private const int listenStrobeTime = 1256; // ms more for a wake flag, the receiver may be in low power listening: listenStrobeTime() of LISTEN_PERIOD in Protocol.h
+    private const int linkMargin = 500; // ms, a link this close to timing out is kept alive before the next message
     private const byte ackFlag = 0xFF;
     private const byte nakFlag = 0x00;
     // IP (InkPlate) flags
@@ -35,16 +54,55 @@ class Program
     private const byte IPImageFlag = 0x02; // flag => [0] - 0x02, [1,2] - image heightAsBytes, [3,4] - image widthAsBytes
     private const byte IPStringFlag = 0x03; // flag => [0] - 0x03, [1,...,4] - string length
     private const byte IPImage3BitFlag = 0x04; // flag => [0] - 0x02, [1,2] - image heightAsBytes, [3,4] - image widthAsBytes
+    private const byte IPRectsFlag = 0x05; // flag => [0] - 0x05, [1,...,4] - byte count of the rectangles (see EncodeRects)
+    private const byte IPCompressedImage3BitFlag = 0x06; // flag => [0] - 0x06, [1,...,4] - byte count of the compressed image (see Compression.cs)
+    private const byte IPDense3BitImageFlag = 0x08; // flag => [0] - 0x08, [1,2] - image heightAsBytes, [3,4] - image widthAsBytes, 8 pixels in 3 bytes (see ConvertBitmap3bitToDense)
+    private const byte IPCachedImageFlag = 0x09; // flag => [0] - 0x09, [1,...,4] - CRC-32 of the packed 3 bit pixels, the Inkplate shows the image from its cache (see ShowCachedImage)
+    private const byte IPCheckedBit = 0x80; // on the Inkplate flag, a CRC trailer follows the message (see displayCheckedBit in DisplayReceiver.h)
+    private const bool compressImages = true; // send 3 bit images compressed when that makes them smaller
+    private const bool denseImages = true; // send the others 8 pixels in 3 bytes instead of 2 pixels per byte
+    private const int checkBlockRows = 8; // rows of an image in a block of the trailer
+    private const int maxImageBlocks = 256; // blocks in a trailer, the Inkplate reports them with a byte
+    private const int maxRepairRounds = 3; // repairs of repairs before the whole image goes out again
+    private const int rectTileWidth = 32; // pixels, the diff is done in tiles of this size
+    private const int rectTileHeight = 8;
 
     private static SerialPort transmitterPort = null!;
     private static SerialPort receiverPort = null!;
 
     private static LinkedList<int> acks = new LinkedList<int>(); // clear when starting transmission
+    private static byte[]? lastFrame = null; // last 3 bit image the Inkplate acknowledged, updates are sent as a diff to it
+    private static int lastFrameHeight = 0;
+    private static int lastFrameWidth = 0;
+    private static long displaySession = -1; // the Inkplate's session from the last wake, changes when it restarts
+    private static long lastFrameSession = -1; // the session lastFrame was sent in
+    private static long linkTimeout = 0; // ms of the open link, 0 without one
+    private static System.Diagnostics.Stopwatch linkWatch = new System.Diagnostics.Stopwatch(); // since the link last got a message
+    private static int selectedNode = 0; // the receiver the transfers go to (SelectNode)
+    private static int group = 0; // the nodes that got the last broadcast, from the transmitter's groupFlag
+    private static volatile bool groupReceived = false;
+    private static int parityBlock = 0; // payloads per parity frame of a broadcast, 0 for none, set with "parity"
+    private static bool checkImages = true; // check images and updates end to end and repair the bad blocks, set with "check"
+    private static bool cacheImages = true; // ask the Inkplate for a whole image from its cache before sending it, set with "cache"
+    private static long cacheHits = 0, cacheMisses = 0, cacheBytesSaved = 0; // of the Inkplate's image cache since the start, the bytes uncompressed
+    private static Crc32 transferCrc = new Crc32(); // of the data of the last transfer, for checkFlag
+    private static List<byte> checkBlocks = new List<byte>(); // bad blocks from the transmitter before the ack of a check
+    private static uint[]? statusCounters = null; // from the transmitter's statusFlag, before the ack of a status query
+    private static readonly string[] transmitterStats = { "frames sent", "frames lost", "retransmits", "ack timeouts", "naks",
+        "radio resets", "bytes", "transfer ms", "rtt min us", "rtt max us", "rtt total us",
+        "wake strobes" }; // TransmitterStat in LinkStats.h
+    private static readonly string[] receiverStats = { "frames", "old payloads", "future payloads", "ack failures",
+        "timeouts", "bytes" }; // ReceiverStat in LinkStats.h
 
 
 
     static void Main(string[] args)
     {
+        if (args.Length == 2 && args[0] == "fixtures") // ex. dotnet run -- fixtures ../../NRF_ImagePrep/fixtures
+        {
+            WriteFixtures(args[1]);
+            return;
+        }
         byte[][] img = ConvertImageForInkplate(imgFilename);
         byte[] img3Bit = Convert3BitImageForInkplate(imgFilename);
         transmitterPort = OpenPort(transmitterCOM);
@@ -113,6 +171,74 @@ class Program
                         SendByteArray(data);
                     }
                 }
+                else if (Regex.IsMatch(input, @"^\s*sendupdate\s+\S", RegexOptions.IgnoreCase)) // ex. sendupdate C:\clock.png
+                {
+                    string filename = input.Trim().Substring("sendupdate".Length).Trim();
+                    byte[] update = Convert3BitImageForInkplate(filename);
+                    var watch = System.Diagnostics.Stopwatch.StartNew();
+                    if (SendImage3BitUpdate(update, MyImageExtensions.inkplateHeight, MyImageExtensions.inkplateWidth))
+                        Console.WriteLine($"Time taken to send update: {watch.ElapsedMilliseconds}ms");
+                }
+                else if (Regex.IsMatch(input, @"^\s*openlink\s*(\d+)?\s*$", RegexOptions.IgnoreCase)) // ex. openlink, openlink 60 (seconds)
+                {
+                    string[] parts = input.Trim().Split(" ", StringSplitOptions.RemoveEmptyEntries);
+                    long seconds = parts.Length > 1 ? Convert.ToInt64(parts[1]) : 30;
+                    if (OpenLink(seconds * 1000))
+                        Console.WriteLine($"Link open, closes after {seconds}s without a message");
+                }
+                else if (Regex.IsMatch(input, @"^\s*keeplink\s*$", RegexOptions.IgnoreCase))
+                {
+                    if (KeepLink() == false)
+                        Console.WriteLine("No link to keep open");
+                }
+                else if (Regex.IsMatch(input, @"^\s*closelink\s*$", RegexOptions.IgnoreCase))
+                {
+                    CloseLink();
+                }
+                else if (Regex.IsMatch(input, @"^\s*node\s+\d+\s*$", RegexOptions.IgnoreCase)) // ex. node 2
+                {
+                    int target = Convert.ToInt32(input.Trim().Split(" ", StringSplitOptions.RemoveEmptyEntries)[1]);
+                    if (SelectNode(target))
+                        Console.WriteLine($"Sending to node {target}");
+                }
+                else if (Regex.IsMatch(input, @"^\s*(sendnodes|broadcast)\s+\d+(\s*,\s*\d+)*\s*$", RegexOptions.IgnoreCase)) // ex. broadcast 0,1,3
+                {
+                    int nodes = 0;
+                    foreach (string node in input.Trim().Split(" ", 2)[1].Split(","))
+                        nodes |= 1 << Math.Min(Convert.ToInt32(node.Trim()), maxNodes - 1);
+                    var watch = System.Diagnostics.Stopwatch.StartNew();
+                    var deadline = TimeSpan.FromSeconds(120);
+                    int done = input.Trim().ToLower().StartsWith("broadcast")
+                        ? BroadcastImage3Bit(nodes, img3Bit, MyImageExtensions.inkplateHeight, MyImageExtensions.inkplateWidth, deadline)
+                        : SendToNodes(nodes, () => SendImage3Bit(img3Bit, MyImageExtensions.inkplateHeight, MyImageExtensions.inkplateWidth), deadline);
+                    Console.WriteLine($"Nodes done: 0x{done:X2} of 0x{nodes:X2}, time taken: {watch.ElapsedMilliseconds}ms");
+                }
+                else if (Regex.IsMatch(input, @"^\s*parity\s+(0|2|4|8)\s*$", RegexOptions.IgnoreCase)) // ex. parity 4, parity 0 turns it off
+                {
+                    parityBlock = Convert.ToInt32(input.Trim().Split(" ", StringSplitOptions.RemoveEmptyEntries)[1]);
+                    Console.WriteLine(parityBlock == 0 ? "Broadcasts without parity" : $"Broadcasts with a parity frame every {parityBlock} payloads");
+                }
+                else if (Regex.IsMatch(input, @"^\s*check\s+(on|off)\s*$", RegexOptions.IgnoreCase)) // ex. check off
+                {
+                    checkImages = input.Trim().ToLower().EndsWith("on");
+                    Console.WriteLine(checkImages ? "Images are checked end to end" : "Images aren't checked");
+                }
+                else if (Regex.IsMatch(input, @"^\s*cache\s+(on|off)\s*$", RegexOptions.IgnoreCase)) // ex. cache off
+                {
+                    cacheImages = input.Trim().ToLower().EndsWith("on");
+                    Console.WriteLine(cacheImages ? "Images are looked up in the Inkplate's cache first" : "Images are always sent whole");
+                }
+                else if (Regex.IsMatch(input, @"^\s*status\s*$", RegexOptions.IgnoreCase))
+                {
+                    PrintStatus();
+                }
+                else if (Regex.IsMatch(input, @"^\s*sendfile\s+\S", RegexOptions.IgnoreCase)) // ex. sendfile C:\firmware.bin
+                {
+                    string filename = input.Trim().Substring("sendfile".Length).Trim();
+                    var watch = System.Diagnostics.Stopwatch.StartNew();
+                    if (SendFile(filename))
+                        Console.WriteLine($"Time taken to send file: {watch.ElapsedMilliseconds}ms");
+                }
                 /*else if (Regex.IsMatch(input, @"\s*send [\w\s]+"))
                 {
                     input = input.Trim().Substring(new string("send ").Length);
@@ -133,17 +259,14 @@ class Program
 
 
 
-    static bool SendInitFlag(int byteCount, bool wakeFlag = false)
+    static bool SendInitFlag(long byteCount, byte type = bytesFlag)
     {
-        byte[] dataSize = BitConverter.GetBytes((Int32)byteCount);
+        byte[] dataSize = BitConverter.GetBytes((UInt32)byteCount);
         Array.Reverse(dataSize); // little endian
 
         // establish communication (send flag)
         byte[] flag = new byte[flagBytesCount];
-        if (wakeFlag)
-            flag[0] = bytesWakeFlag;
-        else
-            flag[0] = bytesFlag;
+        flag[0] = type;
         flag[1] = dataSize[0];
         flag[2] = dataSize[1];
         flag[3] = dataSize[2];
@@ -151,16 +274,19 @@ class Program
 
 
         transmitterPort.Write(flag, 0, flag.Length);
+        long timeout = type == linkBytesFlag || (type & ~parityBits) == broadcastFlag ? linkAckTimeout : 2000;
+        if (type == bytesWakeFlag || type == linkBytesFlag || type == openLinkFlag || type == keepLinkFlag)
+            timeout += listenStrobeTime;
         var stopWatch = System.Diagnostics.Stopwatch.StartNew();
         while (acks.Count == 0)
         {
-            if (stopWatch.ElapsedMilliseconds > 2000)
+            if (stopWatch.ElapsedMilliseconds > timeout)
             {
                 Console.WriteLine("No ack received");
                 return false;
             }
         }
-        if (acks.First() == byteCount)
+        if ((uint)acks.First() == (uint)byteCount)
         {
             acks.RemoveFirst();
             return true;
@@ -173,15 +299,32 @@ class Program
     // return true if transmission was successful
     static bool SendByteArray(byte[] data, bool sendFlag = true)
     {
-        if (data.Length > Math.Pow(2, 32))
-            throw new ArgumentException("Size of byte array is too big");
+        return SendStream(new MemoryStream(data, false), data.Length, sendFlag);
+    }
+
+
+
+    // sends a file without loading it into memory, so firmware blobs or image sequences of any size
+    // (up to the 32 bit byte count of the flag) go through in one transfer
+    static bool SendFile(string filename)
+    {
+        using (FileStream file = File.OpenRead(filename))
+        {
+            return SendStream(file, file.Length);
+        }
+    }
+
+
 
-        byte[] dataSize = BitConverter.GetBytes(data.Length);
+    // return true if transmission was successful
+    static bool SendStream(Stream data, long length, bool sendFlag = true)
+    {
+        if (length > uint.MaxValue)
+            throw new ArgumentException("Size of the data is too big");
+
+        byte[] dataSize = BitConverter.GetBytes((UInt32)length);
         Array.Reverse(dataSize); // little endian
 
-        // establish communication (send flag)
-        if (SendInitFlag(inkplateFlagBytesCount, true) == false)
-            return false;
         byte[] inkplateFlag = new byte[inkplateFlagBytesCount];
         inkplateFlag[0] = IPBytesFlag;
         inkplateFlag[1] = dataSize[0];
@@ -190,46 +333,234 @@ class Program
         inkplateFlag[4] = dataSize[3];
 
         if (sendFlag)
-        {
-            transmitterPort.Write(inkplateFlag, 0, inkplateFlag.Length);
-            Thread.Sleep(5);
-        }
+            return SendToInkplate(inkplateFlag, data, length);
 
+        // establish communication (send flag)
+        if (SendInitFlag(inkplateFlagBytesCount, bytesWakeFlag) == false)
+            return false;
 
         // start sending data
         acks.Clear();
-        int payloadCount = 0;
-        int count = data.Length;
-        if (SendInitFlag(count) == false)
+        if (SendInitFlag(length) == false)
             return false;
-        while (count > 0)
+
+        return SendPayloads(data, length);
+    }
+
+
+    // one transfer on an open link, otherwise a wake flag with the Inkplate flag and then the data
+    // woken - the wake flag already went out (SendImage3BitUpdate)
+    static bool SendToInkplate(byte[] inkplateFlag, Stream data, long length, bool woken = false)
+    {
+        if (linkTimeout > 0)
+            return SendLinkMessage(inkplateFlag, data, length);
+
+        // establish communication with receiving controller (send flag)
+        if (!woken && SendInitFlag(inkplateFlagBytesCount, bytesWakeFlag) == false)
+            return false;
+
+        // the flag goes out as one payload, wait for its ack so a late one isn't taken for the ack of the next init flag
+        if (SendPayloads(new MemoryStream(inkplateFlag, false), inkplateFlag.Length) == false)
+            return false;
+
+        // start sending data
+        acks.Clear();
+        if (SendInitFlag(length) == false)
+            return false;
+
+        return SendPayloads(data, length);
+    }
+
+
+
+    // the Inkplate flag goes in front of the data, the whole message is a single transfer
+    static bool SendLinkMessage(byte[] inkplateFlag, Stream data, long length)
+    {
+        if (linkWatch.ElapsedMilliseconds + linkMargin > linkTimeout && KeepLink() == false)
+            return false;
+
+        acks.Clear(); // acks still queued belong to the last transfer
+        if (SendInitFlag(inkplateFlag.Length + length, linkBytesFlag) == false)
+            return false;
+        if (SendPayloads(data, length, inkplateFlag) == false)
+            return false;
+
+        linkWatch.Restart();
+        return true;
+    }
+
+
+
+    // keeps the receiver and the Inkplate awake until CloseLink, or timeout ms without a message,
+    // every message in between is a single transfer (see Protocol.h)
+    static bool OpenLink(long timeout)
+    {
+        acks.Clear();
+        if (SendInitFlag(timeout, openLinkFlag) == false)
+            return false;
+
+        linkTimeout = timeout;
+        linkWatch.Restart();
+        return true;
+    }
+
+
+
+    // for a pause longer than the link timeout, opens the link again if it timed out
+    static bool KeepLink()
+    {
+        acks.Clear();
+        if (linkTimeout == 0 || SendInitFlag(linkTimeout, keepLinkFlag) == false)
+            return false;
+
+        linkWatch.Restart();
+        return true;
+    }
+
+
+
+    // the boards go back to sleep after their usual timeouts
+    static bool CloseLink()
+    {
+        acks.Clear();
+        linkTimeout = 0;
+        return SendInitFlag(0, closeLinkFlag);
+    }
+
+
+    // the following transfers go to the receiver of node target, the last image and the link belong to the old one
+    static bool SelectNode(int target)
+    {
+        acks.Clear();
+        if (SendInitFlag(target, nodeFlag) == false)
+            return false;
+
+        if (target != selectedNode)
         {
-            int bytesToSend = 0;
-            if (count > payloadSize)
-                bytesToSend = payloadSize;
-            else
-                bytesToSend = count;
+            selectedNode = target;
+            lastFrame = null;
+            displaySession = -1;
+            linkTimeout = 0; // times out on its own
+        }
+        return true;
+    }
 
-            transmitterPort.Write(data, data.Length - count, bytesToSend);
-            count -= bytesToSend;
-            // wait for ack and check if it's correct
-            while (acks.Count == 0) ;
-            if (acks.First() == payloadCount)
-            {
-                acks.RemoveFirst();
-                payloadCount++;
-            }
-            else if (acks.First() == -1)
-            {
-                return false;
-            }
-            else
+
+
+    // runs job for every node in nodes (a bitmask), taking turns. A node whose receiver doesn't answer
+    // (asleep, out of range) is tried again after nodeRetryDelay, the others go on meanwhile.
+    // returns the nodes the job succeeded for before the deadline
+    static int SendToNodes(int nodes, Func<bool> job, TimeSpan deadline)
+    {
+        int done = 0;
+        long[] retryAt = new long[maxNodes];
+        var watch = System.Diagnostics.Stopwatch.StartNew();
+        while ((done & nodes) != nodes && watch.Elapsed < deadline)
+        {
+            bool tried = false;
+            for (int n = 0; n < maxNodes; n++)
             {
-                throw new Exception($"Incorrect ack | Expected: {count}, Received: {acks.First()}");
+                if ((nodes & (1 << n)) == 0 || (done & (1 << n)) != 0 || watch.ElapsedMilliseconds < retryAt[n])
+                    continue;
+
+                tried = true;
+                if (SelectNode(n) && job())
+                    done |= 1 << n;
+                else
+                    retryAt[n] = watch.ElapsedMilliseconds + nodeRetryDelay;
             }
+            if (!tried)
+                Thread.Sleep(1); // every node left is waiting for its retry
         }
+        return done;
+    }
 
-        return true;
+
+
+    // the Inkplate flag and the data to every node in nodes at once (see broadcast in Protocol.h)
+    // returns the nodes that got all of it
+    static int Broadcast(int nodes, byte[] inkplateFlag, byte[] data)
+    {
+        acks.Clear();
+        if (SendInitFlag(nodes, groupFlag) == false)
+            return 0;
+
+        acks.Clear();
+        if (SendInitFlag(inkplateFlag.Length + data.Length, (byte)(broadcastFlag | ParityFlagBits(parityBlock))) == false)
+            return 0;
+
+        groupReceived = false;
+        if (SendPayloads(new MemoryStream(data, false), data.Length, inkplateFlag) == false)
+            return 0;
+
+        // the nodes that got all of it come after the last ack
+        var stopWatch = System.Diagnostics.Stopwatch.StartNew();
+        while (!groupReceived)
+        {
+            if (stopWatch.ElapsedMilliseconds > 2000)
+                return 0;
+        }
+        return group;
+    }
+
+
+
+    // parityBits for a parity frame every blockPayloads payloads, 0 for none (parityFlagBits in Parity.h)
+    static byte ParityFlagBits(int blockPayloads)
+    {
+        int bits = blockPayloads >= 8 ? 3 : blockPayloads >= 4 ? 2 : blockPayloads >= 2 ? 1 : 0;
+        return (byte)(bits << 4);
+    }
+
+
+
+    // one broadcast to nodes, the ones that missed it get the image on their own (SendToNodes)
+    // the last image of every node is unknown afterwards, so the next update is a whole image
+    static int BroadcastImage3Bit(int nodes, byte[] img, int height, int width, TimeSpan deadline)
+    {
+        var watch = System.Diagnostics.Stopwatch.StartNew();
+        byte[] inkplateFlag = new byte[inkplateFlagBytesCount];
+        byte[] raw = denseImages ? MyImageExtensions.ConvertBitmap3bitToDense(img, height, width) : img;
+        byte[] data = raw;
+        byte[]? compressed = compressImages ? Compression.CompressImage3Bit(img, height, width) : null;
+        if (compressed != null && compressed.Length < raw.Length)
+        {
+            byte[] countAsBytes = BitConverter.GetBytes(compressed.Length);
+            Array.Reverse(countAsBytes);
+            inkplateFlag[0] = IPCompressedImage3BitFlag;
+            Array.Copy(countAsBytes, 0, inkplateFlag, 1, 4);
+            data = compressed;
+        }
+        else
+        {
+            inkplateFlag[0] = denseImages ? IPDense3BitImageFlag : IPImage3BitFlag;
+            inkplateFlag[1] = (byte)(height >> 8);
+            inkplateFlag[2] = (byte)height;
+            inkplateFlag[3] = (byte)(width >> 8);
+            inkplateFlag[4] = (byte)width;
+        }
+
+        int done = Broadcast(nodes, inkplateFlag, data);
+        lastFrame = null;
+        if ((done & nodes) == nodes)
+            return done;
+
+        Console.WriteLine($"Broadcast reached 0x{done:X2}, sending to the rest one by one");
+        return done | SendToNodes(nodes & ~done, () => SendImage3Bit(img, height, width), deadline - watch.Elapsed);
+    }
+
+
+
+    static void ReadExactly(Stream stream, byte[] buffer, int offset, int count)
+    {
+        int read = 0;
+        while (read < count)
+        {
+            int n = stream.Read(buffer, offset + read, count - read);
+            if (n == 0)
+                throw new EndOfStreamException("Data ended before the announced length");
+            read += n;
+        }
     }
 
 
@@ -294,7 +625,8 @@ class Program
 
 
 
-    static bool SendImage3Bit(byte[] img, int height, int width)
+    // woken - the Inkplate was already woken up for this transfer (by SendImage3BitUpdate)
+    static bool SendImage3Bit(byte[] img, int height, int width, bool woken = false)
     {
         byte[] heightAsBytes = BitConverter.GetBytes((ushort)height);
         byte[] widthAsBytes = BitConverter.GetBytes((ushort)width);
@@ -304,50 +636,449 @@ class Program
         Array.Reverse(widthAsBytes);
 
 
-        // establish communication with receiving controller (send flag)
-        if (SendInitFlag(inkplateFlagBytesCount, true) == false)
-            return false;
+        bool cached = false;
+        // the Inkplate only caches whole screens
+        if (cacheImages && checkImages && height == MyImageExtensions.inkplateHeight && width == MyImageExtensions.inkplateWidth)
+        {
+            cached = ShowCachedImage(img, height, width, woken);
+            if (cached)
+            {
+                int saved = denseImages ? (height * width + 7) / 8 * 3 : height * width / 2;
+                cacheHits++;
+                cacheBytesSaved += saved;
+                Console.WriteLine($"Shown from the Inkplate's cache, {saved} bytes not sent");
+            }
+            else
+            {
+                cacheMisses++;
+                woken = false;
+            }
+        }
+
+        // compressed and packed once it's clear the image goes out
+        byte[]? compressed = !cached && compressImages ? Compression.CompressImage3Bit(img, height, width) : null;
+        byte[] raw = cached ? img : denseImages ? MyImageExtensions.ConvertBitmap3bitToDense(img, height, width) : img;
+        for (int attempt = 0; !cached; attempt++)
+        {
+            byte[] inkplateFlag = new byte[inkplateFlagBytesCount];
+            byte[] data = raw;
+            // a flipped bit spoils the rest of a compressed image, one sent again goes out raw so its blocks can be repaired
+            if (compressed != null && compressed.Length < raw.Length && attempt == 0)
+            {
+                // the height and width go in front of the compressed pixels, the flag has the byte count
+                byte[] countAsBytes = BitConverter.GetBytes(compressed.Length);
+                Array.Reverse(countAsBytes);
+                inkplateFlag[0] = IPCompressedImage3BitFlag;
+                Array.Copy(countAsBytes, 0, inkplateFlag, 1, 4);
+                data = compressed;
+                Console.WriteLine($"Compressed: {compressed.Length} bytes instead of {raw.Length}");
+            }
+            else
+            {
+                inkplateFlag[0] = denseImages ? IPDense3BitImageFlag : IPImage3BitFlag;
+                inkplateFlag[1] = heightAsBytes[0];
+                inkplateFlag[2] = heightAsBytes[1];
+                inkplateFlag[3] = widthAsBytes[0];
+                inkplateFlag[4] = widthAsBytes[1];
+            }
+
+            if (SendChecked(inkplateFlag, data, woken, img, height, width) == false)
+                return false;
+            if (!checkImages)
+                break;
+
+            if (CheckTransfer(out List<byte> bad) && (bad.Count == 0 || RepairBlocks(img, height, width, bad)))
+                break;
+            if (attempt > 0)
+            {
+                Console.WriteLine("Image still not intact");
+                return false;
+            }
+            Console.WriteLine("Image not intact, sending it again");
+            woken = false;
+        }
+
+        lastFrame = (byte[])img.Clone();
+        lastFrameHeight = height;
+        lastFrameWidth = width;
+        lastFrameSession = displaySession;
+        return true;
+    }
+
+
+
+    // asks the Inkplate to show the image from its cache, by the CRC-32 of the packed pixels (displayCachedImageFlag in DisplayReceiver.h)
+    // false if it doesn't have the image, or the lookup didn't get through, the image is sent whole then
+    // the Inkplate saves an image after its refresh, so one sent again within ~2 s isn't found yet
+    static bool ShowCachedImage(byte[] img, int height, int width, bool woken)
+    {
+        byte[] keyAsBytes = BitConverter.GetBytes(Crc32.Of(img, 0, height * width / 2));
+        Array.Reverse(keyAsBytes);
         byte[] inkplateFlag = new byte[inkplateFlagBytesCount];
-        inkplateFlag[0] = IPImage3BitFlag;
-        inkplateFlag[1] = heightAsBytes[0];
-        inkplateFlag[2] = heightAsBytes[1];
-        inkplateFlag[3] = widthAsBytes[0];
-        inkplateFlag[4] = widthAsBytes[1];
+        inkplateFlag[0] = IPCachedImageFlag;
+        Array.Copy(keyAsBytes, 0, inkplateFlag, 1, 4);
+        return SendChecked(inkplateFlag, new byte[0], woken) && CheckTransfer(out List<byte> bad) && bad.Count == 0;
+    }
 
-        transmitterPort.Write(inkplateFlag, 0, inkplateFlag.Length);
-        Thread.Sleep(5);
 
-        // start sending data
-        acks.Clear();
-        int payloadCount = 0;
-        int count = img.Length;
-        if (SendInitFlag(count) == false)
+
+    // sends only the parts of the image that changed since the last acknowledged one,
+    // the Inkplate keeps the rest of its framebuffer
+    // falls back to the whole image if there is no last frame, or the rectangles wouldn't be smaller
+    static bool SendImage3BitUpdate(byte[] img, int height, int width)
+    {
+        if (lastFrame == null || lastFrameHeight != height || lastFrameWidth != width || width % 2 != 0)
+            return SendImage3Bit(img, height, width);
+
+        byte[] rects = EncodeRects(lastFrame, img, height, width);
+        if (rects.Length == 0)
+            return true; // nothing changed
+        if (rects.Length >= img.Length)
+            return SendImage3Bit(img, height, width);
+        Console.WriteLine($"Update: {rects.Length} bytes instead of {img.Length}");
+
+        byte[] countAsBytes = BitConverter.GetBytes(rects.Length);
+        Array.Reverse(countAsBytes);
+
+        if (linkTimeout == 0)
+        {
+            // establish communication with receiving controller (send flag)
+            if (SendInitFlag(inkplateFlagBytesCount, bytesWakeFlag) == false)
+                return false;
+            if (displaySession != lastFrameSession)
+            {
+                // the Inkplate restarted since the last frame, the framebuffer the rectangles go into is gone
+                Console.WriteLine("Inkplate restarted, sending the whole image");
+                return SendImage3Bit(img, height, width, woken: true);
+            }
+        }
+        byte[] inkplateFlag = new byte[inkplateFlagBytesCount];
+        inkplateFlag[0] = IPRectsFlag;
+        Array.Copy(countAsBytes, 0, inkplateFlag, 1, 4);
+
+        if (SendChecked(inkplateFlag, rects, woken: true) == false)
             return false;
-        while (count > 0)
+        if (checkImages && (!CheckTransfer(out List<byte> bad) || (bad.Count > 0 && !RepairRects(rects, bad))))
         {
-            int bytesToSend = 0;
-            if (count > payloadSize)
-                bytesToSend = payloadSize;
-            else
-                bytesToSend = count;
+            Console.WriteLine("Update not intact, sending the whole image");
+            return SendImage3Bit(img, height, width);
+        }
+        if (displaySession != lastFrameSession)
+        {
+            // on a link the session comes with the message, the rectangles went into an empty framebuffer
+            Console.WriteLine("Inkplate restarted, sending the whole image");
+            return SendImage3Bit(img, height, width);
+        }
+
+        lastFrame = (byte[])img.Clone();
+        return true;
+    }
+
+
+
+    // the message with a CRC trailer if checkImages (see displayCheckedBit in DisplayReceiver.h)
+    // img - the packed pixels of a whole image, the CRC of every block of checkBlockRows rows goes in the trailer too,
+    // rectangles get the CRC of each rectangle
+    static bool SendChecked(byte[] inkplateFlag, byte[] data, bool woken = false, byte[]? img = null, int height = 0, int width = 0)
+    {
+        if (!checkImages)
+            return SendToInkplate(inkplateFlag, new MemoryStream(data, false), data.Length, woken);
+
+        byte[] checkedFlag = (byte[])inkplateFlag.Clone();
+        checkedFlag[0] |= IPCheckedBit;
+        var crc = new Crc32();
+        crc.Update(checkedFlag, 0, checkedFlag.Length);
+        crc.Update(data, 0, data.Length);
+        var message = new MemoryStream();
+        message.Write(data, 0, data.Length);
+        WriteCrc(message, crc.Value);
+
+        if (img != null && (height + checkBlockRows - 1) / checkBlockRows <= maxImageBlocks)
+        {
+            int blockBytes = width * checkBlockRows / 2;
+            int imageBytes = height * width / 2;
+            for (int offset = 0; offset < imageBytes; offset += blockBytes)
+                WriteCrc(message, Crc32.Of(img, offset, Math.Min(blockBytes, imageBytes - offset)));
+        }
+        if (inkplateFlag[0] == IPRectsFlag)
+        {
+            foreach (var rect in SplitRects(data).Take(maxImageBlocks))
+                WriteCrc(message, Crc32.Of(data, rect.offset + 8, rect.size - 8));
+        }
+        return SendToInkplate(checkedFlag, new MemoryStream(message.ToArray(), false), message.Length, woken);
+    }
+
+
+
+    static void WriteCrc(Stream stream, uint crc)
+    {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            stream.WriteByte((byte)(crc >> shift));
+    }
+
+
+
+    // asks if the last transfer reached the Inkplate intact, bad - the blocks to send again
+    // returns false if the whole message has to go out again
+    static bool CheckTransfer(out List<byte> bad)
+    {
+        acks.Clear();
+        lock (checkBlocks)
+            checkBlocks.Clear();
+        bool intact = SendInitFlag(transferCrc.Value, checkFlag);
+        lock (checkBlocks)
+            bad = new List<byte>(checkBlocks);
+        return intact;
+    }
+
+
+
+    // the counters of the transmitter (0) or the current node's receiver (1), null if it didn't answer
+    static uint[]? QueryStatus(int source)
+    {
+        acks.Clear();
+        statusCounters = null;
+        if (SendInitFlag(source, statusFlag) == false)
+            return null;
+        return statusCounters;
+    }
+
+
+
+    // link health of the transmitter and the current node, the counters count from the last reset of each board
+    static void PrintStatus()
+    {
+        uint[]? tx = QueryStatus(0);
+        if (tx == null || tx.Length < transmitterStats.Length)
+            Console.WriteLine("Transmitter didn't answer");
+        else
+        {
+            Console.WriteLine("Transmitter:");
+            for (int i = 0; i < transmitterStats.Length; i++)
+                Console.WriteLine($"  {transmitterStats[i],-16}{tx[i]}");
+            uint acked = tx[0] - tx[1];
+            if (tx[7] > 0)
+                Console.WriteLine($"  {"bytes/s",-16}{(ulong)tx[6] * 1000 / tx[7]}");
+            if (acked > 0)
+                Console.WriteLine($"  {"rtt us",-16}{tx[8]} min, {tx[10] / acked} avg, {tx[9]} max");
+        }
+
+        uint[]? rx = QueryStatus(1);
+        if (rx == null || rx.Length < receiverStats.Length)
+            Console.WriteLine($"Receiver of node {selectedNode} didn't answer");
+        else
+        {
+            Console.WriteLine($"Receiver of node {selectedNode}:");
+            for (int i = 0; i < receiverStats.Length; i++)
+                Console.WriteLine($"  {receiverStats[i],-16}{rx[i]}");
+        }
+        Console.WriteLine($"Image cache: {cacheHits} hits, {cacheMisses} misses, {cacheBytesSaved} bytes not sent");
+    }
 
-            transmitterPort.Write(img, img.Length - count, bytesToSend);
-            count -= bytesToSend;
+
+
+    // offset and size of every rectangle of EncodeRects, header included
+    static List<(int offset, int size)> SplitRects(byte[] rects)
+    {
+        var result = new List<(int offset, int size)>();
+        int offset = 0;
+        while (offset + 8 <= rects.Length)
+        {
+            int width = (rects[offset + 4] << 8) | rects[offset + 5];
+            int height = (rects[offset + 6] << 8) | rects[offset + 7];
+            int size = 8 + width * height / 2;
+            result.Add((offset, size));
+            offset += size;
+        }
+        return result;
+    }
+
+
+
+    // sends the bad rectangles again until all of them check out, maxRepairRounds at most
+    static bool RepairRects(byte[] rects, List<byte> bad)
+    {
+        for (int round = 0; round < maxRepairRounds; round++)
+        {
+            var parts = SplitRects(rects);
+            var repair = new MemoryStream();
+            foreach (byte index in bad)
+            {
+                if (index >= parts.Count)
+                    return false;
+                repair.Write(rects, parts[index].offset, parts[index].size);
+            }
+            Console.WriteLine($"Repairing {bad.Count} rectangles");
+
+            byte[] countAsBytes = BitConverter.GetBytes((int)repair.Length);
+            Array.Reverse(countAsBytes);
+            byte[] inkplateFlag = new byte[inkplateFlagBytesCount];
+            inkplateFlag[0] = IPRectsFlag;
+            Array.Copy(countAsBytes, 0, inkplateFlag, 1, 4);
+            int repaired = bad.Count;
+            rects = repair.ToArray();
+            if (SendChecked(inkplateFlag, rects) == false)
+                return false;
+            if (CheckTransfer(out bad) && bad.Count == 0)
+                return true;
+            if (bad.Count == 0) // the whole repair again
+                bad = Enumerable.Range(0, repaired).Select(i => (byte)i).ToList();
+        }
+        return false;
+    }
+
+
+
+    // the bad blocks of the image as rectangles of checkBlockRows rows
+    static bool RepairBlocks(byte[] img, int height, int width, List<byte> bad)
+    {
+        var rects = new MemoryStream();
+        int rowBytes = width / 2;
+        foreach (byte block in bad)
+        {
+            int y = block * checkBlockRows;
+            int rows = Math.Min(checkBlockRows, height - y);
+            if (rows <= 0)
+                return false;
+            foreach (int value in new int[] { 0, y, width, rows })
+            {
+                rects.WriteByte((byte)(value >> 8));
+                rects.WriteByte((byte)value);
+            }
+            rects.Write(img, y * rowBytes, rows * rowBytes);
+        }
+        return RepairRects(rects.ToArray(), Enumerable.Range(0, bad.Count).Select(i => (byte)i).ToList());
+    }
+
+
+
+    // rectangles covering every tile that differs between the two packed 3 bit images
+    // rectangle => [0,1] - x, [2,3] - y, [4,5] - width, [6,7] - height, then the packed pixels row by row
+    // dirty tiles next to each other in a row become one rectangle, rows with the same span are merged
+    static byte[] EncodeRects(byte[] previous, byte[] img, int height, int width)
+    {
+        int rowBytes = width / 2;
+        int tileBytes = rectTileWidth / 2;
+        int tilesPerRow = (rowBytes + tileBytes - 1) / tileBytes;
+        var rects = new List<(int x, int y, int width, int height)>();
+        var open = new List<(int x, int y, int width, int height)>(); // rectangles the next band can extend
+
+        for (int bandY = 0; bandY < height; bandY += rectTileHeight)
+        {
+            int bandHeight = Math.Min(rectTileHeight, height - bandY);
+            var runs = new List<(int x, int width)>();
+            int runStart = -1;
+            for (int tile = 0; tile <= tilesPerRow; tile++)
+            {
+                bool dirty = tile < tilesPerRow && TileChanged(previous, img, rowBytes, bandY, bandHeight, tile * tileBytes, Math.Min(tileBytes, rowBytes - tile * tileBytes));
+                if (dirty && runStart < 0)
+                    runStart = tile;
+                else if (!dirty && runStart >= 0)
+                {
+                    int x = runStart * rectTileWidth;
+                    runs.Add((x, Math.Min(tile * rectTileWidth, width) - x));
+                    runStart = -1;
+                }
+            }
+
+            var stillOpen = new List<(int x, int y, int width, int height)>();
+            foreach (var run in runs)
+            {
+                int index = open.FindIndex(r => r.x == run.x && r.width == run.width);
+                if (index >= 0)
+                {
+                    var rect = open[index];
+                    open.RemoveAt(index);
+                    stillOpen.Add((rect.x, rect.y, rect.width, rect.height + bandHeight));
+                }
+                else
+                {
+                    stillOpen.Add((run.x, bandY, run.width, bandHeight));
+                }
+            }
+            rects.AddRange(open); // not extended by this band
+            open = stillOpen;
+        }
+        rects.AddRange(open);
+
+        var result = new MemoryStream();
+        foreach (var rect in rects)
+        {
+            foreach (int value in new int[] { rect.x, rect.y, rect.width, rect.height })
+            {
+                result.WriteByte((byte)(value >> 8));
+                result.WriteByte((byte)value);
+            }
+            for (int y = rect.y; y < rect.y + rect.height; y++)
+                result.Write(img, y * rowBytes + rect.x / 2, rect.width / 2);
+        }
+        return result.ToArray();
+    }
+
+
+
+    static bool TileChanged(byte[] previous, byte[] img, int rowBytes, int y, int height, int offset, int count)
+    {
+        for (int row = y; row < y + height; row++)
+        {
+            int start = row * rowBytes + offset;
+            if (!previous.AsSpan(start, count).SequenceEqual(img.AsSpan(start, count)))
+                return true;
+        }
+        return false;
+    }
+
+
+
+    // streams the data to the transmitter, keeping up to credits payloads in flight
+    // the transmitter acks every payload in order, once the receiver has it, and every ack is a credit for the next one
+    // payloadCount can go past 65535, the 16 bit sequence numbers on air are extended on both boards (Sequence.h)
+    // header - sent in front of the data, in the same payloads
+    static bool SendPayloads(Stream data, long length, byte[]? header = null)
+    {
+        int headerLength = header?.Length ?? 0;
+        long total = headerLength + length;
+        int payloadCount = 0; // next payload to be acked
+        int sentCount = 0;    // payloads written to the transmitter
+        int totalPayloads = (int)((total + payloadSize - 1) / payloadSize);
+        byte[] payload = new byte[payloadSize];
+        transferCrc.Reset();
+        while (payloadCount < totalPayloads)
+        {
+            while (sentCount < totalPayloads && sentCount - payloadCount < credits)
+            {
+                long offset = (long)sentCount * payloadSize;
+                int bytesToSend = (int)Math.Min(payloadSize, total - offset);
+
+                int fromHeader = (int)Math.Clamp(headerLength - offset, 0, bytesToSend);
+                if (fromHeader > 0)
+                    Array.Copy(header!, offset, payload, 0, fromHeader);
+                ReadExactly(data, payload, fromHeader, bytesToSend - fromHeader);
+                transmitterPort.Write(payload, 0, bytesToSend);
+                transferCrc.Update(payload, 0, bytesToSend);
+                sentCount++;
+            }
 
             // wait for ack and check if it's correct
             while (acks.Count == 0) ;
-            if (acks.First() == payloadCount)
+            int ack;
+            lock (acks)
             {
+                ack = acks.First();
                 acks.RemoveFirst();
+            }
+
+            if (ack == payloadCount)
+            {
                 payloadCount++;
             }
-            else if (acks.First() == -1)
+            else if (ack == -1)
             {
                 return false;
             }
             else
             {
-                throw new Exception($"Incorrect ack | Expected: {count}, Received: {acks.First()}");
+                throw new Exception($"Incorrect ack | Expected: {payloadCount}, Received: {ack}");
             }
         }
 
@@ -600,6 +1331,28 @@ class Program
 
 
 
+    // the golden bytes of NRF_ImagePrep (see src/benchmark.cpp there): for every <name>.ppm in *directory*
+    // <name>.packed of Convert3BitImageForInkplate and <name>.gray of ConvertImageForInkplate, without their files
+    static void WriteFixtures(string directory)
+    {
+        foreach (string filename in Directory.GetFiles(directory, "*.ppm"))
+        {
+            Image<Rgba32> image = Image.Load<Rgba32>(filename);
+            image.ConvertToGrayscale();
+            image.AddDither();
+            image.ResizeForInklpate();
+            File.WriteAllBytes(Path.ChangeExtension(filename, ".packed"), image.ConvertToBitmap3bit());
+
+            image = Image.Load<Rgba32>(filename);
+            image.ConvertToGrayscale();
+            image.ResizeForInklpate();
+            File.WriteAllBytes(Path.ChangeExtension(filename, ".gray"), image.GetAsByteMatrix().SelectMany(row => row).ToArray());
+            Console.WriteLine($"{filename}: .packed and .gray written");
+        }
+    }
+
+
+
     static byte[] GetTestBytes(int byteCount)
     {
         byte[] result = new byte[byteCount];
@@ -651,14 +1404,41 @@ class Program
             else if (flag[0] == ackFlag)
             {
                 int payloadCount = (flag[1] << 24) | (flag[2] << 16) | (flag[3] << 8) | flag[4];
-                acks.AddLast(payloadCount); // save ack in queue
+                lock (acks)
+                    acks.AddLast(payloadCount); // save ack in queue
+            }
+            else if (flag[0] == groupFlag)
+            {
+                group = (flag[1] << 24) | (flag[2] << 16) | (flag[3] << 8) | flag[4];
+                groupReceived = true;
+            }
+            else if (flag[0] == checkFlag)
+            {
+                lock (checkBlocks)
+                    checkBlocks.Add(flag[4]);
+            }
+            else if (flag[0] == statusFlag)
+            {
+                int count = (flag[1] << 24) | (flag[2] << 16) | (flag[3] << 8) | flag[4];
+                byte[] data = new byte[count];
+                for (int read = 0; read < count;) // the counters follow right after the flag
+                    read += transmitterPort.Read(data, read, count - read);
+                uint[] counters = new uint[count / 4];
+                for (int i = 0; i < counters.Length; i++)
+                    counters[i] = (uint)((data[i * 4] << 24) | (data[i * 4 + 1] << 16) | (data[i * 4 + 2] << 8) | data[i * 4 + 3]);
+                statusCounters = counters;
+            }
+            else if (flag[0] == sessionFlag)
+            {
+                displaySession = (flag[1] << 24) | (flag[2] << 16) | (flag[3] << 8) | flag[4];
             }
             else if (flag[0] == nakFlag)
             {
                 Console.ForegroundColor = ConsoleColor.Red;
                 Console.WriteLine("NAK received");
                 Console.ForegroundColor = ConsoleColor.White;
-                acks.AddLast(-1); // save nak in queue
+                lock (acks)
+                    acks.AddLast(-1); // save nak in queue
             }
         }
     }